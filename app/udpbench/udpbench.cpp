@@ -0,0 +1,423 @@
+/* udpbench: a loopback throughput and latency benchmark for the UDP library.
+ *
+ * One udp_instance_t, busy-polled on its own thread, echoes every payload it gets
+ * to all the peers in the sender's group. N udp_client_t, polled round-robin on the
+ * main thread, each keep a window of payloads in flight and time the round trip
+ * of their own payloads. Run it before and after a change, with the same options,
+ * on an otherwise idle machine. With -m, everything goes through an in-memory network
+ * (@see udp_memnet_create()) instead of loopback sockets, which leaves just what the
+ * library itself costs.
+ */
+
+#include <onyxudp/udpbase.h>
+#include <onyxudp/udpclient.h>
+#include <onyxutil/histogram.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+
+
+struct options {
+    int clients;
+    int group_size;
+    int payload_size;
+    int window;
+    double seconds;
+    int port;
+    bool memory;
+    bool json;
+};
+
+/* What goes first in each benchmark payload; the rest is filler. */
+struct bench_header {
+    uint32_t client;
+    uint32_t sequence;
+    uint64_t sent;
+};
+
+struct bench_server;
+
+/* The params come first, so the params passed to callbacks are the group. */
+struct bench_group {
+    udp_group_params_t params;
+    bench_server *server;
+    udp_group_t *group;
+    int size;
+};
+
+struct bench_server {
+    udp_params_t params;
+    udp_instance_t *instance;
+    bench_group *groups;
+    int num_groups;
+    int group_size;
+    int errors;
+    volatile bool running;
+};
+
+struct bench_client {
+    udp_client_params_t params;
+    udp_client_t *client;
+    udp_client_connection_t *conn;
+    uint32_t index;
+    uint32_t sequence;
+    int inflight;
+    uint64_t last_receive;
+    uint64_t sent;
+    uint64_t received;
+    uint64_t round_trips;
+    uint64_t lost;
+    int errors;
+    histogram_t rtt;
+};
+
+static options opts = { 4, 1, 100, 8, 5.0, 12346, false, false };
+
+static void echo(bench_server *srv, udp_group_t *group, udp_payload_t *payload) {
+    udp_payload_t *pl = udp_payload_get(srv->instance);
+    if (!pl) {
+        srv->errors++;
+        return;
+    }
+    memcpy(pl->data, payload->data, payload->size);
+    pl->size = payload->size;
+    if (udp_group_payload_enqueue(group, pl) != UDP_OK) {
+        srv->errors++;
+    }
+}
+
+static void on_peer_message(udp_group_params_t *gpar, udp_peer_t *peer, udp_payload_t *payload) {
+    bench_group *bg = (bench_group *)gpar;
+    echo(bg->server, bg->group, payload);
+}
+
+static void on_peer_removed(udp_group_params_t *gpar, udp_peer_t *peer, UDPPEER reason) {
+}
+
+static void on_error(udp_params_t *params, UDPERR err, char const *text) {
+    fprintf(stderr, "udpbench: server error %d (%s)\n", err, text);
+    ((bench_server *)params)->errors++;
+}
+
+static void on_idle(udp_params_t *params) {
+}
+
+static void on_peer_new(udp_params_t *params, udp_peer_t *peer, udp_payload_t *payload) {
+    bench_server *srv = (bench_server *)params;
+    bench_group *bg = srv->num_groups ? &srv->groups[srv->num_groups - 1] : NULL;
+    if (!bg || bg->size == srv->group_size) {
+        bg = &srv->groups[srv->num_groups];
+        bg->params.on_peer_message = on_peer_message;
+        bg->params.on_peer_removed = on_peer_removed;
+        bg->server = srv;
+        bg->group = udp_group_create(srv->instance, &bg->params);
+        if (!bg->group) {
+            srv->errors++;
+            return;
+        }
+        srv->num_groups++;
+    }
+    if (udp_group_peer_add(bg->group, peer) != UDP_OK) {
+        srv->errors++;
+        return;
+    }
+    bg->size++;
+    //  the payload that made the peer known doesn't go to on_peer_message()
+    if (payload) {
+        echo(srv, bg->group, payload);
+    }
+}
+
+static void on_peer_expired(udp_params_t *params, udp_peer_t *peer, UDPPEER reason) {
+}
+
+static void *server_thread(void *arg) {
+    bench_server *srv = (bench_server *)arg;
+    while (srv->running) {
+        udp_poll(srv->instance);
+    }
+    return NULL;
+}
+
+static void c_on_error(udp_client_params_t *cparm, UDPERR err, char const *text) {
+    fprintf(stderr, "udpbench: client error %d (%s)\n", err, text);
+    ((bench_client *)cparm)->errors++;
+}
+
+static void c_on_idle(udp_client_params_t *cparm) {
+}
+
+static void c_on_payload(udp_client_params_t *cparm, udp_client_connection_t *conn, udp_payload_t *payload) {
+    bench_client *c = (bench_client *)cparm;
+    if (payload->size < sizeof(bench_header)) {
+        return;
+    }
+    bench_header hdr;
+    memcpy(&hdr, payload->data, sizeof(hdr));
+    uint64_t now = udp_timestamp();
+    c->last_receive = now;
+    c->received++;
+    if (hdr.client != c->index) {
+        return;
+    }
+    if (c->inflight > 0) {
+        c->inflight--;
+    }
+    c->round_trips++;
+    histogram_record(&c->rtt, now - hdr.sent);
+}
+
+static void c_on_disconnect(udp_client_params_t *cparm, udp_client_connection_t *conn, UDPPEER reason) {
+    bench_client *c = (bench_client *)cparm;
+    fprintf(stderr, "udpbench: client %u disconnected (%d)\n", c->index, reason);
+    c->conn = NULL;
+    c->errors++;
+}
+
+static void c_on_snapshot(udp_client_params_t *cparm, udp_client_connection_t *conn, uint16_t stream, uint32_t sequence, void const *data, size_t size) {
+}
+
+static bool client_send(bench_client *c, uint64_t now) {
+    udp_payload_t *pl = udp_client_payload_get(c->client);
+    if (!pl) {
+        c->errors++;
+        return false;
+    }
+    bench_header hdr = { c->index, c->sequence++, now };
+    memset(pl->data, 0x5a, opts.payload_size);
+    memcpy(pl->data, &hdr, sizeof(hdr));
+    pl->size = (uint16_t)opts.payload_size;
+    if (udp_client_payload_send(c->conn, pl) != UDP_OK) {
+        return false;
+    }
+    c->inflight++;
+    c->sent++;
+    return true;
+}
+
+/* Poll every client once, and top up its window. A window that hasn't moved for
+ * a while is assumed lost (payloads on channel 0 are unreliable) and started over.
+ */
+static void clients_step(bench_client *clients) {
+    for (int i = 0; i != opts.clients; ++i) {
+        bench_client *c = &clients[i];
+        udp_client_poll(c->client);
+        if (!c->conn) {
+            continue;
+        }
+        uint64_t now = udp_timestamp();
+        if (c->inflight && now - c->last_receive > 200000) {
+            c->lost += c->inflight;
+            c->inflight = 0;
+            c->last_receive = now;
+        }
+        while (c->inflight < opts.window && client_send(c, now)) {
+        }
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "usage: udpbench [options]\n"
+            "  -c N   number of clients (default %d)\n"
+            "  -g N   peers per group; each payload is echoed to the sender's group (default %d)\n"
+            "  -s N   payload size in bytes, %d to %d (default %d)\n"
+            "  -w N   payloads in flight per client (default %d)\n"
+            "  -d S   seconds to measure (default %g)\n"
+            "  -p N   server port on 127.0.0.1 (default %d)\n"
+            "  -m     send through memory instead of sockets\n"
+            "  -j     print the results as JSON\n",
+            opts.clients, opts.group_size, (int)UDP_MIN_PAYLOAD_SIZE, (int)UDP_DEFAULT_MAX_PAYLOAD_SIZE,
+            opts.payload_size, opts.window, opts.seconds, opts.port);
+    exit(1);
+}
+
+static void parse_options(int argc, char **argv) {
+    int ch;
+    while ((ch = getopt(argc, argv, "c:g:s:w:d:p:mjh")) != -1) {
+        switch (ch) {
+            case 'c': opts.clients = atoi(optarg); break;
+            case 'g': opts.group_size = atoi(optarg); break;
+            case 's': opts.payload_size = atoi(optarg); break;
+            case 'w': opts.window = atoi(optarg); break;
+            case 'd': opts.seconds = atof(optarg); break;
+            case 'p': opts.port = atoi(optarg); break;
+            case 'm': opts.memory = true; break;
+            case 'j': opts.json = true; break;
+            default: usage();
+        }
+    }
+    if (optind != argc || opts.clients < 1 || opts.group_size < 1 || opts.window < 1 ||
+            opts.payload_size < UDP_MIN_PAYLOAD_SIZE || opts.payload_size > UDP_DEFAULT_MAX_PAYLOAD_SIZE ||
+            opts.seconds <= 0 || opts.port < 1 || opts.port > 65535) {
+        usage();
+    }
+}
+
+static void report(bench_server *srv, bench_client *clients, udp_stats_t const *sstats, double elapsed) {
+    histogram_t rtt;
+    histogram_reset(&rtt);
+    uint64_t sent = 0, received = 0, round_trips = 0, lost = 0;
+    int errors = srv->errors;
+    for (int i = 0; i != opts.clients; ++i) {
+        histogram_merge(&rtt, &clients[i].rtt);
+        sent += clients[i].sent;
+        received += clients[i].received;
+        round_trips += clients[i].round_trips;
+        lost += clients[i].lost;
+        errors += clients[i].errors;
+    }
+    double packets = (double)(sstats->packets_in + sstats->packets_out) / elapsed;
+    double bytes = (double)(sstats->bytes_in + sstats->bytes_out) / elapsed;
+    if (opts.json) {
+        printf("{\"transport\":\"%s\",\"clients\":%d,\"group_size\":%d,\"payload_size\":%d,\"window\":%d,\"seconds\":%.3f,"
+                "\"sent\":%llu,\"received\":%llu,\"round_trips\":%llu,\"lost\":%llu,\"errors\":%d,"
+                "\"payloads_per_sec\":%.1f,\"packets_per_sec\":%.1f,\"bytes_per_sec\":%.1f,"
+                "\"rtt_us\":{\"mean\":%.1f,\"min\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}\n",
+                opts.memory ? "memory" : "socket", opts.clients, opts.group_size, opts.payload_size, opts.window, elapsed,
+                (unsigned long long)sent, (unsigned long long)received, (unsigned long long)round_trips,
+                (unsigned long long)lost, errors,
+                received / elapsed, packets, bytes,
+                histogram_mean(&rtt), (unsigned long long)rtt.min,
+                (unsigned long long)histogram_percentile(&rtt, 50),
+                (unsigned long long)histogram_percentile(&rtt, 99),
+                (unsigned long long)histogram_percentile(&rtt, 99.9),
+                (unsigned long long)rtt.max);
+        return;
+    }
+    printf("%s transport, clients %d, group size %d, payload %d bytes, window %d, %.3f seconds\n",
+            opts.memory ? "memory" : "socket", opts.clients, opts.group_size, opts.payload_size, opts.window, elapsed);
+    printf("payloads: %llu sent, %llu received (%.1f/s), %llu round trips, %llu lost, %d errors\n",
+            (unsigned long long)sent, (unsigned long long)received, received / elapsed,
+            (unsigned long long)round_trips, (unsigned long long)lost, errors);
+    printf("server socket: %.1f packets/s, %.1f bytes/s\n", packets, bytes);
+    printf("round trip (us): mean %.1f, min %llu, p50 %llu, p99 %llu, p999 %llu, max %llu\n",
+            histogram_mean(&rtt), (unsigned long long)rtt.min,
+            (unsigned long long)histogram_percentile(&rtt, 50),
+            (unsigned long long)histogram_percentile(&rtt, 99),
+            (unsigned long long)histogram_percentile(&rtt, 99.9),
+            (unsigned long long)rtt.max);
+}
+
+int main(int argc, char **argv) {
+    parse_options(argc, argv);
+
+    udp_memnet_t *net = NULL;
+    if (opts.memory && !(net = udp_memnet_create(4096, (uint16_t)(opts.payload_size + 64)))) {
+        fprintf(stderr, "udpbench: out of memory\n");
+        return 1;
+    }
+
+    bench_server srv;
+    memset(&srv, 0, sizeof(srv));
+    srv.groups = (bench_group *)calloc(opts.clients, sizeof(bench_group));
+    srv.group_size = opts.group_size;
+    srv.params.port = (uint16_t)opts.port;
+    srv.params.max_payload_size = (uint16_t)opts.payload_size;
+    srv.params.app_id = 0xbe;
+    srv.params.app_version = 1;
+    srv.params.interface = "127.0.0.1";
+    srv.params.on_error = on_error;
+    srv.params.on_idle = on_idle;
+    srv.params.on_peer_new = on_peer_new;
+    srv.params.on_peer_expired = on_peer_expired;
+    srv.params.transport = net ? udp_memnet_endpoint(net, (uint16_t)opts.port) : NULL;
+    srv.instance = udp_initialize(&srv.params);
+    if (!srv.instance || !srv.groups) {
+        fprintf(stderr, "udpbench: could not start the server on port %d\n", opts.port);
+        return 1;
+    }
+
+    udp_addr_t afmt;
+    udp_conn_addr_t addr;
+    snprintf(afmt.addr, sizeof(afmt.addr), "127.0.0.1");
+    snprintf(afmt.port, sizeof(afmt.port), "%d", opts.port);
+    if (udp_client_address_resolve(&afmt, &addr) != UDP_OK) {
+        fprintf(stderr, "udpbench: could not resolve 127.0.0.1:%d\n", opts.port);
+        return 1;
+    }
+    bench_client *clients = (bench_client *)calloc(opts.clients, sizeof(bench_client));
+    if (!clients) {
+        fprintf(stderr, "udpbench: out of memory\n");
+        return 1;
+    }
+    for (int i = 0; i != opts.clients; ++i) {
+        bench_client *c = &clients[i];
+        c->index = (uint32_t)i;
+        c->params.app_id = srv.params.app_id;
+        c->params.app_version = srv.params.app_version;
+        c->params.max_payload_size = (uint16_t)opts.payload_size;
+        c->params.on_error = c_on_error;
+        c->params.on_idle = c_on_idle;
+        c->params.on_payload = c_on_payload;
+        c->params.on_disconnect = c_on_disconnect;
+        c->params.on_snapshot = c_on_snapshot;
+        c->params.transport = net ? udp_memnet_endpoint(net, 0) : NULL;
+        c->client = udp_client_initialize(&c->params);
+        if (!c->client || !(c->conn = udp_client_connect(c->client, &addr, NULL))) {
+            fprintf(stderr, "udpbench: could not start client %d\n", i);
+            return 1;
+        }
+        c->last_receive = udp_timestamp();
+    }
+
+    pthread_t thread;
+    srv.running = true;
+    if (pthread_create(&thread, NULL, server_thread, &srv) != 0) {
+        fprintf(stderr, "udpbench: could not start the server thread\n");
+        return 1;
+    }
+
+    //  warm up until every client has had a round trip, then start counting over;
+    //  the clients aren't polled after the end, so their counts stay put
+    uint64_t start = udp_timestamp();
+    for (int ready = 0; ready != opts.clients;) {
+        clients_step(clients);
+        ready = 0;
+        for (int i = 0; i != opts.clients; ++i) {
+            ready += clients[i].round_trips > 0;
+        }
+        if (udp_timestamp() - start > 5000000) {
+            fprintf(stderr, "udpbench: only %d of %d clients got through to the server\n", ready, opts.clients);
+            return 1;
+        }
+    }
+    udp_stats_t before, after;
+    udp_stats_get(srv.instance, &before);
+    for (int i = 0; i != opts.clients; ++i) {
+        bench_client *c = &clients[i];
+        c->sent = c->received = c->round_trips = c->lost = 0;
+        histogram_reset(&c->rtt);
+    }
+    start = udp_timestamp();
+    uint64_t end = start + (uint64_t)(opts.seconds * 1000000);
+    uint64_t now;
+    do {
+        clients_step(clients);
+        now = udp_timestamp();
+    } while (now < end);
+    udp_stats_get(srv.instance, &after);
+
+    srv.running = false;
+    pthread_join(thread, NULL);
+
+    //  only the traffic in the measured interval counts
+    uint64_t *a = (uint64_t *)&after;
+    uint64_t const *b = (uint64_t const *)&before;
+    for (size_t i = 0; i != sizeof(udp_stats_t) / sizeof(uint64_t); ++i) {
+        a[i] -= b[i];
+    }
+    int errors = srv.errors;
+    report(&srv, clients, &after, (now - start) / 1000000.0);
+    for (int i = 0; i != opts.clients; ++i) {
+        errors += clients[i].errors;
+        udp_client_terminate(clients[i].client);
+    }
+    udp_terminate(srv.instance);
+    free(clients);
+    free(srv.groups);
+    udp_memnet_destroy(net);
+    return errors ? 1 : 0;
+}
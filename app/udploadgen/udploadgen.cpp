@@ -0,0 +1,736 @@
+/* udploadgen: simulate a crowd of clients against one server, from one process.
+ *
+ * Each simulated client is its own udp_client_t (and so its own socket and source
+ * port), because that is what the server sees a real client as; connections from
+ * one udp_client_t are told apart by the server's address, so they can't stand in
+ * for many players of one server. The clients are spread over a few client threads
+ * that sweep them round-robin, and over several loopback addresses, so there are
+ * enough ephemeral ports to go around. That costs a file descriptor per client (the
+ * limit is raised to fit, as far as the hard limit allows) and a few kB of memory.
+ * With -m, the clients and the built-in server talk over a udp_memnet_t instead, which
+ * takes no descriptors and no system calls, so a crowd of 50000 fits in a process
+ * whatever the limits; it measures the library rather than the kernel.
+ *
+ * The load follows a script of phases; each phase says how long it lasts, how many
+ * clients are active, how many payloads per second each of them sends, and how
+ * big those are. Clients connect when they first become active, and go quiet (but
+ * stay connected) when a later phase has fewer of them. The server (by default an
+ * echo server on its own thread in this process) sends every payload back to its
+ * sender, which times the round trip. For each phase, the report has the goodput
+ * the server saw and the latency the clients saw. The round trip includes the time
+ * until the client thread got around to polling the client again; the sweep time
+ * is reported next to it, so keep an eye on that.
+ */
+
+#include <onyxudp/udpbase.h>
+#include <onyxudp/udpclient.h>
+#include <onyxutil/histogram.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+
+enum {
+    MAX_PHASES = 64,
+    MAX_ADDRESSES = 64,
+    GROUP_SIZE = 1024,
+    MAX_ERROR_REPORTS = 10,
+    //  with -m: the server's queue takes a whole sweep's worth of clients sending at once
+    MEMNET_CLIENT_QUEUE = 16,
+    MEMNET_SERVER_QUEUE = 65536
+};
+
+struct phase {
+    double seconds;
+    int clients;
+    double rate;
+    int size;
+};
+
+struct options {
+    int clients;
+    double rate;
+    int size;
+    double seconds;
+    int threads;
+    int per_address;
+    int port;
+    char const *server;
+    char const *script;
+    char const *addresses[MAX_ADDRESSES];
+    int num_addresses;
+    bool json;
+    bool memnet;
+};
+
+/* What goes first in each payload; the rest is filler. */
+struct load_header {
+    uint32_t client;
+    uint32_t sequence;
+    uint64_t sent;
+};
+
+/* What one client thread saw during one phase. */
+struct client_stats {
+    uint64_t sent;
+    uint64_t received;
+    uint64_t connects;
+    uint64_t disconnects;
+    uint64_t late;
+    uint64_t sweeps;
+    uint64_t sweep_time;
+    uint64_t sweep_max;
+    int errors;
+    histogram_t rtt;
+};
+
+/* What the server saw during one phase. */
+struct server_stats {
+    uint64_t peers;
+    uint64_t payloads;
+    uint64_t bytes;
+    udp_stats_t wire;
+};
+
+struct load_thread;
+
+/* The params come first, so the params passed to callbacks are the client. */
+struct sim_client {
+    udp_client_params_t params;
+    udp_client_t *client;
+    udp_client_connection_t *conn;
+    load_thread *thread;
+    uint32_t index;
+    uint32_t sequence;
+    int phase;
+    bool failed;
+    uint64_t next_send;
+};
+
+struct load_thread {
+    pthread_t thread;
+    sim_client *clients;
+    int count;
+    int phase;
+    int errors;
+    uint64_t rng;
+    client_stats stats[MAX_PHASES];
+};
+
+struct load_server;
+
+/* The params come first, so the params passed to callbacks are the group. */
+struct load_group {
+    udp_group_params_t params;
+    load_server *server;
+    udp_group_t *group;
+    int size;
+};
+
+struct load_server {
+    udp_params_t params;
+    udp_instance_t *instance;
+    load_group *groups;
+    int num_groups;
+    int max_groups;
+    int phase;
+    int errors;
+    volatile bool running;
+    //  one more than there are phases; the wire stats of the last one are the totals
+    server_stats stats[MAX_PHASES + 1];
+};
+
+static options opts = { 1000, 10.0, 64, 10.0, 1, 16384, 12350, NULL, NULL, { NULL }, 0, false, false };
+static phase phases[MAX_PHASES];
+static int num_phases;
+//  when each phase ends, in udp_timestamp() time
+static uint64_t phase_end[MAX_PHASES];
+static udp_conn_addr_t server_addr;
+
+static int phase_at(uint64_t now) {
+    int i = 0;
+    while (i != num_phases && now >= phase_end[i]) {
+        ++i;
+    }
+    return i;
+}
+
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static void on_peer_message(udp_group_params_t *gpar, udp_peer_t *peer, udp_payload_t *payload) {
+    load_server *srv = ((load_group *)gpar)->server;
+    server_stats *st = &srv->stats[srv->phase < num_phases ? srv->phase : num_phases - 1];
+    st->payloads++;
+    st->bytes += payload->size;
+    udp_payload_t *pl = udp_payload_get(srv->instance);
+    if (!pl) {
+        srv->errors++;
+        return;
+    }
+    memcpy(pl->data, payload->data, payload->size);
+    pl->size = payload->size;
+    if (udp_peer_payload_enqueue(peer, pl) != UDP_OK) {
+        srv->errors++;
+    }
+}
+
+static void on_peer_removed(udp_group_params_t *gpar, udp_peer_t *peer, UDPPEER reason) {
+    ((load_group *)gpar)->size--;
+}
+
+static void on_error(udp_params_t *params, UDPERR err, char const *text) {
+    load_server *srv = (load_server *)params;
+    if (srv->errors++ < MAX_ERROR_REPORTS) {
+        fprintf(stderr, "udploadgen: server error %d (%s)\n", err, text);
+    }
+}
+
+static void on_idle(udp_params_t *params) {
+}
+
+static void on_peer_new(udp_params_t *params, udp_peer_t *peer, udp_payload_t *payload) {
+    load_server *srv = (load_server *)params;
+    //  peers come and go, so fill up whichever group has room
+    load_group *bg = NULL;
+    for (int i = srv->num_groups; i-- > 0;) {
+        if (srv->groups[i].size < GROUP_SIZE) {
+            bg = &srv->groups[i];
+            break;
+        }
+    }
+    if (!bg) {
+        if (srv->num_groups == srv->max_groups) {
+            srv->errors++;
+            return;
+        }
+        bg = &srv->groups[srv->num_groups];
+        bg->params.on_peer_message = on_peer_message;
+        bg->params.on_peer_removed = on_peer_removed;
+        bg->server = srv;
+        bg->group = udp_group_create(srv->instance, &bg->params);
+        if (!bg->group) {
+            srv->errors++;
+            return;
+        }
+        srv->num_groups++;
+    }
+    if (udp_group_peer_add(bg->group, peer) != UDP_OK) {
+        srv->errors++;
+        return;
+    }
+    bg->size++;
+    srv->stats[srv->phase < num_phases ? srv->phase : num_phases - 1].peers++;
+    //  the payload that made the peer known doesn't go to on_peer_message()
+    if (payload && payload->size) {
+        on_peer_message(&bg->params, peer, payload);
+    }
+}
+
+static void on_peer_expired(udp_params_t *params, udp_peer_t *peer, UDPPEER reason) {
+}
+
+/* Poll the server, and take a snapshot of its socket stats at each phase change. */
+static void *server_thread(void *arg) {
+    load_server *srv = (load_server *)arg;
+    while (srv->running) {
+        int ph = phase_at(udp_timestamp());
+        while (srv->phase < ph) {
+            srv->phase++;
+            udp_stats_get(srv->instance, &srv->stats[srv->phase].wire);
+        }
+        udp_poll(srv->instance);
+    }
+    while (srv->phase < num_phases) {
+        srv->phase++;
+        udp_stats_get(srv->instance, &srv->stats[srv->phase].wire);
+    }
+    return NULL;
+}
+
+static client_stats *current_stats(load_thread *t) {
+    return &t->stats[t->phase < num_phases ? t->phase : num_phases - 1];
+}
+
+static void c_on_error(udp_client_params_t *cparm, UDPERR err, char const *text) {
+    load_thread *t = ((sim_client *)cparm)->thread;
+    current_stats(t)->errors++;
+    if (t->errors++ < MAX_ERROR_REPORTS) {
+        fprintf(stderr, "udploadgen: client %u error %d (%s)\n", ((sim_client *)cparm)->index, err, text);
+    }
+}
+
+static void c_on_idle(udp_client_params_t *cparm) {
+}
+
+static void c_on_payload(udp_client_params_t *cparm, udp_client_connection_t *conn, udp_payload_t *payload) {
+    sim_client *c = (sim_client *)cparm;
+    if (payload->size < sizeof(load_header)) {
+        return;
+    }
+    load_header hdr;
+    memcpy(&hdr, payload->data, sizeof(hdr));
+    if (hdr.client != c->index) {
+        return;
+    }
+    client_stats *st = current_stats(c->thread);
+    st->received++;
+    histogram_record(&st->rtt, udp_timestamp() - hdr.sent);
+}
+
+static void c_on_disconnect(udp_client_params_t *cparm, udp_client_connection_t *conn, UDPPEER reason) {
+    sim_client *c = (sim_client *)cparm;
+    current_stats(c->thread)->disconnects++;
+    c->conn = NULL;
+}
+
+static void c_on_snapshot(udp_client_params_t *cparm, udp_client_connection_t *conn, uint16_t stream, uint32_t sequence, void const *data, size_t size) {
+}
+
+static void client_send(sim_client *c, int size, uint64_t now, client_stats *st) {
+    udp_payload_t *pl = udp_client_payload_get(c->client);
+    if (!pl) {
+        st->errors++;
+        return;
+    }
+    load_header hdr = { c->index, c->sequence++, now };
+    memset(pl->data, 0x5a, size);
+    memcpy(pl->data, &hdr, sizeof(hdr));
+    pl->size = (uint16_t)size;
+    if (udp_client_payload_send(c->conn, pl) == UDP_OK) {
+        st->sent++;
+    }
+}
+
+/* Sweep the thread's clients until the script runs out. A client that is due to
+ * send more than one interval ago has its schedule moved up instead of sending a
+ * burst to catch up; those are counted as late, and mean the thread can't keep up.
+ */
+static void *client_thread(void *arg) {
+    load_thread *t = (load_thread *)arg;
+    for (;;) {
+        uint64_t start = udp_timestamp();
+        t->phase = phase_at(start);
+        if (t->phase == num_phases) {
+            break;
+        }
+        phase const *p = &phases[t->phase];
+        client_stats *st = &t->stats[t->phase];
+        uint64_t interval = p->rate > 0 ? (uint64_t)(1000000 / p->rate) : 0;
+        if (!interval && p->rate > 0) {
+            interval = 1;
+        }
+        for (int i = 0; i != t->count; ++i) {
+            sim_client *c = &t->clients[i];
+            udp_client_poll(c->client);
+            if ((int)c->index >= p->clients || c->failed) {
+                continue;
+            }
+            uint64_t now = udp_timestamp();
+            if (!c->conn) {
+                if (!(c->conn = udp_client_connect(c->client, &server_addr, NULL))) {
+                    c->failed = true;
+                    continue;
+                }
+                st->connects++;
+            }
+            if (!interval) {
+                continue;
+            }
+            if (c->phase != t->phase) {
+                //  spread the clients out over the interval
+                c->phase = t->phase;
+                c->next_send = now + next_random(&t->rng) % interval;
+            }
+            if (now >= c->next_send) {
+                client_send(c, p->size, now, st);
+                c->next_send += interval;
+                if (c->next_send <= now) {
+                    st->late++;
+                    c->next_send = now + interval;
+                }
+            }
+        }
+        uint64_t took = udp_timestamp() - start;
+        st->sweeps++;
+        st->sweep_time += took;
+        if (took > st->sweep_max) {
+            st->sweep_max = took;
+        }
+    }
+    return NULL;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: udploadgen [options]\n"
+            "  -n N   number of simulated clients (default %d)\n"
+            "  -r R   payloads per second per client (default %g)\n"
+            "  -s N   payload size in bytes, %d to %d (default %d)\n"
+            "  -d S   seconds to run (default %g)\n"
+            "  -f F   script file instead of -n -r -s -d; one phase per line:\n"
+            "         seconds clients rate size (# starts a comment)\n"
+            "  -t N   client threads (default %d)\n"
+            "  -l A   local address to send from; repeat to spread the clients over several\n"
+            "         (default 127.0.0.2, 127.0.0.3, ... for the built-in server, none otherwise)\n"
+            "  -a N   clients per local address, for the default addresses (default %d)\n"
+            "  -S H   host of an external server that echoes payloads to their sender,\n"
+            "         instead of the built-in one (its goodput is then not known)\n"
+            "  -p N   server port (default %d)\n"
+            "  -m     talk to the built-in server over an in-process network instead of sockets,\n"
+            "         for up to 65000 clients without a file descriptor each\n"
+            "  -j     print the results as JSON\n",
+            opts.clients, opts.rate, (int)UDP_MIN_PAYLOAD_SIZE, (int)UDP_DEFAULT_MAX_PAYLOAD_SIZE, opts.size,
+            opts.seconds, opts.threads, opts.per_address, opts.port);
+    exit(1);
+}
+
+static bool phase_ok(phase const *p) {
+    return p->seconds > 0 && p->clients >= 0 && p->rate >= 0 &&
+            p->size >= (int)sizeof(load_header) && p->size >= UDP_MIN_PAYLOAD_SIZE &&
+            p->size <= UDP_DEFAULT_MAX_PAYLOAD_SIZE;
+}
+
+static bool read_script(char const *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "udploadgen: can't open %s\n", path);
+        return false;
+    }
+    char line[256];
+    int lineno = 0;
+    while (fgets(line, sizeof(line), f)) {
+        ++lineno;
+        char *hash = strchr(line, '#');
+        if (hash) {
+            *hash = 0;
+        }
+        char extra;
+        phase p;
+        int n = sscanf(line, "%lf %d %lf %d %c", &p.seconds, &p.clients, &p.rate, &p.size, &extra);
+        if (n <= 0) {
+            continue;
+        }
+        if (n != 4 || !phase_ok(&p) || num_phases == MAX_PHASES) {
+            fprintf(stderr, "udploadgen: %s:%d: bad phase\n", path, lineno);
+            fclose(f);
+            return false;
+        }
+        phases[num_phases++] = p;
+    }
+    fclose(f);
+    if (!num_phases) {
+        fprintf(stderr, "udploadgen: %s has no phases\n", path);
+        return false;
+    }
+    return true;
+}
+
+static void parse_options(int argc, char **argv) {
+    int ch;
+    while ((ch = getopt(argc, argv, "n:r:s:d:f:t:l:a:S:p:mjh")) != -1) {
+        switch (ch) {
+            case 'n': opts.clients = atoi(optarg); break;
+            case 'r': opts.rate = atof(optarg); break;
+            case 's': opts.size = atoi(optarg); break;
+            case 'd': opts.seconds = atof(optarg); break;
+            case 'f': opts.script = optarg; break;
+            case 't': opts.threads = atoi(optarg); break;
+            case 'l':
+                if (opts.num_addresses == MAX_ADDRESSES) {
+                    usage();
+                }
+                opts.addresses[opts.num_addresses++] = optarg;
+                break;
+            case 'a': opts.per_address = atoi(optarg); break;
+            case 'S': opts.server = optarg; break;
+            case 'p': opts.port = atoi(optarg); break;
+            case 'm': opts.memnet = true; break;
+            case 'j': opts.json = true; break;
+            default: usage();
+        }
+    }
+    if (optind != argc || opts.threads < 1 || opts.per_address < 1 || opts.port < 1 || opts.port > 65535 ||
+            (opts.memnet && opts.server)) {
+        usage();
+    }
+    if (opts.script) {
+        if (!read_script(opts.script)) {
+            exit(1);
+        }
+    } else {
+        phase p = { opts.seconds, opts.clients, opts.rate, opts.size };
+        if (!phase_ok(&p)) {
+            usage();
+        }
+        phases[num_phases++] = p;
+    }
+}
+
+/* Every client is a socket; ask for as many descriptors as we are allowed. */
+static bool raise_file_limit(int clients) {
+    rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+        return false;
+    }
+    rlim_t want = (rlim_t)clients + 64;
+    if (rl.rlim_cur < want) {
+        rl.rlim_cur = rl.rlim_max == RLIM_INFINITY || rl.rlim_max > want ? want : rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    if (rl.rlim_cur < want) {
+        fprintf(stderr, "udploadgen: %d clients need %llu file descriptors, and the limit is %llu\n",
+                clients, (unsigned long long)want, (unsigned long long)rl.rlim_cur);
+        return false;
+    }
+    return true;
+}
+
+static void report(load_server const *srv, load_thread const *threads, udp_memnet_t const *net) {
+    if (opts.json) {
+        printf("{\"phases\":[");
+    }
+    for (int ph = 0; ph != num_phases; ++ph) {
+        phase const *p = &phases[ph];
+        client_stats total;
+        memset(&total, 0, sizeof(total));
+        histogram_reset(&total.rtt);
+        for (int i = 0; i != opts.threads; ++i) {
+            client_stats const *st = &threads[i].stats[ph];
+            total.sent += st->sent;
+            total.received += st->received;
+            total.connects += st->connects;
+            total.disconnects += st->disconnects;
+            total.late += st->late;
+            total.errors += st->errors;
+            total.sweeps += st->sweeps;
+            total.sweep_time += st->sweep_time;
+            if (st->sweep_max > total.sweep_max) {
+                total.sweep_max = st->sweep_max;
+            }
+            histogram_merge(&total.rtt, &st->rtt);
+        }
+        double sweep_ms = total.sweeps ? total.sweep_time / 1000.0 / total.sweeps : 0;
+        histogram_t const *rtt = &total.rtt;
+        server_stats const *ss = srv ? &srv->stats[ph] : NULL;
+        double goodput = ss ? ss->payloads / p->seconds : 0;
+        double goodbytes = ss ? ss->bytes / p->seconds : 0;
+        double packets = 0;
+        if (ss) {
+            udp_stats_t const *a = &srv->stats[ph].wire, *b = &srv->stats[ph + 1].wire;
+            packets = (b->packets_in + b->packets_out - a->packets_in - a->packets_out) / p->seconds;
+        }
+        if (opts.json) {
+            printf("%s{\"seconds\":%.3f,\"clients\":%d,\"rate\":%g,\"size\":%d,"
+                    "\"connects\":%llu,\"disconnects\":%llu,\"sent\":%llu,\"received\":%llu,\"late\":%llu,\"errors\":%d,",
+                    ph ? "," : "", p->seconds, p->clients, p->rate, p->size,
+                    (unsigned long long)total.connects, (unsigned long long)total.disconnects,
+                    (unsigned long long)total.sent, (unsigned long long)total.received,
+                    (unsigned long long)total.late, total.errors);
+            if (ss) {
+                printf("\"server\":{\"peers\":%llu,\"payloads_per_sec\":%.1f,\"goodput_bytes_per_sec\":%.1f,\"packets_per_sec\":%.1f},",
+                        (unsigned long long)ss->peers, goodput, goodbytes, packets);
+            }
+            printf("\"sweep_ms\":{\"mean\":%.3f,\"max\":%.3f},"
+                    "\"rtt_us\":{\"mean\":%.1f,\"min\":%llu,\"p50\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}}",
+                    sweep_ms, total.sweep_max / 1000.0,
+                    histogram_mean(rtt), (unsigned long long)rtt->min,
+                    (unsigned long long)histogram_percentile(rtt, 50),
+                    (unsigned long long)histogram_percentile(rtt, 99),
+                    (unsigned long long)histogram_percentile(rtt, 99.9),
+                    (unsigned long long)rtt->max);
+            continue;
+        }
+        printf("phase %d: %.3f seconds, %d clients, %g payloads/s each, %d bytes\n",
+                ph + 1, p->seconds, p->clients, p->rate, p->size);
+        printf("  clients: %llu connects, %llu disconnects, %llu sent (%.1f/s), %llu echoed (%.1f/s), %llu late, %d errors\n",
+                (unsigned long long)total.connects, (unsigned long long)total.disconnects,
+                (unsigned long long)total.sent, total.sent / p->seconds,
+                (unsigned long long)total.received, total.received / p->seconds,
+                (unsigned long long)total.late, total.errors);
+        if (ss) {
+            printf("  server: %llu new peers, goodput %.1f payloads/s, %.1f bytes/s, %.1f packets/s on the wire\n",
+                    (unsigned long long)ss->peers, goodput, goodbytes, packets);
+        }
+        printf("  sweep (ms): mean %.3f, max %.3f\n", sweep_ms, total.sweep_max / 1000.0);
+        printf("  round trip (us): mean %.1f, min %llu, p50 %llu, p99 %llu, p999 %llu, max %llu\n",
+                histogram_mean(rtt), (unsigned long long)rtt->min,
+                (unsigned long long)histogram_percentile(rtt, 50),
+                (unsigned long long)histogram_percentile(rtt, 99),
+                (unsigned long long)histogram_percentile(rtt, 99.9),
+                (unsigned long long)rtt->max);
+    }
+    if (opts.json) {
+        printf("]");
+        if (net) {
+            printf(",\"memnet_dropped\":%llu", (unsigned long long)udp_memnet_dropped(net));
+        }
+        printf("}\n");
+    } else if (net) {
+        printf("in-process network: %llu datagrams dropped\n", (unsigned long long)udp_memnet_dropped(net));
+    }
+}
+
+int main(int argc, char **argv) {
+    parse_options(argc, argv);
+
+    int clients = 0, max_size = UDP_MIN_PAYLOAD_SIZE;
+    for (int i = 0; i != num_phases; ++i) {
+        if (phases[i].clients > clients) {
+            clients = phases[i].clients;
+        }
+        if (phases[i].size > max_size) {
+            max_size = phases[i].size;
+        }
+    }
+    if (opts.threads > clients) {
+        opts.threads = clients ? clients : 1;
+    }
+    if (!opts.memnet && !raise_file_limit(clients)) {
+        return 1;
+    }
+
+    //  the built-in server, unless told otherwise
+    static load_server srv;
+    static char default_addresses[MAX_ADDRESSES][24];
+    udp_memnet_t *net = NULL;
+    if (opts.memnet) {
+        net = udp_memnet_create(MEMNET_CLIENT_QUEUE, (uint16_t)(max_size + 32));
+        if (!net || !(srv.params.transport = udp_memnet_endpoint_queue(net, (uint16_t)opts.port, MEMNET_SERVER_QUEUE))) {
+            fprintf(stderr, "udploadgen: out of memory\n");
+            return 1;
+        }
+    }
+    if (!opts.server) {
+        srv.max_groups = clients / GROUP_SIZE + 1;
+        srv.groups = (load_group *)calloc(srv.max_groups, sizeof(load_group));
+        srv.params.port = (uint16_t)opts.port;
+        srv.params.max_payload_size = (uint16_t)max_size;
+        srv.params.app_id = 0x10ad;
+        srv.params.app_version = 1;
+        srv.params.interface = "127.0.0.1";
+        srv.params.on_error = on_error;
+        srv.params.on_idle = on_idle;
+        srv.params.on_peer_new = on_peer_new;
+        srv.params.on_peer_expired = on_peer_expired;
+        srv.instance = udp_initialize(&srv.params);
+        if (!srv.instance || !srv.groups) {
+            fprintf(stderr, "udploadgen: could not start the server on port %d\n", opts.port);
+            return 1;
+        }
+        while (!opts.memnet && (!opts.num_addresses || (opts.num_addresses < MAX_ADDRESSES &&
+                opts.num_addresses * opts.per_address < clients))) {
+            snprintf(default_addresses[opts.num_addresses], sizeof(default_addresses[0]), "127.0.0.%d", opts.num_addresses + 2);
+            opts.addresses[opts.num_addresses] = default_addresses[opts.num_addresses];
+            opts.num_addresses++;
+        }
+    }
+
+    udp_addr_t afmt;
+    snprintf(afmt.addr, sizeof(afmt.addr), "%s", opts.server ? opts.server : "127.0.0.1");
+    snprintf(afmt.port, sizeof(afmt.port), "%d", opts.port);
+    if (udp_client_address_resolve(&afmt, &server_addr) != UDP_OK) {
+        fprintf(stderr, "udploadgen: could not resolve %s:%d\n", afmt.addr, opts.port);
+        return 1;
+    }
+
+    //  all the sockets up front, so making them doesn't count against the first phase
+    sim_client *sims = (sim_client *)calloc(clients ? clients : 1, sizeof(sim_client));
+    load_thread *threads = (load_thread *)calloc(opts.threads, sizeof(load_thread));
+    if (!sims || !threads) {
+        fprintf(stderr, "udploadgen: out of memory\n");
+        return 1;
+    }
+    int per_thread = (clients + opts.threads - 1) / opts.threads;
+    for (int i = 0; i != opts.threads; ++i) {
+        load_thread *t = &threads[i];
+        int first = i * per_thread < clients ? i * per_thread : clients;
+        t->clients = &sims[first];
+        t->count = clients - first < per_thread ? clients - first : per_thread;
+        t->rng = 0x9e3779b97f4a7c15ull * (i + 1);
+        for (int ph = 0; ph != num_phases; ++ph) {
+            histogram_reset(&t->stats[ph].rtt);
+        }
+        for (int j = 0; j != t->count; ++j) {
+            sim_client *c = &t->clients[j];
+            c->thread = t;
+            c->index = (uint32_t)(first + j);
+            c->phase = -1;
+            c->params.app_id = 0x10ad;
+            c->params.app_version = 1;
+            c->params.max_payload_size = (uint16_t)max_size;
+            c->params.on_error = c_on_error;
+            c->params.on_idle = c_on_idle;
+            c->params.on_payload = c_on_payload;
+            c->params.on_disconnect = c_on_disconnect;
+            c->params.on_snapshot = c_on_snapshot;
+            if (opts.num_addresses) {
+                c->params.interface = opts.addresses[(c->index / opts.per_address) % opts.num_addresses];
+            }
+            if (net && !(c->params.transport = udp_memnet_endpoint(net, 0))) {
+                fprintf(stderr, "udploadgen: no port left on the in-process network for client %u\n", c->index);
+                return 1;
+            }
+            if (!(c->client = udp_client_initialize(&c->params))) {
+                fprintf(stderr, "udploadgen: could not start client %u\n", c->index);
+                return 1;
+            }
+        }
+    }
+
+    uint64_t start = udp_timestamp();
+    uint64_t at = start;
+    for (int i = 0; i != num_phases; ++i) {
+        at += (uint64_t)(phases[i].seconds * 1000000);
+        phase_end[i] = at;
+    }
+    pthread_t sthread;
+    if (srv.instance) {
+        udp_stats_get(srv.instance, &srv.stats[0].wire);
+        srv.running = true;
+        if (pthread_create(&sthread, NULL, server_thread, &srv) != 0) {
+            fprintf(stderr, "udploadgen: could not start the server thread\n");
+            return 1;
+        }
+    }
+    for (int i = 0; i != opts.threads; ++i) {
+        if (pthread_create(&threads[i].thread, NULL, client_thread, &threads[i]) != 0) {
+            fprintf(stderr, "udploadgen: could not start client thread %d\n", i);
+            return 1;
+        }
+    }
+    for (int i = 0; i != opts.threads; ++i) {
+        pthread_join(threads[i].thread, NULL);
+    }
+    if (srv.instance) {
+        srv.running = false;
+        pthread_join(sthread, NULL);
+    }
+
+    report(srv.instance ? &srv : NULL, threads, net);
+    int errors = srv.errors;
+    for (int i = 0; i != opts.threads; ++i) {
+        errors += threads[i].errors;
+    }
+    for (int i = 0; i != clients; ++i) {
+        udp_client_terminate(sims[i].client);
+    }
+    if (srv.instance) {
+        udp_terminate(srv.instance);
+    }
+    udp_memnet_destroy(net);
+    free(sims);
+    free(threads);
+    free(srv.groups);
+    return errors ? 1 : 0;
+}
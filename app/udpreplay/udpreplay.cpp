@@ -0,0 +1,211 @@
+/* udpreplay: feed a capture file (@see udp_capture_start()) to a udp_instance_t.
+ *
+ * The datagrams go in through udp_receive_inject(), with their original source
+ * addresses, at the pace they were captured, some multiple of it, or as fast as
+ * the instance will take them. Everyone who connects is put in one group. Nothing
+ * the instance sends back leaves the machine; it all goes to a simulated network
+ * that loses everything. Run it under a profiler to see where a load spike went.
+ */
+
+#include <onyxudp/udpbase.h>
+#include <onyxudp/capture.h>
+#include <onyxutil/histogram.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+struct options {
+    double speed;
+    int loops;
+    int port;
+    int app_id;
+    int app_version;
+    int max_payload_size;
+    char const *path;
+};
+
+struct replay {
+    udp_params_t params;
+    udp_instance_t *instance;
+    udp_group_params_t gp;
+    udp_group_t *group;
+    uint64_t peers;
+    uint64_t messages;
+    int errors;
+};
+
+static options opts = { 1.0, 1, 4712, -1, 0, 0, NULL };
+static replay rp;
+
+static void on_peer_message(udp_group_params_t *gpar, udp_peer_t *peer, udp_payload_t *payload) {
+    rp.messages++;
+}
+
+static void on_peer_removed(udp_group_params_t *gpar, udp_peer_t *peer, UDPPEER reason) {
+}
+
+static void on_error(udp_params_t *params, UDPERR err, char const *text) {
+    fprintf(stderr, "udpreplay: error %d (%s)\n", err, text);
+    rp.errors++;
+}
+
+static void on_idle(udp_params_t *params) {
+}
+
+static void on_peer_new(udp_params_t *params, udp_peer_t *peer, udp_payload_t *payload) {
+    if (!rp.group) {
+        rp.gp.on_peer_message = on_peer_message;
+        rp.gp.on_peer_removed = on_peer_removed;
+        rp.group = udp_group_create(rp.instance, &rp.gp);
+        if (!rp.group) {
+            return;
+        }
+    }
+    if (udp_group_peer_add(rp.group, peer) == UDP_OK) {
+        rp.peers++;
+    }
+}
+
+static void on_peer_expired(udp_params_t *params, udp_peer_t *peer, UDPPEER reason) {
+}
+
+static void usage() {
+    fprintf(stderr, "usage: udpreplay [options] -a app_id capture-file\n"
+            "  -a N   the app_id of the captured server (required)\n"
+            "  -v N   the app_version of the captured server (default %d)\n"
+            "  -s N   the max_payload_size of the captured server (default %d)\n"
+            "  -x N   replay at N times the captured speed; 0 for as fast as possible (default %g)\n"
+            "  -n N   replay the file N times (default %d)\n"
+            "  -p N   local port for the instance (default %d)\n",
+            opts.app_version, (int)UDP_DEFAULT_MAX_PAYLOAD_SIZE, opts.speed, opts.loops, opts.port);
+    exit(1);
+}
+
+static void report(histogram_t const *hist, char const *name) {
+    if (!hist->count) {
+        return;
+    }
+    printf("%-16s %10llu calls, mean %8.1f us, p50 %8.1f us, p99 %8.1f us, max %8.1f us\n", name,
+            (unsigned long long)hist->count, histogram_mean(hist) / 1000.0,
+            histogram_percentile(hist, 50) / 1000.0, histogram_percentile(hist, 99) / 1000.0,
+            hist->max / 1000.0);
+}
+
+/* Replay the file once.
+ * @return the number of datagrams, or -1 if the file is bad.
+ */
+static long replay_file(uint64_t *o_late) {
+    udp_capture_t *cap = udp_capture_open(opts.path);
+    if (!cap) {
+        fprintf(stderr, "udpreplay: %s is not a capture file\n", opts.path);
+        return -1;
+    }
+    static unsigned char buffer[65536];
+    udp_capture_record_t rec;
+    long n = 0;
+    int r;
+    uint64_t first = 0, start = udp_timestamp();
+    while ((r = udp_capture_read(cap, &rec, buffer)) > 0) {
+        if (!n) {
+            first = rec.timestamp;
+        }
+        if (opts.speed > 0) {
+            uint64_t due = start + (uint64_t)((rec.timestamp - first) / opts.speed);
+            uint64_t now = udp_timestamp();
+            if (now > due) {
+                *o_late += now - due;
+            }
+            //  keep the instance ticking while waiting, like the real thing would
+            while (now < due) {
+                udp_poll(rp.instance);
+                now = udp_timestamp();
+            }
+        }
+        if (udp_receive_inject(rp.instance, &rec.from, rec.ecn, rec.data, rec.size) != UDP_OK) {
+            fprintf(stderr, "udpreplay: datagram %ld is too big; check -s\n", n);
+        }
+        udp_poll(rp.instance);
+        ++n;
+    }
+    udp_capture_close(cap);
+    if (r < 0) {
+        fprintf(stderr, "udpreplay: %s is broken after %ld datagrams\n", opts.path, n);
+        return -1;
+    }
+    return n;
+}
+
+int main(int argc, char **argv) {
+    int ch;
+    while ((ch = getopt(argc, argv, "a:v:s:x:n:p:h")) != -1) {
+        switch (ch) {
+            case 'a': opts.app_id = atoi(optarg); break;
+            case 'v': opts.app_version = atoi(optarg); break;
+            case 's': opts.max_payload_size = atoi(optarg); break;
+            case 'x': opts.speed = atof(optarg); break;
+            case 'n': opts.loops = atoi(optarg); break;
+            case 'p': opts.port = atoi(optarg); break;
+            default: usage();
+        }
+    }
+    if (optind + 1 != argc || opts.app_id < 0 || opts.app_id > 65535 || opts.speed < 0 || opts.loops < 1) {
+        usage();
+    }
+    opts.path = argv[optind];
+
+    //  answers go nowhere
+    udp_impairment_t blackhole;
+    memset(&blackhole, 0, sizeof(blackhole));
+    blackhole.loss = 1.0f;
+    rp.params.port = (uint16_t)opts.port;
+    rp.params.max_payload_size = (uint16_t)opts.max_payload_size;
+    rp.params.app_id = (uint16_t)opts.app_id;
+    rp.params.app_version = (uint16_t)opts.app_version;
+    rp.params.interface = "127.0.0.1";
+    rp.params.on_error = on_error;
+    rp.params.on_idle = on_idle;
+    rp.params.on_peer_new = on_peer_new;
+    rp.params.on_peer_expired = on_peer_expired;
+    rp.params.impairment = &blackhole;
+    rp.instance = udp_initialize(&rp.params);
+    if (!rp.instance) {
+        return 1;
+    }
+    udp_timing_enable(rp.instance, 1);
+
+    uint64_t late = 0;
+    long total = 0;
+    uint64_t start = udp_timestamp();
+    for (int i = 0; i != opts.loops; ++i) {
+        long n = replay_file(&late);
+        if (n < 0) {
+            udp_terminate(rp.instance);
+            return 1;
+        }
+        total += n;
+    }
+    double elapsed = (udp_timestamp() - start) / 1000000.0;
+
+    printf("%ld datagrams in %.3f seconds (%.1f/s), %llu peers, %llu messages, %d errors\n",
+            total, elapsed, total / elapsed, (unsigned long long)rp.peers, (unsigned long long)rp.messages, rp.errors);
+    if (opts.speed > 0 && total) {
+        printf("fell behind the captured pace by %.1f us per datagram on average\n", (double)late / total);
+    }
+    histogram_t hist;
+    static struct { UDPTIMING which; char const *name; } const timings[] = {
+        { UDP_TIMING_POLL, "poll" },
+        { UDP_TIMING_CRC, "crc" },
+        { UDP_TIMING_ON_PEER_NEW, "on_peer_new" },
+        { UDP_TIMING_ON_PEER_MESSAGE, "on_peer_message" },
+    };
+    for (size_t i = 0; i != sizeof(timings) / sizeof(timings[0]); ++i) {
+        if (udp_timing_get(rp.instance, timings[i].which, &hist, 0) == UDP_OK) {
+            report(&hist, timings[i].name);
+        }
+    }
+    udp_terminate(rp.instance);
+    return rp.errors ? 1 : 0;
+}
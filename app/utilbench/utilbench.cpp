@@ -0,0 +1,546 @@
+/* utilbench: microbenchmarks for the onyxutil containers, hash and CRC functions.
+ *
+ * Each benchmark is run several times, and the fastest run counts, which filters
+ * out most of the noise from interrupts and other processes. Times are reported
+ * in cycles per operation (time stamp counter ticks, where the CPU has one) and
+ * nanoseconds per operation. Save a run with -o, and compare a later run against
+ * it with -b; the exit code is non-zero if anything got slower than the
+ * threshold.
+ */
+
+#include <onyxutil/hashtable.h>
+#include <onyxutil/vector.h>
+#include <onyxutil/crc.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+
+struct result {
+    char name[64];
+    double cycles;
+    double ns;
+    //  bytes processed per operation, for throughput, or 0
+    size_t bytes;
+};
+
+struct baseline {
+    char name[64];
+    double cycles;
+};
+
+struct options {
+    int repeats;
+    char const *filter;
+    char const *save;
+    char const *compare;
+    double threshold;
+};
+
+static options opts = { 5, NULL, NULL, NULL, 10.0 };
+static result results[256];
+static int num_results;
+//  results are summed into here, so the compiler can't throw the work away
+static volatile size_t sink;
+
+static inline uint64_t cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline uint64_t nanoseconds() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint32_t rng_state = 1;
+
+static uint32_t rng() {
+    //  xorshift32; the same sequence every run, so runs are comparable
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+/* A benchmark sets up in setup(), runs `ops` operations in run(), and cleans up in
+ * teardown(). Only run() is timed.
+ */
+struct bench {
+    void (*setup)(bench *b);
+    void (*run)(bench *b);
+    void (*teardown)(bench *b);
+    size_t size;
+    size_t ops;
+    size_t bytes;
+    hash_table_t table;
+    vector_t vec;
+    uint32_t *keys;
+    unsigned char *buffer;
+};
+
+static void measure(char const *name, bench *b) {
+    if (opts.filter && !strstr(name, opts.filter)) {
+        return;
+    }
+    if (num_results == (int)(sizeof(results) / sizeof(results[0]))) {
+        fprintf(stderr, "utilbench: too many benchmarks\n");
+        exit(1);
+    }
+    double best_cycles = 0, best_ns = 0;
+    for (int i = 0; i != opts.repeats; ++i) {
+        if (b->setup) {
+            b->setup(b);
+        }
+        uint64_t n0 = nanoseconds();
+        uint64_t c0 = cycles();
+        b->run(b);
+        uint64_t c1 = cycles();
+        uint64_t n1 = nanoseconds();
+        if (b->teardown) {
+            b->teardown(b);
+        }
+        double c = (double)(c1 - c0) / b->ops;
+        if (!i || c < best_cycles) {
+            best_cycles = c;
+            best_ns = (double)(n1 - n0) / b->ops;
+        }
+    }
+    result *r = &results[num_results++];
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->cycles = best_cycles;
+    r->ns = best_ns;
+    r->bytes = b->bytes;
+}
+
+/* hash table: items are a 4 byte key and 12 bytes of value, like a small peer record */
+
+struct item {
+    uint32_t key;
+    char value[12];
+};
+
+static size_t hash_key(void const *data, size_t) {
+    return hash_pod(data, sizeof(uint32_t));
+}
+
+static int comp_key(void const *a, void const *b, size_t) {
+    return memcmp(a, b, sizeof(uint32_t));
+}
+
+static void make_keys(bench *b, size_t count) {
+    b->keys = (uint32_t *)malloc(sizeof(uint32_t) * count);
+    rng_state = 1;
+    for (size_t i = 0; i != count; ++i) {
+        b->keys[i] = rng();
+    }
+}
+
+static void fill_table(bench *b) {
+    hash_table_init(&b->table, sizeof(item), 0, hash_key, comp_key);
+    item itm;
+    memset(&itm, 0, sizeof(itm));
+    for (size_t i = 0; i != b->size; ++i) {
+        itm.key = b->keys[i];
+        hash_table_assign(&b->table, &itm);
+    }
+}
+
+static void hash_setup_filled(bench *b) {
+    make_keys(b, b->size * 2);
+    fill_table(b);
+}
+
+static void hash_setup_empty(bench *b) {
+    make_keys(b, b->size);
+    hash_table_init(&b->table, sizeof(item), 0, hash_key, comp_key);
+}
+
+static void hash_teardown(bench *b) {
+    hash_table_deinit(&b->table);
+    free(b->keys);
+}
+
+static void hash_find_sequential(bench *b) {
+    size_t found = 0;
+    for (size_t i = 0; i != b->ops; ++i) {
+        item itm;
+        itm.key = b->keys[i % b->size];
+        found += hash_table_find(&b->table, &itm) != NULL;
+    }
+    sink += found;
+}
+
+static void hash_find_random(bench *b) {
+    size_t found = 0;
+    uint32_t r = 7;
+    for (size_t i = 0; i != b->ops; ++i) {
+        item itm;
+        r = r * 1664525 + 1013904223;
+        itm.key = b->keys[r % b->size];
+        found += hash_table_find(&b->table, &itm) != NULL;
+    }
+    sink += found;
+}
+
+static void hash_find_miss(bench *b) {
+    size_t found = 0;
+    for (size_t i = 0; i != b->ops; ++i) {
+        item itm;
+        //  the second half of the keys was never put in the table
+        itm.key = b->keys[b->size + i % b->size];
+        found += hash_table_find(&b->table, &itm) != NULL;
+    }
+    sink += found;
+}
+
+static void hash_assign(bench *b) {
+    item itm;
+    memset(&itm, 0, sizeof(itm));
+    for (size_t i = 0; i != b->ops; ++i) {
+        itm.key = b->keys[i];
+        hash_table_assign(&b->table, &itm);
+    }
+}
+
+static void hash_remove(bench *b) {
+    size_t removed = 0;
+    for (size_t i = 0; i != b->ops; ++i) {
+        item itm;
+        itm.key = b->keys[i];
+        removed += hash_table_remove(&b->table, &itm);
+    }
+    sink += removed;
+}
+
+/* Peers come and go: remove the oldest key and add a new one, at a steady size. */
+static void hash_churn(bench *b) {
+    item itm;
+    memset(&itm, 0, sizeof(itm));
+    for (size_t i = 0; i != b->ops / 2; ++i) {
+        size_t k = i % b->size;
+        itm.key = b->keys[k];
+        hash_table_remove(&b->table, &itm);
+        itm.key = b->keys[b->size + k];
+        hash_table_assign(&b->table, &itm);
+        uint32_t t = b->keys[k];
+        b->keys[k] = b->keys[b->size + k];
+        b->keys[b->size + k] = t;
+    }
+}
+
+static void bench_hash_table() {
+    size_t const sizes[] = { 16, 1024, 16384 };
+    char name[64];
+    for (size_t s = 0; s != sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        size_t n = sizes[s];
+        bench b;
+        memset(&b, 0, sizeof(b));
+        b.size = n;
+        b.ops = 20000;
+        b.setup = hash_setup_filled;
+        b.teardown = hash_teardown;
+        b.run = hash_find_sequential;
+        snprintf(name, sizeof(name), "hash_find_seq/%zu", n);
+        measure(name, &b);
+        b.run = hash_find_random;
+        snprintf(name, sizeof(name), "hash_find_random/%zu", n);
+        measure(name, &b);
+        b.run = hash_find_miss;
+        snprintf(name, sizeof(name), "hash_find_miss/%zu", n);
+        measure(name, &b);
+        b.run = hash_churn;
+        snprintf(name, sizeof(name), "hash_churn/%zu", n);
+        measure(name, &b);
+        b.ops = n;
+        b.run = hash_remove;
+        snprintf(name, sizeof(name), "hash_remove/%zu", n);
+        measure(name, &b);
+        b.setup = hash_setup_empty;
+        b.run = hash_assign;
+        snprintf(name, sizeof(name), "hash_assign/%zu", n);
+        measure(name, &b);
+    }
+}
+
+/* vector: 16 byte items */
+
+static void vector_setup_empty(bench *b) {
+    vector_init(&b->vec, sizeof(item));
+}
+
+static void vector_setup_filled(bench *b) {
+    vector_init(&b->vec, sizeof(item));
+    item itm;
+    memset(&itm, 0, sizeof(itm));
+    for (size_t i = 0; i != b->size; ++i) {
+        itm.key = (uint32_t)i;
+        vector_item_append(&b->vec, &itm);
+    }
+}
+
+static void vector_teardown(bench *b) {
+    vector_deinit(&b->vec);
+}
+
+static void vector_append(bench *b) {
+    item itm;
+    memset(&itm, 0, sizeof(itm));
+    for (size_t i = 0; i != b->ops; ++i) {
+        itm.key = (uint32_t)i;
+        vector_item_append(&b->vec, &itm);
+    }
+}
+
+static void vector_insert_front(bench *b) {
+    item itm;
+    memset(&itm, 0, sizeof(itm));
+    for (size_t i = 0; i != b->ops; ++i) {
+        itm.key = (uint32_t)i;
+        vector_item_insert(&b->vec, 0, &itm, 1);
+    }
+}
+
+static void vector_insert_middle(bench *b) {
+    item itm;
+    memset(&itm, 0, sizeof(itm));
+    for (size_t i = 0; i != b->ops; ++i) {
+        itm.key = (uint32_t)i;
+        vector_item_insert(&b->vec, b->vec.item_count / 2, &itm, 1);
+    }
+}
+
+static void vector_remove_front(bench *b) {
+    for (size_t i = 0; i != b->ops; ++i) {
+        vector_item_remove(&b->vec, 0, 1);
+    }
+}
+
+static void vector_remove_back(bench *b) {
+    for (size_t i = 0; i != b->ops; ++i) {
+        vector_item_remove(&b->vec, b->vec.item_count - 1, 1);
+    }
+}
+
+static void bench_vector() {
+    size_t const sizes[] = { 16, 1024, 16384 };
+    char name[64];
+    for (size_t s = 0; s != sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        size_t n = sizes[s];
+        bench b;
+        memset(&b, 0, sizeof(b));
+        b.size = n;
+        b.ops = n;
+        b.setup = vector_setup_empty;
+        b.teardown = vector_teardown;
+        b.run = vector_append;
+        snprintf(name, sizeof(name), "vector_append/%zu", n);
+        measure(name, &b);
+        b.run = vector_insert_front;
+        snprintf(name, sizeof(name), "vector_insert_front/%zu", n);
+        measure(name, &b);
+        b.run = vector_insert_middle;
+        snprintf(name, sizeof(name), "vector_insert_middle/%zu", n);
+        measure(name, &b);
+        b.setup = vector_setup_filled;
+        b.run = vector_remove_front;
+        snprintf(name, sizeof(name), "vector_remove_front/%zu", n);
+        measure(name, &b);
+        b.run = vector_remove_back;
+        snprintf(name, sizeof(name), "vector_remove_back/%zu", n);
+        measure(name, &b);
+    }
+}
+
+/* hash_pod and CRC over buffers of packet-ish sizes */
+
+static void buffer_setup(bench *b) {
+    b->buffer = (unsigned char *)malloc(b->bytes);
+    rng_state = 1;
+    for (size_t i = 0; i != b->bytes; ++i) {
+        b->buffer[i] = (unsigned char)rng();
+    }
+}
+
+static void buffer_teardown(bench *b) {
+    free(b->buffer);
+}
+
+static void run_hash_pod(bench *b) {
+    size_t h = 0;
+    for (size_t i = 0; i != b->ops; ++i) {
+        h += hash_pod(b->buffer, b->bytes);
+    }
+    sink += h;
+}
+
+static void run_crc32(bench *b) {
+    uint32_t crc = 0;
+    for (size_t i = 0; i != b->ops; ++i) {
+        crc = update_crc32(b->buffer, b->bytes, crc);
+    }
+    sink += crc;
+}
+
+static void run_crc16(bench *b) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i != b->ops; ++i) {
+        crc = update_crc16(b->buffer, b->bytes, crc);
+    }
+    sink += crc;
+}
+
+static void bench_hash_crc() {
+    size_t const sizes[] = { 4, 8, 64, 256, 1200, 65536 };
+    char name[64];
+    for (size_t s = 0; s != sizeof(sizes) / sizeof(sizes[0]); ++s) {
+        bench b;
+        memset(&b, 0, sizeof(b));
+        b.bytes = sizes[s];
+        //  about 4 MB of data per run, but at least 1000 calls
+        b.ops = (4 << 20) / sizes[s];
+        if (b.ops < 1000) {
+            b.ops = 1000;
+        }
+        b.setup = buffer_setup;
+        b.teardown = buffer_teardown;
+        b.run = run_hash_pod;
+        snprintf(name, sizeof(name), "hash_pod/%zu", sizes[s]);
+        measure(name, &b);
+        b.run = run_crc32;
+        snprintf(name, sizeof(name), "crc32/%zu", sizes[s]);
+        measure(name, &b);
+        b.run = run_crc16;
+        snprintf(name, sizeof(name), "crc16/%zu", sizes[s]);
+        measure(name, &b);
+    }
+}
+
+static int load_baseline(char const *path, baseline **o_base) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "utilbench: cannot read %s\n", path);
+        exit(1);
+    }
+    int n = 0, cap = 0;
+    baseline *base = NULL;
+    char line[256];
+    while (fgets(line, sizeof(line), f)) {
+        baseline bl;
+        double ns;
+        if (line[0] == '#' || sscanf(line, "%63s %lf %lf", bl.name, &bl.cycles, &ns) != 3) {
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            base = (baseline *)realloc(base, sizeof(baseline) * cap);
+        }
+        base[n++] = bl;
+    }
+    fclose(f);
+    *o_base = base;
+    return n;
+}
+
+static void save_results(char const *path) {
+    FILE *f = fopen(path, "w");
+    if (!f) {
+        fprintf(stderr, "utilbench: cannot write %s\n", path);
+        exit(1);
+    }
+    fprintf(f, "# name cycles/op ns/op\n");
+    for (int i = 0; i != num_results; ++i) {
+        fprintf(f, "%s %.3f %.3f\n", results[i].name, results[i].cycles, results[i].ns);
+    }
+    fclose(f);
+}
+
+static int report() {
+    baseline *base = NULL;
+    int nbase = opts.compare ? load_baseline(opts.compare, &base) : 0;
+    int slower = 0;
+    if (opts.compare) {
+        printf("%-28s %12s %12s %10s %8s\n", "benchmark", "cycles/op", "baseline", "ns/op", "change");
+    } else {
+        printf("%-28s %12s %10s %10s\n", "benchmark", "cycles/op", "ns/op", "MB/s");
+    }
+    for (int i = 0; i != num_results; ++i) {
+        result const *r = &results[i];
+        if (!opts.compare) {
+            if (r->bytes) {
+                printf("%-28s %12.1f %10.1f %10.1f\n", r->name, r->cycles, r->ns, r->bytes * 1000.0 / r->ns);
+            } else {
+                printf("%-28s %12.1f %10.1f\n", r->name, r->cycles, r->ns);
+            }
+            continue;
+        }
+        baseline const *bl = NULL;
+        for (int j = 0; j != nbase; ++j) {
+            if (!strcmp(base[j].name, r->name)) {
+                bl = &base[j];
+                break;
+            }
+        }
+        if (!bl || bl->cycles <= 0) {
+            printf("%-28s %12.1f %12s %10.1f %8s\n", r->name, r->cycles, "-", r->ns, "new");
+            continue;
+        }
+        double change = (r->cycles - bl->cycles) * 100.0 / bl->cycles;
+        bool worse = change > opts.threshold;
+        slower += worse;
+        printf("%-28s %12.1f %12.1f %10.1f %+7.1f%%%s\n", r->name, r->cycles, bl->cycles, r->ns, change, worse ? " SLOWER" : "");
+    }
+    free(base);
+    if (opts.compare) {
+        printf("%d of %d benchmarks more than %.1f%% slower than %s\n", slower, num_results, opts.threshold, opts.compare);
+    }
+    return slower;
+}
+
+static void usage() {
+    fprintf(stderr, "usage: utilbench [options]\n"
+            "  -f TEXT   only run benchmarks with TEXT in their name\n"
+            "  -r N      runs per benchmark; the fastest counts (default %d)\n"
+            "  -o FILE   save the results as a baseline\n"
+            "  -b FILE   compare against a saved baseline\n"
+            "  -t PCT    how much slower than the baseline is a regression (default %g)\n",
+            opts.repeats, opts.threshold);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int ch;
+    while ((ch = getopt(argc, argv, "f:r:o:b:t:h")) != -1) {
+        switch (ch) {
+            case 'f': opts.filter = optarg; break;
+            case 'r': opts.repeats = atoi(optarg); break;
+            case 'o': opts.save = optarg; break;
+            case 'b': opts.compare = optarg; break;
+            case 't': opts.threshold = atof(optarg); break;
+            default: usage();
+        }
+    }
+    if (optind != argc || opts.repeats < 1) {
+        usage();
+    }
+    bench_hash_table();
+    bench_vector();
+    bench_hash_crc();
+    if (opts.save) {
+        save_results(opts.save);
+    }
+    return report() ? 1 : 0;
+}
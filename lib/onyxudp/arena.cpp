@@ -0,0 +1,135 @@
+#include "arena.h"
+#include "udpbase.h"
+#include "types.h"
+#include "thread.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+
+enum {
+    //  slots start on cache lines, so two never share one
+    SLOT_ALIGN = 64,
+    HUGE_PAGE_SIZE = 2 * 1024 * 1024
+};
+
+struct udp_arena_t {
+    unsigned char       *base;
+    size_t              mapped;
+    size_t              stride;
+    size_t              count;
+    udp_params_t        *server;
+    pthread_mutex_t     lock;
+    /* indices of the free slots, free_count of them */
+    uint32_t            *free_slots;
+    size_t              free_count;
+    bool                closing;
+};
+
+static size_t round_up(size_t n, size_t to) {
+    return (n + to - 1) / to * to;
+}
+
+udp_arena_t *udp_arena_create(size_t count, size_t size, int huge_pages, unsigned long numa_nodes, udp_params_t *server) {
+    if (!count || count > 0xffffffffu) {
+        return NULL;
+    }
+    udp_arena_t *arena = (udp_arena_t *)calloc(1, sizeof(udp_arena_t));
+    if (!arena) {
+        return NULL;
+    }
+    arena->stride = round_up(sizeof(udp_payload_t) + sizeof(udp_payload_owner_t) + size, SLOT_ALIGN);
+    arena->count = count;
+    arena->server = server;
+    arena->free_slots = (uint32_t *)malloc(count * sizeof(uint32_t));
+    if (!arena->free_slots) {
+        free(arena);
+        return NULL;
+    }
+    void *base = MAP_FAILED;
+    if (huge_pages) {
+        arena->mapped = round_up(arena->stride * count, HUGE_PAGE_SIZE);
+        base = mmap(NULL, arena->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (base == MAP_FAILED) {
+        //  no huge pages reserved (or not asked for); transparent ones may still do
+        arena->mapped = arena->stride * count;
+        base = mmap(NULL, arena->mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            free(arena->free_slots);
+            free(arena);
+            return NULL;
+        }
+        if (huge_pages) {
+            madvise(base, arena->mapped, MADV_HUGEPAGE);
+        }
+    }
+    if (numa_nodes) {
+        //  the pages aren't touched yet, so they all come from the nodes asked for
+        udp_numa_bind(base, arena->mapped, numa_nodes);
+    }
+    arena->base = (unsigned char *)base;
+    //  hand out the low slots first, so a lightly loaded server touches few pages
+    for (size_t i = 0; i != count; ++i) {
+        arena->free_slots[i] = (uint32_t)(count - 1 - i);
+    }
+    arena->free_count = count;
+    pthread_mutex_init(&arena->lock, NULL);
+    return arena;
+}
+
+static void udp_arena_free(udp_arena_t *arena) {
+    munmap(arena->base, arena->mapped);
+    pthread_mutex_destroy(&arena->lock);
+    free(arena->free_slots);
+    free(arena);
+}
+
+udp_payload_t *udp_arena_get(udp_arena_t *arena) {
+    pthread_mutex_lock(&arena->lock);
+    if (!arena->free_count) {
+        pthread_mutex_unlock(&arena->lock);
+        return NULL;
+    }
+    uint32_t slot = arena->free_slots[--arena->free_count];
+    pthread_mutex_unlock(&arena->lock);
+    unsigned char *p = arena->base + (size_t)slot * arena->stride;
+    udp_payload_t *payload = (udp_payload_t *)p;
+    udp_payload_owner_t *owner = (udp_payload_owner_t *)(payload + 1);
+    memset(p, 0, sizeof(udp_payload_t) + sizeof(udp_payload_owner_t));
+    payload->data = owner + 1;
+    payload->_refcount = 1;
+    owner->server = arena->server;
+    owner->arena = arena;
+    return payload;
+}
+
+void udp_arena_put(udp_arena_t *arena, udp_payload_t *payload) {
+    uint32_t slot = (uint32_t)(((unsigned char *)payload - arena->base) / arena->stride);
+    pthread_mutex_lock(&arena->lock);
+    arena->free_slots[arena->free_count++] = slot;
+    bool last = arena->closing && arena->free_count == arena->count;
+    pthread_mutex_unlock(&arena->lock);
+    if (last) {
+        udp_arena_free(arena);
+    }
+}
+
+unsigned char *udp_arena_buffer(udp_payload_t *payload) {
+    return (unsigned char *)((udp_payload_owner_t *)(payload + 1) + 1);
+}
+
+void udp_arena_destroy(udp_arena_t *arena) {
+    if (!arena) {
+        return;
+    }
+    pthread_mutex_lock(&arena->lock);
+    arena->closing = true;
+    bool last = arena->free_count == arena->count;
+    pthread_mutex_unlock(&arena->lock);
+    if (last) {
+        udp_arena_free(arena);
+    }
+}
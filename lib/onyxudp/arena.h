@@ -0,0 +1,47 @@
+#if !defined(onyxudp_arena_h)
+#define onyxudp_arena_h
+
+/* Internal support for udp_params_t::receive_arena.
+ *
+ * The arena is one mapping, made up front, of equal slots. Each slot is a whole
+ * payload: the udp_payload_t, the owner record that udp_payload_new() puts after it,
+ * and room for a datagram, headers and all. The socket receives straight into a slot,
+ * and if the datagram turns out to be a payload, the udp_payload_t of the slot is
+ * pointed at the data past the headers and handed on, so the data is never copied.
+ * Anything else leaves the slot for the next receive. When the last reference to a
+ * payload goes, udp_payload_release() puts the slot back on the free list.
+ *
+ * Payloads can be released from worker threads, or any thread the application held
+ * them on, so the free list has a lock. The slots live until the last one comes back,
+ * even when that's after udp_terminate().
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct udp_payload_t udp_payload_t;
+typedef struct udp_params_t udp_params_t;
+typedef struct udp_arena_t udp_arena_t;
+
+/* Map count slots with room for datagrams of up to size bytes, on huge pages if asked
+ * and there are any to be had (transparent ones, if not), and on numa_nodes if not 0.
+ * @return NULL if out of memory.
+ */
+udp_arena_t *udp_arena_create(size_t count, size_t size, int huge_pages, unsigned long numa_nodes, udp_params_t *server);
+
+/* Take a free slot, as a payload with one reference, no data, and its data pointer at
+ * the start of room for size bytes.
+ * @return NULL if all slots are in use.
+ */
+udp_payload_t *udp_arena_get(udp_arena_t *arena);
+
+/* Put the slot of a payload whose last reference is gone back on the free list. */
+void udp_arena_put(udp_arena_t *arena, udp_payload_t *payload);
+
+/* @return where a slot from udp_arena_get() has its room for size bytes. */
+unsigned char *udp_arena_buffer(udp_payload_t *payload);
+
+/* Unmap the arena, now or when the last slot in use comes back. */
+void udp_arena_destroy(udp_arena_t *arena);
+
+#endif  //  onyxudp_arena_h
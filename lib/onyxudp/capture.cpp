@@ -0,0 +1,104 @@
+#include "capture.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+static char const capture_magic[8] = { 'O', 'N', 'Y', 'X', 'C', 'A', 'P', '1' };
+
+//  Records are written with the host byte order; every platform we build on is
+//  little-endian, which is what the format says.
+struct capture_record_header {
+    uint32_t            delta;
+    uint16_t            size;
+    uint8_t             addr_size;
+    uint8_t             ecn;
+};
+
+static size_t addr_size(udp_conn_addr_t const *addr) {
+    size_t n = 2 + addr->data[1];
+    return n > sizeof(addr->data) ? sizeof(addr->data) : n;
+}
+
+udp_capture_t *udp_capture_create(char const *path, uint64_t start) {
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        return NULL;
+    }
+    if (fwrite(capture_magic, 1, 8, f) != 8 || fwrite(&start, 8, 1, f) != 1) {
+        fclose(f);
+        return NULL;
+    }
+    udp_capture_t *cap = (udp_capture_t *)malloc(sizeof(udp_capture_t));
+    if (!cap) {
+        fclose(f);
+        return NULL;
+    }
+    cap->file = f;
+    cap->last = start;
+    return cap;
+}
+
+int udp_capture_write(udp_capture_t *cap, uint64_t timestamp, udp_conn_addr_t const *from, uint8_t ecn, void const *data, size_t size) {
+    capture_record_header hdr;
+    //  time only goes forward, and a gap of over an hour is just a long gap
+    uint64_t delta = timestamp > cap->last ? timestamp - cap->last : 0;
+    hdr.delta = delta > 0xffffffffu ? 0xffffffffu : (uint32_t)delta;
+    hdr.size = (uint16_t)size;
+    hdr.addr_size = (uint8_t)addr_size(from);
+    hdr.ecn = ecn;
+    cap->last += hdr.delta;
+    if (fwrite(&hdr, sizeof(hdr), 1, cap->file) != 1 ||
+            fwrite(from->data, 1, hdr.addr_size, cap->file) != hdr.addr_size ||
+            fwrite(data, 1, size, cap->file) != size) {
+        return -1;
+    }
+    return 0;
+}
+
+udp_capture_t *udp_capture_open(char const *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        return NULL;
+    }
+    char magic[8];
+    uint64_t start;
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, capture_magic, 8) || fread(&start, 8, 1, f) != 1) {
+        fclose(f);
+        return NULL;
+    }
+    udp_capture_t *cap = (udp_capture_t *)malloc(sizeof(udp_capture_t));
+    if (!cap) {
+        fclose(f);
+        return NULL;
+    }
+    cap->file = f;
+    cap->last = start;
+    return cap;
+}
+
+int udp_capture_read(udp_capture_t *cap, udp_capture_record_t *o_record, void *buffer) {
+    capture_record_header hdr;
+    if (fread(&hdr, sizeof(hdr), 1, cap->file) != 1) {
+        return ferror(cap->file) ? -1 : 0;
+    }
+    if (hdr.addr_size > sizeof(o_record->from.data)) {
+        return -1;
+    }
+    memset(&o_record->from, 0, sizeof(o_record->from));
+    if (fread(o_record->from.data, 1, hdr.addr_size, cap->file) != hdr.addr_size ||
+            fread(buffer, 1, hdr.size, cap->file) != hdr.size) {
+        return ferror(cap->file) ? -1 : 0;
+    }
+    cap->last += hdr.delta;
+    o_record->timestamp = cap->last;
+    o_record->ecn = hdr.ecn;
+    o_record->size = hdr.size;
+    o_record->data = buffer;
+    return 1;
+}
+
+void udp_capture_close(udp_capture_t *cap) {
+    fclose(cap->file);
+    free(cap);
+}
@@ -0,0 +1,65 @@
+#if !defined(onyxudp_capture_h)
+#define onyxudp_capture_h
+
+/* Capture files, as written by udp_capture_start() and read back by the udpreplay
+ * tool (or your own.)
+ *
+ * The file is a header, followed by one record per datagram, in the order they
+ * were received. Records are only ever appended, so a capture that is cut short
+ * (by a crash, or a full disk) is still readable up to the last whole record.
+ * Numbers are little-endian.
+ *
+ *  header:  "ONYXCAP1" (8 bytes), uint64 timestamp of the first record
+ *  record:  uint32 microseconds since the previous record (since the header for
+ *           the first), uint16 datagram size, uint8 address size, uint8 ECN bits,
+ *           then the address bytes, then the datagram bytes
+ *
+ * The address bytes are the used part of the udp_conn_addr_t the datagram came from.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "udpbase.h"
+
+typedef struct udp_capture_t {
+    FILE                *file;
+    uint64_t            last;
+} udp_capture_t;
+
+typedef struct udp_capture_record_t {
+    /* udp_timestamp() when the datagram was received */
+    uint64_t            timestamp;
+    udp_conn_addr_t     from;
+    uint8_t             ecn;
+    uint16_t            size;
+    /* the datagram; valid until the next udp_capture_read() */
+    void const          *data;
+} udp_capture_record_t;
+
+/* Create (or truncate) a capture file for writing, starting at the time start.
+ * @return NULL if the file can't be created.
+ */
+udp_capture_t *udp_capture_create(char const *path, uint64_t start);
+
+/* Append a datagram.
+ * @return 0 for success, or -1 if the file couldn't be written (errno tells why.)
+ */
+int udp_capture_write(udp_capture_t *cap, uint64_t timestamp, udp_conn_addr_t const *from, uint8_t ecn, void const *data, size_t size);
+
+/* Open a capture file for reading.
+ * @return NULL if the file can't be opened, or isn't a capture file.
+ */
+udp_capture_t *udp_capture_open(char const *path);
+
+/* Read the next datagram.
+ * @param buffer Where to put the datagram; must hold 65535 bytes.
+ * @return 1 for a datagram, 0 at the end of the file (including a last record that
+ * was cut short), or -1 for a read error or a broken record.
+ */
+int udp_capture_read(udp_capture_t *cap, udp_capture_record_t *o_record, void *buffer);
+
+/* Flush and close a capture file, whether reading or writing. */
+void udp_capture_close(udp_capture_t *cap);
+
+#endif  //  onyxudp_capture_h
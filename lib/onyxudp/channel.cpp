@@ -0,0 +1,415 @@
+#include "udpbase.h"
+#include "protocol.h"
+#include "types.h"
+#include "channel.h"
+
+#include <onyxutil/vector.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+
+//  Resend timeout before there's an RTT estimate, and the least it can be after.
+#define CHANNEL_INITIAL_RTO 200000
+#define CHANNEL_MIN_RTO 20000
+
+static bool sequence_newer(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) > 0;
+}
+
+void udp_channel_config_init(udp_channel_config_t *config) {
+    memset(config, 0, sizeof(udp_channel_config_t) * UDP_MAX_CHANNELS);
+    config[0].configured = 1;
+    config[0].kind = UDP_CHANNEL_UNRELIABLE;
+    config[0].weight = 1;
+}
+
+UDPERR udp_channel_config_set(udp_channel_config_t *config, uint8_t channel, UDPCHANNEL kind, uint8_t priority, uint16_t weight) {
+    if (channel >= UDP_MAX_CHANNELS || kind > UDP_CHANNEL_RELIABLE_ORDERED || !weight) {
+        return UDPERR_INVALID_ARGUMENT;
+    }
+    if (channel == 0 && kind != UDP_CHANNEL_UNRELIABLE) {
+        //  channel 0 has no header to carry a sequence number in
+        return UDPERR_INVALID_ARGUMENT;
+    }
+    config[channel].configured = 1;
+    config[channel].kind = (uint8_t)kind;
+    config[channel].priority = priority;
+    config[channel].weight = weight;
+    return UDP_OK;
+}
+
+void udp_channels_init(udp_channels_t *ch) {
+    memset(ch, 0, sizeof(*ch));
+    for (int i = 0; i != UDP_MAX_CHANNELS; ++i) {
+        vector_init(&ch->send[i].queue, sizeof(udp_payload_t *));
+        vector_init(&ch->send[i].unacked, sizeof(udp_channel_unacked_t));
+        ch->send[i].next_sequence = 1;
+    }
+}
+
+void udp_channels_deinit(udp_channels_t *ch) {
+    for (int i = 0; i != UDP_MAX_CHANNELS; ++i) {
+        udp_send_channel_t *s = &ch->send[i];
+        for (size_t j = 0, n = s->queue.item_count; j != n; ++j) {
+            udp_payload_release(*(udp_payload_t **)vector_item_get(&s->queue, j));
+        }
+        for (size_t j = 0, n = s->unacked.item_count; j != n; ++j) {
+            udp_payload_release(((udp_channel_unacked_t *)vector_item_get(&s->unacked, j))->payload);
+        }
+        vector_deinit(&s->queue);
+        vector_deinit(&s->unacked);
+        udp_recv_channel_t *r = &ch->recv[i];
+        if (r->window) {
+            for (int j = 0; j != UDP_CHANNEL_WINDOW; ++j) {
+                if (r->window[j]) {
+                    udp_payload_release(r->window[j]);
+                }
+            }
+            free(r->window);
+        }
+    }
+    memset(ch, 0, sizeof(*ch));
+}
+
+UDPERR udp_channels_enqueue(udp_channels_t *ch, udp_channel_config_t const *config, uint8_t channel, udp_payload_t *payload) {
+    if (channel == 0 || channel >= UDP_MAX_CHANNELS || !config[channel].configured) {
+        udp_payload_release(payload);
+        return UDPERR_INVALID_ARGUMENT;
+    }
+    udp_send_channel_t *s = &ch->send[channel];
+    if (config[channel].kind == UDP_CHANNEL_LATEST_ONLY) {
+        //  whatever is still waiting has been superseded
+        for (size_t j = 0, n = s->queue.item_count; j != n; ++j) {
+            udp_payload_release(*(udp_payload_t **)vector_item_get(&s->queue, j));
+        }
+        vector_item_remove(&s->queue, 0, s->queue.item_count);
+    }
+    if (vector_item_append(&s->queue, &payload) == 0) {
+        udp_payload_release(payload);
+        return UDPERR_OUT_OF_MEMORY;
+    }
+    return UDP_OK;
+}
+
+static uint64_t udp_channel_rto(udp_congestion_t const *cc) {
+    if (!cc->srtt) {
+        return CHANNEL_INITIAL_RTO;
+    }
+    uint64_t rto = (uint64_t)cc->srtt * 2;
+    return rto < CHANNEL_MIN_RTO ? CHANNEL_MIN_RTO : rto;
+}
+
+/* State for one call to udp_channels_flush() */
+struct udp_channel_flush_t {
+    udp_channels_t              *ch;
+    udp_channel_config_t const  *config;
+    vector_t                    *plain;
+    udp_congestion_t            *cc;
+    udp_channel_send_t          send;
+    void                        *context;
+    uint64_t                    now;
+    uint64_t                    rto;
+    //  queue entries sent so far; they're removed from the queues at the end
+    size_t                      head[UDP_MAX_CHANNELS];
+    int                         sent;
+    bool                        blocked;
+};
+
+static udp_channel_unacked_t *udp_channel_due(udp_channel_flush_t *f, int c) {
+    vector_t *unacked = &f->ch->send[c].unacked;
+    for (size_t i = 0, n = unacked->item_count; i != n; ++i) {
+        udp_channel_unacked_t *u = (udp_channel_unacked_t *)vector_item_get(unacked, i);
+        if (f->now - u->sent_timestamp >= f->rto) {
+            return u;
+        }
+    }
+    return NULL;
+}
+
+static bool udp_channel_has_work(udp_channel_flush_t *f, int c) {
+    if (!f->config[c].configured) {
+        return false;
+    }
+    if (c == 0) {
+        return f->head[0] < f->plain->item_count;
+    }
+    udp_send_channel_t *s = &f->ch->send[c];
+    if (f->config[c].kind != UDP_CHANNEL_RELIABLE_ORDERED) {
+        return f->head[c] < s->queue.item_count;
+    }
+    if (!s->unacked.item_count && f->head[c] == s->queue.item_count) {
+        return false;
+    }
+    if (!udp_congestion_budget(f->cc, f->now)) {
+        return false;
+    }
+    return (f->head[c] < s->queue.item_count && s->unacked.item_count < UDP_CHANNEL_WINDOW) ||
+        udp_channel_due(f, c) != NULL;
+}
+
+/* Send the next thing from channel c.
+ * @return the number of bytes sent, or 0 if the socket is full (or a reliable
+ * payload can't be kept for resending, in which case it stays queued.)
+ */
+static size_t udp_channel_send_one(udp_channel_flush_t *f, int c) {
+    if (c == 0) {
+        udp_payload_t *payload = *(udp_payload_t **)vector_item_get(f->plain, f->head[0]);
+        if (!f->send(f->context, payload, NULL, f->now)) {
+            return 0;
+        }
+        f->head[0]++;
+        size_t size = payload->size;
+        udp_payload_release(payload);
+        return size ? size : 1;
+    }
+    udp_send_channel_t *s = &f->ch->send[c];
+    channel_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.channel = (uint8_t)c;
+    hdr.kind = f->config[c].kind;
+    if (hdr.kind == UDP_CHANNEL_RELIABLE_ORDERED) {
+        udp_channel_unacked_t *u = udp_channel_due(f, c);
+        if (u) {
+            hdr.sequence = u->sequence;
+            if (!f->send(f->context, u->payload, &hdr, f->now)) {
+                return 0;
+            }
+            u->sent_timestamp = f->now;
+            return u->payload->size ? u->payload->size : 1;
+        }
+    }
+    udp_payload_t *payload = *(udp_payload_t **)vector_item_get(&s->queue, f->head[c]);
+    hdr.sequence = s->next_sequence;
+    bool reliable = hdr.kind == UDP_CHANNEL_RELIABLE_ORDERED;
+    if (reliable) {
+        //  the queue's reference moves to the unacked list; make room for it first,
+        //  so that nothing goes out that couldn't be resent
+        udp_channel_unacked_t u = { payload, hdr.sequence, f->now };
+        if (vector_item_append(&s->unacked, &u) == 0) {
+            return 0;
+        }
+    }
+    if (!f->send(f->context, payload, &hdr, f->now)) {
+        if (reliable) {
+            vector_item_remove(&s->unacked, s->unacked.item_count - 1, 1);
+        }
+        return 0;
+    }
+    s->next_sequence++;
+    f->head[c]++;
+    size_t size = payload->size ? payload->size : 1;
+    if (!reliable) {
+        udp_payload_release(payload);
+    }
+    return size;
+}
+
+int udp_channels_flush(udp_channels_t *ch, udp_channel_config_t const *config, vector_t *plain, udp_congestion_t *cc, udp_channel_send_t send, void *context, uint64_t now) {
+    udp_channel_flush_t f;
+    memset(&f, 0, sizeof(f));
+    f.ch = ch;
+    f.config = config;
+    f.plain = plain;
+    f.cc = cc;
+    f.send = send;
+    f.context = context;
+    f.now = now;
+    f.rto = udp_channel_rto(cc);
+    while (!f.blocked) {
+        //  the most urgent priority that has anything to send
+        int priority = -1;
+        for (int c = 0; c != UDP_MAX_CHANNELS; ++c) {
+            if (config[c].priority > priority && udp_channel_has_work(&f, c)) {
+                priority = config[c].priority;
+            }
+        }
+        if (priority < 0) {
+            break;
+        }
+        //  deficit round robin within the priority, until it runs dry
+        bool more = true;
+        while (more && !f.blocked) {
+            more = false;
+            for (int c = 0; c != UDP_MAX_CHANNELS && !f.blocked; ++c) {
+                if (config[c].priority != priority) {
+                    continue;
+                }
+                udp_send_channel_t *s = &ch->send[c];
+                if (!udp_channel_has_work(&f, c)) {
+                    s->deficit = 0;
+                    continue;
+                }
+                s->deficit += config[c].weight * UDP_CHANNEL_QUANTUM;
+                while (s->deficit > 0 && udp_channel_has_work(&f, c)) {
+                    size_t n = udp_channel_send_one(&f, c);
+                    if (!n) {
+                        f.blocked = true;
+                        break;
+                    }
+                    s->deficit -= (int32_t)n;
+                    f.sent++;
+                }
+                more = more || udp_channel_has_work(&f, c);
+            }
+        }
+    }
+    if (f.head[0]) {
+        vector_item_remove(plain, 0, f.head[0]);
+    }
+    for (int c = 1; c != UDP_MAX_CHANNELS; ++c) {
+        if (f.head[c]) {
+            vector_item_remove(&ch->send[c].queue, 0, f.head[c]);
+        }
+    }
+    return f.sent;
+}
+
+static void udp_channel_ready(vector_t *ready, udp_payload_t *payload) {
+    udp_payload_hold(payload);
+    if (vector_item_append(ready, &payload) == 0) {
+        udp_payload_release(payload);
+    }
+}
+
+size_t udp_channels_queued(udp_channels_t const *ch) {
+    size_t n = 0;
+    for (int i = 1; i != UDP_MAX_CHANNELS; ++i) {
+        n += ch->send[i].queue.item_count;
+    }
+    return n;
+}
+
+void udp_channels_receive(udp_channels_t *ch, channel_header const *hdr, udp_payload_t *payload, vector_t *ready) {
+    if (hdr->channel == 0 || hdr->channel >= UDP_MAX_CHANNELS || hdr->kind > UDP_CHANNEL_RELIABLE_ORDERED) {
+        return;
+    }
+    udp_recv_channel_t *r = &ch->recv[hdr->channel];
+    if (!r->active) {
+        r->active = 1;
+        r->kind = hdr->kind;
+        r->sequence = hdr->kind == UDP_CHANNEL_RELIABLE_ORDERED ? 1 : 0;
+    } else if (r->kind != hdr->kind) {
+        return;
+    }
+    ((udp_payload_owner_t *)(payload + 1))->channel = hdr->channel;
+    switch (r->kind) {
+        case UDP_CHANNEL_UNRELIABLE:
+            udp_channel_ready(ready, payload);
+            break;
+        case UDP_CHANNEL_LATEST_ONLY:
+        case UDP_CHANNEL_SEQUENCED:
+            if (!r->sequence || sequence_newer(hdr->sequence, r->sequence)) {
+                r->sequence = hdr->sequence;
+                udp_channel_ready(ready, payload);
+            }
+            break;
+        case UDP_CHANNEL_RELIABLE_ORDERED: {
+            if (!r->window) {
+                r->window = (udp_payload_t **)calloc(UDP_CHANNEL_WINDOW, sizeof(udp_payload_t *));
+                if (!r->window) {
+                    //  not acknowledged, so it'll come again
+                    return;
+                }
+            }
+            //  acknowledge even duplicates; the earlier ack may have been lost
+            if (!r->ack_pending) {
+                r->ack_pending = 1;
+                ch->acks_pending++;
+            }
+            uint32_t d = hdr->sequence - r->sequence;
+            if ((int32_t)d < 0 || d >= UDP_CHANNEL_WINDOW) {
+                return;
+            }
+            if (d > 0) {
+                udp_payload_t **slot = &r->window[hdr->sequence % UDP_CHANNEL_WINDOW];
+                if (!*slot) {
+                    udp_payload_hold(payload);
+                    *slot = payload;
+                }
+                return;
+            }
+            udp_channel_ready(ready, payload);
+            r->sequence++;
+            //  and whatever was waiting for it
+            for (udp_payload_t **slot; *(slot = &r->window[r->sequence % UDP_CHANNEL_WINDOW]); r->sequence++) {
+                if (vector_item_append(ready, slot) == 0) {
+                    udp_payload_release(*slot);
+                }
+                *slot = NULL;
+            }
+            break;
+        }
+    }
+}
+
+void udp_channels_ack_receive(udp_channels_t *ch, void const *data, size_t size) {
+    unsigned char const *p = (unsigned char const *)data;
+    for (size_t o = 0; size - o >= sizeof(channel_ack); o += sizeof(channel_ack)) {
+        channel_ack ack;
+        memcpy(&ack, p + o, sizeof(ack));
+        if (ack.channel >= UDP_MAX_CHANNELS) {
+            continue;
+        }
+        vector_t *unacked = &ch->send[ack.channel].unacked;
+        size_t kept = 0;
+        for (size_t i = 0, n = unacked->item_count; i != n; ++i) {
+            udp_channel_unacked_t *u = (udp_channel_unacked_t *)vector_item_get(unacked, i);
+            uint32_t d = u->sequence - ack.next_sequence;
+            bool acked = (int32_t)d < 0 || (d > 0 && d <= 64 && (ack.received & ((uint64_t)1 << (d - 1))));
+            if (acked) {
+                udp_payload_release(u->payload);
+            } else {
+                if (kept != i) {
+                    memcpy(vector_item_get(unacked, kept), u, sizeof(*u));
+                }
+                ++kept;
+            }
+        }
+        if (kept != unacked->item_count) {
+            vector_item_remove(unacked, kept, unacked->item_count - kept);
+        }
+    }
+}
+
+size_t udp_channels_ack_fill(udp_channels_t *ch, void *out, size_t size) {
+    size_t o = 0;
+    for (int c = 1; c != UDP_MAX_CHANNELS && ch->acks_pending; ++c) {
+        udp_recv_channel_t *r = &ch->recv[c];
+        if (!r->ack_pending) {
+            continue;
+        }
+        if (size - o < sizeof(channel_ack)) {
+            break;
+        }
+        channel_ack ack;
+        memset(&ack, 0, sizeof(ack));
+        ack.channel = (uint8_t)c;
+        ack.next_sequence = r->sequence;
+        for (uint32_t i = 0; i != UDP_CHANNEL_WINDOW - 1; ++i) {
+            if (r->window[(r->sequence + 1 + i) % UDP_CHANNEL_WINDOW]) {
+                ack.received |= (uint64_t)1 << i;
+            }
+        }
+        memcpy((unsigned char *)out + o, &ack, sizeof(ack));
+        o += sizeof(ack);
+        r->ack_pending = 0;
+        ch->acks_pending--;
+    }
+    return o;
+}
+
+static_assert(sizeof(channel_ack) == UDP_CHANNEL_ACK_SIZE, "UDP_CHANNEL_ACK_SIZE is sizeof(channel_ack)");
+static_assert(offsetof(udp_channel_acks_t, owner) == sizeof(udp_payload_t), "the owner follows the payload");
+
+udp_payload_t *udp_channel_acks_get(udp_channel_acks_t *acks, udp_channels_t *ch, size_t max_payload_size) {
+    memset(&acks->payload, 0, sizeof(acks->payload) + sizeof(acks->owner));
+    acks->payload.data = acks->data;
+    //  pinned, so nothing ever tries to free it
+    acks->payload._refcount = 0xffff;
+    acks->owner.flags = UDP_DATA_FLAG_CHANNEL_ACK;
+    size_t size = max_payload_size < sizeof(acks->data) ? max_payload_size : sizeof(acks->data);
+    acks->payload.size = (uint16_t)udp_channels_ack_fill(ch, acks->data, size);
+    return &acks->payload;
+}
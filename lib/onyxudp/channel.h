@@ -0,0 +1,113 @@
+#if !defined(onyxudp_channel_h)
+#define onyxudp_channel_h
+
+/* Per-remote-end message channels, used by both udp_peer_t and
+ * udp_client_connection_t.
+ *
+ * Channel 0 is the plain out queue that udp_peer_payload_enqueue() and
+ * udp_client_payload_send() have always used; its payloads go out without a
+ * channel header. Other channels are configured per instance/client, and each
+ * has a kind (UDPCHANNEL), a priority and a weight. The flush sends the highest
+ * priority channels that have something to send first, and shares out sending
+ * between channels of the same priority by weight (deficit round robin, counted
+ * in bytes.)
+ *
+ * Reliable channels keep sent payloads until they are acknowledged, and resend
+ * them after a timeout derived from the round trip time. At most
+ * UDP_CHANNEL_WINDOW payloads are outstanding per channel, and reliable
+ * channels only send while the congestion budget allows; everything else is
+ * sent regardless, as before.
+ */
+
+#include <stdint.h>
+#include <onyxutil/vector.h>
+
+#include "udpbase.h"
+#include "congestion.h"
+
+struct channel_header;
+
+enum {
+    /* how many reliable payloads can be in flight, per channel */
+    UDP_CHANNEL_WINDOW = 64,
+    /* bytes of sending per unit of weight per round */
+    UDP_CHANNEL_QUANTUM = 256,
+    /* sizeof(channel_ack) */
+    UDP_CHANNEL_ACK_SIZE = 16
+};
+
+typedef struct udp_channel_config_t {
+    uint8_t     configured;
+    uint8_t     kind;
+    uint8_t     priority;
+    uint16_t    weight;
+} udp_channel_config_t;
+
+typedef struct udp_channel_unacked_t {
+    udp_payload_t   *payload;
+    uint32_t        sequence;
+    uint64_t        sent_timestamp;
+} udp_channel_unacked_t;
+
+typedef struct udp_send_channel_t {
+    /* udp_payload_t pointers, not yet sent */
+    vector_t    queue;
+    /* udp_channel_unacked_t, reliable channels only */
+    vector_t    unacked;
+    uint32_t    next_sequence;
+    int32_t     deficit;
+} udp_send_channel_t;
+
+typedef struct udp_recv_channel_t {
+    uint8_t     kind;
+    uint8_t     active;
+    uint8_t     ack_pending;
+    /* next expected (reliable) or last delivered (sequenced) */
+    uint32_t    sequence;
+    /* out of order payloads, reliable channels only, allocated on first use */
+    udp_payload_t **window;
+} udp_recv_channel_t;
+
+typedef struct udp_channels_t {
+    udp_send_channel_t  send[UDP_MAX_CHANNELS];
+    udp_recv_channel_t  recv[UDP_MAX_CHANNELS];
+    uint16_t            acks_pending;
+} udp_channels_t;
+
+/* Send one payload, with the channel header if hdr isn't NULL.
+ * @return 1 if sent (or dropped for good), 0 if the socket is full.
+ */
+typedef int (*udp_channel_send_t)(void *context, udp_payload_t *payload, channel_header const *hdr, uint64_t now);
+
+void udp_channel_config_init(udp_channel_config_t *config);
+UDPERR udp_channel_config_set(udp_channel_config_t *config, uint8_t channel, UDPCHANNEL kind, uint8_t priority, uint16_t weight);
+
+void udp_channels_init(udp_channels_t *ch);
+/* Releases everything queued, unacknowledged or waiting to be delivered. */
+void udp_channels_deinit(udp_channels_t *ch);
+
+/* Queue a payload on a channel other than 0. Takes ownership of the payload. */
+UDPERR udp_channels_enqueue(udp_channels_t *ch, udp_channel_config_t const *config, uint8_t channel, udp_payload_t *payload);
+
+/* Send what's queued, in priority order. plain is the channel 0 queue.
+ * @return the number of payloads sent.
+ */
+int udp_channels_flush(udp_channels_t *ch, udp_channel_config_t const *config, vector_t *plain, udp_congestion_t *cc, udp_channel_send_t send, void *context, uint64_t now);
+
+/* @return the number of payloads queued on channels other than 0, not yet sent. */
+size_t udp_channels_queued(udp_channels_t const *ch);
+
+/* Process a received channel payload. Payloads that are ready for the
+ * application are appended to ready, in order, each with a hold on it.
+ */
+void udp_channels_receive(udp_channels_t *ch, channel_header const *hdr, udp_payload_t *payload, vector_t *ready);
+
+/* Process a received array of channel_ack. */
+void udp_channels_ack_receive(udp_channels_t *ch, void const *data, size_t size);
+
+/* Write pending acknowledgements as an array of channel_ack.
+ * @return the number of bytes written.
+ */
+size_t udp_channels_ack_fill(udp_channels_t *ch, void *out, size_t size);
+
+#endif  //  onyxudp_channel_h
@@ -0,0 +1,82 @@
+#include "udpbase.h"
+#include "udpclient.h"
+#include "protocol.h"
+#include "types.h"
+
+#include <onyxutil/compress.h>
+#include <onyxutil/crc.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+
+//  Below this, there isn't enough in a payload for compression to find.
+#define UDP_COMPRESS_MIN_SIZE 32
+
+UDPERR udp_compression_set(udp_compression_t **slot, int enable, void const *dictionary, size_t size) {
+    if (*slot) {
+        compress_dict_deinit(&(*slot)->dict);
+        free(*slot);
+        *slot = NULL;
+    }
+    if (!enable) {
+        return UDP_OK;
+    }
+    if (size > COMPRESS_MAX_DICT_SIZE || (size && !dictionary)) {
+        return UDPERR_INVALID_ARGUMENT;
+    }
+    udp_compression_t *compression = (udp_compression_t *)malloc(sizeof(udp_compression_t));
+    if (!compression) {
+        return UDPERR_OUT_OF_MEMORY;
+    }
+    if (compress_dict_init(&compression->dict, dictionary, size) < 0) {
+        free(compression);
+        return UDPERR_OUT_OF_MEMORY;
+    }
+    uint32_t id = size ? update_crc32(dictionary, size, 0) : 0;
+    compression->id = id ? id : 1;
+    *slot = compression;
+    return UDP_OK;
+}
+
+size_t udp_compress_payload(udp_compression_t const *compression, udp_payload_t const *payload, unsigned char *out) {
+    if (payload->size < UDP_COMPRESS_MIN_SIZE || payload->size > COMPRESS_MAX_BLOCK_SIZE) {
+        return 0;
+    }
+    //  only worth it if it gets smaller, id and all
+    size_t n = compress_block(&compression->dict, payload->data, payload->size, out + sizeof(compression->id), payload->size - 1 - sizeof(compression->id));
+    if (!n) {
+        return 0;
+    }
+    memcpy(out, &compression->id, sizeof(compression->id));
+    return sizeof(compression->id) + n;
+}
+
+uint32_t udp_compression_id(unsigned char const *buf, size_t size, size_t header_size) {
+    uint32_t id = 0;
+    if (size >= header_size + sizeof(id)) {
+        memcpy(&id, buf + header_size, sizeof(id));
+    }
+    return id;
+}
+
+size_t udp_decompress_packet(udp_compression_t const *compression, unsigned char const **io_buf, size_t size, size_t header_size, unsigned char **io_scratch, size_t max_payload_size) {
+    if (udp_compression_id(*io_buf, size, header_size) != compression->id) {
+        return 0;
+    }
+    if (!*io_scratch) {
+        *io_scratch = (unsigned char *)malloc(sizeof(data_header) + sizeof(channel_header) + max_payload_size);
+        if (!*io_scratch) {
+            return 0;
+        }
+    }
+    unsigned char *out = *io_scratch;
+    size_t skip = header_size + sizeof(compression->id);
+    int n = decompress_block(&compression->dict, *io_buf + skip, size - skip, out + header_size, max_payload_size);
+    if (n < 0) {
+        return 0;
+    }
+    memcpy(out, *io_buf, header_size);
+    *io_buf = out;
+    return header_size + (size_t)n;
+}
@@ -0,0 +1,173 @@
+#include "congestion.h"
+#include "protocol.h"
+#include "socket.h"
+
+#include <string.h>
+
+
+//  Start out at what a modest DSL line can take, and never go outside
+//  what game traffic plausibly needs.
+#define CC_INITIAL_RATE 64000
+#define CC_MIN_RATE 4000
+#define CC_MAX_RATE 12500000
+//  Queuing delay we're willing to add on top of the base RTT.
+#define CC_TARGET_DELAY 25000
+//  The base RTT is the minimum over two windows of this length, so a route
+//  change that raises the base RTT is forgotten after at most two windows.
+#define CC_BASE_RTT_WINDOW 10000000
+//  The bucket holds at most this much time worth of sending.
+#define CC_BURST_TIME 20000
+#define CC_MIN_BURST 3000
+//  RTT samples bigger than this are garbage (bad echo, or clock wrap.)
+#define CC_MAX_RTT 5000000
+#define CC_MIN_ADJUST_INTERVAL 10000
+
+void udp_congestion_init(udp_congestion_t *cc, uint64_t now) {
+    memset(cc, 0, sizeof(*cc));
+    cc->rate = CC_INITIAL_RATE;
+    cc->budget = CC_MIN_BURST;
+    cc->budget_timestamp = now;
+    cc->adjust_timestamp = now;
+    cc->base_rtt_timestamp = now;
+}
+
+static uint32_t base_rtt(udp_congestion_t const *cc) {
+    uint32_t a = cc->base_rtt[0];
+    uint32_t b = cc->base_rtt[1];
+    if (!a) return b;
+    if (!b) return a;
+    return a < b ? a : b;
+}
+
+static void clamp_rate(udp_congestion_t *cc, uint64_t rate) {
+    if (rate < CC_MIN_RATE) {
+        rate = CC_MIN_RATE;
+    }
+    if (rate > CC_MAX_RATE) {
+        rate = CC_MAX_RATE;
+    }
+    cc->rate = (uint32_t)rate;
+}
+
+static void on_rtt_sample(udp_congestion_t *cc, uint32_t rtt, uint64_t now) {
+    if (!rtt) {
+        rtt = 1;
+    }
+    if (now - cc->base_rtt_timestamp > CC_BASE_RTT_WINDOW) {
+        cc->base_rtt[1] = cc->base_rtt[0];
+        cc->base_rtt[0] = 0;
+        cc->base_rtt_timestamp = now;
+    }
+    if (!cc->base_rtt[0] || rtt < cc->base_rtt[0]) {
+        cc->base_rtt[0] = rtt;
+    }
+    if (!cc->srtt) {
+        cc->srtt = rtt;
+    } else {
+        cc->srtt = (uint32_t)(((uint64_t)cc->srtt * 7 + rtt) >> 3);
+    }
+
+    //  adjust at most once per RTT, so each adjustment sees the effect of the previous one
+    uint64_t elapsed = now - cc->adjust_timestamp;
+    if (elapsed < cc->srtt || elapsed < CC_MIN_ADJUST_INTERVAL) {
+        return;
+    }
+    uint32_t base = base_rtt(cc);
+    uint32_t qdelay = cc->srtt > base ? cc->srtt - base : 0;
+    uint64_t rate = cc->rate;
+    if (qdelay > CC_TARGET_DELAY) {
+        //  shrink in proportion to how far over target we are, at most by half
+        uint32_t over = qdelay - CC_TARGET_DELAY;
+        if (over > CC_TARGET_DELAY) {
+            over = CC_TARGET_DELAY;
+        }
+        rate -= rate * over / (2 * CC_TARGET_DELAY);
+        cc->decrease_timestamp = now;
+    } else if (cc->bytes_sent * 1000000 >= (uint64_t)cc->rate * elapsed / 2) {
+        //  only grow when the application actually used at least half the rate;
+        //  otherwise an idle link would inflate the estimate without evidence
+        uint32_t under = CC_TARGET_DELAY - qdelay;
+        rate += rate * under / (8 * CC_TARGET_DELAY) + 1;
+    }
+    clamp_rate(cc, rate);
+    cc->bytes_sent = 0;
+    cc->adjust_timestamp = now;
+}
+
+static void on_ce_echo(udp_congestion_t *cc, uint16_t ce_count, uint64_t now) {
+    if (!cc->have_ce_echo) {
+        cc->have_ce_echo = 1;
+        cc->ce_echoed = ce_count;
+        return;
+    }
+    if (ce_count == cc->ce_echoed) {
+        return;
+    }
+    cc->ce_echoed = ce_count;
+    //  one reaction per round trip -- the marks in flight are all from the same episode
+    uint32_t rtt = cc->srtt ? cc->srtt : CC_TARGET_DELAY;
+    if (now - cc->decrease_timestamp < rtt) {
+        return;
+    }
+    clamp_rate(cc, (uint64_t)cc->rate * 3 / 4);
+    cc->decrease_timestamp = now;
+    cc->adjust_timestamp = now;
+    cc->bytes_sent = 0;
+}
+
+void udp_congestion_header_fill(udp_congestion_t *cc, data_header *hdr, uint64_t now) {
+    hdr->timestamp = (uint32_t)now;
+    hdr->ce_count = cc->ce_received;
+    if (cc->have_remote_timestamp) {
+        hdr->echo_timestamp = cc->remote_timestamp + (uint32_t)(now - cc->remote_timestamp_received);
+        hdr->flags |= UDP_DATA_FLAG_ECHO;
+    } else {
+        hdr->echo_timestamp = 0;
+    }
+}
+
+void udp_congestion_header_receive(udp_congestion_t *cc, data_header const *hdr, uint8_t ecn, uint64_t now) {
+    udp_congestion_ecn_receive(cc, ecn);
+    cc->remote_timestamp = hdr->timestamp;
+    cc->remote_timestamp_received = now;
+    cc->have_remote_timestamp = 1;
+    if (hdr->flags & UDP_DATA_FLAG_ECHO) {
+        uint32_t rtt = (uint32_t)now - hdr->echo_timestamp;
+        if (rtt < CC_MAX_RTT) {
+            on_rtt_sample(cc, rtt, now);
+        }
+    }
+    on_ce_echo(cc, hdr->ce_count, now);
+}
+
+void udp_congestion_ecn_receive(udp_congestion_t *cc, uint8_t ecn) {
+    if (ecn == UDP_ECN_CE) {
+        cc->ce_received++;
+    }
+}
+
+void udp_congestion_charge(udp_congestion_t *cc, uint32_t bytes) {
+    cc->budget -= bytes;
+    cc->bytes_sent += bytes;
+}
+
+uint32_t udp_congestion_budget(udp_congestion_t *cc, uint64_t now) {
+    if (now > cc->budget_timestamp) {
+        int64_t max = (int64_t)cc->rate * CC_BURST_TIME / 1000000;
+        if (max < CC_MIN_BURST) {
+            max = CC_MIN_BURST;
+        }
+        uint64_t add = (uint64_t)cc->rate * (now - cc->budget_timestamp) / 1000000;
+        if (add > 0) {
+            //  only advance the clock by the time actually converted to bytes, so
+            //  frequent queries don't round the refill down to nothing
+            cc->budget += (int64_t)add;
+            cc->budget_timestamp += add * 1000000 / cc->rate;
+            if (cc->budget >= max) {
+                cc->budget = max;
+                cc->budget_timestamp = now;
+            }
+        }
+    }
+    return cc->budget > 0 ? (uint32_t)cc->budget : 0;
+}
@@ -0,0 +1,73 @@
+#if !defined(onyxudp_congestion_h)
+#define onyxudp_congestion_h
+
+/* Per-remote-end congestion control, used by both udp_peer_t and
+ * udp_client_connection_t.
+ *
+ * The estimate is delay based (in the spirit of LEDBAT): each data packet
+ * carries the sender's clock, and echoes back the last clock value received
+ * from the other end, advanced by however long the echo was held. That gives
+ * an RTT sample per received packet. The smallest RTT seen recently is taken
+ * as the "empty queue" RTT, and anything above that is queuing delay. While
+ * queuing delay stays under a target, the rate grows; once it exceeds the
+ * target, the rate shrinks in proportion.
+ *
+ * ECN is used as a second signal: receivers count CE-marked packets and echo
+ * the running count back in each data header. Any increase is treated as a
+ * congestion event, at most once per RTT.
+ *
+ * The rate drives a token bucket, which is the send budget the application
+ * can query before deciding what to send.
+ */
+
+#include <stdint.h>
+
+struct data_header;
+
+typedef struct udp_congestion_t {
+    /* estimated available bandwidth, bytes per second */
+    uint32_t    rate;
+    /* smoothed round trip time, microseconds (0 until the first sample) */
+    uint32_t    srtt;
+    /* minimum round trip time in the current and previous window */
+    uint32_t    base_rtt[2];
+    uint64_t    base_rtt_timestamp;
+    /* token bucket; may go negative when a flush overspends */
+    int64_t     budget;
+    uint64_t    budget_timestamp;
+    /* bytes sent since the last rate adjustment, to tell application-limited
+     * traffic apart from traffic that actually tests the rate */
+    uint64_t    bytes_sent;
+    uint64_t    adjust_timestamp;
+    uint64_t    decrease_timestamp;
+    /* last clock value received from the remote end, and when it arrived */
+    uint32_t    remote_timestamp;
+    uint64_t    remote_timestamp_received;
+    /* CE-marked packets received from the remote end (echoed back) */
+    uint16_t    ce_received;
+    /* last CE count echoed to us by the remote end */
+    uint16_t    ce_echoed;
+    uint8_t     have_remote_timestamp;
+    uint8_t     have_ce_echo;
+} udp_congestion_t;
+
+void udp_congestion_init(udp_congestion_t *cc, uint64_t now);
+
+/* Fill in the timestamp, echo and ECN fields of an outgoing data header. */
+void udp_congestion_header_fill(udp_congestion_t *cc, data_header *hdr, uint64_t now);
+
+/* Process the timestamp, echo and ECN fields of an incoming data header.
+ * @param ecn the ECN codepoint the packet arrived with.
+ */
+void udp_congestion_header_receive(udp_congestion_t *cc, data_header const *hdr, uint8_t ecn, uint64_t now);
+
+/* Account for a packet received without a data header (commands.) */
+void udp_congestion_ecn_receive(udp_congestion_t *cc, uint8_t ecn);
+
+/* Account for bytes put on the wire (including headers.) */
+void udp_congestion_charge(udp_congestion_t *cc, uint32_t bytes);
+
+/* @return the number of bytes that may be sent right now. */
+uint32_t udp_congestion_budget(udp_congestion_t *cc, uint64_t now);
+
+#endif  //  onyxudp_congestion_h
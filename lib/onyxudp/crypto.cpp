@@ -0,0 +1,249 @@
+#include "crypto.h"
+#include "protocol.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+
+//  Each label is the 16 bytes of HChaCha20 input, so keys for different uses never
+//  come out the same.
+static unsigned char const LABEL_ES[16] = { 'o','n','y','x','u','d','p',' ','e','s',' ',' ',' ',' ',' ',' ' };
+static unsigned char const LABEL_HELLO[16] = { 'o','n','y','x','u','d','p',' ','h','e','l','l','o',' ',' ',' ' };
+static unsigned char const LABEL_SESSION[16] = { 'o','n','y','x','u','d','p',' ','s','e','s','s','i','o','n',' ' };
+static unsigned char const LABEL_C2S[16] = { 'o','n','y','x','u','d','p',' ','c','2','s',' ',' ',' ',' ',' ' };
+static unsigned char const LABEL_S2C[16] = { 'o','n','y','x','u','d','p',' ','s','2','c',' ',' ',' ',' ',' ' };
+
+//  The data header is authenticated as a whole, and the sequence number goes where
+//  the CRC would be.
+enum {
+    HEADER_SIZE = sizeof(data_header)
+};
+
+int udp_crypto_random(void *buf, size_t size) {
+    int fd = open("/dev/urandom", O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t r = read(fd, buf, size);
+    close(fd);
+    return r == (ssize_t)size ? 0 : -1;
+}
+
+static void nonce_make(unsigned char *nonce, uint64_t sequence) {
+    memset(nonce, 0, 4);
+    for (int i = 0; i != 8; ++i) {
+        nonce[4 + i] = (unsigned char)(sequence >> (8 * i));
+    }
+}
+
+//  es gives the hello key, and es with ee gives the session; both sides do this with
+//  their own halves of the two DH results.
+static void hello_key_derive(udp_crypto_t *crypto, unsigned char const *es) {
+    unsigned char chain[AEAD_KEY_SIZE];
+    hchacha20(chain, es, LABEL_ES);
+    hchacha20(crypto->hello_key, chain, LABEL_HELLO);
+    memset(chain, 0, sizeof(chain));
+}
+
+static void session_derive(udp_crypto_t *crypto, unsigned char const *es, unsigned char const *ee, bool server) {
+    unsigned char chain[AEAD_KEY_SIZE];
+    unsigned char session[AEAD_KEY_SIZE];
+    hchacha20(chain, es, LABEL_ES);
+    for (int i = 0; i != AEAD_KEY_SIZE; ++i) {
+        chain[i] ^= ee[i];
+    }
+    hchacha20(session, chain, LABEL_SESSION);
+    hchacha20(server ? crypto->send_key : crypto->recv_key, session, LABEL_S2C);
+    hchacha20(server ? crypto->recv_key : crypto->send_key, session, LABEL_C2S);
+    memset(chain, 0, sizeof(chain));
+    memset(session, 0, sizeof(session));
+    crypto->send_sequence = 1;
+    crypto->recv_next = 1;
+    crypto->recv_window = 1;
+    crypto->keyed = 1;
+}
+
+static int keypair_make(udp_crypto_t *crypto) {
+    if (udp_crypto_random(crypto->private_key, sizeof(crypto->private_key))) {
+        return -1;
+    }
+    x25519_public_key(crypto->public_key, crypto->private_key);
+    return 0;
+}
+
+udp_crypto_t *udp_crypto_client_create(unsigned char const *server_public_key) {
+    udp_crypto_t *crypto = (udp_crypto_t *)calloc(1, sizeof(udp_crypto_t));
+    if (!crypto) {
+        return NULL;
+    }
+    unsigned char es[X25519_KEY_SIZE];
+    if (keypair_make(crypto) || x25519(es, crypto->private_key, server_public_key)) {
+        udp_crypto_destroy(crypto);
+        return NULL;
+    }
+    hello_key_derive(crypto, es);
+    memset(es, 0, sizeof(es));
+    return crypto;
+}
+
+size_t udp_crypto_client_hello(udp_crypto_t const *crypto, void const *payload, size_t size, unsigned char *out) {
+    unsigned char nonce[AEAD_NONCE_SIZE];
+    nonce_make(nonce, 0);
+    memcpy(out, crypto->public_key, X25519_KEY_SIZE);
+    //  the public key is authenticated with the payload, so it can't be swapped
+    aead_seal(out + X25519_KEY_SIZE, out + X25519_KEY_SIZE + size, out, X25519_KEY_SIZE,
+            (unsigned char const *)payload, size, crypto->hello_key, nonce);
+    return UDP_CRYPTO_HELLO_SIZE + size;
+}
+
+static void reply_ad(unsigned char *ad, unsigned char const *public_key, uint32_t connection_id) {
+    memcpy(ad, public_key, X25519_KEY_SIZE);
+    for (int i = 0; i != 4; ++i) {
+        ad[X25519_KEY_SIZE + i] = (unsigned char)(connection_id >> (8 * i));
+    }
+}
+
+int udp_crypto_client_finish(udp_crypto_t *crypto, unsigned char const *server_public_key, unsigned char const *reply, size_t size, uint32_t connection_id) {
+    if (size != UDP_CRYPTO_REPLY_SIZE) {
+        return -1;
+    }
+    if (crypto->keyed) {
+        //  a copy of the reply we already have; deriving again would start the
+        //  sequence numbers over, and reuse nonces
+        return memcmp(crypto->peer_public_key, reply, X25519_KEY_SIZE) ? -1 : 0;
+    }
+    udp_crypto_t next = *crypto;
+    unsigned char es[X25519_KEY_SIZE];
+    unsigned char ee[X25519_KEY_SIZE];
+    if (x25519(es, crypto->private_key, server_public_key) || x25519(ee, crypto->private_key, reply)) {
+        return -1;
+    }
+    session_derive(&next, es, ee, false);
+    memset(es, 0, sizeof(es));
+    memset(ee, 0, sizeof(ee));
+    unsigned char ad[X25519_KEY_SIZE + 4];
+    unsigned char nonce[AEAD_NONCE_SIZE];
+    reply_ad(ad, reply, connection_id);
+    nonce_make(nonce, 0);
+    //  the reply has no plain text; the tag is all there is
+    unsigned char none[1];
+    if (aead_open(none, reply + X25519_KEY_SIZE, ad, sizeof(ad), none, 0, next.recv_key, nonce)) {
+        memset(&next, 0, sizeof(next));
+        return -1;
+    }
+    memcpy(next.peer_public_key, reply, X25519_KEY_SIZE);
+    *crypto = next;
+    memset(&next, 0, sizeof(next));
+    return 0;
+}
+
+int udp_crypto_server_hello(udp_crypto_t *crypto, unsigned char const *server_private_key, unsigned char const *hello, size_t size, unsigned char *o_payload) {
+    if (size < UDP_CRYPTO_HELLO_SIZE) {
+        return -1;
+    }
+    size_t payload_size = size - UDP_CRYPTO_HELLO_SIZE;
+    udp_crypto_t next;
+    memset(&next, 0, sizeof(next));
+    unsigned char es[X25519_KEY_SIZE];
+    unsigned char ee[X25519_KEY_SIZE];
+    unsigned char nonce[AEAD_NONCE_SIZE];
+    int ret = -1;
+    if (x25519(es, server_private_key, hello)) {
+        goto done;
+    }
+    hello_key_derive(&next, es);
+    nonce_make(nonce, 0);
+    if (aead_open(o_payload, hello + X25519_KEY_SIZE + payload_size, hello, X25519_KEY_SIZE,
+            hello + X25519_KEY_SIZE, payload_size, next.hello_key, nonce)) {
+        goto done;
+    }
+    if (keypair_make(&next) || x25519(ee, next.private_key, hello)) {
+        goto done;
+    }
+    session_derive(&next, es, ee, true);
+    memcpy(next.peer_public_key, hello, X25519_KEY_SIZE);
+    *crypto = next;
+    ret = (int)payload_size;
+done:
+    memset(es, 0, sizeof(es));
+    memset(ee, 0, sizeof(ee));
+    memset(&next, 0, sizeof(next));
+    return ret;
+}
+
+int udp_crypto_same_hello(udp_crypto_t const *crypto, unsigned char const *hello, size_t size) {
+    return size >= X25519_KEY_SIZE && !memcmp(crypto->peer_public_key, hello, X25519_KEY_SIZE);
+}
+
+void udp_crypto_server_reply(udp_crypto_t const *crypto, uint32_t connection_id, unsigned char *out) {
+    unsigned char ad[X25519_KEY_SIZE + 4];
+    unsigned char nonce[AEAD_NONCE_SIZE];
+    reply_ad(ad, crypto->public_key, connection_id);
+    nonce_make(nonce, 0);
+    memcpy(out, crypto->public_key, X25519_KEY_SIZE);
+    unsigned char none[1];
+    aead_seal(none, out + X25519_KEY_SIZE, ad, sizeof(ad), none, 0, crypto->send_key, nonce);
+}
+
+size_t udp_crypto_seal(udp_crypto_t *crypto, unsigned char *packet, size_t size) {
+    uint64_t sequence = crypto->send_sequence++;
+    uint32_t low = (uint32_t)sequence;
+    memcpy(packet, &low, 4);
+    unsigned char nonce[AEAD_NONCE_SIZE];
+    nonce_make(nonce, sequence);
+    aead_seal(packet + HEADER_SIZE, packet + size, packet, HEADER_SIZE,
+            packet + HEADER_SIZE, size - HEADER_SIZE, crypto->send_key, nonce);
+    return size + UDP_CRYPTO_TAG_SIZE;
+}
+
+//  Pick the full sequence number nearest the highest one seen that has these low bits.
+static uint64_t sequence_expand(uint64_t next, uint32_t low) {
+    uint64_t sequence = (next & ~(uint64_t)0xffffffff) | low;
+    if (sequence + 0x80000000u < next) {
+        sequence += (uint64_t)1 << 32;
+    } else if (sequence > next + 0x80000000u && sequence >= ((uint64_t)1 << 32)) {
+        sequence -= (uint64_t)1 << 32;
+    }
+    return sequence;
+}
+
+size_t udp_crypto_open(udp_crypto_t *crypto, unsigned char const *packet, size_t size, unsigned char *out) {
+    if (!crypto->keyed || size < HEADER_SIZE + UDP_CRYPTO_TAG_SIZE) {
+        return 0;
+    }
+    uint32_t low;
+    memcpy(&low, packet, 4);
+    uint64_t sequence = sequence_expand(crypto->recv_next, low);
+    //  reject replays before spending time on the tag
+    if (sequence < crypto->recv_next) {
+        uint64_t back = crypto->recv_next - 1 - sequence;
+        if (back >= 64 || (crypto->recv_window & ((uint64_t)1 << back))) {
+            return 0;
+        }
+    }
+    size_t plain = size - UDP_CRYPTO_TAG_SIZE;
+    unsigned char nonce[AEAD_NONCE_SIZE];
+    nonce_make(nonce, sequence);
+    if (aead_open(out + HEADER_SIZE, packet + plain, packet, HEADER_SIZE,
+            packet + HEADER_SIZE, plain - HEADER_SIZE, crypto->recv_key, nonce)) {
+        return 0;
+    }
+    memcpy(out, packet, HEADER_SIZE);
+    if (sequence >= crypto->recv_next) {
+        uint64_t shift = sequence - crypto->recv_next + 1;
+        crypto->recv_window = shift >= 64 ? 0 : crypto->recv_window << shift;
+        crypto->recv_window |= 1;
+        crypto->recv_next = sequence + 1;
+    } else {
+        crypto->recv_window |= (uint64_t)1 << (crypto->recv_next - 1 - sequence);
+    }
+    return plain;
+}
+
+void udp_crypto_destroy(udp_crypto_t *crypto) {
+    if (crypto) {
+        memset(crypto, 0, sizeof(*crypto));
+        free(crypto);
+    }
+}
@@ -0,0 +1,106 @@
+#if !defined(onyxudp_crypto_h)
+#define onyxudp_crypto_h
+
+/* Internal support for udp_params_t::private_key and udp_client_params_t::server_public_key.
+ *
+ * The handshake is the Noise "NK" pattern: the client knows the server's static public
+ * key up front, and each side brings an ephemeral key pair for the connection.
+ *
+ *  client hello:  ephemeral public key, then the connect payload, sealed with a key
+ *                 from DH(client ephemeral, server static)
+ *  server reply:  ephemeral public key, and a tag made with the session key
+ *
+ * The session keys come from both DH(client ephemeral, server static) and
+ * DH(client ephemeral, server ephemeral), so only the holder of the server's private
+ * key can make the reply, and recording the traffic doesn't help whoever steals that
+ * key later. There is one key for each direction, derived with HChaCha20.
+ *
+ * After that, every data packet is sealed with ChaCha20-Poly1305. The data header is
+ * authenticated, not encrypted, and its crc32 field carries the low 32 bits of the
+ * sender's packet sequence number, which is the nonce; everything after the header is
+ * encrypted, and the tag goes at the end. The receiver rebuilds the full sequence
+ * number from the highest one it has seen, and refuses any it has already had, or
+ * that's more than 64 behind, so recorded packets can't be played back.
+ * Sequence number 0 of each key is for the handshake; data starts at 1.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <onyxutil/aead.h>
+#include <onyxutil/x25519.h>
+
+enum {
+    UDP_CRYPTO_TAG_SIZE = AEAD_TAG_SIZE,
+    /* what a handshake packet carries on top of the payload */
+    UDP_CRYPTO_HELLO_SIZE = X25519_KEY_SIZE + AEAD_TAG_SIZE,
+    /* the server's reply is just that */
+    UDP_CRYPTO_REPLY_SIZE = X25519_KEY_SIZE + AEAD_TAG_SIZE
+};
+
+typedef struct udp_crypto_t {
+    unsigned char send_key[AEAD_KEY_SIZE];
+    unsigned char recv_key[AEAD_KEY_SIZE];
+    uint64_t send_sequence;
+    /* one past the highest sequence number received, and bit N set if that minus 1 + N
+     * has been received */
+    uint64_t recv_next;
+    uint64_t recv_window;
+    /* our ephemeral key pair, and the other side's ephemeral public key */
+    unsigned char private_key[X25519_KEY_SIZE];
+    unsigned char public_key[X25519_KEY_SIZE];
+    unsigned char peer_public_key[X25519_KEY_SIZE];
+    /* the key the client hello is sealed with */
+    unsigned char hello_key[AEAD_KEY_SIZE];
+    /* set once the session keys are known */
+    int keyed;
+} udp_crypto_t;
+
+/* Fill buf with random bytes from the system.
+ * @return 0, or -1 if there is no source of randomness.
+ */
+int udp_crypto_random(void *buf, size_t size);
+
+/* Start a handshake with the server that has server_public_key.
+ * @return NULL if out of memory or randomness, or the server key is no good.
+ */
+udp_crypto_t *udp_crypto_client_create(unsigned char const *server_public_key);
+
+/* Write the client hello, with the connect payload, to out, which has room for
+ * UDP_CRYPTO_HELLO_SIZE + size bytes. The same payload gives the same hello every time.
+ * @return the number of bytes written.
+ */
+size_t udp_crypto_client_hello(udp_crypto_t const *crypto, void const *payload, size_t size, unsigned char *out);
+
+/* Check the server reply, and set up the session keys if it's good.
+ * @return 0, or -1 if the reply isn't from the server we wanted.
+ */
+int udp_crypto_client_finish(udp_crypto_t *crypto, unsigned char const *server_public_key, unsigned char const *reply, size_t size, uint32_t connection_id);
+
+/* Take a client hello, and set up the session keys, with a new ephemeral key pair.
+ * @param o_payload where the connect payload goes; it has room for size bytes.
+ * @return the size of the connect payload, or -1 if the hello is no good.
+ */
+int udp_crypto_server_hello(udp_crypto_t *crypto, unsigned char const *server_private_key, unsigned char const *hello, size_t size, unsigned char *o_payload);
+
+/* @return whether a client hello is the one this session was set up from. */
+int udp_crypto_same_hello(udp_crypto_t const *crypto, unsigned char const *hello, size_t size);
+
+/* Write the server reply to out, which has room for UDP_CRYPTO_REPLY_SIZE bytes. */
+void udp_crypto_server_reply(udp_crypto_t const *crypto, uint32_t connection_id, unsigned char *out);
+
+/* Seal a data packet in place: set the sequence number in the header, encrypt what
+ * follows it, and put the tag after that, so the packet needs UDP_CRYPTO_TAG_SIZE more
+ * bytes of room.
+ * @return the size of the sealed packet.
+ */
+size_t udp_crypto_seal(udp_crypto_t *crypto, unsigned char *packet, size_t size);
+
+/* Check and decrypt a sealed data packet into out, header included.
+ * @return the size of the packet without the tag, or 0 if it is forged, damaged, or
+ * a replay.
+ */
+size_t udp_crypto_open(udp_crypto_t *crypto, unsigned char const *packet, size_t size, unsigned char *out);
+
+void udp_crypto_destroy(udp_crypto_t *crypto);
+
+#endif  //  onyxudp_crypto_h
@@ -0,0 +1,129 @@
+#include "filter.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <netinet/in.h>
+
+#include <onyxutil/siphash.h>
+
+
+//  The hash of the host part of the address: the family and the IP, not the port.
+static uint64_t udp_filter_hash(udp_filter_t const *filter, udp_conn_addr_t const *addr) {
+    unsigned char host[17];
+    memset(host, 0, sizeof(host));
+    sa_family_t family;
+    memcpy(&family, &addr->data[2], sizeof(family));
+    if (family == AF_INET && addr->data[1] >= sizeof(sockaddr_in)) {
+        host[0] = 4;
+        memcpy(&host[1], &addr->data[2 + offsetof(sockaddr_in, sin_addr)], 4);
+    } else if (family == AF_INET6 && addr->data[1] >= sizeof(sockaddr_in6)) {
+        host[0] = 6;
+        memcpy(&host[1], &addr->data[2 + offsetof(sockaddr_in6, sin6_addr)], 16);
+    } else {
+        //  nothing we know how to take apart; the whole thing it is
+        return siphash24(filter->key, addr, sizeof(*addr));
+    }
+    return siphash24(filter->key, host, sizeof(host));
+}
+
+udp_filter_t *udp_filter_create(udp_rate_limit_t const *rate, unsigned char const *key) {
+    udp_filter_t *filter = (udp_filter_t *)calloc(1, sizeof(udp_filter_t));
+    if (!filter) {
+        return NULL;
+    }
+    memcpy(filter->key, key, sizeof(filter->key));
+    if (rate && rate->packets_per_second > 0) {
+        filter->rate = *rate;
+        if (filter->rate.burst < 1) {
+            filter->rate.burst = 1;
+        }
+        filter->buckets = (udp_filter_bucket_t *)malloc(sizeof(udp_filter_bucket_t) * 2 * UDP_FILTER_BUCKETS);
+        if (!filter->buckets) {
+            free(filter);
+            return NULL;
+        }
+        for (size_t i = 0; i != 2 * UDP_FILTER_BUCKETS; ++i) {
+            filter->buckets[i].last = 0;
+            filter->buckets[i].tokens = filter->rate.burst;
+        }
+    }
+    return filter;
+}
+
+void udp_filter_destroy(udp_filter_t *filter) {
+    if (!filter) {
+        return;
+    }
+    free(filter->buckets);
+    free(filter->bloom);
+    free(filter);
+}
+
+//  Double hashing: the i-th probe is h1 + i * h2, with h2 odd so the probes differ.
+static uint32_t udp_filter_bloom_bit(uint64_t hash, uint32_t i) {
+    uint32_t h1 = (uint32_t)hash;
+    uint32_t h2 = (uint32_t)(hash >> 32) | 1;
+    return (h1 + i * h2) & (UDP_FILTER_BLOOM_BITS - 1);
+}
+
+static float udp_filter_refill(udp_filter_t *filter, udp_filter_bucket_t *b, uint64_t now) {
+    if (now > b->last) {
+        float t = b->tokens + (float)(now - b->last) * filter->rate.packets_per_second * 1e-6f;
+        b->tokens = t < filter->rate.burst ? t : filter->rate.burst;
+        b->last = now;
+    }
+    return b->tokens;
+}
+
+static void udp_filter_take(udp_filter_bucket_t *b) {
+    b->tokens = b->tokens > 1 ? b->tokens - 1 : 0;
+}
+
+UDPFILTER udp_filter_check(udp_filter_t *filter, udp_conn_addr_t const *from, uint64_t now) {
+    if (!filter->bloom && !filter->buckets) {
+        return UDPFILTER_PASS;
+    }
+    uint64_t hash = udp_filter_hash(filter, from);
+    if (filter->bloom) {
+        uint32_t i = 0;
+        for (; i != UDP_FILTER_BLOOM_HASHES; ++i) {
+            uint32_t bit = udp_filter_bloom_bit(hash, i);
+            if (!(filter->bloom[bit >> 6] & ((uint64_t)1 << (bit & 63)))) {
+                break;
+            }
+        }
+        if (i == UDP_FILTER_BLOOM_HASHES) {
+            return UDPFILTER_BLOCKED;
+        }
+    }
+    if (filter->buckets) {
+        udp_filter_bucket_t *a = &filter->buckets[(uint32_t)hash & (UDP_FILTER_BUCKETS - 1)];
+        udp_filter_bucket_t *b = &filter->buckets[UDP_FILTER_BUCKETS + ((uint32_t)(hash >> 32) & (UDP_FILTER_BUCKETS - 1))];
+        float ta = udp_filter_refill(filter, a, now);
+        float tb = udp_filter_refill(filter, b, now);
+        if (ta < 1 && tb < 1) {
+            return UDPFILTER_RATE_LIMITED;
+        }
+        udp_filter_take(a);
+        udp_filter_take(b);
+    }
+    return UDPFILTER_PASS;
+}
+
+int udp_filter_block(udp_filter_t *filter, udp_conn_addr_t const *addr) {
+    if (!filter->bloom && !(filter->bloom = (uint64_t *)calloc(UDP_FILTER_BLOOM_BITS / 64, sizeof(uint64_t)))) {
+        return -1;
+    }
+    uint64_t hash = udp_filter_hash(filter, addr);
+    for (uint32_t i = 0; i != UDP_FILTER_BLOOM_HASHES; ++i) {
+        uint32_t bit = udp_filter_bloom_bit(hash, i);
+        filter->bloom[bit >> 6] |= (uint64_t)1 << (bit & 63);
+    }
+    return 0;
+}
+
+void udp_filter_unblock_all(udp_filter_t *filter) {
+    free(filter->bloom);
+    filter->bloom = NULL;
+}
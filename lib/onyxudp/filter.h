@@ -0,0 +1,69 @@
+#if !defined(onyxudp_filter_h)
+#define onyxudp_filter_h
+
+/* Internal support for udp_params_t::rate_limit and udp_blocklist_add().
+ *
+ * Every datagram from the socket goes through here first, before the capture, the
+ * CRC or the peer lookup, so that abusive sources cost as little as possible. Sources
+ * are hosts: all ports of an address count as one. One keyed hash of the host picks
+ * everything the filter looks at:
+ *
+ * - The rate limit is a fixed-size table of token buckets, two per host, in separate
+ *   halves. A datagram gets through if either of its buckets has a token, and takes a
+ *   token from both. A host that shares one bucket with a flood still has the other,
+ *   so, as in a count-min sketch, it only suffers if both are shared.
+ *
+ * - The blocklist is a Bloom filter. Hosts never added are blocked too, by chance,
+ *   once a few thousand have been; and it can only forget everything at once.
+ */
+
+#include <stdint.h>
+
+#include "udpbase.h"
+
+enum {
+    /* token buckets in each half of the table */
+    UDP_FILTER_BUCKETS = 4096,
+    UDP_FILTER_BLOOM_BITS = 65536,
+    UDP_FILTER_BLOOM_HASHES = 4
+};
+
+enum UDPFILTER {
+    UDPFILTER_PASS = 0,
+    UDPFILTER_RATE_LIMITED = 1,
+    UDPFILTER_BLOCKED = 2
+};
+
+typedef struct udp_filter_bucket_t {
+    uint64_t            last;
+    float               tokens;
+} udp_filter_bucket_t;
+
+typedef struct udp_filter_t {
+    unsigned char       key[16];
+    udp_rate_limit_t    rate;
+    /* 2 * UDP_FILTER_BUCKETS, NULL unless rate limiting */
+    udp_filter_bucket_t *buckets;
+    /* UDP_FILTER_BLOOM_BITS bits, NULL until something is blocked */
+    uint64_t            *bloom;
+} udp_filter_t;
+
+/* Copy the rate limit (NULL for none), and start with nobody blocked.
+ * @param key 16 bytes of secret, so nobody outside can pick hosts that collide
+ * @return NULL if out of memory.
+ */
+udp_filter_t *udp_filter_create(udp_rate_limit_t const *rate, unsigned char const *key);
+void udp_filter_destroy(udp_filter_t *filter);
+
+/* @return what to do with a datagram from the address, arriving now. */
+UDPFILTER udp_filter_check(udp_filter_t *filter, udp_conn_addr_t const *from, uint64_t now);
+
+/* Block the host of the address.
+ * @return 0, or -1 if out of memory.
+ */
+int udp_filter_block(udp_filter_t *filter, udp_conn_addr_t const *addr);
+
+/* Unblock everyone. */
+void udp_filter_unblock_all(udp_filter_t *filter);
+
+#endif  //  onyxudp_filter_h
@@ -0,0 +1,136 @@
+#include "impair.h"
+#include "socket.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+
+typedef struct udp_impair_packet_t {
+    uint64_t            due;
+    udp_conn_addr_t     to;
+    size_t              size;
+    /* followed by size bytes of datagram */
+} udp_impair_packet_t;
+
+//  splitmix64, which is happy with any seed, including 0
+static uint64_t impair_random(udp_impair_t *imp) {
+    uint64_t z = (imp->rng += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+//  uniform in [0, 1)
+static double impair_uniform(udp_impair_t *imp) {
+    return (impair_random(imp) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+udp_impair_t *udp_impair_create(udp_impairment_t const *params) {
+    udp_impair_t *imp = (udp_impair_t *)malloc(sizeof(udp_impair_t));
+    if (!imp) {
+        return NULL;
+    }
+    memset(imp, 0, sizeof(*imp));
+    imp->params = *params;
+    imp->rng = params->seed;
+    if (vector_init(&imp->queue, sizeof(udp_impair_packet_t *)) != 0) {
+        free(imp);
+        return NULL;
+    }
+    return imp;
+}
+
+void udp_impair_destroy(udp_impair_t *imp) {
+    for (size_t i = 0, n = imp->queue.item_count; i != n; ++i) {
+        free(*(udp_impair_packet_t **)vector_item_get(&imp->queue, i));
+    }
+    vector_deinit(&imp->queue);
+    free(imp);
+}
+
+static int udp_impair_enqueue(udp_impair_t *imp, void const *buf, size_t size, udp_conn_addr_t const *to, uint64_t due) {
+    udp_impair_packet_t *pkt = (udp_impair_packet_t *)malloc(sizeof(udp_impair_packet_t) + size);
+    if (!pkt) {
+        return -1;
+    }
+    pkt->due = due;
+    pkt->to = *to;
+    pkt->size = size;
+    memcpy(pkt + 1, buf, size);
+    //  after everything due at the same time or earlier, so equal times keep send order
+    size_t lo = 0, hi = imp->queue.item_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if ((*(udp_impair_packet_t **)vector_item_get(&imp->queue, mid))->due <= due) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (vector_item_insert(&imp->queue, lo, &pkt, 1) == 0) {
+        free(pkt);
+        return -1;
+    }
+    imp->queued_bytes += size;
+    return 0;
+}
+
+int udp_impair_send(udp_impair_t *imp, void const *buf, size_t size, udp_conn_addr_t const *to, uint64_t now) {
+    udp_impairment_t const *p = &imp->params;
+    if (p->queue_bytes && imp->queued_bytes + size > p->queue_bytes) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    //  draw the same number of random values for every datagram, so that one setting
+    //  doesn't change what happens to the datagrams after it
+    bool lost = impair_uniform(imp) < p->loss;
+    bool duplicated = impair_uniform(imp) < p->duplicate;
+    uint64_t jitter = p->jitter_us ? impair_random(imp) % (p->jitter_us + 1) : 0;
+    uint64_t jitter2 = p->jitter_us ? impair_random(imp) % (p->jitter_us + 1) : 0;
+    if (p->bandwidth) {
+        //  lost datagrams still used the link up to where they were lost
+        if (imp->link_free < now) {
+            imp->link_free = now;
+        }
+        imp->link_free += (uint64_t)size * 1000000 / p->bandwidth;
+    } else {
+        imp->link_free = now;
+    }
+    if (lost) {
+        return (int)size;
+    }
+    uint64_t due = imp->link_free + p->latency_us;
+    if (udp_impair_enqueue(imp, buf, size, to, due + jitter) < 0 ||
+            (duplicated && udp_impair_enqueue(imp, buf, size, to, due + jitter2) < 0)) {
+        errno = ENOBUFS;
+        return -1;
+    }
+    return (int)size;
+}
+
+int udp_impair_flush(udp_impair_t *imp, udp_transport_t *transport, uint64_t now) {
+    size_t n = 0;
+    while (n != imp->queue.item_count) {
+        udp_impair_packet_t *pkt = *(udp_impair_packet_t **)vector_item_get(&imp->queue, n);
+        if (pkt->due > now) {
+            break;
+        }
+        //  a real link doesn't tell the sender about losses, and neither does this one
+        udp_transport_send(transport, pkt + 1, pkt->size, &pkt->to, now);
+        imp->queued_bytes -= pkt->size;
+        free(pkt);
+        ++n;
+    }
+    if (n) {
+        vector_item_remove(&imp->queue, 0, n);
+    }
+    return (int)n;
+}
+
+uint64_t udp_impair_next(udp_impair_t const *imp) {
+    if (!imp->queue.item_count) {
+        return 0;
+    }
+    return (*(udp_impair_packet_t **)vector_item_get((vector_t *)&imp->queue, 0))->due;
+}
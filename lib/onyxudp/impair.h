@@ -0,0 +1,51 @@
+#if !defined(onyxudp_impair_h)
+#define onyxudp_impair_h
+
+/* Internal support for udp_params_t::impairment and udp_client_params_t::impairment.
+ *
+ * Outgoing datagrams are put through a simulated link instead of going straight
+ * to the transport: some are dropped or duplicated, the rest wait until the link has
+ * room for them (the bandwidth cap), plus the latency, plus a random amount of
+ * jitter. Datagrams whose jitter is different enough overtake each other, which
+ * is how real networks reorder, too. udp_impair_flush() then sends what is due.
+ *
+ * All the randomness comes from a generator seeded from the parameters, so the
+ * same traffic, at the same times, is impaired the same way every run.
+ */
+
+#include <stdint.h>
+#include <onyxutil/vector.h>
+
+#include "udpbase.h"
+
+typedef struct udp_impair_t {
+    udp_impairment_t    params;
+    uint64_t            rng;
+    /* when the simulated link is done sending what it already has */
+    uint64_t            link_free;
+    /* udp_impair_packet_t *, in order of when they are due */
+    vector_t            queue;
+    size_t              queued_bytes;
+} udp_impair_t;
+
+/* Copy the parameters, and start an empty link.
+ * @return NULL if out of memory.
+ */
+udp_impair_t *udp_impair_create(udp_impairment_t const *params);
+void udp_impair_destroy(udp_impair_t *imp);
+
+/* Put a datagram on the simulated link.
+ * @return size, as if it was sent, even if the link drops it; or -1 with errno set to
+ * ENOBUFS if the link queue is full or memory runs out.
+ */
+int udp_impair_send(udp_impair_t *imp, void const *buf, size_t size, udp_conn_addr_t const *to, uint64_t now);
+
+/* Send the datagrams that are due by now, in the order they are due.
+ * @return the number of datagrams sent.
+ */
+int udp_impair_flush(udp_impair_t *imp, udp_transport_t *transport, uint64_t now);
+
+/* @return the time of the next datagram that is due, or 0 if there is none. */
+uint64_t udp_impair_next(udp_impair_t const *imp);
+
+#endif  //  onyxudp_impair_h
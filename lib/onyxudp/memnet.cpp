@@ -0,0 +1,227 @@
+#include "udpbase.h"
+#include "socket.h"
+#include "timing.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+//  Each endpoint receives through a bounded multi-producer queue: a ring of slots,
+//  each with a sequence number that says whose turn it is. A sender claims the slot
+//  at head by bumping head, fills it in, and then publishes it by setting its
+//  sequence to one past its position. The receiver (there is only one) takes the
+//  slot at tail once it is published, and hands it back to the senders a lap later.
+//  See Dmitry Vyukov's bounded MPMC queue; this is that, with the consumer side
+//  simplified for a single consumer.
+
+struct memnet_slot {
+    uint64_t            sequence;
+    udp_conn_addr_t     from;
+    uint32_t            size;
+    uint8_t             ecn;
+    //  the sender's time of sending, standing in for the kernel's receive time
+    uint64_t            timestamp;
+    //  followed by max_datagram_size bytes
+};
+
+struct memnet_endpoint {
+    udp_transport_t     transport;
+    udp_memnet_t        *net;
+    udp_conn_addr_t     addr;
+    uint32_t            queue_length;
+    //  senders and the receiver each get their own cache line
+    char                pad0[64];
+    uint64_t            head;
+    char                pad1[64];
+    uint64_t            tail;
+    char                pad2[64];
+    unsigned char       *slots;
+};
+
+struct udp_memnet_t {
+    uint32_t            queue_length;
+    uint16_t            max_datagram_size;
+    size_t              slot_size;
+    uint16_t            next_port;
+    uint64_t            dropped;
+    //  by port; written only while adding endpoints, before traffic starts
+    memnet_endpoint     *endpoints[65536];
+};
+
+static memnet_slot *memnet_slot_at(memnet_endpoint *ep, uint64_t pos) {
+    return (memnet_slot *)(ep->slots + (pos & (ep->queue_length - 1)) * ep->net->slot_size);
+}
+
+static void memnet_drop(udp_memnet_t *net) {
+    __atomic_fetch_add(&net->dropped, 1, __ATOMIC_RELAXED);
+}
+
+static void memnet_deliver(memnet_endpoint *from, udp_datagram_t const *dg) {
+    udp_memnet_t *net = from->net;
+    sockaddr_in sin;
+    memcpy(&sin, &dg->addr.data[2], sizeof(sin));
+    if (dg->addr.data[1] < sizeof(sockaddr_in) || sin.sin_family != AF_INET) {
+        memnet_drop(net);
+        return;
+    }
+    memnet_endpoint *to = net->endpoints[ntohs(sin.sin_port)];
+    if (!to) {
+        memnet_drop(net);
+        return;
+    }
+    uint64_t pos = __atomic_load_n(&to->head, __ATOMIC_RELAXED);
+    memnet_slot *slot;
+    for (;;) {
+        slot = memnet_slot_at(to, pos);
+        uint64_t seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&to->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            //  full
+            memnet_drop(net);
+            return;
+        } else {
+            pos = __atomic_load_n(&to->head, __ATOMIC_RELAXED);
+        }
+    }
+    slot->from = from->addr;
+    slot->ecn = dg->ecn;
+    slot->timestamp = dg->timestamp;
+    //  remember the real size, so the receiver can tell it was cut short
+    slot->size = (uint32_t)dg->size;
+    memcpy(slot + 1, dg->data, dg->size < net->max_datagram_size ? dg->size : net->max_datagram_size);
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+}
+
+static int memnet_send_batch(udp_transport_t *transport, udp_datagram_t const *datagrams, int count) {
+    memnet_endpoint *ep = (memnet_endpoint *)transport;
+    //  a full queue drops, rather than pushing back, like a real receiver would
+    for (int i = 0; i != count; ++i) {
+        memnet_deliver(ep, &datagrams[i]);
+    }
+    return count;
+}
+
+static int memnet_recv_batch(udp_transport_t *transport, udp_datagram_t *datagrams, int count) {
+    memnet_endpoint *ep = (memnet_endpoint *)transport;
+    udp_memnet_t *net = ep->net;
+    int n = 0;
+    while (n != count) {
+        uint64_t pos = ep->tail;
+        memnet_slot *slot = memnet_slot_at(ep, pos);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != pos + 1) {
+            break;
+        }
+        udp_datagram_t *dg = &datagrams[n];
+        size_t stored = slot->size < net->max_datagram_size ? slot->size : net->max_datagram_size;
+        memcpy(dg->data, slot + 1, stored < dg->size ? stored : dg->size);
+        dg->size = slot->size;
+        dg->addr = slot->from;
+        dg->ecn = slot->ecn;
+        dg->timestamp = slot->timestamp;
+        __atomic_store_n(&slot->sequence, pos + ep->queue_length, __ATOMIC_RELEASE);
+        ep->tail = pos + 1;
+        ++n;
+    }
+    return n;
+}
+
+//  Nothing to block on without a lock, so this spins, politely.
+static int memnet_wait(udp_transport_t *transport, uint32_t timeout_us) {
+    memnet_endpoint *ep = (memnet_endpoint *)transport;
+    //  real time, even when the instance goes by a clock that stands still
+    uint64_t end = udp_timing_clock() + (uint64_t)timeout_us * 1000;
+    do {
+        memnet_slot *slot = memnet_slot_at(ep, ep->tail);
+        if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == ep->tail + 1) {
+            return 1;
+        }
+        sched_yield();
+    } while (udp_timing_clock() < end);
+    return 0;
+}
+
+static uint32_t memnet_queue_length(uint32_t queue_length) {
+    uint32_t n = 1;
+    while (n < queue_length && n < 0x80000000u) {
+        n <<= 1;
+    }
+    return n;
+}
+
+udp_memnet_t *udp_memnet_create(uint32_t queue_length, uint16_t max_datagram_size) {
+    udp_memnet_t *net = (udp_memnet_t *)calloc(1, sizeof(udp_memnet_t));
+    if (!net) {
+        return NULL;
+    }
+    net->queue_length = memnet_queue_length(queue_length);
+    net->max_datagram_size = max_datagram_size;
+    net->slot_size = (sizeof(memnet_slot) + max_datagram_size + 7) & ~(size_t)7;
+    net->next_port = 49152;
+    return net;
+}
+
+udp_transport_t *udp_memnet_endpoint(udp_memnet_t *net, uint16_t port) {
+    return udp_memnet_endpoint_queue(net, port, net->queue_length);
+}
+
+udp_transport_t *udp_memnet_endpoint_queue(udp_memnet_t *net, uint16_t port, uint32_t queue_length) {
+    if (!port) {
+        for (int i = 0; i != 65536 && net->endpoints[net->next_port]; ++i) {
+            net->next_port = net->next_port == 65535 ? 1 : net->next_port + 1;
+        }
+        port = net->next_port;
+    }
+    if (!port || net->endpoints[port]) {
+        return NULL;
+    }
+    memnet_endpoint *ep = (memnet_endpoint *)calloc(1, sizeof(memnet_endpoint));
+    if (!ep) {
+        return NULL;
+    }
+    ep->queue_length = memnet_queue_length(queue_length);
+    ep->slots = (unsigned char *)malloc(net->slot_size * ep->queue_length);
+    if (!ep->slots) {
+        free(ep);
+        return NULL;
+    }
+    ep->transport.send_batch = memnet_send_batch;
+    ep->transport.recv_batch = memnet_recv_batch;
+    ep->transport.wait = memnet_wait;
+    ep->net = net;
+    for (uint32_t i = 0; i != ep->queue_length; ++i) {
+        memnet_slot_at(ep, i)->sequence = i;
+    }
+    sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    udp_conn_addr_set(&ep->addr, (sockaddr const *)&sin, sizeof(sin));
+    __atomic_store_n(&net->endpoints[port], ep, __ATOMIC_RELEASE);
+    return &ep->transport;
+}
+
+uint64_t udp_memnet_dropped(udp_memnet_t const *net) {
+    return __atomic_load_n(&net->dropped, __ATOMIC_RELAXED);
+}
+
+void udp_memnet_destroy(udp_memnet_t *net) {
+    if (!net) {
+        return;
+    }
+    for (size_t i = 0; i != 65536; ++i) {
+        if (net->endpoints[i]) {
+            free(net->endpoints[i]->slots);
+            free(net->endpoints[i]);
+        }
+    }
+    free(net);
+}
@@ -9,6 +9,9 @@
 
 udp_payload_t *udp_payload_new(size_t size, udp_params_t *server, udp_client_params_t *client) {
     char *ret = (char *)malloc(sizeof(udp_payload_t) + sizeof(udp_payload_owner_t) + size);
+    if (!ret) {
+        return NULL;
+    }
     memset(ret, 0, sizeof(udp_payload_t) + sizeof(udp_payload_owner_t));
     udp_payload_t *pl = (udp_payload_t *)ret;
     pl->data = ret + sizeof(udp_payload_t) + sizeof(udp_payload_owner_t);
@@ -30,8 +33,19 @@ udp_payload_t *udp_client_payload_get(udp_client_t *client) {
     return udp_payload_new(client->params->max_payload_size, NULL, client->params);
 }
 
+uint64_t udp_payload_received_at(udp_payload_t const *payload) {
+    return ((udp_payload_owner_t const *)(payload + 1))->received;
+}
+
+uint8_t udp_payload_channel(udp_payload_t const *payload) {
+    return ((udp_payload_owner_t const *)(payload + 1))->channel;
+}
+
+//  With udp_params_t::worker_threads, workers hold and release payloads the polling
+//  thread also has, so the count is atomic.
 void udp_payload_release(udp_payload_t *payload) {
-    if (payload->_refcount == 0) {
+    uint16_t refcount = __atomic_load_n(&payload->_refcount, __ATOMIC_RELAXED);
+    if (refcount == 0) {
         udp_payload_owner_t *owner = (udp_payload_owner_t *)(payload + 1);
         if (owner->server) {
             owner->server->on_error(owner->server, UDPERR_INVALID_ARGUMENT, "udp_payload_release(): invalid payload (server)");
@@ -41,18 +55,23 @@ void udp_payload_release(udp_payload_t *payload) {
         return;
     }
     /* payloads with a refcount of 0xffff are "pinned" and live forever */
-    if (payload->_refcount < 0xffff) {
-        --payload->_refcount;
-        if (payload->_refcount == 0) {
+    if (refcount < 0xffff) {
+        if (__atomic_sub_fetch(&payload->_refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+            udp_arena_t *arena = ((udp_payload_owner_t *)(payload + 1))->arena;
             memset(payload, 0xff, sizeof(*payload));
-            ::free(payload);
+            if (arena) {
+                udp_arena_put(arena, payload);
+            } else {
+                ::free(payload);
+            }
         }
     }
 }
 
 void udp_payload_hold(udp_payload_t *payload) {
     udp_payload_owner_t *owner = (udp_payload_owner_t *)(payload + 1);
-    if (payload->_refcount == 0) {
+    uint16_t refcount = __atomic_load_n(&payload->_refcount, __ATOMIC_RELAXED);
+    if (refcount == 0) {
         if (owner->server) {
             owner->server->on_error(owner->server, UDPERR_INVALID_ARGUMENT, "udp_payload_hold(): invalid payload (server)");
         } else {
@@ -60,8 +79,8 @@ void udp_payload_hold(udp_payload_t *payload) {
         }
         return;
     }
-    if (payload->_refcount < 0xffff) {
-        ++payload->_refcount;
+    if (refcount < 0xffff) {
+        __atomic_add_fetch(&payload->_refcount, 1, __ATOMIC_RELAXED);
     } else {
         if (owner->server) {
             owner->server->on_error(owner->server, UDPERR_INVALID_ARGUMENT, "udp_payload_hold(): payload refcount pinned (server)");
@@ -70,5 +89,3 @@ void udp_payload_hold(udp_payload_t *payload) {
         }
     }
 }
-
-
@@ -8,50 +8,197 @@
  * receiving ends (both of which run x86 or ARM in little-endian mode) makes 
  * no sense.
  *
- * <8-byte packet:
+ * <12-byte packet:
  * invalid
  *
- * 8-byte control packet:
+ * 12-byte control packet:
  * crc16 (2 bytes)
  * command (2 bytes)
  * app_id (2 bytes)
  * app_version (2 bytes)
+ * connection_id (4 bytes)
  *
- * >8-byte data packet:
+ * >=24-byte data packet:
  * crc32 (4 bytes)
  * app_id (2 bytes)
  * app_version (2 bytes)
+ * timestamp (4 bytes)
+ * echo_timestamp (4 bytes)
+ * ce_count (2 bytes)
+ * flags (2 bytes)
+ * connection_id (4 bytes)
+ * <channel_header, if UDP_DATA_FLAG_CHANNEL> (8 bytes)
  * <data> <N bytes>
  *
  * In each case, the CRC is calculated on all data following the CRC field 
  * to the end of the packet.
  *
- * For later versions of the protocol, perhaps cryptography will be added, in which 
- * case more fields will go into the header.
+ * When the server has a private key (udp_params_t::private_key), data packets are 
+ * sealed instead: UDP_DATA_FLAG_ENCRYPTED is set, the crc32 field holds the low bits 
+ * of the sender's packet sequence number, everything after the header is encrypted, 
+ * and a 16-byte ChaCha20-Poly1305 tag that covers the header too follows it. The 
+ * keys come from a handshake in UDP_DATA_FLAG_HANDSHAKE packets; see crypto.h. 
+ * Control packets are only CRC-protected, so anybody could have made them: once there 
+ * are keys, the only ones that count are UDP_CMD_CHALLENGE, during the handshake, and 
+ * the sealed ones in UDP_DATA_FLAG_COMMAND packets.
  */
 
-/* 8-byte packets have a crc16, and a command and application identifying information.
+/* Control packets have a crc16, and a command and application identifying information.
  */
 struct command_header {
-    uint16_t crc16;             //  command, app_id, app_version
+    uint16_t crc16;             //  command, app_id, app_version, connection_id
     uint16_t command;
     uint16_t app_id;
     uint16_t app_version;
+    uint32_t connection_id;
 };
 
 /* Data packets have a 32-bit CRC of the data and application ids, as well as the 
- * application ids, followed by the data.
+ * application ids, followed by the congestion control fields, followed by the data.
+ * The timestamp is the low 32 bits of the sender's udp_timestamp(). The echo_timestamp 
+ * is the last timestamp received from the other end, advanced by the time it was held 
+ * before being echoed, so the original sender gets an RTT sample by subtracting it from 
+ * its own clock. ce_count is the (wrapping) number of ECN CE-marked packets the sender 
+ * has received from the other end.
+ *
+ * connection_id is handed out by the server, in its UDP_CMD_CONNECT reply and in 
+ * everything it sends after that, and the client puts it in everything it sends once 
+ * it has it (0 before then.) The server finds the peer by it, rather than by source 
+ * address, so a client whose address changes (a NAT rebinding, or a new network) 
+ * keeps its connection. The id is no secret, though, so a packet with it from a new 
+ * address doesn't move the peer: the server drops it, and answers the new address 
+ * with UDP_CMD_CHALLENGE. The client sends the cookie back from there in a 
+ * UDP_DATA_FLAG_MIGRATE packet, and the peer moves once the server has that. Sealed 
+ * packets (UDP_DATA_FLAG_ENCRYPTED) move the peer right away; nobody else can make them.
+ *
+ * Before that, the field carries a cookie instead. The server answers the first 
+ * packets from an address it doesn't know with UDP_CMD_CHALLENGE, and a cookie in 
+ * connection_id: a keyed hash of the address and the time, which it can check again 
+ * later without having remembered anything. The client sends the cookie back in its 
+ * next UDP_CMD_CONNECT, or in data packets flagged UDP_DATA_FLAG_COOKIE, and only then 
+ * does the server allocate a peer. Spoofed source addresses never see the cookie, so 
+ * they cost the server a hash and a reply no bigger than what they sent.
  */
 struct data_header {
-    uint32_t crc32;             //  app_id, app_version, <data>
+    uint32_t crc32;             //  app_id, app_version, ..., <data>
     uint16_t app_id;
     uint16_t app_version;
+    uint32_t timestamp;
+    uint32_t echo_timestamp;    //  valid if UDP_DATA_FLAG_ECHO
+    uint16_t ce_count;
+    uint16_t flags;
+    uint32_t connection_id;
+};
+
+/* The low UDP_CONNECTION_SLOT_BITS of a connection_id index the server's peer slots; 
+ * the rest are a keyed hash, so that a stale or made-up id rarely names a live peer.
+ */
+enum {
+    UDP_CONNECTION_SLOT_BITS = 20,
+    UDP_CONNECTION_SLOT_MASK = (1 << UDP_CONNECTION_SLOT_BITS) - 1
+};
+
+enum {
+    UDP_DATA_FLAG_ECHO = 0x1,
+    /* The data is a snapshot_header and a fragment of an encoded snapshot. */
+    UDP_DATA_FLAG_SNAPSHOT = 0x2,
+    /* The data is an array of snapshot_ack. */
+    UDP_DATA_FLAG_SNAPSHOT_ACK = 0x4,
+    /* The data is the crc32 of a dictionary, then the payload compressed with 
+     * compress_block() (see onyxutil/compress.h) using that dictionary: one configured 
+     * for a group (server) or the connection (client). The CRC covers the compressed 
+     * data. Other flags describe the uncompressed data.
+     */
+    UDP_DATA_FLAG_COMPRESSED = 0x8,
+    /* A channel_header follows the data header. */
+    UDP_DATA_FLAG_CHANNEL = 0x10,
+    /* The data is an array of channel_ack. */
+    UDP_DATA_FLAG_CHANNEL_ACK = 0x20,
+    /* connection_id is a cookie from UDP_CMD_CHALLENGE, not a connection id. */
+    UDP_DATA_FLAG_COOKIE = 0x40,
+    /* The data is a handshake message (crypto.h) rather than payload: from the client, 
+     * its ephemeral key and the sealed connect payload, with UDP_DATA_FLAG_COOKIE; from 
+     * the server, its ephemeral key and a tag, with the new connection id. The CRC 
+     * covers these as usual.
+     */
+    UDP_DATA_FLAG_HANDSHAKE = 0x80,
+    /* The packet is sealed with the session key, rather than CRC-protected. */
+    UDP_DATA_FLAG_ENCRYPTED = 0x100,
+    /* The data is the cookie from a UDP_CMD_CHALLENGE that the server sent to a new 
+     * address of a connected client, sent back from there, with the connection id. 
+     */
+    UDP_DATA_FLAG_MIGRATE = 0x200,
+    /* The data is the uint16_t command of a control packet (UDP_CMD_IDLE or 
+     * UDP_CMD_DISCONNECT), sent this way so it can be sealed. 
+     */
+    UDP_DATA_FLAG_COMMAND = 0x400
+};
+
+/* Snapshots are encoded with delta_encode() (see onyxutil/delta.h) against the 
+ * baseline snapshot of the same stream, or against nothing if baseline is 0. The 
+ * encoded data is split into fragment_count fragments of fragment_size bytes (the 
+ * last one may be shorter), and each fragment goes in its own data packet.
+ */
+struct snapshot_header {
+    uint16_t stream;
+    uint16_t fragment;
+    uint16_t fragment_count;
+    uint16_t fragment_size;
+    uint32_t sequence;
+    uint32_t baseline;
+    uint32_t size;              //  decoded size
+    uint32_t encoded_size;
+};
+
+/* The receiver of a snapshot acknowledges it, so the sender can use it as the 
+ * baseline for following snapshots.
+ */
+struct snapshot_ack {
+    uint16_t stream;
+    uint16_t reserved;
+    uint32_t sequence;
+};
+
+/* Payloads sent on a channel other than 0 carry the channel, the kind of channel 
+ * (UDPCHANNEL), and a per-channel sequence number starting at 1. The channel 
+ * header is not compressed, even if the data following it is.
+ */
+struct channel_header {
+    uint8_t channel;
+    uint8_t kind;
+    uint16_t reserved;
+    uint32_t sequence;
+};
+
+/* Receivers of UDP_CHANNEL_RELIABLE_ORDERED channels acknowledge what they have. 
+ * Everything before next_sequence has been received, and bit N of received is set 
+ * if next_sequence + 1 + N has been received.
+ */
+struct channel_ack {
+    uint8_t channel;
+    uint8_t reserved;
+    uint16_t reserved2;
+    uint32_t next_sequence;
+    uint64_t received;
+};
+
+/* Payloads sent by udp_group_replication_tick() are a sequence of entity updates, 
+ * each an entity_update_header followed by size bytes of serialized fields. An 
+ * update with no fields means the entity was removed.
+ */
+struct entity_update_header {
+    uint32_t id;
+    uint32_t fields;
+    uint16_t size;
+    uint16_t reserved;
 };
 
 enum {
     UDP_CMD_IDLE = 0,
     UDP_CMD_CONNECT = 1,
-    UDP_CMD_DISCONNECT = 2
+    UDP_CMD_DISCONNECT = 2,
+    /* Server to client: send the connect again, with the cookie in connection_id. */
+    UDP_CMD_CHALLENGE = 3
 };
 
 #endif  //  onyxudp_protocol_h
@@ -0,0 +1,471 @@
+#include "replication.h"
+#include "protocol.h"
+#include "types.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+static size_t entity_index_hash(void const *data, size_t sz) {
+    return hash_pod(data, sizeof(uint32_t));
+}
+
+static int entity_index_comp(void const *a, void const *b, size_t sz) {
+    return memcmp(a, b, sizeof(uint32_t));
+}
+
+static size_t replica_peer_hash(void const *data, size_t sz) {
+    return hash_pod(data, sizeof(udp_peer_t *));
+}
+
+static int replica_peer_comp(void const *a, void const *b, size_t sz) {
+    return memcmp(a, b, sizeof(udp_peer_t *));
+}
+
+static void replica_peer_free(udp_replica_peer_t *rp) {
+    free(rp->pending);
+    free(rp->accumulator);
+    free(rp->known);
+    vector_deinit(&rp->removed);
+    free(rp);
+}
+
+/* Make room for count entities in the peer's arrays. */
+static int replica_peer_reserve(udp_replica_peer_t *rp, uint32_t count) {
+    if (count <= rp->capacity) {
+        return 0;
+    }
+    uint32_t capacity = rp->capacity ? rp->capacity * 2 : 64;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    uint32_t *pending = (uint32_t *)realloc(rp->pending, capacity * sizeof(uint32_t));
+    if (!pending) {
+        return -1;
+    }
+    rp->pending = pending;
+    float *accumulator = (float *)realloc(rp->accumulator, capacity * sizeof(float));
+    if (!accumulator) {
+        return -1;
+    }
+    rp->accumulator = accumulator;
+    uint8_t *known = (uint8_t *)realloc(rp->known, capacity);
+    if (!known) {
+        return -1;
+    }
+    rp->known = known;
+    rp->capacity = capacity;
+    return 0;
+}
+
+/* A peer that hasn't been sent an entity needs all of it. */
+static void replica_peer_entity_new(udp_replica_peer_t *rp, uint32_t ix) {
+    rp->pending[ix] = UDP_ENTITY_ALL_FIELDS;
+    rp->accumulator[ix] = 0;
+    rp->known[ix] = 0;
+    ++rp->pending_count;
+}
+
+static udp_replica_peer_t *replica_peer_get(udp_replication_t *rep, udp_peer_t *peer) {
+    udp_replica_peer_t key;
+    key.peer = peer;
+    udp_replica_peer_t *rp = (udp_replica_peer_t *)hash_table_find(&rep->peers, &key);
+    if (rp) {
+        return rp;
+    }
+    rp = (udp_replica_peer_t *)malloc(sizeof(udp_replica_peer_t));
+    if (!rp) {
+        return NULL;
+    }
+    memset(rp, 0, sizeof(*rp));
+    rp->peer = peer;
+    vector_init(&rp->removed, sizeof(uint32_t));
+    uint32_t n = (uint32_t)rep->entities.item_count;
+    if (replica_peer_reserve(rp, n) < 0 || !hash_table_assign(&rep->peers, rp)) {
+        replica_peer_free(rp);
+        return NULL;
+    }
+    for (uint32_t i = 0; i != n; ++i) {
+        replica_peer_entity_new(rp, i);
+    }
+    return rp;
+}
+
+static udp_entity_t *entity_find(udp_replication_t *rep, uint32_t id, uint32_t *oix) {
+    udp_entity_index_t key;
+    key.id = id;
+    udp_entity_index_t *ei = (udp_entity_index_t *)hash_table_find(&rep->index, &key);
+    if (!ei) {
+        return NULL;
+    }
+    *oix = ei->index;
+    return (udp_entity_t *)vector_item_get(&rep->entities, ei->index);
+}
+
+/* An update in the payload being packed: the entity index and fields, or for a
+ * removal, the id and no fields.
+ */
+struct replication_written_t {
+    uint32_t        index;
+    uint32_t        fields;
+};
+
+UDPERR udp_group_replication_init(udp_group_t *group, udp_replication_params_t *params) {
+    if (group->replication || !params || !params->serialize || params->channel >= UDP_MAX_CHANNELS ||
+            !group->instance->channels[params->channel].configured) {
+        return UDPERR_INVALID_ARGUMENT;
+    }
+    udp_replication_t *rep = (udp_replication_t *)malloc(sizeof(udp_replication_t));
+    if (!rep) {
+        return UDPERR_OUT_OF_MEMORY;
+    }
+    memset(rep, 0, sizeof(*rep));
+    rep->params = params;
+    vector_init(&rep->entities, sizeof(udp_entity_t));
+    vector_init(&rep->dirty, sizeof(uint32_t));
+    vector_init(&rep->written, sizeof(replication_written_t));
+    hash_table_init(&rep->index, sizeof(udp_entity_index_t), 0, entity_index_hash, entity_index_comp);
+    hash_table_init(&rep->peers, sizeof(udp_replica_peer_t), HASHTABLE_POINTERS, replica_peer_hash, replica_peer_comp);
+    group->replication = rep;
+    return UDP_OK;
+}
+
+void udp_group_replication_free(udp_group_t *group) {
+    udp_replication_t *rep = group->replication;
+    if (!rep) {
+        return;
+    }
+    hash_iterator_t iter;
+    for (void *rp = hash_table_begin(&rep->peers, &iter); rp; rp = hash_table_next(&iter)) {
+        replica_peer_free((udp_replica_peer_t *)rp);
+    }
+    hash_table_deinit(&rep->peers);
+    hash_table_deinit(&rep->index);
+    vector_deinit(&rep->entities);
+    vector_deinit(&rep->dirty);
+    vector_deinit(&rep->written);
+    free(rep->order);
+    free(rep);
+    group->replication = NULL;
+}
+
+void udp_group_replication_peer_forget(udp_group_t *group, udp_peer_t *peer) {
+    if (!group->replication) {
+        return;
+    }
+    udp_replica_peer_t key;
+    key.peer = peer;
+    udp_replica_peer_t *rp = (udp_replica_peer_t *)hash_table_find(&group->replication->peers, &key);
+    if (rp) {
+        hash_table_remove(&group->replication->peers, rp);
+        replica_peer_free(rp);
+    }
+}
+
+UDPERR udp_group_entity_add(udp_group_t *group, uint32_t id, void *entity, float priority) {
+    udp_replication_t *rep = group->replication;
+    uint32_t ix;
+    if (!rep || !(priority > 0) || entity_find(rep, id, &ix)) {
+        return UDPERR_INVALID_ARGUMENT;
+    }
+    ix = (uint32_t)rep->entities.item_count;
+    hash_iterator_t iter;
+    for (void *rp = hash_table_begin(&rep->peers, &iter); rp; rp = hash_table_next(&iter)) {
+        if (replica_peer_reserve((udp_replica_peer_t *)rp, ix + 1) < 0) {
+            return UDPERR_OUT_OF_MEMORY;
+        }
+    }
+    udp_entity_t e = { id, entity, priority, 0 };
+    if (!vector_item_append(&rep->entities, &e)) {
+        return UDPERR_OUT_OF_MEMORY;
+    }
+    udp_entity_index_t ei = { id, ix };
+    if (!hash_table_assign(&rep->index, &ei)) {
+        vector_item_remove(&rep->entities, ix, 1);
+        return UDPERR_OUT_OF_MEMORY;
+    }
+    for (void *rp = hash_table_begin(&rep->peers, &iter); rp; rp = hash_table_next(&iter)) {
+        replica_peer_entity_new((udp_replica_peer_t *)rp, ix);
+    }
+    return UDP_OK;
+}
+
+UDPERR udp_group_entity_remove(udp_group_t *group, uint32_t id) {
+    udp_replication_t *rep = group->replication;
+    uint32_t ix;
+    if (!rep || !entity_find(rep, id, &ix)) {
+        return UDPERR_INVALID_ARGUMENT;
+    }
+    //  the last entity moves into the hole, in every parallel array
+    uint32_t last = (uint32_t)rep->entities.item_count - 1;
+    UDPERR err = UDP_OK;
+    hash_iterator_t iter;
+    for (void *p = hash_table_begin(&rep->peers, &iter); p; p = hash_table_next(&iter)) {
+        udp_replica_peer_t *rp = (udp_replica_peer_t *)p;
+        if (rp->known[ix] && !vector_item_append(&rp->removed, &id)) {
+            err = UDPERR_OUT_OF_MEMORY;
+        }
+        if (rp->pending[ix]) {
+            --rp->pending_count;
+        }
+        rp->pending[ix] = rp->pending[last];
+        rp->accumulator[ix] = rp->accumulator[last];
+        rp->known[ix] = rp->known[last];
+    }
+    for (size_t i = rep->dirty.item_count; i > 0; --i) {
+        uint32_t *d = (uint32_t *)vector_item_get(&rep->dirty, i - 1);
+        if (*d == ix) {
+            vector_item_remove(&rep->dirty, i - 1, 1);
+        } else if (*d == last) {
+            *d = ix;
+        }
+    }
+    udp_entity_index_t key;
+    key.id = id;
+    hash_table_remove(&rep->index, &key);
+    if (ix != last) {
+        udp_entity_t *moved = (udp_entity_t *)vector_item_get(&rep->entities, last);
+        memcpy(vector_item_get(&rep->entities, ix), moved, sizeof(udp_entity_t));
+        key.id = moved->id;
+        ((udp_entity_index_t *)hash_table_find(&rep->index, &key))->index = ix;
+    }
+    vector_item_remove(&rep->entities, last, 1);
+    return err;
+}
+
+UDPERR udp_group_entity_dirty(udp_group_t *group, uint32_t id, uint32_t fields) {
+    udp_replication_t *rep = group->replication;
+    uint32_t ix;
+    udp_entity_t *e = rep ? entity_find(rep, id, &ix) : NULL;
+    if (!e) {
+        return UDPERR_INVALID_ARGUMENT;
+    }
+    if (!e->dirty && fields) {
+        if (!vector_item_append(&rep->dirty, &ix)) {
+            return UDPERR_OUT_OF_MEMORY;
+        }
+    }
+    e->dirty |= fields;
+    return UDP_OK;
+}
+
+static int replication_order_comp(void const *a, void const *b) {
+    float fa = ((udp_replication_order_t const *)a)->accumulator;
+    float fb = ((udp_replication_order_t const *)b)->accumulator;
+    return fa > fb ? -1 : fa < fb ? 1 : 0;
+}
+
+
+/* Packs entity updates into payloads, enqueueing each payload as it fills up. The peer
+ * only counts as knowing about what's in a payload once the payload is queued; if it
+ * can't be, the updates are pending again, for the next tick.
+ */
+struct replication_writer_t {
+    udp_replica_peer_t  *rp;
+    uint8_t             channel;
+    udp_payload_t       *payload;
+    size_t              max_size;
+    /* replication_written_t for what's in payload */
+    vector_t            written;
+    UDPERR              err;
+};
+
+static void replication_writer_flush(replication_writer_t *w) {
+    if (w->payload) {
+        udp_replica_peer_t *rp = w->rp;
+        UDPERR e = udp_peer_channel_enqueue(rp->peer, w->channel, w->payload);
+        for (size_t i = 0, n = w->written.item_count; i != n; ++i) {
+            replication_written_t *wr = (replication_written_t *)vector_item_get(&w->written, i);
+            if (e == UDP_OK) {
+                if (wr->fields) {
+                    rp->known[wr->index] = 1;
+                }
+            } else if (!wr->fields) {
+                //  if this fails, the peer keeps the entity until it leaves; no worse than a lost payload
+                vector_item_append(&rp->removed, &wr->index);
+            } else {
+                if (!rp->pending[wr->index]) {
+                    ++rp->pending_count;
+                }
+                rp->pending[wr->index] |= wr->fields;
+            }
+        }
+        vector_item_remove(&w->written, 0, w->written.item_count);
+        if (e != UDP_OK) {
+            w->err = e;
+        }
+        w->payload = NULL;
+    }
+}
+
+/* Write one update. serialize is NULL for removals.
+ * @return the bytes written, or 0 if it doesn't fit in a payload.
+ */
+static size_t replication_writer_put(replication_writer_t *w, udp_replication_params_t *params, udp_entity_t *e, uint32_t ix, uint32_t id, uint32_t fields) {
+    for (int attempt = 0; attempt != 2; ++attempt) {
+        if (!w->payload) {
+            w->payload = udp_payload_get(w->rp->peer->instance);
+            if (!w->payload) {
+                w->err = UDPERR_OUT_OF_MEMORY;
+                return 0;
+            }
+        }
+        unsigned char *base = (unsigned char *)w->payload->data + w->payload->size;
+        size_t room = w->max_size - w->payload->size;
+        if (room > sizeof(entity_update_header)) {
+            size_t size = e ? params->serialize(params, id, e->entity, fields, base + sizeof(entity_update_header), room - sizeof(entity_update_header)) : 0;
+            if ((size || !e) && size <= 0xffff) {
+                replication_written_t wr = { e ? ix : id, e ? fields : 0 };
+                if (!vector_item_append(&w->written, &wr)) {
+                    w->err = UDPERR_OUT_OF_MEMORY;
+                    return 0;
+                }
+                entity_update_header hdr = { id, fields, (uint16_t)size, 0 };
+                memcpy(base, &hdr, sizeof(hdr));
+                w->payload->size += (uint16_t)(sizeof(hdr) + size);
+                return sizeof(hdr) + size;
+            }
+        }
+        if (w->payload->size == 0) {
+            //  doesn't fit even in an empty payload
+            return 0;
+        }
+        replication_writer_flush(w);
+    }
+    return 0;
+}
+
+int udp_group_replication_tick(udp_group_t *group) {
+    udp_replication_t *rep = group->replication;
+    if (!rep) {
+        return -1;
+    }
+    udp_replication_params_t *params = rep->params;
+    udp_params_t *iparams = group->instance->params;
+    //  peers new to the group need everything
+    for (size_t i = 0, n = group->peers.item_count; i != n; ++i) {
+        if (!replica_peer_get(rep, *(udp_peer_t **)vector_item_get(&group->peers, i))) {
+            iparams->on_error(iparams, UDPERR_OUT_OF_MEMORY, "udp_group_replication_tick(): out of memory for peer");
+            return -1;
+        }
+    }
+    //  hand out this tick's dirty fields to everybody
+    hash_iterator_t iter;
+    for (size_t d = 0, nd = rep->dirty.item_count; d != nd; ++d) {
+        uint32_t ix = *(uint32_t *)vector_item_get(&rep->dirty, d);
+        udp_entity_t *e = (udp_entity_t *)vector_item_get(&rep->entities, ix);
+        for (void *p = hash_table_begin(&rep->peers, &iter); p; p = hash_table_next(&iter)) {
+            udp_replica_peer_t *rp = (udp_replica_peer_t *)p;
+            if (!rp->pending[ix]) {
+                ++rp->pending_count;
+            }
+            rp->pending[ix] |= e->dirty;
+        }
+        e->dirty = 0;
+    }
+    vector_item_remove(&rep->dirty, 0, rep->dirty.item_count);
+
+    uint32_t nentities = (uint32_t)rep->entities.item_count;
+    if (rep->order_capacity < nentities) {
+        free(rep->order);
+        rep->order = (udp_replication_order_t *)malloc(nentities * sizeof(udp_replication_order_t));
+        rep->order_capacity = rep->order ? nentities : 0;
+        if (!rep->order) {
+            iparams->on_error(iparams, UDPERR_OUT_OF_MEMORY, "udp_group_replication_tick(): out of memory for ordering");
+            return -1;
+        }
+    }
+    udp_replication_order_t *order = rep->order;
+
+    int nupdates = 0;
+    for (void *p = hash_table_begin(&rep->peers, &iter); p; p = hash_table_next(&iter)) {
+        udp_replica_peer_t *rp = (udp_replica_peer_t *)p;
+        if (!rp->pending_count && !rp->removed.item_count) {
+            continue;
+        }
+        replication_writer_t w = { rp, params->channel, NULL, iparams->max_payload_size, rep->written, UDP_OK };
+        uint32_t budget = udp_peer_send_budget(rp->peer);
+        if (params->max_bytes_per_tick && params->max_bytes_per_tick < budget) {
+            budget = params->max_bytes_per_tick;
+        }
+        uint32_t used = 0;
+        //  removals are small, and go first, so a re-used id isn't removed after it's added
+        //  (the ones that don't make it into a queued payload are put back at the end)
+        size_t nremoved = 0;
+        for (size_t n = rp->removed.item_count; nremoved != n; ++nremoved) {
+            size_t put = replication_writer_put(&w, params, NULL, 0, *(uint32_t *)vector_item_get(&rp->removed, nremoved), 0);
+            if (!put) {
+                break;
+            }
+            used += (uint32_t)put;
+            ++nupdates;
+        }
+        vector_item_remove(&rp->removed, 0, nremoved);
+        //  everything that's waiting gets more urgent; send the most urgent first
+        uint32_t norder = 0;
+        if (rp->pending_count) {
+            for (uint32_t ix = 0; ix != nentities; ++ix) {
+                if (!rp->pending[ix]) {
+                    continue;
+                }
+                udp_entity_t *e = (udp_entity_t *)vector_item_get(&rep->entities, ix);
+                float pri = params->priority ? params->priority(params, rp->peer, e->id, e->entity, e->priority) : e->priority;
+                if (pri > 0) {
+                    rp->accumulator[ix] += pri;
+                    order[norder].accumulator = rp->accumulator[ix];
+                    order[norder].index = ix;
+                    ++norder;
+                }
+            }
+            qsort(order, norder, sizeof(udp_replication_order_t), replication_order_comp);
+        }
+        for (uint32_t k = 0; k != norder && used < budget; ++k) {
+            uint32_t ix = order[k].index;
+            udp_entity_t *e = (udp_entity_t *)vector_item_get(&rep->entities, ix);
+            size_t n = replication_writer_put(&w, params, e, ix, e->id, rp->pending[ix]);
+            if (!n) {
+                if (w.err != UDP_OK) {
+                    break;
+                }
+                //  drop the update, rather than fail the same way every tick
+                iparams->on_error(iparams, UDPERR_INVALID_ARGUMENT, "udp_group_replication_tick(): entity doesn't fit in a payload");
+                rp->pending[ix] = 0;
+                rp->accumulator[ix] = 0;
+                --rp->pending_count;
+                continue;
+            }
+            used += (uint32_t)n;
+            rp->pending[ix] = 0;
+            rp->accumulator[ix] = 0;
+            --rp->pending_count;
+            ++nupdates;
+        }
+        replication_writer_flush(&w);
+        //  keep the memory for the next peer
+        rep->written = w.written;
+        if (w.err != UDP_OK) {
+            iparams->on_error(iparams, w.err, "udp_group_replication_tick(): could not queue updates");
+        }
+    }
+    return nupdates;
+}
+
+int udp_entity_update_next(void const *data, size_t size, size_t *offset, udp_entity_update_t *update) {
+    if (*offset >= size) {
+        return 0;
+    }
+    entity_update_header hdr;
+    if (size - *offset < sizeof(hdr)) {
+        return -1;
+    }
+    memcpy(&hdr, (unsigned char const *)data + *offset, sizeof(hdr));
+    if (size - *offset - sizeof(hdr) < hdr.size) {
+        return -1;
+    }
+    update->id = hdr.id;
+    update->fields = hdr.fields;
+    update->data = (unsigned char const *)data + *offset + sizeof(hdr);
+    update->size = hdr.size;
+    *offset += sizeof(hdr) + hdr.size;
+    return 1;
+}
@@ -0,0 +1,76 @@
+#if !defined(onyxudp_replication_h)
+#define onyxudp_replication_h
+
+/* Internal support for udp_group_replication_init() and friends.
+ *
+ * Entities live in a dense array, so each peer can keep its own state for every
+ * entity in parallel arrays indexed the same way: which fields the peer still
+ * needs (pending), how long the entity has been waiting to be sent to it
+ * (accumulator), and whether the peer has been sent the entity at all (known.)
+ * Fields marked dirty during a tick are handed out to every peer at the next
+ * udp_group_replication_tick(); each peer then gets its most urgent pending
+ * entities, within its send budget. Only what actually goes out is serialized.
+ */
+
+#include <stdint.h>
+#include <onyxutil/hashtable.h>
+#include <onyxutil/vector.h>
+
+#include "udpbase.h"
+
+typedef struct udp_entity_t {
+    uint32_t    id;
+    void        *entity;
+    float       priority;
+    /* fields marked dirty since the last tick */
+    uint32_t    dirty;
+} udp_entity_t;
+
+typedef struct udp_entity_index_t {
+    /* must be first, the index hash table keys on it */
+    uint32_t    id;
+    uint32_t    index;
+} udp_entity_index_t;
+
+typedef struct udp_replica_peer_t {
+    /* must be first, the peers hash table keys on it */
+    udp_peer_t  *peer;
+    /* all of these have capacity items, indexed like the entities */
+    uint32_t    *pending;
+    float       *accumulator;
+    uint8_t     *known;
+    uint32_t    capacity;
+    /* how many entities have pending fields; peers with none cost nothing */
+    uint32_t    pending_count;
+    /* ids of entities the peer knows about that have been removed */
+    vector_t    removed;
+} udp_replica_peer_t;
+
+typedef struct udp_replication_order_t {
+    float       accumulator;
+    uint32_t    index;
+} udp_replication_order_t;
+
+typedef struct udp_replication_t {
+    udp_replication_params_t *params;
+    /* udp_entity_t */
+    vector_t    entities;
+    /* udp_entity_index_t, by id */
+    hash_table_t index;
+    /* uint32_t indices of entities with dirty fields */
+    vector_t    dirty;
+    /* udp_replica_peer_t, by peer */
+    hash_table_t peers;
+    /* scratch space for picking what to send */
+    udp_replication_order_t *order;
+    uint32_t    order_capacity;
+    /* scratch space for what's in the payload being packed */
+    vector_t    written;
+} udp_replication_t;
+
+/* Free the replication state of a group, if any. */
+void udp_group_replication_free(udp_group_t *group);
+/* Forget what a peer leaving the group has been sent. */
+void udp_group_replication_peer_forget(udp_group_t *group, udp_peer_t *peer);
+
+#endif  //  onyxudp_replication_h
@@ -0,0 +1,421 @@
+#include "udpbase.h"
+#include "udpclient.h"
+#include "protocol.h"
+#include "types.h"
+#include "snapshot.h"
+#include "stats.h"
+
+#include <onyxutil/delta.h>
+#include <onyxutil/pool.h>
+#include <onyxutil/vector.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+
+//  Pool blocks grow in steps of this, so a snapshot that grows a little at a
+//  time doesn't flush the history every tick.
+#define SNAPSHOT_BLOCK_GRANULARITY 1024
+//  A client won't track more streams than this per connection.
+#define SNAPSHOT_MAX_STREAMS 64
+
+static bool sequence_newer(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) > 0;
+}
+
+void udp_snapshot_history_init(udp_snapshot_history_t *history) {
+    memset(history, 0, sizeof(*history));
+}
+
+void udp_snapshot_history_deinit(udp_snapshot_history_t *history) {
+    pool_deinit(&history->pool);
+    memset(history, 0, sizeof(*history));
+}
+
+udp_snapshot_entry_t *udp_snapshot_history_add(udp_snapshot_history_t *history, uint32_t sequence, void const *data, size_t size, udp_stats_t *stats) {
+    if (size > history->pool.block_size) {
+        //  Bigger than anything before; start over with bigger blocks. The peers
+        //  get full snapshots until they acknowledge one of the new size.
+        size_t block = (size + SNAPSHOT_BLOCK_GRANULARITY - 1) & ~(size_t)(SNAPSHOT_BLOCK_GRANULARITY - 1);
+        udp_snapshot_history_deinit(history);
+        if (pool_init(&history->pool, block ? block : SNAPSHOT_BLOCK_GRANULARITY, 8) < 0) {
+            return NULL;
+        }
+    }
+    udp_snapshot_entry_t *e = &history->entries[sequence % UDP_SNAPSHOT_HISTORY];
+    if (!e->data) {
+        size_t misses = history->pool.misses;
+        e->data = pool_alloc(&history->pool);
+        if (!e->data) {
+            e->sequence = 0;
+            return NULL;
+        }
+        udp_stat_add(history->pool.misses != misses ? &stats->pool_misses : &stats->pool_hits, 1);
+    } else {
+        //  the slot's block is re-used as is
+        udp_stat_add(&stats->pool_hits, 1);
+    }
+    e->sequence = sequence;
+    e->size = (uint32_t)size;
+    memcpy(e->data, data, size);
+    return e;
+}
+
+udp_snapshot_entry_t *udp_snapshot_history_find(udp_snapshot_history_t *history, uint32_t sequence) {
+    if (!sequence) {
+        return NULL;
+    }
+    udp_snapshot_entry_t *e = &history->entries[sequence % UDP_SNAPSHOT_HISTORY];
+    if (e->sequence != sequence || !e->data) {
+        return NULL;
+    }
+    return e;
+}
+
+
+/* server side */
+
+uint16_t udp_group_snapshot_stream(udp_group_t *group) {
+    return group->snapshot_stream;
+}
+
+void udp_group_snapshots_free(udp_group_t *group) {
+    if (group->snapshots) {
+        udp_snapshot_history_deinit(group->snapshots);
+        free(group->snapshots);
+        group->snapshots = NULL;
+    }
+}
+
+static uint32_t udp_peer_snapshot_acked(udp_peer_t *peer, uint16_t stream) {
+    for (size_t i = 0, n = peer->snapshot_acks.item_count; i != n; ++i) {
+        udp_snapshot_ack_t *ack = (udp_snapshot_ack_t *)vector_item_get(&peer->snapshot_acks, i);
+        if (ack->stream == stream) {
+            return ack->sequence;
+        }
+    }
+    return 0;
+}
+
+void udp_peer_snapshot_ack_receive(udp_peer_t *peer, void const *data, size_t size) {
+    unsigned char const *p = (unsigned char const *)data;
+    for (size_t o = 0; size - o >= sizeof(snapshot_ack); o += sizeof(snapshot_ack)) {
+        snapshot_ack sa;
+        memcpy(&sa, p + o, sizeof(sa));
+        //  only track streams of groups the peer is actually in, so a client can't make us grow the vector
+        bool member = false;
+        for (size_t i = 0, n = peer->groups.item_count; i != n; ++i) {
+            udp_group_t *g = *(udp_group_t **)vector_item_get(&peer->groups, i);
+            if (g->snapshot_stream == sa.stream) {
+                member = !sequence_newer(sa.sequence, g->snapshot_sequence);
+                break;
+            }
+        }
+        if (!member || !sa.sequence) {
+            continue;
+        }
+        udp_snapshot_ack_t *found = NULL;
+        for (size_t i = 0, n = peer->snapshot_acks.item_count; i != n; ++i) {
+            udp_snapshot_ack_t *ack = (udp_snapshot_ack_t *)vector_item_get(&peer->snapshot_acks, i);
+            if (ack->stream == sa.stream) {
+                found = ack;
+                break;
+            }
+        }
+        if (!found) {
+            udp_snapshot_ack_t ack = { sa.stream, sa.sequence };
+            vector_item_append(&peer->snapshot_acks, &ack);
+        } else if (sequence_newer(sa.sequence, found->sequence)) {
+            //  acks can arrive out of order; keep the newest
+            found->sequence = sa.sequence;
+        }
+    }
+}
+
+void udp_peer_snapshot_ack_forget(udp_peer_t *peer, uint16_t stream) {
+    for (size_t i = 0, n = peer->snapshot_acks.item_count; i != n; ++i) {
+        udp_snapshot_ack_t *ack = (udp_snapshot_ack_t *)vector_item_get(&peer->snapshot_acks, i);
+        if (ack->stream == stream) {
+            vector_item_remove(&peer->snapshot_acks, i, 1);
+            return;
+        }
+    }
+}
+
+/* Split an encoded snapshot into payloads, appending them to out. */
+static UDPERR udp_snapshot_fragment(udp_group_t *group, uint32_t baseline, uint32_t size, unsigned char const *enc, size_t enc_size, vector_t *out) {
+    udp_params_t *params = group->instance->params;
+    size_t fragment_size = params->max_payload_size - sizeof(snapshot_header);
+    size_t count = enc_size ? (enc_size + fragment_size - 1) / fragment_size : 1;
+    if (count > UDP_SNAPSHOT_MAX_FRAGMENTS) {
+        return UDPERR_INVALID_ARGUMENT;
+    }
+    snapshot_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.stream = group->snapshot_stream;
+    hdr.fragment_count = (uint16_t)count;
+    hdr.fragment_size = (uint16_t)fragment_size;
+    hdr.sequence = group->snapshot_sequence;
+    hdr.baseline = baseline;
+    hdr.size = size;
+    hdr.encoded_size = (uint32_t)enc_size;
+    for (size_t i = 0; i != count; ++i) {
+        udp_payload_t *payload = udp_payload_new(params->max_payload_size, params, NULL);
+        if (!payload) {
+            return UDPERR_OUT_OF_MEMORY;
+        }
+        ((udp_payload_owner_t *)(payload + 1))->flags = UDP_DATA_FLAG_SNAPSHOT;
+        size_t offset = i * fragment_size;
+        size_t n = enc_size - offset < fragment_size ? enc_size - offset : fragment_size;
+        hdr.fragment = (uint16_t)i;
+        memcpy(payload->data, &hdr, sizeof(hdr));
+        if (n) {
+            memcpy((char *)payload->data + sizeof(hdr), enc + offset, n);
+        }
+        payload->size = (uint16_t)(sizeof(hdr) + n);
+        if (vector_item_append(out, &payload) == 0) {
+            udp_payload_release(payload);
+            return UDPERR_OUT_OF_MEMORY;
+        }
+    }
+    return UDP_OK;
+}
+
+struct udp_snapshot_encoding_t {
+    uint32_t    baseline;
+    size_t      first;
+    size_t      count;
+};
+
+UDPERR udp_group_snapshot_send(udp_group_t *group, void const *data, size_t size) {
+    udp_instance_t *instance = group->instance;
+    if (size > UDP_MAX_SNAPSHOT_SIZE) {
+        return UDPERR_INVALID_ARGUMENT;
+    }
+    size_t bound = delta_encode_bound(UDP_MAX_SNAPSHOT_SIZE);
+    if (!instance->snapshot_buffer) {
+        instance->snapshot_buffer = (unsigned char *)malloc(bound);
+        if (!instance->snapshot_buffer) {
+            return UDPERR_OUT_OF_MEMORY;
+        }
+    }
+    if (!group->snapshots) {
+        group->snapshots = (udp_snapshot_history_t *)malloc(sizeof(udp_snapshot_history_t));
+        if (!group->snapshots) {
+            return UDPERR_OUT_OF_MEMORY;
+        }
+        udp_snapshot_history_init(group->snapshots);
+    }
+    if (!++group->snapshot_sequence) {
+        //  0 means "no baseline"
+        ++group->snapshot_sequence;
+    }
+    udp_snapshot_entry_t *entry = udp_snapshot_history_add(group->snapshots, group->snapshot_sequence, data, size, &group->instance->stats);
+    if (!entry) {
+        return UDPERR_OUT_OF_MEMORY;
+    }
+
+    //  Most peers will have acknowledged the same recent snapshot, so each distinct
+    //  baseline is encoded once, and the resulting payloads are shared.
+    UDPERR err = UDP_OK;
+    vector_t payloads;
+    vector_t encodings;
+    vector_init(&payloads, sizeof(udp_payload_t *));
+    vector_init(&encodings, sizeof(udp_snapshot_encoding_t));
+    for (size_t i = 0, n = group->peers.item_count; i != n; ++i) {
+        udp_peer_t *peer = *(udp_peer_t **)vector_item_get(&group->peers, i);
+        udp_snapshot_entry_t *base = udp_snapshot_history_find(group->snapshots, udp_peer_snapshot_acked(peer, group->snapshot_stream));
+        if (base == entry) {
+            //  can't happen unless the peer acknowledged a snapshot before we sent it
+            base = NULL;
+        }
+        uint32_t baseline = base ? base->sequence : 0;
+        udp_snapshot_encoding_t *enc = NULL;
+        for (size_t j = 0, m = encodings.item_count; j != m; ++j) {
+            udp_snapshot_encoding_t *e = (udp_snapshot_encoding_t *)vector_item_get(&encodings, j);
+            if (e->baseline == baseline) {
+                enc = e;
+                break;
+            }
+        }
+        if (!enc) {
+            size_t enc_size = delta_encode(base ? base->data : NULL, base ? base->size : 0, entry->data, size, instance->snapshot_buffer, bound);
+            udp_snapshot_encoding_t e = { baseline, payloads.item_count, 0 };
+            UDPERR ferr = udp_snapshot_fragment(group, baseline, (uint32_t)size, instance->snapshot_buffer, enc_size, &payloads);
+            if (ferr != UDP_OK) {
+                err = ferr;
+                break;
+            }
+            e.count = payloads.item_count - e.first;
+            if (vector_item_append(&encodings, &e) == 0) {
+                err = UDPERR_OUT_OF_MEMORY;
+                break;
+            }
+            enc = (udp_snapshot_encoding_t *)vector_item_get(&encodings, encodings.item_count - 1);
+        }
+        for (size_t j = 0; j != enc->count; ++j) {
+            udp_payload_t *payload = *(udp_payload_t **)vector_item_get(&payloads, enc->first + j);
+            udp_payload_hold(payload);
+            if (udp_peer_payload_enqueue(peer, payload) != UDP_OK) {
+                err = UDPERR_OUT_OF_MEMORY;
+            }
+        }
+    }
+    for (size_t i = 0, n = payloads.item_count; i != n; ++i) {
+        udp_payload_release(*(udp_payload_t **)vector_item_get(&payloads, i));
+    }
+    vector_deinit(&payloads);
+    vector_deinit(&encodings);
+    return err;
+}
+
+
+/* client side */
+
+static udp_client_snapshot_stream_t *udp_client_snapshot_stream_get(udp_client_connection_t *conn, uint16_t stream) {
+    for (size_t i = 0, n = conn->snapshot_streams.item_count; i != n; ++i) {
+        udp_client_snapshot_stream_t *s = *(udp_client_snapshot_stream_t **)vector_item_get(&conn->snapshot_streams, i);
+        if (s->stream == stream) {
+            return s;
+        }
+    }
+    if (conn->snapshot_streams.item_count >= SNAPSHOT_MAX_STREAMS) {
+        return NULL;
+    }
+    udp_client_snapshot_stream_t *s = (udp_client_snapshot_stream_t *)malloc(sizeof(udp_client_snapshot_stream_t));
+    if (!s) {
+        return NULL;
+    }
+    memset(s, 0, sizeof(*s));
+    s->stream = stream;
+    udp_snapshot_history_init(&s->history);
+    if (vector_item_append(&conn->snapshot_streams, &s) == 0) {
+        free(s);
+        return NULL;
+    }
+    return s;
+}
+
+void udp_client_snapshot_streams_free(udp_client_connection_t *conn) {
+    for (size_t i = 0, n = conn->snapshot_streams.item_count; i != n; ++i) {
+        udp_client_snapshot_stream_t *s = *(udp_client_snapshot_stream_t **)vector_item_get(&conn->snapshot_streams, i);
+        udp_snapshot_history_deinit(&s->history);
+        free(s->buffer);
+        free(s);
+    }
+    vector_deinit(&conn->snapshot_streams);
+}
+
+static void udp_client_snapshot_complete(udp_client_connection_t *conn, udp_client_snapshot_stream_t *s) {
+    udp_client_t *client = conn->client;
+    udp_snapshot_entry_t *base = NULL;
+    if (s->baseline) {
+        base = udp_snapshot_history_find(&s->history, s->baseline);
+        if (!base) {
+            //  we've forgotten the baseline; wait for a snapshot based on something newer
+            return;
+        }
+    }
+    if (!client->snapshot_buffer) {
+        client->snapshot_buffer = (unsigned char *)malloc(UDP_MAX_SNAPSHOT_SIZE);
+        if (!client->snapshot_buffer) {
+            client->params->on_error(client->params, UDPERR_OUT_OF_MEMORY, "udp_client_snapshot_receive(): malloc() failed");
+            return;
+        }
+    }
+    if (delta_decode(base ? base->data : NULL, base ? base->size : 0, s->buffer, s->encoded_size, client->snapshot_buffer, s->size) < 0) {
+        return;
+    }
+    udp_snapshot_entry_t *e = udp_snapshot_history_add(&s->history, s->sequence, client->snapshot_buffer, s->size, &client->stats);
+    if (!e) {
+        client->params->on_error(client->params, UDPERR_OUT_OF_MEMORY, "udp_client_snapshot_receive(): udp_snapshot_history_add() failed");
+        return;
+    }
+    s->latest = s->sequence;
+    s->ack_pending = 1;
+    if (client->params->on_snapshot) {
+        client->params->on_snapshot(client->params, conn, s->stream, e->sequence, e->data, e->size);
+    }
+}
+
+void udp_client_snapshot_receive(udp_client_connection_t *conn, void const *data, size_t size) {
+    if (size < sizeof(snapshot_header)) {
+        return;
+    }
+    snapshot_header hdr;
+    memcpy(&hdr, data, sizeof(hdr));
+    size_t n = size - sizeof(hdr);
+    if (!hdr.sequence || hdr.size > UDP_MAX_SNAPSHOT_SIZE || hdr.encoded_size > delta_encode_bound(UDP_MAX_SNAPSHOT_SIZE) ||
+            !hdr.fragment_count || hdr.fragment_count > UDP_SNAPSHOT_MAX_FRAGMENTS || hdr.fragment >= hdr.fragment_count ||
+            (size_t)hdr.fragment * hdr.fragment_size + n > hdr.encoded_size ||
+            (hdr.fragment + 1 < hdr.fragment_count && n != hdr.fragment_size)) {
+        return;
+    }
+    udp_client_snapshot_stream_t *s = udp_client_snapshot_stream_get(conn, hdr.stream);
+    if (!s) {
+        return;
+    }
+    if (s->latest && !sequence_newer(hdr.sequence, s->latest)) {
+        //  already have something newer
+        return;
+    }
+    if (hdr.sequence != s->sequence) {
+        if (s->sequence && s->fragments_received < s->fragment_count && sequence_newer(s->sequence, hdr.sequence)) {
+            //  a late fragment of an older snapshot than the one being put together
+            return;
+        }
+        if (!s->buffer) {
+            s->buffer = (unsigned char *)malloc(delta_encode_bound(UDP_MAX_SNAPSHOT_SIZE));
+            if (!s->buffer) {
+                return;
+            }
+        }
+        s->sequence = hdr.sequence;
+        s->baseline = hdr.baseline;
+        s->size = hdr.size;
+        s->encoded_size = hdr.encoded_size;
+        s->fragment_count = hdr.fragment_count;
+        s->fragments_received = 0;
+        memset(s->fragment_bits, 0, sizeof(s->fragment_bits));
+    } else if (hdr.fragment_count != s->fragment_count || hdr.encoded_size != s->encoded_size) {
+        return;
+    }
+    uint32_t bit = 1u << (hdr.fragment & 31);
+    if (s->fragment_bits[hdr.fragment >> 5] & bit) {
+        //  duplicate
+        return;
+    }
+    s->fragment_bits[hdr.fragment >> 5] |= bit;
+    memcpy(s->buffer + (size_t)hdr.fragment * hdr.fragment_size, (unsigned char const *)data + sizeof(hdr), n);
+    if (++s->fragments_received == s->fragment_count) {
+        udp_client_snapshot_complete(conn, s);
+    }
+}
+
+void udp_client_snapshot_ack_flush(udp_client_connection_t *conn) {
+    udp_payload_t *payload = NULL;
+    for (size_t i = 0, n = conn->snapshot_streams.item_count; i != n; ++i) {
+        udp_client_snapshot_stream_t *s = *(udp_client_snapshot_stream_t **)vector_item_get(&conn->snapshot_streams, i);
+        if (!s->ack_pending) {
+            continue;
+        }
+        if (!payload) {
+            payload = udp_client_payload_get(conn->client);
+            if (!payload) {
+                return;
+            }
+            ((udp_payload_owner_t *)(payload + 1))->flags = UDP_DATA_FLAG_SNAPSHOT_ACK;
+        }
+        if (payload->size + sizeof(snapshot_ack) > conn->client->params->max_payload_size) {
+            break;
+        }
+        snapshot_ack sa = { s->stream, 0, s->latest };
+        memcpy((char *)payload->data + payload->size, &sa, sizeof(sa));
+        payload->size += sizeof(sa);
+        s->ack_pending = 0;
+    }
+    if (payload) {
+        udp_client_payload_send(conn, payload);
+    }
+}
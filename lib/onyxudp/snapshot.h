@@ -0,0 +1,79 @@
+#if !defined(onyxudp_snapshot_h)
+#define onyxudp_snapshot_h
+
+/* Internal support for udp_group_snapshot_send() and on_snapshot().
+ *
+ * Both ends keep the last UDP_SNAPSHOT_HISTORY snapshots of each stream, so that
+ * a delta can be made (server) or undone (client) against any snapshot the client
+ * may have acknowledged. The snapshot copies live in a pool, so steady state
+ * snapshotting doesn't go to malloc().
+ */
+
+#include "udpbase.h"
+#include "udpclient.h"
+
+#include <onyxutil/pool.h>
+
+typedef struct udp_snapshot_entry_t {
+    uint32_t    sequence;
+    uint32_t    size;
+    void        *data;
+} udp_snapshot_entry_t;
+
+typedef struct udp_snapshot_history_t {
+    /* blocks are sized for the biggest snapshot seen so far */
+    pool_t                  pool;
+    udp_snapshot_entry_t    entries[UDP_SNAPSHOT_HISTORY];
+} udp_snapshot_history_t;
+
+/* What the server knows a peer has received, for one stream. */
+typedef struct udp_snapshot_ack_t {
+    uint16_t    stream;
+    uint32_t    sequence;
+} udp_snapshot_ack_t;
+
+enum {
+    /* A snapshot can't be split into more fragments than this. */
+    UDP_SNAPSHOT_MAX_FRAGMENTS = 1024
+};
+
+/* A snapshot stream, as seen by a client connection. */
+typedef struct udp_client_snapshot_stream_t {
+    uint16_t                stream;
+    uint8_t                 ack_pending;
+    /* last delivered sequence */
+    uint32_t                latest;
+    udp_snapshot_history_t  history;
+    /* the snapshot currently being put together from fragments */
+    uint32_t                sequence;
+    uint32_t                baseline;
+    uint32_t                size;
+    uint32_t                encoded_size;
+    uint16_t                fragment_count;
+    uint16_t                fragments_received;
+    uint32_t                fragment_bits[UDP_SNAPSHOT_MAX_FRAGMENTS / 32];
+    unsigned char           *buffer;
+} udp_client_snapshot_stream_t;
+
+void udp_snapshot_history_init(udp_snapshot_history_t *history);
+void udp_snapshot_history_deinit(udp_snapshot_history_t *history);
+/* Copy a snapshot into the history, replacing whatever was in its slot.
+ * Block re-use and allocation are counted in stats.
+ * @return the new entry, or NULL if out of memory.
+ */
+udp_snapshot_entry_t *udp_snapshot_history_add(udp_snapshot_history_t *history, uint32_t sequence, void const *data, size_t size, udp_stats_t *stats);
+/* @return the entry for the sequence, or NULL if it's not (any longer) in the history. */
+udp_snapshot_entry_t *udp_snapshot_history_find(udp_snapshot_history_t *history, uint32_t sequence);
+
+/* server side */
+void udp_group_snapshots_free(udp_group_t *group);
+void udp_peer_snapshot_ack_receive(udp_peer_t *peer, void const *data, size_t size);
+/* Called when the peer leaves the group of the stream. */
+void udp_peer_snapshot_ack_forget(udp_peer_t *peer, uint16_t stream);
+
+/* client side */
+void udp_client_snapshot_receive(udp_client_connection_t *conn, void const *data, size_t size);
+void udp_client_snapshot_ack_flush(udp_client_connection_t *conn);
+void udp_client_snapshot_streams_free(udp_client_connection_t *conn);
+
+#endif  //  onyxudp_snapshot_h
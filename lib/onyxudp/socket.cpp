@@ -0,0 +1,244 @@
+#include "socket.h"
+
+#include <onyxutil/hashtable.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+
+
+size_t connection_hash(void const *data, size_t sz) {
+    return hash_pod(data, sizeof(udp_conn_addr_t));
+}
+
+int connection_comp(void const *a, void const *b, size_t sz) {
+    return memcmp(a, b, sizeof(udp_conn_addr_t));
+}
+
+void udp_conn_addr_set(udp_conn_addr_t *addr, sockaddr const *sa, socklen_t len) {
+    memset(addr, 0, sizeof(*addr));
+    if (sa->sa_family == AF_INET6 && len >= (socklen_t)sizeof(sockaddr_in6)) {
+        sockaddr_in6 const *sin6 = (sockaddr_in6 const *)sa;
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            sockaddr_in sin;
+            memset(&sin, 0, sizeof(sin));
+            sin.sin_family = AF_INET;
+            sin.sin_port = sin6->sin6_port;
+            memcpy(&sin.sin_addr, &sin6->sin6_addr.s6_addr[12], 4);
+            addr->data[0] = 1;
+            addr->data[1] = sizeof(sin);
+            memcpy(&addr->data[2], &sin, sizeof(sin));
+            return;
+        }
+    }
+    if (len > (socklen_t)(sizeof(udp_conn_addr_t) - 2)) {
+        return;
+    }
+    addr->data[0] = 1;
+    addr->data[1] = len;
+    memcpy(&addr->data[2], sa, len);
+}
+
+int udp_socket_enable_ecn(int sock, int family) {
+    int ect = UDP_ECN_ECT0;
+    int on = 1;
+    int ok = 0;
+    if (family == AF_INET6) {
+        if (::setsockopt(sock, IPPROTO_IPV6, IPV6_TCLASS, &ect, sizeof(ect)) < 0) {
+            ok = -1;
+        }
+        if (::setsockopt(sock, IPPROTO_IPV6, IPV6_RECVTCLASS, &on, sizeof(on)) < 0) {
+            ok = -1;
+        }
+    }
+    //  IPv6 sockets also carry IPv4-mapped traffic, so set the IPv4 options where possible
+    if (::setsockopt(sock, IPPROTO_IP, IP_TOS, &ect, sizeof(ect)) < 0 && family == AF_INET) {
+        ok = -1;
+    }
+    if (::setsockopt(sock, IPPROTO_IP, IP_RECVTOS, &on, sizeof(on)) < 0 && family == AF_INET) {
+        ok = -1;
+    }
+    return ok;
+}
+
+int udp_socket_busy_poll(int sock, uint32_t busy_us) {
+    int us = (int)busy_us;
+    if (::setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) < 0) {
+        return -1;
+    }
+#if defined(SO_PREFER_BUSY_POLL)
+    //  Linux 5.11 and later
+    int on = 1;
+    ::setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof(on));
+#endif
+    return 0;
+}
+
+int udp_socket_enable_timestamps(int sock) {
+    int on = 1;
+    return ::setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on)) < 0 ? -1 : 0;
+}
+
+/* The kernel's receive time, in CLOCK_REALTIME microseconds, or 0 if there is none. */
+static uint64_t socket_timestamp(msghdr *msg) {
+    for (cmsghdr *cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPNS) {
+            timespec ts;
+            memcpy(&ts, CMSG_DATA(cm), sizeof(ts));
+            return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+        }
+    }
+    return 0;
+}
+
+static uint8_t socket_ecn(msghdr *msg) {
+    uint8_t ecn = UDP_ECN_NOT_ECT;
+    for (cmsghdr *cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == IPPROTO_IP && (cm->cmsg_type == IP_TOS || cm->cmsg_type == IP_RECVTOS)) {
+            ecn = *(unsigned char *)CMSG_DATA(cm) & UDP_ECN_MASK;
+        } else if (cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_TCLASS) {
+            int tclass = 0;
+            memcpy(&tclass, CMSG_DATA(cm), sizeof(tclass));
+            ecn = tclass & UDP_ECN_MASK;
+        }
+    }
+    return ecn;
+}
+
+static int socket_recv_batch(udp_transport_t *transport, udp_datagram_t *datagrams, int count) {
+    udp_socket_transport_t *st = (udp_socket_transport_t *)transport;
+    if (count > UDP_RECV_BATCH) {
+        count = UDP_RECV_BATCH;
+    }
+    mmsghdr msgs[UDP_RECV_BATCH];
+    iovec iovs[UDP_RECV_BATCH];
+    sockaddr_storage names[UDP_RECV_BATCH];
+    //  room for the TOS (or traffic class) and a time stamp
+    char control[UDP_RECV_BATCH][96];
+    memset(msgs, 0, sizeof(mmsghdr) * count);
+    for (int i = 0; i != count; ++i) {
+        iovs[i].iov_base = datagrams[i].data;
+        iovs[i].iov_len = datagrams[i].size;
+        msgs[i].msg_hdr.msg_name = &names[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(names[i]);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = control[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+    }
+    //  MSG_TRUNC makes msg_len the real size of a datagram that didn't fit
+    int r = ::recvmmsg(st->socket, msgs, count, MSG_TRUNC, NULL);
+    if (r < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    }
+    //  the kernel stamps with the wall clock; move that onto ours, once per batch
+    uint64_t now = 0;
+    uint64_t wall = 0;
+    for (int i = 0; i != r; ++i) {
+        datagrams[i].size = msgs[i].msg_len;
+        datagrams[i].ecn = socket_ecn(&msgs[i].msg_hdr);
+        udp_conn_addr_set(&datagrams[i].addr, (sockaddr const *)&names[i], msgs[i].msg_hdr.msg_namelen);
+        uint64_t stamp = socket_timestamp(&msgs[i].msg_hdr);
+        if (stamp) {
+            if (!wall) {
+                timespec ts;
+                clock_gettime(CLOCK_REALTIME, &ts);
+                wall = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+                now = udp_clock_read(st->clock, st->clock_context);
+            }
+            //  a wall clock stepped backwards since makes it look like it arrived just now
+            uint64_t age = wall > stamp ? wall - stamp : 0;
+            datagrams[i].timestamp = now > age ? now - age : 1;
+        }
+    }
+    return r;
+}
+
+static int socket_send_batch(udp_transport_t *transport, udp_datagram_t const *datagrams, int count) {
+    udp_socket_transport_t *st = (udp_socket_transport_t *)transport;
+    enum { SEND_BATCH = 16 };
+    mmsghdr msgs[SEND_BATCH];
+    iovec iovs[SEND_BATCH];
+    sockaddr_in6 mapped[SEND_BATCH];
+    int sent = 0;
+    while (sent != count) {
+        int n = count - sent > SEND_BATCH ? SEND_BATCH : count - sent;
+        memset(msgs, 0, sizeof(mmsghdr) * n);
+        for (int i = 0; i != n; ++i) {
+            udp_datagram_t const *dg = &datagrams[sent + i];
+            sockaddr const *sa = (sockaddr const *)&dg->addr.data[2];
+            socklen_t len = dg->addr.data[1];
+            if (st->family == AF_INET6 && sa->sa_family == AF_INET) {
+                sockaddr_in const *sin = (sockaddr_in const *)sa;
+                memset(&mapped[i], 0, sizeof(mapped[i]));
+                mapped[i].sin6_family = AF_INET6;
+                mapped[i].sin6_port = sin->sin_port;
+                mapped[i].sin6_addr.s6_addr[10] = 0xff;
+                mapped[i].sin6_addr.s6_addr[11] = 0xff;
+                memcpy(&mapped[i].sin6_addr.s6_addr[12], &sin->sin_addr, 4);
+                sa = (sockaddr const *)&mapped[i];
+                len = sizeof(mapped[i]);
+            }
+            iovs[i].iov_base = dg->data;
+            iovs[i].iov_len = dg->size;
+            msgs[i].msg_hdr.msg_name = (void *)sa;
+            msgs[i].msg_hdr.msg_namelen = len;
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int r = ::sendmmsg(st->socket, msgs, n, 0);
+        if (r < 0) {
+            return sent ? sent : -1;
+        }
+        sent += r;
+        if (r != n) {
+            break;
+        }
+    }
+    return sent;
+}
+
+static int socket_wait(udp_transport_t *transport, uint32_t timeout_us) {
+    udp_socket_transport_t *st = (udp_socket_transport_t *)transport;
+    pollfd pfd = { st->socket, POLLIN, 0 };
+    timespec ts = { (time_t)(timeout_us / 1000000), (long)(timeout_us % 1000000) * 1000 };
+    int r = ::ppoll(&pfd, 1, &ts, NULL);
+    if (r < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    return r > 0 ? 1 : 0;
+}
+
+uint64_t udp_clock_read(uint64_t (*clock)(void *context), void *context) {
+    return clock ? clock(context) : udp_timestamp();
+}
+
+void udp_socket_transport_init(udp_socket_transport_t *st, int sock, int family, uint64_t (*clock)(void *context), void *clock_context) {
+    st->transport.send_batch = socket_send_batch;
+    st->transport.recv_batch = socket_recv_batch;
+    st->transport.wait = socket_wait;
+    st->socket = sock;
+    st->family = family;
+    st->clock = clock;
+    st->clock_context = clock_context;
+}
+
+int udp_transport_send(udp_transport_t *transport, void const *buf, size_t size, udp_conn_addr_t const *to, uint64_t now) {
+    udp_datagram_t dg;
+    dg.addr = *to;
+    dg.data = (void *)buf;
+    dg.size = size;
+    dg.ecn = 0;
+    dg.timestamp = now;
+    int r = transport->send_batch(transport, &dg, 1);
+    if (r == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return r < 0 ? -1 : (int)size;
+}
@@ -0,0 +1,91 @@
+#if !defined(onyxudp_socket_h)
+#define onyxudp_socket_h
+
+/* Internal helpers that wrap the BSD socket calls used by both the server
+ * instance and the client. Addresses are passed around as udp_conn_addr_t,
+ * with the layout:
+ *
+ * data[0] = 1 (address is valid)
+ * data[1] = length of the sockaddr that follows
+ * data[2..] = sockaddr_in or sockaddr_in6
+ *
+ * IPv4-mapped IPv6 source addresses are folded back to sockaddr_in, so the
+ * same remote end always produces the same bytes, and can be hashed.
+ */
+
+#include "udpbase.h"
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/* ECN codepoints, as found in the low two bits of the IP TOS / traffic class */
+enum {
+    UDP_ECN_NOT_ECT = 0,
+    UDP_ECN_ECT1 = 1,
+    UDP_ECN_ECT0 = 2,
+    UDP_ECN_CE = 3,
+    UDP_ECN_MASK = 3
+};
+
+/* Used for hash tables of structs that start with a udp_conn_addr_t. */
+size_t connection_hash(void const *data, size_t sz);
+int connection_comp(void const *a, void const *b, size_t sz);
+
+/* Fill in a udp_conn_addr_t from a sockaddr.
+ */
+void udp_conn_addr_set(udp_conn_addr_t *addr, sockaddr const *sa, socklen_t len);
+
+/* Ask the kernel to mark outgoing packets ECT(0) and to report the TOS/traffic class
+ * of incoming packets, so that CE marks from congested routers can be seen.
+ * Failure is not fatal; the socket will just not see ECN marks.
+ * @return 0 if ECN reporting is enabled, -1 otherwise.
+ */
+int udp_socket_enable_ecn(int sock, int family);
+
+/* Have receives that find nothing spin on the device queue for up to busy_us, and ask
+ * the kernel to leave that queue to busy polling rather than interrupts where it can.
+ * Failure is not fatal; the socket just doesn't busy poll in the kernel.
+ * @return 0 if SO_BUSY_POLL was set, -1 otherwise.
+ */
+int udp_socket_busy_poll(int sock, uint32_t busy_us);
+
+/* Ask the kernel to time stamp received datagrams, for udp_datagram_t::timestamp.
+ * Failure is not fatal; datagrams just have no time stamps.
+ * @return 0 if time stamps are on, -1 otherwise.
+ */
+int udp_socket_enable_timestamps(int sock);
+
+/* How many datagrams the instance and the client receive from their transport at once. */
+enum {
+    UDP_RECV_BATCH = 16
+};
+
+/* The udp_transport_t that goes straight to a socket, which is what the instance and
+ * the client use unless the application gives them a transport. Batches go through
+ * recvmmsg() and sendmmsg(), so a busy server makes one system call per batch rather
+ * than one per datagram.
+ */
+typedef struct udp_socket_transport_t {
+    udp_transport_t     transport;
+    int                 socket;
+    /* the address family of the socket, so IPv4 destinations can be mapped when
+     * sending from an IPv6 socket */
+    int                 family;
+    /* the clock of the instance or client, which kernel time stamps are moved onto */
+    uint64_t            (*clock)(void *context);
+    void                *clock_context;
+} udp_socket_transport_t;
+
+/* The time by clock, or udp_timestamp() if clock is NULL (@see udp_params_t::clock.) */
+uint64_t udp_clock_read(uint64_t (*clock)(void *context), void *context);
+
+/* Point the transport at a socket, which it doesn't take ownership of. */
+void udp_socket_transport_init(udp_socket_transport_t *st, int sock, int family, uint64_t (*clock)(void *context), void *clock_context);
+
+/* Send one datagram through a transport, stamped with now.
+ * @return size, or -1 with errno set (EAGAIN if the transport is full for now.)
+ */
+int udp_transport_send(udp_transport_t *transport, void const *buf, size_t size, udp_conn_addr_t const *to, uint64_t now);
+
+#endif  //  onyxudp_socket_h
@@ -0,0 +1,194 @@
+#include "spatial.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+
+//  Keep cell coordinates well inside int32_t, whatever the positions.
+#define SPATIAL_MAX_CELL 0x3fffffff
+
+static size_t spatial_entry_hash(void const *data, size_t sz) {
+    return hash_pod(data, sizeof(udp_peer_t *));
+}
+
+static int spatial_entry_comp(void const *a, void const *b, size_t sz) {
+    return memcmp(a, b, sizeof(udp_peer_t *));
+}
+
+static inline int32_t spatial_cell(udp_spatial_t const *sp, float v) {
+    double c = floor((double)v / sp->cell_size);
+    if (c < -SPATIAL_MAX_CELL) {
+        return -SPATIAL_MAX_CELL;
+    }
+    if (c > SPATIAL_MAX_CELL) {
+        return SPATIAL_MAX_CELL;
+    }
+    return (int32_t)c;
+}
+
+static inline vector_t *spatial_bucket(udp_spatial_t *sp, int32_t cx, int32_t cy) {
+    uint32_t h = ((uint32_t)cx * 73856093u) ^ ((uint32_t)cy * 19349663u);
+    return &sp->buckets[h & (UDP_SPATIAL_BUCKETS - 1)];
+}
+
+static int spatial_list_find(vector_t *list, udp_spatial_entry_t *e) {
+    for (size_t i = 0, n = list->item_count; i != n; ++i) {
+        if (*(udp_spatial_entry_t **)vector_item_get(list, i) == e) {
+            return (int)i;
+        }
+    }
+    return -1;
+}
+
+static void spatial_list_remove(vector_t *list, udp_spatial_entry_t *e) {
+    int i = spatial_list_find(list, e);
+    if (i >= 0) {
+        vector_item_remove(list, (size_t)i, 1);
+    }
+}
+
+static void spatial_unlink(udp_spatial_t *sp, udp_spatial_entry_t *e) {
+    if (e->everywhere) {
+        spatial_list_remove(&sp->everywhere, e);
+        return;
+    }
+    for (int32_t cy = e->cy0; cy <= e->cy1; ++cy) {
+        for (int32_t cx = e->cx0; cx <= e->cx1; ++cx) {
+            spatial_list_remove(spatial_bucket(sp, cx, cy), e);
+        }
+    }
+}
+
+static UDPERR spatial_link(udp_spatial_t *sp, udp_spatial_entry_t *e) {
+    if (e->everywhere) {
+        return vector_item_append(&sp->everywhere, &e) ? UDP_OK : UDPERR_OUT_OF_MEMORY;
+    }
+    for (int32_t cy = e->cy0; cy <= e->cy1; ++cy) {
+        for (int32_t cx = e->cx0; cx <= e->cx1; ++cx) {
+            vector_t *bucket = spatial_bucket(sp, cx, cy);
+            if (spatial_list_find(bucket, e) < 0 && !vector_item_append(bucket, &e)) {
+                //  leave it linked nowhere rather than half-way
+                spatial_unlink(sp, e);
+                return UDPERR_OUT_OF_MEMORY;
+            }
+        }
+    }
+    return UDP_OK;
+}
+
+udp_spatial_t *udp_spatial_create(float cell_size) {
+    udp_spatial_t *sp = (udp_spatial_t *)malloc(sizeof(udp_spatial_t));
+    if (!sp) {
+        return NULL;
+    }
+    sp->cell_size = cell_size;
+    hash_table_init(&sp->entries, sizeof(udp_spatial_entry_t), HASHTABLE_POINTERS, spatial_entry_hash, spatial_entry_comp);
+    vector_init(&sp->everywhere, sizeof(udp_spatial_entry_t *));
+    for (size_t i = 0; i != UDP_SPATIAL_BUCKETS; ++i) {
+        vector_init(&sp->buckets[i], sizeof(udp_spatial_entry_t *));
+    }
+    return sp;
+}
+
+void udp_spatial_destroy(udp_spatial_t *sp) {
+    if (!sp) {
+        return;
+    }
+    hash_iterator_t iter;
+    for (void *e = hash_table_begin(&sp->entries, &iter); e; e = hash_table_next(&iter)) {
+        free(e);
+    }
+    hash_table_deinit(&sp->entries);
+    vector_deinit(&sp->everywhere);
+    for (size_t i = 0; i != UDP_SPATIAL_BUCKETS; ++i) {
+        vector_deinit(&sp->buckets[i]);
+    }
+    free(sp);
+}
+
+UDPERR udp_spatial_set(udp_spatial_t *sp, udp_peer_t *peer, float x, float y, float radius) {
+    if (!isfinite(x) || !isfinite(y) || !isfinite(radius) || radius < 0) {
+        return UDPERR_INVALID_ARGUMENT;
+    }
+    udp_spatial_entry_t key;
+    key.peer = peer;
+    udp_spatial_entry_t *e = (udp_spatial_entry_t *)hash_table_find(&sp->entries, &key);
+    bool added = false;
+    if (!e) {
+        e = (udp_spatial_entry_t *)malloc(sizeof(udp_spatial_entry_t));
+        if (!e) {
+            return UDPERR_OUT_OF_MEMORY;
+        }
+        memset(e, 0, sizeof(*e));
+        e->peer = peer;
+        if (!hash_table_assign(&sp->entries, e)) {
+            free(e);
+            return UDPERR_OUT_OF_MEMORY;
+        }
+        added = true;
+    }
+    int32_t cx0 = spatial_cell(sp, x - radius);
+    int32_t cy0 = spatial_cell(sp, y - radius);
+    int32_t cx1 = spatial_cell(sp, x + radius);
+    int32_t cy1 = spatial_cell(sp, y + radius);
+    e->x = x;
+    e->y = y;
+    e->radius = radius;
+    if (!added && cx0 == e->cx0 && cy0 == e->cy0 && cx1 == e->cx1 && cy1 == e->cy1) {
+        //  same cells; the common case for small moves
+        return UDP_OK;
+    }
+    if (!added) {
+        spatial_unlink(sp, e);
+    }
+    e->cx0 = cx0;
+    e->cy0 = cy0;
+    e->cx1 = cx1;
+    e->cy1 = cy1;
+    e->everywhere = ((int64_t)cx1 - cx0 + 1) * ((int64_t)cy1 - cy0 + 1) > UDP_SPATIAL_BUCKETS;
+    UDPERR err = spatial_link(sp, e);
+    if (err != UDP_OK) {
+        hash_table_remove(&sp->entries, e);
+        free(e);
+    }
+    return err;
+}
+
+void udp_spatial_remove(udp_spatial_t *sp, udp_peer_t *peer) {
+    udp_spatial_entry_t key;
+    key.peer = peer;
+    udp_spatial_entry_t *e = (udp_spatial_entry_t *)hash_table_find(&sp->entries, &key);
+    if (!e) {
+        return;
+    }
+    spatial_unlink(sp, e);
+    hash_table_remove(&sp->entries, e);
+    free(e);
+}
+
+static inline bool spatial_covers(udp_spatial_entry_t const *e, float x, float y) {
+    float dx = x - e->x;
+    float dy = y - e->y;
+    return dx * dx + dy * dy <= e->radius * e->radius;
+}
+
+size_t udp_spatial_query(udp_spatial_t *sp, float x, float y, udp_spatial_visit_t visit, void *context) {
+    size_t n = 0;
+    vector_t *bucket = spatial_bucket(sp, spatial_cell(sp, x), spatial_cell(sp, y));
+    for (size_t i = 0, m = bucket->item_count; i != m; ++i) {
+        udp_spatial_entry_t *e = *(udp_spatial_entry_t **)vector_item_get(bucket, i);
+        if (spatial_covers(e, x, y)) {
+            visit(context, e->peer);
+            ++n;
+        }
+    }
+    for (size_t i = 0, m = sp->everywhere.item_count; i != m; ++i) {
+        udp_spatial_entry_t *e = *(udp_spatial_entry_t **)vector_item_get(&sp->everywhere, i);
+        if (spatial_covers(e, x, y)) {
+            visit(context, e->peer);
+            ++n;
+        }
+    }
+    return n;
+}
@@ -0,0 +1,71 @@
+#if !defined(onyxudp_spatial_h)
+#define onyxudp_spatial_h
+
+/* Internal support for spatial groups (udp_group_spatial_init().)
+ *
+ * Each positioned peer has an area of interest: a circle around its position.
+ * The plane is cut into square cells, and the cells are hashed into a fixed
+ * number of buckets. A peer is listed in the bucket of every cell its area of
+ * interest touches (once per bucket, even if several of those cells hash to the
+ * same bucket.) Finding the peers interested in a point then only looks at the
+ * one bucket for the point's cell, and checks each peer in it for real; cells
+ * that share a bucket only cost a few extra distance checks.
+ *
+ * Moving a peer only touches the buckets when its area of interest moves into
+ * different cells.
+ */
+
+#include <stdint.h>
+#include <onyxutil/hashtable.h>
+#include <onyxutil/vector.h>
+
+#include "udpbase.h"
+
+enum {
+    /* must be a power of two */
+    UDP_SPATIAL_BUCKETS = 1024
+};
+
+typedef struct udp_spatial_entry_t {
+    /* must be first, the entries hash table keys on it */
+    udp_peer_t  *peer;
+    float       x;
+    float       y;
+    float       radius;
+    /* the cells the area of interest touches, inclusive */
+    int32_t     cx0;
+    int32_t     cy0;
+    int32_t     cx1;
+    int32_t     cy1;
+    /* the area touches more cells than there are buckets */
+    uint8_t     everywhere;
+} udp_spatial_entry_t;
+
+typedef struct udp_spatial_t {
+    float       cell_size;
+    /* udp_spatial_entry_t, by peer */
+    hash_table_t entries;
+    /* udp_spatial_entry_t pointers for entries with the everywhere flag */
+    vector_t    everywhere;
+    /* udp_spatial_entry_t pointers */
+    vector_t    buckets[UDP_SPATIAL_BUCKETS];
+} udp_spatial_t;
+
+typedef void (*udp_spatial_visit_t)(void *context, udp_peer_t *peer);
+
+/* @return NULL if out of memory */
+udp_spatial_t *udp_spatial_create(float cell_size);
+void udp_spatial_destroy(udp_spatial_t *sp);
+
+/* Add the peer, or move it if it's already there. */
+UDPERR udp_spatial_set(udp_spatial_t *sp, udp_peer_t *peer, float x, float y, float radius);
+/* Forget the peer, if it's there. */
+void udp_spatial_remove(udp_spatial_t *sp, udp_peer_t *peer);
+
+/* Call visit once for each peer whose area of interest covers the point.
+ * visit must not add, move or remove peers.
+ * @return the number of peers visited.
+ */
+size_t udp_spatial_query(udp_spatial_t *sp, float x, float y, udp_spatial_visit_t visit, void *context);
+
+#endif  //  onyxudp_spatial_h
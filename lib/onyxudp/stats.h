@@ -0,0 +1,50 @@
+#if !defined(onyxudp_stats_h)
+#define onyxudp_stats_h
+
+/* Internal support for udp_stats_get() and udp_client_stats_get().
+ *
+ * Only the thread polling an instance (or client) writes its counters, so
+ * there is no need for locked read-modify-write instructions; a relaxed load
+ * and store is enough, and costs the same as a plain increment. Other threads
+ * read the counters with relaxed loads, which can't see torn values. The
+ * counters may be a little out of step with each other while being read.
+ */
+
+#include <stdint.h>
+#include <errno.h>
+
+#include "udpbase.h"
+
+static inline void udp_stat_add(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void udp_stat_set(uint64_t *counter, uint64_t value) {
+    __atomic_store_n(counter, value, __ATOMIC_RELAXED);
+}
+
+static inline void udp_stat_sent(udp_stats_t *stats, size_t size) {
+    udp_stat_add(&stats->packets_out, 1);
+    udp_stat_add(&stats->bytes_out, size);
+}
+
+/* Count a failed sendto(), by errno. */
+static inline void udp_stat_send_error(udp_stats_t *stats, int err) {
+    if (err == EAGAIN || err == EWOULDBLOCK) {
+        udp_stat_add(&stats->send_again, 1);
+    } else if (err == ENOBUFS) {
+        udp_stat_add(&stats->send_nobufs, 1);
+    } else {
+        udp_stat_add(&stats->send_errors, 1);
+    }
+}
+
+static inline void udp_stats_read(udp_stats_t const *from, udp_stats_t *to) {
+    uint64_t const *src = (uint64_t const *)from;
+    uint64_t *dst = (uint64_t *)to;
+    for (size_t i = 0; i != sizeof(udp_stats_t) / sizeof(uint64_t); ++i) {
+        dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+#endif  //  onyxudp_stats_h
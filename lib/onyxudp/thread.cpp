@@ -0,0 +1,103 @@
+#include "thread.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+
+//  Bits in the node masks; the kernel wants one more than the highest node it may see.
+#define NUMA_MAX_NODE (8 * sizeof(unsigned long))
+
+static long udp_set_mempolicy(int mode, unsigned long const *nodes) {
+    return syscall(SYS_set_mempolicy, mode, nodes, nodes ? NUMA_MAX_NODE + 1 : 0);
+}
+
+int udp_numa_prefer(unsigned long numa_nodes, udp_numa_saved_t *o_saved) {
+    o_saved->mode = MPOL_DEFAULT;
+    o_saved->nodes = 0;
+    if (syscall(SYS_get_mempolicy, &o_saved->mode, &o_saved->nodes, NUMA_MAX_NODE + 1, NULL, 0) < 0) {
+        return -1;
+    }
+    return udp_set_mempolicy(MPOL_PREFERRED, &numa_nodes) < 0 ? -1 : 0;
+}
+
+void udp_numa_restore(udp_numa_saved_t const *saved) {
+    udp_set_mempolicy(saved->mode, saved->mode == MPOL_DEFAULT ? NULL : &saved->nodes);
+}
+
+int udp_numa_bind(void *addr, size_t size, unsigned long numa_nodes) {
+    return syscall(SYS_mbind, addr, size, MPOL_PREFERRED, &numa_nodes, NUMA_MAX_NODE + 1, 0) < 0 ? -1 : 0;
+}
+
+struct udp_thread_start_t {
+    void            *(*func)(void *);
+    void            *arg;
+    unsigned long   numa_nodes;
+};
+
+static void *udp_thread_func(void *arg) {
+    udp_thread_start_t start = *(udp_thread_start_t *)arg;
+    free(arg);
+    //  the node was checked when the instance was made, so this doesn't fail
+    udp_set_mempolicy(MPOL_PREFERRED, &start.numa_nodes);
+    return start.func(start.arg);
+}
+
+int udp_thread_start(pthread_t *o_thread, void *(*func)(void *), void *arg, udp_thread_params_t const *params, int cpu_index, unsigned long numa_nodes) {
+    if ((!params || (!params->cpu_count && !params->fifo_priority)) && !numa_nodes) {
+        return pthread_create(o_thread, NULL, func, arg);
+    }
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    int err = 0;
+    if (params && params->cpu_count > 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int i = 0; i != params->cpu_count; ++i) {
+            if (cpu_index < 0 || i == cpu_index % params->cpu_count) {
+                if (params->cpus[i] < 0 || params->cpus[i] >= CPU_SETSIZE) {
+                    err = EINVAL;
+                    break;
+                }
+                CPU_SET(params->cpus[i], &cpus);
+            }
+        }
+        if (!err) {
+            err = pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+        }
+    }
+    if (!err && params && params->fifo_priority) {
+        sched_param sp;
+        memset(&sp, 0, sizeof(sp));
+        sp.sched_priority = params->fifo_priority;
+        err = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        if (!err) {
+            err = pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        }
+        if (!err) {
+            err = pthread_attr_setschedparam(&attr, &sp);
+        }
+    }
+    if (!err && numa_nodes) {
+        udp_thread_start_t *start = (udp_thread_start_t *)malloc(sizeof(udp_thread_start_t));
+        if (!start) {
+            err = ENOMEM;
+        } else {
+            start->func = func;
+            start->arg = arg;
+            start->numa_nodes = numa_nodes;
+            err = pthread_create(o_thread, &attr, udp_thread_func, start);
+            if (err) {
+                free(start);
+            }
+        }
+    } else if (!err) {
+        err = pthread_create(o_thread, &attr, func, arg);
+    }
+    pthread_attr_destroy(&attr);
+    return err;
+}
@@ -0,0 +1,43 @@
+#if !defined(onyxudp_thread_h)
+#define onyxudp_thread_h
+
+/* Internal support for udp_thread_params_t and the numa_nodes parameters.
+ *
+ * CPU sets and the scheduling policy are pthread attributes, so a thread is placed
+ * before it runs any code. The NUMA memory policy is per thread and can only be set
+ * from inside, so the thread sets it first thing. Policies are set with the system
+ * calls, so there is no libnuma to link with; without NUMA support in the kernel,
+ * asking for nodes is an error, and asking for none costs nothing.
+ */
+
+#include <pthread.h>
+
+#include "udpbase.h"
+
+/* Start a thread running func(arg), placed as params says (NULL for anywhere), and
+ * preferring numa_nodes (a bit per node, 0 for none) for the memory it allocates.
+ * @param cpu_index -1 to let the thread run on all of params->cpus, or which one of
+ * them (modulo cpu_count) it gets to itself.
+ * @return 0, or the errno from pthread_create(): EPERM if the priority isn't allowed,
+ * EINVAL if the CPUs or the priority are no good.
+ */
+int udp_thread_start(pthread_t *o_thread, void *(*func)(void *), void *arg, udp_thread_params_t const *params, int cpu_index, unsigned long numa_nodes);
+
+/* The memory policy of the calling thread, to put back later. */
+typedef struct udp_numa_saved_t {
+    int mode;
+    unsigned long nodes;
+} udp_numa_saved_t;
+
+/* Make the calling thread prefer numa_nodes for new memory, saving the old policy.
+ * @return 0, or -1 if the kernel can't.
+ */
+int udp_numa_prefer(unsigned long numa_nodes, udp_numa_saved_t *o_saved);
+void udp_numa_restore(udp_numa_saved_t const *saved);
+
+/* Prefer numa_nodes for the pages of a mapping, whoever touches them first.
+ * @return 0, or -1 if the kernel can't.
+ */
+int udp_numa_bind(void *addr, size_t size, unsigned long numa_nodes);
+
+#endif  //  onyxudp_thread_h
@@ -0,0 +1,49 @@
+#include "timing.h"
+#include "types.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+
+void udp_timing_enqueued(histogram_t const *timing, udp_payload_t *payload) {
+    if (timing) {
+        ((udp_payload_owner_t *)(payload + 1))->enqueue_time = udp_timing_clock();
+    }
+}
+
+void udp_timing_sent(histogram_t *timing, udp_payload_t *payload) {
+    uint64_t queued = ((udp_payload_owner_t *)(payload + 1))->enqueue_time;
+    if (timing && queued) {
+        histogram_record(&timing[UDP_TIMING_QUEUE], udp_timing_clock() - queued);
+    }
+}
+
+UDPERR udp_timing_set(histogram_t **timing, int enable) {
+    if (!enable) {
+        free(*timing);
+        *timing = NULL;
+        return UDP_OK;
+    }
+    if (*timing) {
+        return UDP_OK;
+    }
+    *timing = (histogram_t *)malloc(sizeof(histogram_t) * UDP_TIMING_COUNT);
+    if (!*timing) {
+        return UDPERR_OUT_OF_MEMORY;
+    }
+    for (int i = 0; i != UDP_TIMING_COUNT; ++i) {
+        histogram_reset(&(*timing)[i]);
+    }
+    return UDP_OK;
+}
+
+UDPERR udp_timing_read(histogram_t *timing, UDPTIMING which, histogram_t *o_hist, int reset) {
+    if (!timing || which < 0 || which >= UDP_TIMING_COUNT) {
+        return UDPERR_INVALID_ARGUMENT;
+    }
+    memcpy(o_hist, &timing[which], sizeof(histogram_t));
+    if (reset) {
+        histogram_reset(&timing[which]);
+    }
+    return UDP_OK;
+}
@@ -0,0 +1,42 @@
+#if !defined(onyxudp_timing_h)
+#define onyxudp_timing_h
+
+/* Internal support for udp_timing_enable() and udp_client_timing_enable().
+ *
+ * The histograms are NULL until timing is turned on, and every measurement
+ * checks that first, so timing costs a predictable branch when off, and two
+ * reads of the clock (through the vDSO, no system call) when on.
+ */
+
+#include <stdint.h>
+#include <time.h>
+#include <onyxutil/histogram.h>
+
+#include "udpbase.h"
+
+static inline uint64_t udp_timing_clock() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t udp_timing_start(histogram_t const *timing) {
+    return timing ? udp_timing_clock() : 0;
+}
+
+static inline void udp_timing_end(histogram_t *timing, UDPTIMING which, uint64_t start) {
+    if (timing) {
+        histogram_record(&timing[which], udp_timing_clock() - start);
+    }
+}
+
+/* Remember when a payload was queued, for UDP_TIMING_QUEUE. */
+void udp_timing_enqueued(histogram_t const *timing, udp_payload_t *payload);
+/* Record the time since the payload was queued, if it was. */
+void udp_timing_sent(histogram_t *timing, udp_payload_t *payload);
+
+/* Allocate (enable) or free (disable) a set of UDP_TIMING_COUNT histograms. */
+UDPERR udp_timing_set(histogram_t **timing, int enable);
+UDPERR udp_timing_read(histogram_t *timing, UDPTIMING which, histogram_t *o_hist, int reset);
+
+#endif  //  onyxudp_timing_h
@@ -5,6 +5,20 @@
 #include <pthread.h>
 #include <onyxutil/hashtable.h>
 #include <onyxutil/vector.h>
+#include <onyxutil/compress.h>
+
+#include "congestion.h"
+#include "snapshot.h"
+#include "channel.h"
+#include "spatial.h"
+#include "replication.h"
+#include "impair.h"
+#include "capture.h"
+#include "filter.h"
+#include "crypto.h"
+#include "worker.h"
+#include "arena.h"
+#include "socket.h"
 
 #if defined(__cplusplus)
 extern "C" {
@@ -20,13 +34,81 @@ typedef struct udp_client_params_t udp_client_params_t;
 
 /* internal types used by the library */
 
+/* A compression dictionary, and the id that packets compressed with it carry. */
+typedef struct udp_compression_t {
+    compress_dict_t dict;
+    /* crc32 of the dictionary data; never 0 */
+    uint32_t id;
+} udp_compression_t;
+
 struct udp_instance_t {
     udp_params_t *params;
     udp_group_t *groups;
-    int socket;
+    /* the socket, unless params->transport; socket is -1 then */
+    udp_socket_transport_t sock;
+    /* &sock.transport or params->transport */
+    udp_transport_t *transport;
     int running;
     pthread_t thread;
     hash_table_t peers;
+    /* udp_peer_t pointers, by the slot bits of their connection id; NULL if free */
+    vector_t peer_slots;
+    /* uint32_t indices of the free entries in peer_slots */
+    vector_t free_peer_slots;
+    /* connection ids handed out; hashed with cookie_key for the random bits of the next */
+    uint32_t connection_ids;
+    /* siphash24() key for connect cookies and connection ids, random per instance */
+    unsigned char cookie_key[16];
+    /* a copy of params->private_key, if encrypted */
+    unsigned char private_key[UDP_KEY_SIZE];
+    bool encrypted;
+    /* UDP_RECV_BATCH datagrams worth of buffer in, one out */
+    unsigned char *recv_buffer;
+    unsigned char *send_buffer;
+    size_t buffer_size;
+    /* scratch space for encoding snapshots, allocated on first use */
+    unsigned char *snapshot_buffer;
+    uint16_t next_snapshot_stream;
+    /* scratch space for decompressing packets, allocated on first use */
+    unsigned char *decompress_buffer;
+    /* scratch space for decrypting packets, allocated on first use */
+    unsigned char *decrypt_buffer;
+    udp_channel_config_t channels[UDP_MAX_CHANNELS];
+    /* written by the polling thread only, see stats.h */
+    udp_stats_t stats;
+    /* UDP_TIMING_COUNT histograms, NULL unless timing is on */
+    histogram_t *timing;
+    /* the simulated network to send through, NULL unless params->impairment */
+    udp_impair_t *impair;
+    /* where received datagrams are recorded, NULL unless udp_capture_start() */
+    udp_capture_t *capture;
+    /* the rate limit and blocklist, NULL unless params->rate_limit or udp_blocklist_add() */
+    udp_filter_t *filter;
+    /* the threads that run group callbacks, NULL unless params->worker_threads */
+    udp_workers_t *workers;
+    /* udp_work_t back from the workers, being handled */
+    vector_t work_done;
+    /* callbacks handed to workers and not yet done */
+    size_t work_pending;
+    /* the payload slots to receive into, NULL unless params->receive_arena */
+    udp_arena_t *arena;
+    /* slots taken from the arena for the next receive; NULL where none was free */
+    udp_payload_t *recv_slots[UDP_RECV_BATCH];
+    /* set while work_done is being handled, which callbacks can get back into */
+    bool work_collecting;
+    /* groups with on_peer_messages() that have a batch waiting; NULL if destroyed since */
+    vector_t batch_groups;
+    /* an empty udp_peer_message_t vector to swap with a group's batch while delivering it */
+    vector_t batch_scratch;
+    bool batch_delivering;
+    /* a copy of params->busy_poll with the defaults filled in, if busy_polling */
+    udp_busy_poll_t busy_poll;
+    bool busy_polling;
+    /* udp_timing_clock() when udp_run() last woke up, until the first callback; else 0 */
+    uint64_t woken;
+    /* udp_timestamp() at the start of udp_poll(), for calls from callbacks, while polling */
+    uint64_t now;
+    bool polling;
 };
 
 struct udp_group_t {
@@ -34,17 +116,44 @@ struct udp_group_t {
     udp_group_params_t *params;
     udp_group_t *next;
     vector_t peers;
+    uint16_t snapshot_stream;
+    uint32_t snapshot_sequence;
+    /* allocated on the first snapshot */
+    udp_snapshot_history_t *snapshots;
+    /* NULL unless compression is on for the group */
+    udp_compression_t *compression;
+    /* NULL unless udp_group_spatial_init() was called */
+    udp_spatial_t *spatial;
+    /* NULL unless udp_group_replication_init() was called */
+    udp_replication_t *replication;
+    /* which of instance->workers runs the callbacks, if there are workers */
+    int worker;
+    /* udp_peer_message_t for on_peer_messages(), each holding the payload and peer->busy */
+    vector_t batch;
 };
 
 struct udp_peer_t {
+    /* must be first, the peers hash table keys on it */
+    udp_conn_addr_t addr;
     udp_addr_t address;
+    /* 0 if the instance ran out of slots; the peer is found by address only then */
+    uint32_t connection_id;
     uint64_t last_receive_timestamp;
     uint64_t last_send_timestamp;
     /* Used to be able to down-version communications with the peer */
     uint16_t remote_app_version;
+    /* set while callbacks for this peer are running; destruction is deferred */
+    uint32_t busy;
+    uint16_t destroy_pending;
     udp_instance_t *instance;
     vector_t out_queue;
     vector_t groups;
+    udp_congestion_t congestion;
+    /* udp_snapshot_ack_t, one per snapshot stream the peer has acknowledged */
+    vector_t snapshot_acks;
+    udp_channels_t channels;
+    /* the session keys, NULL unless the instance is encrypted */
+    udp_crypto_t *crypto;
 };
 
 enum UDPCONNECTIONSTATE {
@@ -57,29 +166,118 @@ enum UDPCONNECTIONSTATE {
 
 struct udp_client_t {
     udp_client_params_t *params;
-    int socket;
+    /* the socket, unless params->transport; socket is -1 then */
+    udp_socket_transport_t sock;
+    /* &sock.transport or params->transport */
+    udp_transport_t *transport;
     int running;
     UDPCONNECTIONSTATE state;
     pthread_t thread;
     hash_table_t connections;
+    /* UDP_RECV_BATCH datagrams worth of buffer in, one out */
+    unsigned char *recv_buffer;
+    unsigned char *send_buffer;
+    size_t buffer_size;
+    /* scratch space for decoding snapshots, allocated on first use */
+    unsigned char *snapshot_buffer;
+    /* scratch space for decompressing packets, allocated on first use */
+    unsigned char *decompress_buffer;
+    /* scratch space for decrypting packets, allocated on first use */
+    unsigned char *decrypt_buffer;
+    /* a copy of params->server_public_key, if encrypted */
+    unsigned char server_public_key[UDP_KEY_SIZE];
+    bool encrypted;
+    udp_channel_config_t channels[UDP_MAX_CHANNELS];
+    /* written by the polling thread only, see stats.h */
+    udp_stats_t stats;
+    /* UDP_TIMING_COUNT histograms, NULL unless timing is on */
+    histogram_t *timing;
+    /* the simulated network to send through, NULL unless params->impairment */
+    udp_impair_t *impair;
+    /* addresses of connections with a batch waiting for on_payloads() */
+    vector_t batch_conns;
+    /* an empty udp_payload_t * vector to swap with a connection's batch while delivering it */
+    vector_t batch_scratch;
+    /* udp_timestamp() at the start of udp_client_poll(), for calls from callbacks, while polling */
+    uint64_t now;
+    bool polling;
 };
 
 struct udp_client_connection_t {
+    /* must be first, the connections hash table keys on it */
     udp_conn_addr_t addr;
     udp_client_t *client;
+    /* from the server, 0 until it has told us */
+    uint32_t connection_id;
     udp_payload_t *conn_payload;
     vector_t outgoing;
     uint64_t last_transmit;
     uint64_t last_receive;
     size_t ntransmit;
     UDPCONNECTIONSTATE state;
+    udp_congestion_t congestion;
+    /* udp_client_snapshot_stream_t pointers */
+    vector_t snapshot_streams;
+    /* NULL unless compression is on for the connection */
+    udp_compression_t *compression;
+    udp_channels_t channels;
+    /* the handshake, then the session keys; NULL unless the client is encrypted */
+    udp_crypto_t *crypto;
+    /* held udp_payload_t pointers for on_payloads() */
+    vector_t batch;
 };
 
 struct udp_payload_owner_t {
     udp_params_t            *server;
     udp_client_params_t     *client;
+    /* UDP_DATA_FLAG_ bits to send with the payload, for library-generated payloads */
+    uint16_t                flags;
+    /* udp_timing_clock() when queued, if timing is on */
+    uint64_t                enqueue_time;
+    /* the arena the payload is a slot of, or NULL if it was malloc()ed */
+    udp_arena_t             *arena;
+    /* udp_datagram_t::timestamp of the datagram it came in, for udp_payload_received_at() */
+    uint64_t                received;
+    /* the channel it came in on, for udp_payload_channel() */
+    uint8_t                 channel;
+};
+
+/* A payload for channel acknowledgements. They go out as soon as they are made and
+ * are never queued or held, so this lives on the stack of whoever sends them.
+ */
+struct udp_channel_acks_t {
+    udp_payload_t           payload;
+    udp_payload_owner_t     owner;
+    unsigned char           data[UDP_MAX_CHANNELS * UDP_CHANNEL_ACK_SIZE];
 };
 
+/* internal functions shared between the library files */
+
+/* Put as many of the pending acknowledgements of ch in acks as fit in max_payload_size.
+ * @return the payload to send.
+ */
+udp_payload_t *udp_channel_acks_get(udp_channel_acks_t *acks, udp_channels_t *ch, size_t max_payload_size);
+
+udp_payload_t *udp_payload_new(size_t size, udp_params_t *server, udp_client_params_t *client);
+
+/* Turn compression on or off in *slot. */
+UDPERR udp_compression_set(udp_compression_t **slot, int enable, void const *dictionary, size_t size);
+/* Compress a payload into out, which has room for payload->size bytes: the id of the
+ * dictionary, then the compressed data.
+ * @return the compressed size, or 0 if compressing doesn't make the payload smaller.
+ */
+size_t udp_compress_payload(udp_compression_t const *compression, udp_payload_t const *payload, unsigned char *out);
+/* @return the id of the dictionary a UDP_DATA_FLAG_COMPRESSED packet was compressed
+ * with, or 0 if it's too short to say.
+ */
+uint32_t udp_compression_id(unsigned char const *buf, size_t size, size_t header_size);
+/* Decompress a UDP_DATA_FLAG_COMPRESSED packet into *io_scratch (allocated on first
+ * use), headers (header_size bytes, which aren't compressed) and all, and point *io_buf
+ * at it.
+ * @return the size of the decompressed packet, or 0 if it's malformed or too big.
+ */
+size_t udp_decompress_packet(udp_compression_t const *compression, unsigned char const **io_buf, size_t size, size_t header_size, unsigned char **io_scratch, size_t max_payload_size);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -1,6 +1,11 @@
 #include "udpbase.h"
 #include "protocol.h"
 #include "types.h"
+#include "socket.h"
+#include "congestion.h"
+#include "stats.h"
+#include "timing.h"
+#include "thread.h"
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -11,22 +16,67 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <assert.h>
+#include <sched.h>
 
 #include <onyxutil/hashtable.h>
 #include <onyxutil/vector.h>
+#include <onyxutil/crc.h>
+#include <onyxutil/siphash.h>
 
 
-udp_instance_t *udp_initialize(udp_params_t *params) {
-    if (!params->max_payload_size) {
-        params->max_payload_size = UDP_DEFAULT_MAX_PAYLOAD_SIZE;
-    }
-    if (params->max_payload_size < UDP_MIN_PAYLOAD_SIZE) {
-        params->on_error(params, UDPERR_INVALID_ARGUMENT, "udp_initialize(): min_payload_size too small");
-        return NULL;
+//  Don't starve the timers and the send side when flooded. Each poll also sweeps all
+//  the peers, so it may receive as many datagrams as there are peers, to keep the sweep
+//  from costing more per datagram as the crowd grows.
+#define POLL_MAX_RECEIVE 64
+//  Same intervals as the client uses for its side of the connection
+#define PEER_IDLE_INTERVAL 600000
+#define PEER_TIMEOUT_INTERVAL 5000000
+//  Connect cookies are good for between one and two of these
+#define COOKIE_INTERVAL 10000000
+//  Defaults for udp_busy_poll_t
+#define BUSY_POLL_SOCKET_US 50
+#define BUSY_POLL_PAUSE_AFTER_US 50
+#define BUSY_POLL_YIELD_AFTER_US 1000
+#define BUSY_POLL_WAIT_AFTER_US 100000
+
+static uint64_t timestamp_epoch;
+
+uint64_t udp_timestamp() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t t = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    uint64_t epoch = __atomic_load_n(&timestamp_epoch, __ATOMIC_RELAXED);
+    //  instances and clients on different threads may get here first at once
+    if (!epoch && __atomic_compare_exchange_n(&timestamp_epoch, &epoch, t, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        epoch = t;
     }
-    if (!params->port) {
-        params->port = 4812;
+    return t - epoch;
+}
+
+/* The time of the poll in progress, if any; else what the clock says. */
+static uint64_t udp_instance_now(udp_instance_t *instance) {
+    return instance->polling ? instance->now : udp_clock_read(instance->params->clock, instance->params->clock_context);
+}
+
+/* Pick a cookie key nobody outside can guess. */
+static void udp_cookie_key_init(udp_instance_t *instance) {
+    if (!udp_crypto_random(instance->cookie_key, sizeof(instance->cookie_key))) {
+        return;
     }
+    //  Not much of a secret, but still different per process and instance
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t mix[2] = { (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec, (uint64_t)(uintptr_t)instance ^ (uint64_t)getpid() };
+    memcpy(instance->cookie_key, mix, sizeof(instance->cookie_key));
+}
+
+/* Open the listening socket described by params, calling on_error on failure.
+ * @return the socket, or -1.
+ */
+static int udp_instance_socket_open(udp_params_t *params, int *o_family) {
     char port[16];
     sprintf(port, "%d", params->port);
     addrinfo hints;
@@ -37,64 +87,460 @@ udp_instance_t *udp_initialize(udp_params_t *params) {
     int gaierr = getaddrinfo(params->interface, port, &hints, &ai);
     if (gaierr != 0) {
         params->on_error(params, UDPERR_ADDRESS_ERROR, "udp_initialize(): getaddrinfo() failed");
+        return -1;
+    }
+    int sock = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sock < 0) {
+        freeaddrinfo(ai);
+        params->on_error(params, UDPERR_SOCKET_ERROR, "udp_initialize(): socket() failed");
+        return -1;
+    }
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0) {
+        freeaddrinfo(ai);
+        close(sock);
+        params->on_error(params, UDPERR_IO_ERROR, "udp_initialize(): fcntl() failed");
+        return -1;
+    }
+    if (bind(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+        freeaddrinfo(ai);
+        close(sock);
+        params->on_error(params, UDPERR_SOCKET_ERROR, "udp_initialize(): bind() failed");
+        return -1;
+    }
+    *o_family = ai->ai_family;
+    freeaddrinfo(ai);
+    //  Not fatal; congestion control falls back to delay only.
+    udp_socket_enable_ecn(sock, *o_family);
+    if (params->busy_poll) {
+        //  Not fatal either; udp_run() still spins.
+        udp_socket_busy_poll(sock, params->busy_poll->socket_us ? params->busy_poll->socket_us : BUSY_POLL_SOCKET_US);
+    }
+    if (params->receive_timestamps) {
+        udp_socket_enable_timestamps(sock);
+    }
+    return sock;
+}
+
+/* Runs on a worker thread; see worker.h. */
+static void udp_work_run(void *context, udp_work_t const *work) {
+    udp_group_t *group = work->group;
+    if (work->kind == UDP_WORK_MESSAGE) {
+        group->params->on_peer_message(group->params, work->peer, work->payload);
+    } else if (work->kind == UDP_WORK_MESSAGES) {
+        group->params->on_peer_messages(group->params, work->messages, work->count);
+    } else if (work->kind == UDP_WORK_REMOVED) {
+        group->params->on_peer_removed(group->params, work->peer, (UDPPEER)work->reason);
+    }
+}
+
+/* Free whatever udp_instance_create() got to before it ran out of memory, and say so. */
+static udp_instance_t *udp_instance_create_failed(udp_instance_t *udp, char const *text) {
+    udp_params_t *params = udp->params;
+    udp_arena_destroy(udp->arena);
+    udp_workers_destroy(udp->workers);
+    udp_filter_destroy(udp->filter);
+    if (udp->impair) {
+        udp_impair_destroy(udp->impair);
+    }
+    if (udp->sock.socket >= 0) {
+        close(udp->sock.socket);
+    }
+    hash_table_deinit(&udp->peers);
+    vector_deinit(&udp->peer_slots);
+    vector_deinit(&udp->free_peer_slots);
+    vector_deinit(&udp->work_done);
+    vector_deinit(&udp->batch_groups);
+    vector_deinit(&udp->batch_scratch);
+    free(udp->recv_buffer);
+    free(udp->send_buffer);
+    free(udp);
+    params->on_error(params, UDPERR_OUT_OF_MEMORY, text);
+    return NULL;
+}
+
+static udp_instance_t *udp_instance_create(udp_params_t *params) {
+    if (!params->max_payload_size) {
+        params->max_payload_size = UDP_DEFAULT_MAX_PAYLOAD_SIZE;
+    }
+    if (params->max_payload_size < UDP_MIN_PAYLOAD_SIZE) {
+        params->on_error(params, UDPERR_INVALID_ARGUMENT, "udp_initialize(): min_payload_size too small");
+        return NULL;
+    }
+    if (!params->port) {
+        params->port = 4812;
+    }
+    udp_timestamp();
+    int family = 0;
+    int sock = -1;
+    if (!params->transport && (sock = udp_instance_socket_open(params, &family)) < 0) {
         return NULL;
     }
 
     udp_instance_t *udp = (udp_instance_t *)malloc(sizeof(udp_instance_t));
     if (!udp) {
-        freeaddrinfo(ai);
+        if (sock >= 0) {
+            close(sock);
+        }
         params->on_error(params, UDPERR_OUT_OF_MEMORY, "udp_initialize(): malloc() failed");
         return NULL;
     }
     memset(udp, 0, sizeof(udp_instance_t));
 
     udp->params = params;
-    udp->socket = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-    if (udp->socket < 0) {
-        freeaddrinfo(ai);
-        free(udp);
-        params->on_error(params, UDPERR_SOCKET_ERROR, "udp_initialize(): socket() failed");
-        return NULL;
+    udp_socket_transport_init(&udp->sock, sock, family, params->clock, params->clock_context);
+    udp->transport = params->transport ? params->transport : &udp->sock.transport;
+    if (!hash_table_init(&udp->peers, sizeof(udp_peer_t), HASHTABLE_POINTERS, connection_hash, connection_comp)) {
+        return udp_instance_create_failed(udp, "udp_initialize(): hash_table_init() failed");
     }
-    if (fcntl(udp->socket, F_SETFL, fcntl(udp->socket, F_GETFL) | O_NONBLOCK) < 0) {
-        freeaddrinfo(ai);
-        free(udp);
-        params->on_error(params, UDPERR_IO_ERROR, "udp_initialize(): fcntl() failed");
-        return NULL;
+    if (vector_init(&udp->peer_slots, sizeof(udp_peer_t *)) < 0 ||
+            vector_init(&udp->free_peer_slots, sizeof(uint32_t)) < 0 ||
+            vector_init(&udp->work_done, sizeof(udp_work_t)) < 0 ||
+            vector_init(&udp->batch_groups, sizeof(udp_group_t *)) < 0 ||
+            vector_init(&udp->batch_scratch, sizeof(udp_peer_message_t)) < 0) {
+        return udp_instance_create_failed(udp, "udp_initialize(): vector_init() failed");
     }
-    if (bind(udp->socket, ai->ai_addr, ai->ai_addrlen) < 0) {
-        freeaddrinfo(ai);
-        free(udp);
-        params->on_error(params, UDPERR_SOCKET_ERROR, "udp_initialize(): bind() failed");
-        return NULL;
+    //  room for a handshake, which is the biggest there is when encrypted
+    udp->buffer_size = sizeof(data_header) + sizeof(channel_header) + params->max_payload_size + UDP_CRYPTO_HELLO_SIZE;
+    udp->recv_buffer = (unsigned char *)malloc(udp->buffer_size * UDP_RECV_BATCH);
+    udp->send_buffer = (unsigned char *)malloc(udp->buffer_size);
+    if (!udp->recv_buffer || !udp->send_buffer) {
+        return udp_instance_create_failed(udp, "udp_initialize(): malloc() failed");
     }
+    udp_cookie_key_init(udp);
+    if (params->private_key) {
+        memcpy(udp->private_key, params->private_key, UDP_KEY_SIZE);
+        udp->encrypted = true;
+    }
+    udp_channel_config_init(udp->channels);
+    if (params->busy_poll) {
+        udp_busy_poll_t const *bp = params->busy_poll;
+        udp->busy_poll.socket_us = bp->socket_us ? bp->socket_us : BUSY_POLL_SOCKET_US;
+        udp->busy_poll.pause_after_us = bp->pause_after_us ? bp->pause_after_us : BUSY_POLL_PAUSE_AFTER_US;
+        udp->busy_poll.yield_after_us = bp->yield_after_us ? bp->yield_after_us : BUSY_POLL_YIELD_AFTER_US;
+        udp->busy_poll.wait_after_us = bp->wait_after_us ? bp->wait_after_us : BUSY_POLL_WAIT_AFTER_US;
+        udp->busy_polling = true;
+    }
+    if (params->impairment && !(udp->impair = udp_impair_create(params->impairment))) {
+        return udp_instance_create_failed(udp, "udp_initialize(): udp_impair_create() failed");
+    }
+    if (params->rate_limit && !(udp->filter = udp_filter_create(params->rate_limit, udp->cookie_key))) {
+        return udp_instance_create_failed(udp, "udp_initialize(): udp_filter_create() failed");
+    }
+    if (params->worker_threads > 0 && !(udp->workers = udp_workers_create(params->worker_threads, udp_work_run, udp, params->worker_thread, params->numa_nodes))) {
+        return udp_instance_create_failed(udp, "udp_initialize(): udp_workers_create() failed");
+    }
+    if (params->receive_arena && !(udp->arena = udp_arena_create(params->receive_arena, udp->buffer_size, params->receive_arena_huge_pages, params->numa_nodes, params))) {
+        return udp_instance_create_failed(udp, "udp_initialize(): udp_arena_create() failed");
+    }
+    return udp;
+}
 
-    freeaddrinfo(ai);
+udp_instance_t *udp_initialize(udp_params_t *params) {
+    if (!params->numa_nodes) {
+        return udp_instance_create(params);
+    }
+    //  everything allocated from here on is the instance's, so put it on its nodes
+    udp_numa_saved_t saved;
+    if (udp_numa_prefer(params->numa_nodes, &saved) < 0) {
+        params->on_error(params, UDPERR_INVALID_ARGUMENT, "udp_initialize(): set_mempolicy() failed");
+        return NULL;
+    }
+    udp_instance_t *udp = udp_instance_create(params);
+    udp_numa_restore(&saved);
     return udp;
 }
 
+static void udp_peer_free(udp_peer_t *peer) {
+    for (size_t i = 0, n = peer->out_queue.item_count; i != n; ++i) {
+        udp_payload_t *payload = *(udp_payload_t **)vector_item_get(&peer->out_queue, i);
+        udp_payload_release(payload);
+    }
+    vector_deinit(&peer->out_queue);
+    vector_deinit(&peer->groups);
+    vector_deinit(&peer->snapshot_acks);
+    udp_channels_deinit(&peer->channels);
+    udp_crypto_destroy(peer->crypto);
+    memset(peer, 0xff, sizeof(*peer));
+    free(peer);
+}
+
+/* Let go of the payloads and peers held for on_peer_messages(). */
+static void udp_peer_messages_release(udp_peer_message_t const *messages, size_t count) {
+    for (size_t i = 0; i != count; ++i) {
+        udp_peer_t *peer = messages[i].peer;
+        udp_payload_release(messages[i].payload);
+        peer->busy--;
+        if (!peer->busy && peer->destroy_pending) {
+            udp_peer_free(peer);
+        }
+    }
+}
+
+/* The first callback since udp_run() woke up: count how long that took. */
+static void udp_run_woken(udp_instance_t *instance) {
+    if (instance->woken) {
+        uint64_t ns = udp_timing_clock() - instance->woken;
+        instance->woken = 0;
+        udp_stat_add(&instance->stats.wakeups, 1);
+        udp_stat_add(&instance->stats.wake_latency_ns, ns);
+        if (instance->timing) {
+            histogram_record(&instance->timing[UDP_TIMING_WAKE], ns);
+        }
+    }
+}
+
+/* Hand a callback for the peer to the group's worker. The peer and payload are held
+ * until it's done.
+ */
+static void udp_work_post(udp_group_t *group, udp_peer_t *peer, UDPWORK kind, uint16_t reason, udp_payload_t *payload) {
+    udp_instance_t *instance = group->instance;
+    udp_work_t work = { (uint8_t)kind, 0, reason, group, peer, payload };
+    if (payload) {
+        udp_payload_hold(payload);
+    }
+    udp_run_woken(instance);
+    if (udp_workers_post(instance->workers, group->worker, &work) < 0) {
+        if (payload) {
+            udp_payload_release(payload);
+        }
+        instance->params->on_error(instance->params, UDPERR_OUT_OF_MEMORY, "udp_work_post(): udp_workers_post() failed");
+        return;
+    }
+    peer->busy++;
+    instance->work_pending++;
+}
+
+/* If this is a worker thread, pass a call from the application on to the polling
+ * thread, taking over the payload.
+ * @return whether it was passed on; *o_err is its result then.
+ */
+static bool udp_work_defer(udp_instance_t *instance, UDPWORK kind, udp_group_t *group, udp_peer_t *peer, uint8_t channel, udp_payload_t *payload, UDPERR *o_err) {
+    if (!instance->workers) {
+        return false;
+    }
+    udp_work_t work = { (uint8_t)kind, channel, 0, group, peer, payload };
+    int r = udp_workers_defer(&work);
+    if (r == 0) {
+        return false;
+    }
+    *o_err = UDP_OK;
+    if (r < 0) {
+        if (payload) {
+            udp_payload_release(payload);
+        }
+        *o_err = UDPERR_OUT_OF_MEMORY;
+    }
+    return true;
+}
+
+static void udp_work_done(udp_instance_t *instance, udp_work_t const *work) {
+    if (work->messages) {
+        udp_peer_messages_release(work->messages, work->count);
+        free(work->messages);
+        instance->work_pending--;
+        return;
+    }
+    if (work->payload) {
+        udp_payload_release(work->payload);
+    }
+    instance->work_pending--;
+    udp_peer_t *peer = work->peer;
+    peer->busy--;
+    if (!peer->busy && peer->destroy_pending) {
+        udp_peer_free(peer);
+    }
+}
+
+static void udp_work_do(udp_instance_t *instance, udp_work_t const *work) {
+    UDPERR err = UDP_OK;
+    switch (work->kind) {
+    case UDP_WORK_DONE:
+        udp_work_done(instance, work);
+        break;
+    case UDP_WORK_PEER_SEND:
+        if (work->peer->destroy_pending) {
+            //  gone while the worker was at it
+            udp_payload_release(work->payload);
+        } else {
+            err = udp_peer_channel_enqueue(work->peer, work->channel, work->payload);
+        }
+        break;
+    case UDP_WORK_GROUP_SEND:
+        if (!work->group) {
+            //  the group was destroyed, see udp_group_destroy()
+            udp_payload_release(work->payload);
+        } else if (work->channel) {
+            err = udp_group_channel_enqueue(work->group, work->channel, work->payload);
+        } else {
+            err = udp_group_payload_enqueue(work->group, work->payload);
+        }
+        break;
+    case UDP_WORK_PEER_REMOVE:
+        if (work->group && !work->peer->destroy_pending) {
+            //  an error just means it was removed already
+            udp_group_peer_remove(work->group, work->peer);
+        }
+        break;
+    }
+    if (err != UDP_OK) {
+        instance->params->on_error(instance->params, err, "udp_poll(): payload enqueue from a worker failed");
+    }
+}
+
+/* Do what the workers have sent back.
+ * @return how many things that was.
+ */
+static int udp_work_collect(udp_instance_t *instance) {
+    udp_workers_collect(instance->workers, &instance->work_done);
+    if (instance->work_collecting) {
+        //  called from a callback below; the loop there will get to it
+        return 0;
+    }
+    instance->work_collecting = true;
+    size_t i = 0;
+    //  callbacks may add to work_done, so don't hold on to pointers into it
+    for (; i < instance->work_done.item_count; ++i) {
+        udp_work_t work = *(udp_work_t *)vector_item_get(&instance->work_done, i);
+        udp_work_do(instance, &work);
+    }
+    vector_item_remove(&instance->work_done, 0, i);
+    instance->work_collecting = false;
+    return (int)i;
+}
+
+/* Let go of what the workers have sent back, without doing it. */
+static void udp_work_discard(udp_instance_t *instance) {
+    for (size_t i = 0, n = instance->work_done.item_count; i != n; ++i) {
+        udp_work_t *work = (udp_work_t *)vector_item_get(&instance->work_done, i);
+        if (work->kind == UDP_WORK_DONE) {
+            udp_work_done(instance, work);
+        } else if (work->payload) {
+            udp_payload_release(work->payload);
+        }
+    }
+    vector_item_remove(&instance->work_done, 0, instance->work_done.item_count);
+}
+
 void udp_terminate(udp_instance_t *udp) {
     if (!udp) return;
 
-    udp->running = false;
+    __atomic_store_n(&udp->running, 0, __ATOMIC_RELEASE);
     if (udp->thread) {
         void *status = 0;
         pthread_join(udp->thread, &status);
         udp->thread = 0;
     }
 
-    close(udp->socket);
-    udp->socket = -1;
+    if (udp->sock.socket >= 0) {
+        close(udp->sock.socket);
+        udp->sock.socket = -1;
+    }
 
+    if (udp->workers) {
+        //  the workers finish what they have, but what they asked for is dropped
+        udp_workers_stop(udp->workers);
+        udp_workers_collect(udp->workers, &udp->work_done);
+        udp_work_discard(udp);
+        udp_workers_destroy(udp->workers);
+        udp->workers = NULL;
+    }
+    vector_deinit(&udp->work_done);
+    vector_deinit(&udp->batch_groups);
+    vector_deinit(&udp->batch_scratch);
+
+    //  No callbacks at this point; the application is tearing down.
+    hash_iterator_t iter;
+    for (void *peer = hash_table_begin(&udp->peers, &iter); peer; peer = hash_table_next(&iter)) {
+        udp_peer_free((udp_peer_t *)peer);
+    }
+    hash_table_deinit(&udp->peers);
+    vector_deinit(&udp->peer_slots);
+    vector_deinit(&udp->free_peer_slots);
+    while (udp->groups) {
+        udp_group_t *group = udp->groups;
+        udp->groups = group->next;
+        for (size_t i = 0, n = group->batch.item_count; i != n; ++i) {
+            //  the peers are gone already
+            udp_payload_release(((udp_peer_message_t *)vector_item_get(&group->batch, i))->payload);
+        }
+        vector_deinit(&group->batch);
+        vector_deinit(&group->peers);
+        udp_group_snapshots_free(group);
+        udp_compression_set(&group->compression, 0, NULL, 0);
+        udp_spatial_destroy(group->spatial);
+        udp_group_replication_free(group);
+        free(group);
+    }
+
+    free(udp->recv_buffer);
+    free(udp->send_buffer);
+    free(udp->snapshot_buffer);
+    free(udp->decompress_buffer);
+    free(udp->decrypt_buffer);
+    free(udp->timing);
+    if (udp->impair) {
+        udp_impair_destroy(udp->impair);
+    }
+    udp_capture_stop(udp);
+    udp_filter_destroy(udp->filter);
+    for (int i = 0; i != UDP_RECV_BATCH; ++i) {
+        if (udp->recv_slots[i]) {
+            udp_payload_release(udp->recv_slots[i]);
+        }
+    }
+    //  payloads the application still holds keep it around
+    udp_arena_destroy(udp->arena);
+    memset(udp->private_key, 0, sizeof(udp->private_key));
     free(udp);
 }
 
+static inline void udp_cpu_pause() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/* Nothing to do for idle_ns so far; spin, pause, yield or wait, as busy_poll says. */
+static void udp_run_idle(udp_instance_t *instance, uint64_t idle_ns) {
+    if (instance->busy_polling) {
+        udp_busy_poll_t const *bp = &instance->busy_poll;
+        if (idle_ns < (uint64_t)bp->pause_after_us * 1000) {
+            return;
+        }
+        if (idle_ns < (uint64_t)bp->yield_after_us * 1000) {
+            //  let a hyperthread sibling have the core for a little while
+            for (int i = 0; i != 16; ++i) {
+                udp_cpu_pause();
+            }
+            return;
+        }
+        if (idle_ns < (uint64_t)bp->wait_after_us * 1000) {
+            sched_yield();
+            return;
+        }
+    }
+    //  workers may have something to send soon, which no datagram will wake us for
+    instance->transport->wait(instance->transport, instance->work_pending ? 100 : 1000);
+}
+
 static void *udp_run_func(void *iptr) {
     udp_instance_t *instance = (udp_instance_t *)iptr;
-    while (instance->running) {
+    uint64_t idle_since = 0;
+    while (__atomic_load_n(&instance->running, __ATOMIC_ACQUIRE)) {
+        uint64_t now = udp_timing_clock();
+        //  coming back from having nothing to do, this poll may be the wake-up
+        instance->woken = idle_since ? now : 0;
         int n = udp_poll(instance);
-        if ((n == 0) && instance->running) {
-            usleep(1000);
+        instance->woken = 0;
+        if (n != 0) {
+            idle_since = 0;
+        } else if (__atomic_load_n(&instance->running, __ATOMIC_ACQUIRE)) {
+            if (!idle_since) {
+                idle_since = now;
+            }
+            udp_run_idle(instance, now - idle_since);
         }
     }
     return NULL;
@@ -105,62 +551,155 @@ UDPERR udp_run(udp_instance_t *instance) {
         return UDPERR_INVALID_ARGUMENT;
     }
     instance->running = true;
-    int i = pthread_create(&instance->thread, NULL, udp_run_func, instance);
+    int i = udp_thread_start(&instance->thread, udp_run_func, instance, instance->params->run_thread, -1, instance->params->numa_nodes);
     if (i != 0) {
         instance->running = false;
         instance->thread = 0;
-        return UDPERR_IO_ERROR;
+        return (i == EINVAL || i == EPERM) ? UDPERR_INVALID_ARGUMENT : UDPERR_IO_ERROR;
     }
     return UDP_OK;
 }
 
 
-int udp_poll(udp_instance_t *instance) {
-    /* TODO: implement me */
-    return 0;
+/* Give the peer a slot, and a connection id naming it. */
+static void udp_peer_slot_assign(udp_instance_t *instance, udp_peer_t *peer) {
+    uint32_t slot;
+    size_t nfree = instance->free_peer_slots.item_count;
+    if (nfree) {
+        slot = *(uint32_t *)vector_item_get(&instance->free_peer_slots, nfree - 1);
+        vector_item_remove(&instance->free_peer_slots, nfree - 1, 1);
+        *(udp_peer_t **)vector_item_get(&instance->peer_slots, slot) = peer;
+    } else {
+        slot = (uint32_t)instance->peer_slots.item_count;
+        if (slot > UDP_CONNECTION_SLOT_MASK || !vector_item_append(&instance->peer_slots, &peer)) {
+            //  found by address only
+            return;
+        }
+    }
+    //  keyed, so the ids handed out so far don't tell what the next one will be
+    uint32_t msg[2] = { slot, instance->connection_ids++ };
+    uint32_t random = (uint32_t)siphash24(instance->cookie_key, msg, sizeof(msg)) & ~(uint32_t)UDP_CONNECTION_SLOT_MASK;
+    //  never 0, which means "none"
+    peer->connection_id = (random ? random : (uint32_t)1 << UDP_CONNECTION_SLOT_BITS) | slot;
 }
 
-udp_group_t *udp_group_create(udp_instance_t *instance, udp_group_params_t *params) {
-    udp_group_t *ret = (udp_group_t *)malloc(sizeof(udp_group_t));
-    memset(ret, 0, sizeof(*ret));
-    if (vector_init(&ret->peers, sizeof(udp_peer_t *)) < 0) {
-        free(ret);
-        instance->params->on_error(instance->params, UDPERR_OUT_OF_MEMORY, "udp_group_create(): vector_init() failed");
-        return NULL;
+/* Take the peer out of the lookups, so no more packets find it. */
+static void udp_peer_unlink(udp_instance_t *instance, udp_peer_t *peer) {
+    hash_table_remove(&instance->peers, peer);
+    if (peer->connection_id) {
+        uint32_t slot = peer->connection_id & UDP_CONNECTION_SLOT_MASK;
+        *(udp_peer_t **)vector_item_get(&instance->peer_slots, slot) = NULL;
+        //  if this fails, the slot is never used again; no harm done
+        vector_item_append(&instance->free_peer_slots, &slot);
+        peer->connection_id = 0;
     }
-    ret->instance = instance;
-    ret->params = params;
-    ret->next = instance->groups;
-    return ret;
 }
 
-static void udp_peer_destroy(udp_peer_t *peer) {
+/* Find who a packet is from: by connection id if it has one that's live, by address
+ * otherwise (the first packets of a connection, or ids from a server that has since
+ * restarted.)
+ */
+static udp_peer_t *udp_peer_find(udp_instance_t *instance, uint32_t connection_id, udp_conn_addr_t const *from) {
+    uint32_t slot = connection_id & UDP_CONNECTION_SLOT_MASK;
+    if (connection_id && slot < instance->peer_slots.item_count) {
+        udp_peer_t *peer = *(udp_peer_t **)vector_item_get(&instance->peer_slots, slot);
+        if (peer && peer->connection_id == connection_id) {
+            return peer;
+        }
+    }
+    return (udp_peer_t *)hash_table_find(&instance->peers, (void *)from);
+}
+
+/* The peer has shown that it's at a new address (a NAT rebinding, or a client that
+ * changed networks), so send there from now on.
+ * @return false if some other peer has that address already; the packet is dropped then,
+ * and the move happens once that peer has timed out. Also false if there is no memory
+ * for the move; the peer stays where it was then.
+ */
+static bool udp_peer_migrate(udp_instance_t *instance, udp_peer_t *peer, udp_conn_addr_t const *to) {
+    if (hash_table_find(&instance->peers, (void *)to)) {
+        udp_stat_add(&instance->stats.unknown_peer_packets, 1);
+        return false;
+    }
+    //  In at the new address before out at the old one: udp_poll_peers() and
+    //  udp_terminate() only see peers that are in the table.
+    udp_conn_addr_t from = peer->addr;
+    memcpy(&peer->addr, to, sizeof(peer->addr));
+    if (!hash_table_assign(&instance->peers, peer)) {
+        memcpy(&peer->addr, &from, sizeof(peer->addr));
+        instance->params->on_error(instance->params, UDPERR_OUT_OF_MEMORY, "udp_peer_migrate(): hash_table_assign() failed");
+        return false;
+    }
+    //  the old entry is found by the old address, and compared with the peer
+    memcpy(&peer->addr, &from, sizeof(peer->addr));
+    hash_table_remove(&instance->peers, peer);
+    memcpy(&peer->addr, to, sizeof(peer->addr));
+    udp_stat_add(&instance->stats.peer_migrations, 1);
+    return true;
+}
+
+/* The cookie for an address, in the given COOKIE_INTERVAL; never 0. */
+static uint32_t udp_cookie_make(udp_instance_t *instance, udp_conn_addr_t const *addr, uint64_t interval) {
+    unsigned char msg[sizeof(udp_conn_addr_t) + sizeof(interval)];
+    memcpy(msg, addr, sizeof(*addr));
+    memcpy(msg + sizeof(*addr), &interval, sizeof(interval));
+    uint32_t cookie = (uint32_t)siphash24(instance->cookie_key, msg, sizeof(msg));
+    return cookie ? cookie : 1;
+}
+
+/* Whether a would-be peer has sent back a cookie we gave it recently. Injected
+ * datagrams had theirs checked when they were captured, by an instance with another
+ * key, so any cookie will do for them.
+ */
+static bool udp_cookie_accept(udp_instance_t *instance, udp_conn_addr_t const *from, uint32_t cookie, bool injected, uint64_t now) {
+    if (!cookie) {
+        return false;
+    }
+    if (injected) {
+        return true;
+    }
+    uint64_t interval = now / COOKIE_INTERVAL;
+    return cookie == udp_cookie_make(instance, from, interval) ||
+        (interval && cookie == udp_cookie_make(instance, from, interval - 1));
+}
+
+static void udp_peer_destroy(udp_peer_t *peer, UDPPEER reason) {
     assert(peer->groups.item_count == 0);
-    peer->instance->params->on_peer_expired(peer->instance->params, peer, UDPPEER_LAST_GROUP_DESTROYED);
-    for (size_t i = 0, n = peer->out_queue.item_count; i != n; ++i) {
-        udp_payload_t *payload = (udp_payload_t *)vector_item_get(&peer->out_queue, i);
-        udp_payload_release(payload);
+    udp_instance_t *instance = peer->instance;
+    udp_peer_unlink(instance, peer);
+    instance->params->on_peer_expired(instance->params, peer, reason);
+    if (peer->busy) {
+        //  still inside a callback for this peer; the caller frees it
+        peer->destroy_pending = 1;
+        return;
     }
-    vector_deinit(&peer->out_queue);
-    vector_deinit(&peer->groups);
-    free(peer);
+    udp_peer_free(peer);
 }
 
-static UDPERR udp_group_peer_remove_ix(udp_group_t *group, size_t ix) {
+static UDPERR udp_group_peer_remove_ix(udp_group_t *group, size_t ix, UDPPEER reason) {
     assert(ix < group->peers.item_count);
     if (ix >= group->peers.item_count) {
         return UDPERR_INVALID_ARGUMENT;
     }
-    udp_peer_t *peer = (udp_peer_t *)vector_item_get(&group->peers, ix);
+    udp_peer_t *peer = *(udp_peer_t **)vector_item_get(&group->peers, ix);
     vector_item_remove(&group->peers, ix, 1);
-    group->params->on_peer_removed(group->params, peer, UDPPEER_REMOVED_FROM_GROUP);
+    if (group->spatial) {
+        udp_spatial_remove(group->spatial, peer);
+    }
+    udp_group_replication_peer_forget(group, peer);
+    if (group->instance->workers) {
+        udp_work_post(group, peer, UDP_WORK_REMOVED, (uint16_t)reason, NULL);
+    } else {
+        group->params->on_peer_removed(group->params, peer, reason);
+    }
     for (size_t i = 0, n = peer->groups.item_count; i != n; ++i) {
-        udp_group_t *g = (udp_group_t *)vector_item_get(&peer->groups, i);
+        udp_group_t *g = *(udp_group_t **)vector_item_get(&peer->groups, i);
         if (g == group) {
             vector_item_remove(&peer->groups, i, 1);
+            udp_peer_snapshot_ack_forget(peer, group->snapshot_stream);
             if (peer->groups.item_count == 0) {
                 //  last group keeping peer alive
-                udp_peer_destroy(peer);
+                udp_peer_destroy(peer, reason == UDPPEER_REMOVED_FROM_GROUP ? UDPPEER_LAST_GROUP_DESTROYED : reason);
             }
             return UDP_OK;
         }
@@ -169,13 +708,923 @@ static UDPERR udp_group_peer_remove_ix(udp_group_t *group, size_t ix) {
     return UDPERR_INVALID_ARGUMENT;
 }
 
+static UDPERR udp_group_peer_remove_reason(udp_group_t *group, udp_peer_t *peer, UDPPEER reason) {
+    for (size_t i = 0, n = group->peers.item_count; i != n; ++i) {
+        udp_peer_t *gp = *(udp_peer_t **)vector_item_get(&group->peers, i);
+        if (gp == peer) {
+            return udp_group_peer_remove_ix(group, i, reason);
+        }
+    }
+    return UDPERR_INVALID_ARGUMENT;
+}
+
+/* Remove the peer from all its groups, which ends up destroying it. */
+static void udp_peer_remove_all(udp_peer_t *peer, UDPPEER reason) {
+    if (peer->groups.item_count == 0) {
+        udp_peer_destroy(peer, reason);
+        return;
+    }
+    while (true) {
+        size_t n = peer->groups.item_count;
+        udp_group_t *group = *(udp_group_t **)vector_item_get(&peer->groups, n - 1);
+        if (udp_group_peer_remove_reason(group, peer, reason) != UDP_OK || n == 1) {
+            //  n == 1 means the peer is gone now
+            break;
+        }
+    }
+}
+
+/* Send one datagram, through the simulated network if there is one. */
+static int udp_instance_send(udp_instance_t *instance, void const *buf, size_t size, udp_conn_addr_t const *to, uint64_t now) {
+    if (instance->impair) {
+        return udp_impair_send(instance->impair, buf, size, to, now);
+    }
+    return udp_transport_send(instance->transport, buf, size, to, now);
+}
+
+/* The sealed version of a control packet, for encrypted peers, which ignore the plain
+ * ones (@see UDP_DATA_FLAG_COMMAND.)
+ */
+static void udp_sealed_command_send(udp_instance_t *instance, udp_peer_t *peer, uint16_t command, uint64_t now) {
+    data_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.app_id = instance->params->app_id;
+    hdr.app_version = instance->params->app_version;
+    hdr.flags = UDP_DATA_FLAG_COMMAND | UDP_DATA_FLAG_ENCRYPTED;
+    hdr.connection_id = peer->connection_id;
+    udp_congestion_header_fill(&peer->congestion, &hdr, now);
+    unsigned char *buf = instance->send_buffer;
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), &command, sizeof(command));
+    uint64_t t = udp_timing_start(instance->timing);
+    size_t size = udp_crypto_seal(peer->crypto, buf, sizeof(hdr) + sizeof(command));
+    udp_timing_end(instance->timing, UDP_TIMING_CRC, t);
+    t = udp_timing_start(instance->timing);
+    int r = udp_instance_send(instance, buf, size, &peer->addr, now);
+    udp_timing_end(instance->timing, UDP_TIMING_SEND, t);
+    if (r == (int)size) {
+        peer->last_send_timestamp = now;
+        udp_congestion_charge(&peer->congestion, (uint32_t)size);
+        udp_stat_sent(&instance->stats, size);
+        return;
+    }
+    udp_stat_send_error(&instance->stats, errno);
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+        instance->params->on_error(instance->params, UDPERR_SOCKET_ERROR, "udp_sealed_command_send(): sendto() failed");
+    }
+}
+
+static void udp_command_send(udp_instance_t *instance, udp_peer_t *peer, uint16_t command, uint64_t now) {
+    if (peer->crypto) {
+        udp_sealed_command_send(instance, peer, command, now);
+        return;
+    }
+    command_header hdr = { 0, command, instance->params->app_id, instance->params->app_version, peer->connection_id };
+    assert(sizeof(hdr) == 12);
+    uint64_t t = udp_timing_start(instance->timing);
+    hdr.crc16 = update_crc16(&hdr.command, 10, 0);
+    udp_timing_end(instance->timing, UDP_TIMING_CRC, t);
+    t = udp_timing_start(instance->timing);
+    int r = udp_instance_send(instance, &hdr, sizeof(hdr), &peer->addr, now);
+    udp_timing_end(instance->timing, UDP_TIMING_SEND, t);
+    if (r == sizeof(hdr)) {
+        peer->last_send_timestamp = now;
+        udp_congestion_charge(&peer->congestion, sizeof(hdr));
+        udp_stat_sent(&instance->stats, sizeof(hdr));
+        return;
+    }
+    udp_stat_send_error(&instance->stats, errno);
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+        instance->params->on_error(instance->params, UDPERR_SOCKET_ERROR, "udp_command_send(): sendto() failed");
+    }
+}
+
+/* Answer a would-be peer with a cookie to send back, remembering nothing about it. */
+static void udp_challenge_send(udp_instance_t *instance, udp_conn_addr_t const *to, uint64_t now) {
+    command_header hdr = { 0, UDP_CMD_CHALLENGE, instance->params->app_id, instance->params->app_version, udp_cookie_make(instance, to, now / COOKIE_INTERVAL) };
+    uint64_t t = udp_timing_start(instance->timing);
+    hdr.crc16 = update_crc16(&hdr.command, 10, 0);
+    udp_timing_end(instance->timing, UDP_TIMING_CRC, t);
+    udp_stat_add(&instance->stats.challenges_sent, 1);
+    t = udp_timing_start(instance->timing);
+    int r = udp_instance_send(instance, &hdr, sizeof(hdr), to, now);
+    udp_timing_end(instance->timing, UDP_TIMING_SEND, t);
+    if (r == sizeof(hdr)) {
+        udp_stat_sent(&instance->stats, sizeof(hdr));
+        return;
+    }
+    //  no on_error(); a flood of spoofed connects shouldn't turn into a flood of errors
+    udp_stat_send_error(&instance->stats, errno);
+}
+
+/* A packet with the peer's connection id came from somewhere other than the peer's
+ * address. Anybody could have sent that, so the peer only moves there once the new
+ * address has sent back a cookie we sent to it (@see UDP_DATA_FLAG_MIGRATE.)
+ * @param hdr NULL for a command, which never brings a cookie.
+ * @return true if the peer has moved.
+ */
+static bool udp_peer_path_check(udp_instance_t *instance, udp_peer_t *peer, udp_conn_addr_t const *from, data_header const *hdr, unsigned char const *body, size_t size, bool injected, uint64_t now) {
+    if (peer->crypto) {
+        //  only sealed packets move it, and this isn't one
+        udp_stat_add(&instance->stats.auth_failures, 1);
+        return false;
+    }
+    if (!hdr || !(hdr->flags & UDP_DATA_FLAG_MIGRATE)) {
+        udp_challenge_send(instance, from, now);
+        return false;
+    }
+    uint32_t cookie;
+    if (size != sizeof(cookie)) {
+        return false;
+    }
+    memcpy(&cookie, body, sizeof(cookie));
+    if (!udp_cookie_accept(instance, from, cookie, injected, now)) {
+        udp_stat_add(&instance->stats.unknown_peer_packets, 1);
+        return false;
+    }
+    return udp_peer_migrate(instance, peer, from);
+}
+
+/* The encrypted version of UDP_CMD_CONNECT: the connection id, and our half of the
+ * handshake, which proves we have the private key.
+ */
+static void udp_handshake_send(udp_instance_t *instance, udp_peer_t *peer, uint64_t now) {
+    data_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.app_id = instance->params->app_id;
+    hdr.app_version = instance->params->app_version;
+    hdr.flags = UDP_DATA_FLAG_HANDSHAKE;
+    hdr.connection_id = peer->connection_id;
+    udp_congestion_header_fill(&peer->congestion, &hdr, now);
+    unsigned char *buf = instance->send_buffer;
+    memcpy(buf, &hdr, sizeof(hdr));
+    udp_crypto_server_reply(peer->crypto, peer->connection_id, buf + sizeof(hdr));
+    size_t size = sizeof(hdr) + UDP_CRYPTO_REPLY_SIZE;
+    uint64_t t = udp_timing_start(instance->timing);
+    uint32_t crc = update_crc32(buf + 4, size - 4, 0);
+    udp_timing_end(instance->timing, UDP_TIMING_CRC, t);
+    memcpy(buf, &crc, 4);
+    t = udp_timing_start(instance->timing);
+    int r = udp_instance_send(instance, buf, size, &peer->addr, now);
+    udp_timing_end(instance->timing, UDP_TIMING_SEND, t);
+    if (r == (int)size) {
+        peer->last_send_timestamp = now;
+        udp_congestion_charge(&peer->congestion, (uint32_t)size);
+        udp_stat_sent(&instance->stats, size);
+        return;
+    }
+    udp_stat_send_error(&instance->stats, errno);
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+        instance->params->on_error(instance->params, UDPERR_SOCKET_ERROR, "udp_handshake_send(): sendto() failed");
+    }
+}
+
+/* A peer is sent payloads compressed with the dictionary of the first group it's in
+ * that has compression turned on (id 0), and may send with that of any of them.
+ */
+static udp_compression_t *udp_peer_compression(udp_peer_t *peer, uint32_t id) {
+    for (size_t i = 0, n = peer->groups.item_count; i != n; ++i) {
+        udp_group_t *g = *(udp_group_t **)vector_item_get(&peer->groups, i);
+        if (g->compression && (!id || g->compression->id == id)) {
+            return g->compression;
+        }
+    }
+    return NULL;
+}
+
+/* @return 1 if sent (or dropped for good), 0 if the socket is full and the payload
+ * should be retried later.
+ */
+static int udp_peer_payload_send(udp_instance_t *instance, udp_peer_t *peer, udp_payload_t *payload, channel_header const *chdr, uint64_t now) {
+    data_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.app_id = instance->params->app_id;
+    hdr.app_version = instance->params->app_version;
+    hdr.flags = ((udp_payload_owner_t *)(payload + 1))->flags;
+    hdr.connection_id = peer->connection_id;
+    udp_congestion_header_fill(&peer->congestion, &hdr, now);
+    unsigned char *buf = instance->send_buffer;
+    size_t header_size = sizeof(hdr);
+    if (chdr) {
+        hdr.flags |= UDP_DATA_FLAG_CHANNEL;
+        memcpy(buf + header_size, chdr, sizeof(*chdr));
+        header_size += sizeof(*chdr);
+    }
+    udp_compression_t *compression = udp_peer_compression(peer, 0);
+    size_t n = compression ? udp_compress_payload(compression, payload, buf + header_size) : 0;
+    if (n) {
+        hdr.flags |= UDP_DATA_FLAG_COMPRESSED;
+    } else {
+        memcpy(buf + header_size, payload->data, payload->size);
+        n = payload->size;
+    }
+    if (peer->crypto) {
+        hdr.flags |= UDP_DATA_FLAG_ENCRYPTED;
+    }
+    memcpy(buf, &hdr, sizeof(hdr));
+    size_t size = header_size + n;
+    uint64_t t = udp_timing_start(instance->timing);
+    if (peer->crypto) {
+        size = udp_crypto_seal(peer->crypto, buf, size);
+    } else {
+        uint32_t crc = update_crc32(buf + 4, size - 4, 0);
+        memcpy(buf, &crc, 4);
+    }
+    udp_timing_end(instance->timing, UDP_TIMING_CRC, t);
+    t = udp_timing_start(instance->timing);
+    int r = udp_instance_send(instance, buf, size, &peer->addr, now);
+    udp_timing_end(instance->timing, UDP_TIMING_SEND, t);
+    if (r < 0) {
+        udp_stat_send_error(&instance->stats, errno);
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            return 0;
+        }
+        instance->params->on_error(instance->params, UDPERR_SOCKET_ERROR, "udp_peer_payload_send(): sendto() failed");
+        return 1;
+    }
+    peer->last_send_timestamp = now;
+    udp_congestion_charge(&peer->congestion, (uint32_t)size);
+    udp_stat_sent(&instance->stats, size);
+    udp_timing_sent(instance->timing, payload);
+    return 1;
+}
+
+static int udp_peer_channel_send(void *context, udp_payload_t *payload, channel_header const *chdr, uint64_t now) {
+    udp_peer_t *peer = (udp_peer_t *)context;
+    return udp_peer_payload_send(peer->instance, peer, payload, chdr, now);
+}
+
+/* Acknowledgements for reliable channels go out ahead of everything else, and
+ * aren't queued; if one is lost, the data is resent and acknowledged again.
+ */
+static void udp_peer_channel_acks_send(udp_instance_t *instance, udp_peer_t *peer, uint64_t now) {
+    udp_channel_acks_t acks;
+    udp_peer_payload_send(instance, peer, udp_channel_acks_get(&acks, &peer->channels, instance->params->max_payload_size), NULL, now);
+}
+
+static int udp_peer_flush(udp_instance_t *instance, udp_peer_t *peer, uint64_t now) {
+    if (peer->channels.acks_pending) {
+        udp_peer_channel_acks_send(instance, peer, now);
+    }
+    return udp_channels_flush(&peer->channels, instance->channels, &peer->out_queue, &peer->congestion, udp_peer_channel_send, peer, now);
+}
+
+static udp_peer_t *udp_peer_create(udp_instance_t *instance, udp_conn_addr_t const *from, uint16_t app_version, uint64_t now) {
+    udp_peer_t *peer = (udp_peer_t *)malloc(sizeof(udp_peer_t));
+    if (!peer) {
+        instance->params->on_error(instance->params, UDPERR_OUT_OF_MEMORY, "udp_peer_create(): malloc() failed");
+        return NULL;
+    }
+    memset(peer, 0, sizeof(*peer));
+    memcpy(&peer->addr, from, sizeof(peer->addr));
+    peer->instance = instance;
+    peer->remote_app_version = app_version;
+    peer->last_receive_timestamp = now;
+    peer->last_send_timestamp = now;
+    vector_init(&peer->out_queue, sizeof(udp_payload_t *));
+    vector_init(&peer->groups, sizeof(udp_group_t *));
+    vector_init(&peer->snapshot_acks, sizeof(udp_snapshot_ack_t));
+    udp_channels_init(&peer->channels);
+    udp_congestion_init(&peer->congestion, now);
+    if (!hash_table_assign(&instance->peers, peer)) {
+        free(peer);
+        instance->params->on_error(instance->params, UDPERR_OUT_OF_MEMORY, "udp_peer_create(): hash_table_assign() failed");
+        return NULL;
+    }
+    udp_peer_slot_assign(instance, peer);
+    return peer;
+}
+
+/* Offer a freshly created peer to the application. If the application doesn't put
+ * it in a group, it is forgotten again, without an on_peer_expired() callback
+ * (it was never really alive.)
+ */
+static void udp_peer_offer(udp_instance_t *instance, udp_peer_t *peer, udp_payload_t *payload, uint64_t now) {
+    if (instance->params->on_peer_new) {
+        peer->busy++;
+        udp_run_woken(instance);
+        uint64_t t = udp_timing_start(instance->timing);
+        instance->params->on_peer_new(instance->params, peer, payload);
+        udp_timing_end(instance->timing, UDP_TIMING_ON_PEER_NEW, t);
+        peer->busy--;
+    }
+    if (peer->destroy_pending) {
+        //  unless a worker still has it
+        if (!peer->busy) {
+            udp_peer_free(peer);
+        }
+        return;
+    }
+    if (peer->groups.item_count == 0) {
+        udp_peer_unlink(instance, peer);
+        udp_peer_free(peer);
+        return;
+    }
+    //  tell the other end that it's connected
+    if (peer->crypto) {
+        udp_handshake_send(instance, peer, now);
+    } else {
+        udp_command_send(instance, peer, UDP_CMD_CONNECT, now);
+    }
+}
+
+/* Hold the payload and peer for the group's next on_peer_messages(). */
+static void udp_group_batch_add(udp_group_t *group, udp_peer_t *peer, udp_payload_t *payload) {
+    udp_instance_t *instance = group->instance;
+    udp_peer_message_t message = { peer, payload };
+    if ((!group->batch.item_count && !vector_item_append(&instance->batch_groups, &group)) ||
+            !vector_item_append(&group->batch, &message)) {
+        instance->params->on_error(instance->params, UDPERR_OUT_OF_MEMORY, "udp_peer_deliver(): vector_item_append() failed");
+        return;
+    }
+    udp_payload_hold(payload);
+    peer->busy++;
+}
+
+static bool udp_peer_in_group(udp_peer_t *peer, udp_group_t *group) {
+    if (peer->destroy_pending) {
+        return false;
+    }
+    for (size_t i = 0, n = peer->groups.item_count; i != n; ++i) {
+        if (*(udp_group_t **)vector_item_get(&peer->groups, i) == group) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void udp_group_batch_deliver(udp_group_t *group) {
+    udp_instance_t *instance = group->instance;
+    if (!group->batch.item_count) {
+        return;
+    }
+    //  take the batch, so the callback can start another
+    vector_t batch = group->batch;
+    group->batch = instance->batch_scratch;
+    vector_init(&instance->batch_scratch, sizeof(udp_peer_message_t));
+    udp_peer_message_t *messages = (udp_peer_message_t *)vector_item_get(&batch, 0);
+    size_t n = batch.item_count;
+    size_t count = 0;
+    //  Leave out peers that have left the group, keeping the order of the rest. All of a
+    //  peer's messages go the same way, so letting go of the ones left out can't free a
+    //  peer that's in the batch.
+    for (size_t i = 0; i != n; ++i) {
+        if (udp_peer_in_group(messages[i].peer, group)) {
+            udp_peer_message_t m = messages[count];
+            messages[count++] = messages[i];
+            messages[i] = m;
+        }
+    }
+    udp_peer_messages_release(messages + count, n - count);
+    if (count && instance->workers) {
+        udp_peer_message_t *copy = (udp_peer_message_t *)malloc(count * sizeof(udp_peer_message_t));
+        udp_run_woken(instance);
+        udp_work_t work = { UDP_WORK_MESSAGES, 0, 0, group, NULL, NULL, copy, count };
+        if (copy) {
+            memcpy(copy, messages, count * sizeof(udp_peer_message_t));
+        }
+        if (!copy || udp_workers_post(instance->workers, group->worker, &work) < 0) {
+            udp_peer_messages_release(messages, count);
+            free(copy);
+            instance->params->on_error(instance->params, UDPERR_OUT_OF_MEMORY, "udp_poll(): can't hand on_peer_messages() to a worker");
+        } else {
+            instance->work_pending++;
+        }
+    } else if (count) {
+        udp_run_woken(instance);
+        uint64_t t = udp_timing_start(instance->timing);
+        group->params->on_peer_messages(group->params, messages, count);
+        udp_timing_end(instance->timing, UDP_TIMING_ON_PEER_MESSAGE, t);
+        udp_peer_messages_release(messages, count);
+    }
+    vector_item_remove(&batch, 0, n);
+    instance->batch_scratch = batch;
+}
+
+/* Call on_peer_messages() for each group that has a batch. */
+static void udp_batches_deliver(udp_instance_t *instance) {
+    if (instance->batch_delivering) {
+        //  udp_receive_inject() from a callback below; the loop there will get to it
+        return;
+    }
+    instance->batch_delivering = true;
+    size_t i = 0;
+    for (; i < instance->batch_groups.item_count; ++i) {
+        udp_group_t *group = *(udp_group_t **)vector_item_get(&instance->batch_groups, i);
+        if (group) {
+            udp_group_batch_deliver(group);
+        }
+    }
+    vector_item_remove(&instance->batch_groups, 0, i);
+    instance->batch_delivering = false;
+}
+
+static void udp_peer_deliver(udp_peer_t *peer, udp_payload_t *payload) {
+    if (peer->instance->workers) {
+        for (size_t i = 0, n = peer->groups.item_count; i != n; ++i) {
+            udp_group_t *group = *(udp_group_t **)vector_item_get(&peer->groups, i);
+            if (group->params->on_peer_messages) {
+                udp_group_batch_add(group, peer, payload);
+            } else {
+                udp_work_post(group, peer, UDP_WORK_MESSAGE, 0, payload);
+            }
+        }
+        return;
+    }
+    peer->busy++;
+    for (size_t i = 0; i < peer->groups.item_count && !peer->destroy_pending;) {
+        udp_group_t *group = *(udp_group_t **)vector_item_get(&peer->groups, i);
+        if (group->params->on_peer_messages) {
+            udp_group_batch_add(group, peer, payload);
+            ++i;
+            continue;
+        }
+        udp_run_woken(peer->instance);
+        uint64_t t = udp_timing_start(peer->instance->timing);
+        group->params->on_peer_message(group->params, peer, payload);
+        udp_timing_end(peer->instance->timing, UDP_TIMING_ON_PEER_MESSAGE, t);
+        //  The callback may have removed the peer from this group; if so, the
+        //  next group has moved into this slot.
+        if (i < peer->groups.item_count && *(udp_group_t **)vector_item_get(&peer->groups, i) == group) {
+            ++i;
+        }
+    }
+    peer->busy--;
+    if (!peer->busy && peer->destroy_pending) {
+        udp_peer_free(peer);
+    }
+}
+
+static bool udp_app_accept(udp_params_t *params, udp_peer_t *peer, uint16_t app_id, uint16_t app_version) {
+    if (app_id != params->app_id) {
+        return false;
+    }
+    //  newer versions are only let through once we've been talking to them
+    return app_version <= params->app_version || peer != NULL;
+}
+
+static void udp_receive_command(udp_instance_t *instance, udp_peer_t *peer, udp_conn_addr_t const *from, command_header const *hdr, uint8_t ecn, bool injected, uint64_t now) {
+    if (peer && peer->crypto) {
+        //  anybody can write a command; an encrypted peer only hears sealed ones
+        udp_stat_add(&instance->stats.auth_failures, 1);
+        return;
+    }
+    if (!peer && hdr->command != UDP_CMD_CONNECT) {
+        udp_stat_add(&instance->stats.unknown_peer_packets, 1);
+    }
+    if (peer) {
+        peer->last_receive_timestamp = now;
+        peer->remote_app_version = hdr->app_version;
+        udp_congestion_ecn_receive(&peer->congestion, ecn);
+    }
+    switch (hdr->command) {
+        case UDP_CMD_CONNECT:
+            if (!peer && instance->encrypted) {
+                //  connects come as handshakes, when encrypted
+                udp_stat_add(&instance->stats.auth_failures, 1);
+            } else if (!peer && !udp_cookie_accept(instance, from, hdr->connection_id, injected, now)) {
+                udp_challenge_send(instance, from, now);
+            } else if (!peer) {
+                peer = udp_peer_create(instance, from, hdr->app_version, now);
+                if (!peer) {
+                    return;
+                }
+                udp_payload_t *payload = udp_payload_new(instance->params->max_payload_size, instance->params, NULL);
+                if (!payload) {
+                    udp_peer_unlink(instance, peer);
+                    udp_peer_free(peer);
+                    instance->params->on_error(instance->params, UDPERR_OUT_OF_MEMORY, "udp_receive_command(): udp_payload_new() failed");
+                    return;
+                }
+                payload->app_id = hdr->app_id;
+                payload->app_version = hdr->app_version;
+                udp_peer_offer(instance, peer, payload, now);
+                udp_payload_release(payload);
+            } else {
+                //  our previous reply was lost
+                udp_command_send(instance, peer, UDP_CMD_CONNECT, now);
+            }
+            break;
+        case UDP_CMD_DISCONNECT:
+            if (peer) {
+                udp_peer_remove_all(peer, UDPPEER_CLIENT_DISCONNECTED);
+            }
+            break;
+        default:
+            //  UDP_CMD_IDLE is just a keep-alive
+            break;
+    }
+}
+
+static unsigned char *udp_decrypt_buffer(udp_instance_t *instance) {
+    if (!instance->decrypt_buffer && !(instance->decrypt_buffer = (unsigned char *)malloc(instance->buffer_size))) {
+        instance->params->on_error(instance->params, UDPERR_OUT_OF_MEMORY, "udp_decrypt_buffer(): malloc() failed");
+    }
+    return instance->decrypt_buffer;
+}
+
+/* The encrypted version of UDP_CMD_CONNECT: set up the keys, and offer the peer with
+ * the connect payload that came sealed in the hello.
+ */
+static void udp_receive_handshake(udp_instance_t *instance, udp_peer_t *peer, udp_conn_addr_t const *from, data_header const *hdr, unsigned char const *body, size_t size, uint8_t ecn, bool injected, uint64_t now) {
+    udp_params_t *params = instance->params;
+    if (peer) {
+        //  Our reply was lost, if it's the same hello. A different one is a client that
+        //  started over from the same address, and waits for the old peer to time out.
+        if (peer->crypto && !memcmp(&peer->addr, from, sizeof(peer->addr)) && udp_crypto_same_hello(peer->crypto, body, size)) {
+            peer->last_receive_timestamp = now;
+            udp_handshake_send(instance, peer, now);
+        }
+        return;
+    }
+    if (!udp_cookie_accept(instance, from, (hdr->flags & UDP_DATA_FLAG_COOKIE) ? hdr->connection_id : 0, injected, now)) {
+        udp_challenge_send(instance, from, now);
+        return;
+    }
+    udp_payload_t *payload = udp_payload_new(params->max_payload_size, params, NULL);
+    udp_crypto_t *crypto = (udp_crypto_t *)malloc(sizeof(udp_crypto_t));
+    if (!payload || !crypto) {
+        if (payload) {
+            udp_payload_release(payload);
+        }
+        free(crypto);
+        params->on_error(params, UDPERR_OUT_OF_MEMORY, "udp_receive_handshake(): out of memory");
+        return;
+    }
+    uint64_t t = udp_timing_start(instance->timing);
+    int n = udp_crypto_server_hello(crypto, instance->private_key, body, size, (unsigned char *)payload->data);
+    udp_timing_end(instance->timing, UDP_TIMING_CRC, t);
+    if (n < 0) {
+        //  not made with our public key
+        udp_stat_add(&instance->stats.auth_failures, 1);
+        udp_crypto_destroy(crypto);
+        udp_payload_release(payload);
+        return;
+    }
+    payload->size = (uint16_t)n;
+    payload->app_id = hdr->app_id;
+    payload->app_version = hdr->app_version;
+    peer = udp_peer_create(instance, from, hdr->app_version, now);
+    if (!peer) {
+        udp_crypto_destroy(crypto);
+        udp_payload_release(payload);
+        return;
+    }
+    peer->crypto = crypto;
+    udp_congestion_header_receive(&peer->congestion, hdr, ecn, now);
+    udp_peer_offer(instance, peer, payload, now);
+    udp_payload_release(payload);
+}
+
+/* @param io_slot NULL, or the arena slot buf was received into, if any. If the datagram
+ * is a payload, the slot becomes the payload, and *io_slot is set to NULL.
+ */
+static void udp_receive_packet(udp_instance_t *instance, unsigned char const *buf, size_t size, udp_conn_addr_t const *from, uint8_t ecn, uint64_t received, bool injected, udp_payload_t **io_slot, uint64_t now) {
+    udp_params_t *params = instance->params;
+    if (size == sizeof(command_header)) {
+        command_header hdr;
+        memcpy(&hdr, buf, sizeof(hdr));
+        uint64_t t = udp_timing_start(instance->timing);
+        uint16_t crc = update_crc16(&hdr.command, 10, 0);
+        udp_timing_end(instance->timing, UDP_TIMING_CRC, t);
+        if (crc != hdr.crc16) {
+            udp_stat_add(&instance->stats.crc_failures, 1);
+            return;
+        }
+        //  a connect has a cookie, if anything, not a connection id
+        udp_peer_t *peer = udp_peer_find(instance, hdr.command == UDP_CMD_CONNECT ? 0 : hdr.connection_id, from);
+        if (!udp_app_accept(params, peer, hdr.app_id, hdr.app_version)) {
+            return;
+        }
+        //  anybody can write a command with a peer's id, so commands never move it
+        if (peer && memcmp(&peer->addr, from, sizeof(peer->addr))) {
+            udp_peer_path_check(instance, peer, from, NULL, NULL, 0, injected, now);
+            return;
+        }
+        udp_receive_command(instance, peer, from, &hdr, ecn, injected, now);
+        return;
+    }
+    if (size < sizeof(data_header)) {
+        return;
+    }
+    data_header hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    size_t header_size = sizeof(hdr) + ((hdr.flags & UDP_DATA_FLAG_CHANNEL) ? sizeof(channel_header) : 0);
+    //  and what encryption adds around the payload; without a key, the flags for it are
+    //  just more bits that the CRC has to match
+    bool sealed = instance->encrypted && (hdr.flags & UDP_DATA_FLAG_ENCRYPTED);
+    bool handshake = instance->encrypted && (hdr.flags & UDP_DATA_FLAG_HANDSHAKE);
+    size_t overhead = sealed ? UDP_CRYPTO_TAG_SIZE : handshake ? UDP_CRYPTO_HELLO_SIZE : 0;
+    if (size < header_size + overhead || size - header_size - overhead > params->max_payload_size) {
+        return;
+    }
+    bool cookie = (hdr.flags & UDP_DATA_FLAG_COOKIE) != 0;
+    udp_peer_t *peer;
+    if (sealed) {
+        peer = udp_peer_find(instance, hdr.connection_id, from);
+        if (!peer || !peer->crypto) {
+            udp_stat_add(&instance->stats.unknown_peer_packets, 1);
+            return;
+        }
+        unsigned char *plain = udp_decrypt_buffer(instance);
+        if (!plain) {
+            return;
+        }
+        uint64_t t = udp_timing_start(instance->timing);
+        size = udp_crypto_open(peer->crypto, buf, size, plain);
+        udp_timing_end(instance->timing, UDP_TIMING_CRC, t);
+        if (!size) {
+            udp_stat_add(&instance->stats.auth_failures, 1);
+            return;
+        }
+        buf = plain;
+    } else {
+        uint64_t t = udp_timing_start(instance->timing);
+        uint32_t crc = update_crc32(buf + 4, size - 4, 0);
+        udp_timing_end(instance->timing, UDP_TIMING_CRC, t);
+        if (crc != hdr.crc32) {
+            udp_stat_add(&instance->stats.crc_failures, 1);
+            return;
+        }
+        if (instance->encrypted && !handshake) {
+            //  from a client without the key, or forged
+            udp_stat_add(&instance->stats.auth_failures, 1);
+            return;
+        }
+        peer = udp_peer_find(instance, cookie ? 0 : hdr.connection_id, from);
+    }
+    if (!udp_app_accept(params, peer, hdr.app_id, hdr.app_version)) {
+        return;
+    }
+    if (handshake) {
+        udp_receive_handshake(instance, peer, from, &hdr, buf + sizeof(hdr), size - sizeof(hdr), ecn, injected, now);
+        return;
+    }
+    if (hdr.flags & UDP_DATA_FLAG_COMPRESSED) {
+        if (!peer) {
+            udp_stat_add(&instance->stats.unknown_peer_packets, 1);
+            return;
+        }
+        //  none, if the client has some other dictionary than the peer's groups
+        udp_compression_t *compression = udp_peer_compression(peer, udp_compression_id(buf, size, header_size));
+        size = compression ? udp_decompress_packet(compression, &buf, size, header_size, &instance->decompress_buffer, params->max_payload_size) : 0;
+        if (!size) {
+            udp_stat_add(&instance->stats.decompress_failures, 1);
+            return;
+        }
+    }
+    if (peer && memcmp(&peer->addr, from, sizeof(peer->addr)) && !(sealed ? udp_peer_migrate(instance, peer, from) :
+            udp_peer_path_check(instance, peer, from, &hdr, buf + header_size, size - header_size, injected, now))) {
+        return;
+    }
+    if (hdr.flags & (UDP_DATA_FLAG_SNAPSHOT_ACK | UDP_DATA_FLAG_CHANNEL_ACK | UDP_DATA_FLAG_MIGRATE | UDP_DATA_FLAG_COMMAND)) {
+        //  library traffic; never offered to or delivered to the application
+        if (peer) {
+            peer->last_receive_timestamp = now;
+            udp_congestion_header_receive(&peer->congestion, &hdr, ecn, now);
+            if (hdr.flags & UDP_DATA_FLAG_SNAPSHOT_ACK) {
+                udp_peer_snapshot_ack_receive(peer, buf + sizeof(hdr), size - sizeof(hdr));
+            } else if (hdr.flags & UDP_DATA_FLAG_CHANNEL_ACK) {
+                udp_channels_ack_receive(&peer->channels, buf + sizeof(hdr), size - sizeof(hdr));
+            } else if (hdr.flags & UDP_DATA_FLAG_COMMAND) {
+                uint16_t command = UDP_CMD_IDLE;
+                if (size - sizeof(hdr) >= sizeof(command)) {
+                    memcpy(&command, buf + sizeof(hdr), sizeof(command));
+                }
+                if (command == UDP_CMD_DISCONNECT) {
+                    udp_peer_remove_all(peer, UDPPEER_CLIENT_DISCONNECTED);
+                }
+            }
+        } else {
+            udp_stat_add(&instance->stats.unknown_peer_packets, 1);
+        }
+        return;
+    }
+    if ((hdr.flags & UDP_DATA_FLAG_CHANNEL) && !peer) {
+        //  channel state starts when the peer is accepted
+        udp_stat_add(&instance->stats.unknown_peer_packets, 1);
+        return;
+    }
+    if (!peer && !udp_cookie_accept(instance, from, cookie ? hdr.connection_id : 0, injected, now)) {
+        udp_challenge_send(instance, from, now);
+        return;
+    }
+    udp_payload_t *payload;
+    if (io_slot && *io_slot) {
+        payload = *io_slot;
+        *io_slot = NULL;
+        unsigned char *raw = udp_arena_buffer(payload);
+        if (buf == raw) {
+            //  the point of the arena: the payload is where it was received
+            payload->data = raw + header_size;
+        } else {
+            //  decrypted or decompressed somewhere else
+            memcpy(raw, buf + header_size, size - header_size);
+        }
+    } else {
+        if (io_slot) {
+            udp_stat_add(&instance->stats.arena_exhausted, 1);
+        }
+        payload = udp_payload_new(params->max_payload_size, params, NULL);
+        if (!payload) {
+            params->on_error(params, UDPERR_OUT_OF_MEMORY, "udp_receive_packet(): udp_payload_new() failed");
+            return;
+        }
+        memcpy(payload->data, buf + header_size, size - header_size);
+    }
+    payload->size = (uint16_t)(size - header_size);
+    payload->app_id = hdr.app_id;
+    payload->app_version = hdr.app_version;
+    ((udp_payload_owner_t *)(payload + 1))->received = received;
+    if (!peer) {
+        peer = udp_peer_create(instance, from, hdr.app_version, now);
+        if (peer) {
+            udp_congestion_header_receive(&peer->congestion, &hdr, ecn, now);
+            udp_peer_offer(instance, peer, payload, now);
+        }
+    } else if (hdr.flags & UDP_DATA_FLAG_CHANNEL) {
+        peer->last_receive_timestamp = now;
+        peer->remote_app_version = hdr.app_version;
+        udp_congestion_header_receive(&peer->congestion, &hdr, ecn, now);
+        channel_header chdr;
+        memcpy(&chdr, buf + sizeof(hdr), sizeof(chdr));
+        vector_t ready;
+        vector_init(&ready, sizeof(udp_payload_t *));
+        udp_channels_receive(&peer->channels, &chdr, payload, &ready);
+        //  a reliable payload can release several that were waiting for it
+        peer->busy++;
+        for (size_t i = 0, n = ready.item_count; i != n; ++i) {
+            udp_payload_t *pl = *(udp_payload_t **)vector_item_get(&ready, i);
+            if (!peer->destroy_pending) {
+                udp_peer_deliver(peer, pl);
+            }
+            udp_payload_release(pl);
+        }
+        peer->busy--;
+        vector_deinit(&ready);
+        if (!peer->busy && peer->destroy_pending) {
+            udp_peer_free(peer);
+        }
+    } else {
+        peer->last_receive_timestamp = now;
+        peer->remote_app_version = hdr.app_version;
+        udp_congestion_header_receive(&peer->congestion, &hdr, ecn, now);
+        udp_peer_deliver(peer, payload);
+    }
+    udp_payload_release(payload);
+}
+
+static int udp_poll_receive(udp_instance_t *instance, uint64_t now) {
+    int n = 0;
+    int limit = instance->peers.item_count > POLL_MAX_RECEIVE ? (int)instance->peers.item_count : POLL_MAX_RECEIVE;
+    udp_datagram_t batch[UDP_RECV_BATCH];
+    while (n != limit) {
+        int want = limit - n < UDP_RECV_BATCH ? limit - n : UDP_RECV_BATCH;
+        for (int i = 0; i != want; ++i) {
+            if (instance->arena && !instance->recv_slots[i]) {
+                //  slots that didn't become payloads last time are still here
+                instance->recv_slots[i] = udp_arena_get(instance->arena);
+            }
+            batch[i].data = instance->recv_slots[i] ? udp_arena_buffer(instance->recv_slots[i]) : instance->recv_buffer + i * instance->buffer_size;
+            batch[i].size = instance->buffer_size;
+            batch[i].timestamp = 0;
+        }
+        uint64_t t = udp_timing_start(instance->timing);
+        int r = instance->transport->recv_batch(instance->transport, batch, want);
+        udp_timing_end(instance->timing, UDP_TIMING_RECV, t);
+        if (r <= 0) {
+            if (r < 0) {
+                instance->params->on_error(instance->params, UDPERR_SOCKET_ERROR, "udp_poll(): receive failed");
+            }
+            break;
+        }
+        n += r;
+        for (int i = 0; i != r; ++i) {
+            udp_datagram_t const *dg = &batch[i];
+            udp_stat_add(&instance->stats.packets_in, 1);
+            udp_stat_add(&instance->stats.bytes_in, (uint64_t)dg->size);
+            if (instance->filter) {
+                UDPFILTER f = udp_filter_check(instance->filter, &dg->addr, now);
+                if (f != UDPFILTER_PASS) {
+                    udp_stat_add(f == UDPFILTER_BLOCKED ? &instance->stats.blocked_packets : &instance->stats.rate_limited_packets, 1);
+                    continue;
+                }
+            }
+            if (dg->size > instance->buffer_size || !dg->addr.data[0]) {
+                //  truncated (too big for max_payload_size) or unknown address family
+                continue;
+            }
+            if (instance->capture && udp_capture_write(instance->capture, now, &dg->addr, dg->ecn, dg->data, dg->size) < 0) {
+                udp_capture_stop(instance);
+                instance->params->on_error(instance->params, UDPERR_IO_ERROR, "udp_poll(): udp_capture_write() failed; capture stopped");
+            }
+            udp_receive_packet(instance, (unsigned char const *)dg->data, dg->size, &dg->addr, dg->ecn, dg->timestamp, false, instance->arena ? &instance->recv_slots[i] : NULL, now);
+        }
+        if (r != want) {
+            break;
+        }
+    }
+    return n;
+}
+
+static int udp_poll_peers(udp_instance_t *instance, uint64_t now) {
+    int n = 0;
+    //  Timed out peers are collected first and removed after iterating, because the
+    //  removal callbacks may touch other peers, which would invalidate the iterator.
+    vector_t expired;
+    vector_init(&expired, sizeof(udp_conn_addr_t));
+    uint64_t queued = 0;
+    hash_iterator_t iter;
+    for (void *p = hash_table_begin(&instance->peers, &iter); p; p = hash_table_next(&iter)) {
+        udp_peer_t *peer = (udp_peer_t *)p;
+        if (now - peer->last_receive_timestamp > PEER_TIMEOUT_INTERVAL) {
+            vector_item_append(&expired, &peer->addr);
+            continue;
+        }
+        n += udp_peer_flush(instance, peer, now);
+        if (now - peer->last_send_timestamp > PEER_IDLE_INTERVAL) {
+            udp_command_send(instance, peer, UDP_CMD_IDLE, now);
+        }
+        queued += peer->out_queue.item_count + udp_channels_queued(&peer->channels);
+    }
+    udp_stat_set(&instance->stats.queued_payloads, queued);
+    for (size_t i = 0, ne = expired.item_count; i != ne; ++i) {
+        //  an earlier removal callback may have gotten rid of it already
+        udp_peer_t *peer = (udp_peer_t *)hash_table_find(&instance->peers, vector_item_get(&expired, i));
+        if (peer) {
+            udp_peer_remove_all(peer, UDPPEER_TIMEDOUT);
+            ++n;
+        }
+    }
+    vector_deinit(&expired);
+    return n;
+}
+
+int udp_poll(udp_instance_t *instance) {
+    uint64_t t = udp_timing_start(instance->timing);
+    uint64_t now = udp_clock_read(instance->params->clock, instance->params->clock_context);
+    instance->now = now;
+    instance->polling = true;
+    int n = udp_poll_receive(instance, now);
+    udp_batches_deliver(instance);
+    if (instance->workers) {
+        //  before flushing, so what they send goes out now
+        n += udp_work_collect(instance);
+    }
+    n += udp_poll_peers(instance, now);
+    if (instance->impair) {
+        n += udp_impair_flush(instance->impair, instance->transport, now);
+    }
+    instance->polling = false;
+    udp_timing_end(instance->timing, UDP_TIMING_POLL, t);
+    return n;
+}
+
+udp_group_t *udp_group_create(udp_instance_t *instance, udp_group_params_t *params) {
+    udp_group_t *ret = (udp_group_t *)malloc(sizeof(udp_group_t));
+    if (!ret) {
+        instance->params->on_error(instance->params, UDPERR_OUT_OF_MEMORY, "udp_group_create(): malloc() failed");
+        return NULL;
+    }
+    memset(ret, 0, sizeof(*ret));
+    vector_init(&ret->batch, sizeof(udp_peer_message_t));
+    if (vector_init(&ret->peers, sizeof(udp_peer_t *)) < 0) {
+        free(ret);
+        instance->params->on_error(instance->params, UDPERR_OUT_OF_MEMORY, "udp_group_create(): vector_init() failed");
+        return NULL;
+    }
+    ret->instance = instance;
+    ret->params = params;
+    if (!++instance->next_snapshot_stream) {
+        ++instance->next_snapshot_stream;
+    }
+    ret->snapshot_stream = instance->next_snapshot_stream;
+    if (instance->workers) {
+        ret->worker = udp_workers_assign(instance->workers);
+    }
+    ret->next = instance->groups;
+    instance->groups = ret;
+    return ret;
+}
+
 void udp_group_destroy(udp_group_t *group) {
     udp_params_t *iparams = group->instance->params;
+    if (group->batch.item_count) {
+        //  the peers are still in the group, so they're still there
+        udp_peer_messages_release((udp_peer_message_t *)vector_item_get(&group->batch, 0), group->batch.item_count);
+        vector_item_remove(&group->batch, 0, group->batch.item_count);
+    }
+    for (size_t i = 0, n = group->instance->batch_groups.item_count; i != n; ++i) {
+        udp_group_t **bg = (udp_group_t **)vector_item_get(&group->instance->batch_groups, i);
+        if (*bg == group) {
+            *bg = NULL;
+        }
+    }
     //  for each peer
     int n_errors = 0;
     for (size_t i = group->peers.item_count; i > 0; --i) {
         //  remove peer from group
-        UDPERR err = udp_group_peer_remove_ix(group, i-1);
+        UDPERR err = udp_group_peer_remove_ix(group, i-1, UDPPEER_REMOVED_FROM_GROUP);
         if (err != UDP_OK) {
             ++n_errors;
         }
@@ -191,44 +1640,275 @@ void udp_group_destroy(udp_group_t *group) {
             break;
         }
     }
+    if (group->instance->workers) {
+        //  the workers may still be in callbacks for the group, or have sent something for it
+        udp_workers_drain(group->instance->workers);
+        udp_work_collect(group->instance);
+        for (size_t i = 0, n = group->instance->work_done.item_count; i != n; ++i) {
+            //  left over if we're in a callback from udp_work_collect()
+            udp_work_t *work = (udp_work_t *)vector_item_get(&group->instance->work_done, i);
+            if (work->group == group && work->kind != UDP_WORK_DONE) {
+                work->group = NULL;
+            }
+        }
+    }
     //  free memory
+    vector_deinit(&group->batch);
     vector_deinit(&group->peers);
+    udp_group_snapshots_free(group);
+    udp_compression_set(&group->compression, 0, NULL, 0);
+    udp_spatial_destroy(group->spatial);
+    udp_group_replication_free(group);
     free(group);
     if (n_errors > 0) {
         //  This is a lame error message, but better than a poke in the eye.
-        //  This should never happen, so at least it will provide an indication 
+        //  This should never happen, so at least it will provide an indication
         //  to go look at how the group got corrupted.
         iparams->on_error(iparams, UDPERR_INVALID_ARGUMENT, "udp_group_destroy(): errors during group destruction");
     }
 }
 
 UDPERR udp_group_peer_remove(udp_group_t *group, udp_peer_t *peer) {
-    for (size_t i = 0, n = group->peers.item_count; i != n; ++i) {
-        udp_peer_t *gp = (udp_peer_t *)vector_item_get(&group->peers, i);
-        if (gp == peer) {
-            udp_group_peer_remove_ix(group, i);
-            return UDP_OK;
-        }
+    UDPERR err;
+    if (udp_work_defer(group->instance, UDP_WORK_PEER_REMOVE, group, peer, 0, NULL, &err)) {
+        return err;
     }
-    return UDPERR_INVALID_ARGUMENT;
+    return udp_group_peer_remove_reason(group, peer, UDPPEER_REMOVED_FROM_GROUP);
 }
 
 UDPERR udp_group_peer_add(udp_group_t *group, udp_peer_t *peer) {
+    if (peer->instance != group->instance) {
+        return UDPERR_INVALID_ARGUMENT;
+    }
     for (size_t i = 0, n = peer->groups.item_count; i != n; ++i) {
-        udp_group_t *gp = (udp_group_t *)vector_item_get(&peer->groups, i);
+        udp_group_t *gp = *(udp_group_t **)vector_item_get(&peer->groups, i);
         if (gp == group) {
             //  already in the group
             return UDPERR_INVALID_ARGUMENT;
         }
     }
     size_t i = vector_item_append(&peer->groups, &group);
-    if (i != 0) {
-        size_t j = vector_item_append(&group->peers, &peer);
-        if (j == 0) {
-            vector_item_remove(&peer->groups, i - 1, 1);
-            return UDPERR_OUT_OF_MEMORY;
+    if (i == 0) {
+        return UDPERR_OUT_OF_MEMORY;
+    }
+    size_t j = vector_item_append(&group->peers, &peer);
+    if (j == 0) {
+        vector_item_remove(&peer->groups, i - 1, 1);
+        return UDPERR_OUT_OF_MEMORY;
+    }
+    return UDP_OK;
+}
+
+int udp_group_peers_peek(udp_group_t *group, udp_peer_t **opeers, int nmax) {
+    size_t n = group->peers.item_count;
+    if (nmax < 0 || n > (size_t)nmax) {
+        return -1;
+    }
+    if (n) {
+        memcpy(opeers, vector_item_get(&group->peers, 0), n * sizeof(udp_peer_t *));
+    }
+    return (int)n;
+}
+
+int udp_peer_groups_peek(udp_peer_t *peer, udp_group_t **ogroups, int nmax) {
+    size_t n = peer->groups.item_count;
+    if (nmax < 0 || n > (size_t)nmax) {
+        return -1;
+    }
+    if (n) {
+        memcpy(ogroups, vector_item_get(&peer->groups, 0), n * sizeof(udp_group_t *));
+    }
+    return (int)n;
+}
+
+UDPERR udp_group_payload_enqueue(udp_group_t *group, udp_payload_t *payload) {
+    UDPERR err = UDP_OK;
+    if (udp_work_defer(group->instance, UDP_WORK_GROUP_SEND, group, NULL, 0, payload, &err)) {
+        return err;
+    }
+    udp_timing_enqueued(group->instance->timing, payload);
+    for (size_t i = 0, n = group->peers.item_count; i != n; ++i) {
+        udp_peer_t *peer = *(udp_peer_t **)vector_item_get(&group->peers, i);
+        udp_payload_hold(payload);
+        if (vector_item_append(&peer->out_queue, &payload) == 0) {
+            udp_payload_release(payload);
+            err = UDPERR_OUT_OF_MEMORY;
         }
     }
+    udp_payload_release(payload);
+    return err;
+}
+
+UDPERR udp_peer_payload_enqueue(udp_peer_t *peer, udp_payload_t *payload) {
+    UDPERR err;
+    if (udp_work_defer(peer->instance, UDP_WORK_PEER_SEND, NULL, peer, 0, payload, &err)) {
+        return err;
+    }
+    udp_timing_enqueued(peer->instance->timing, payload);
+    if (vector_item_append(&peer->out_queue, &payload) == 0) {
+        udp_payload_release(payload);
+        return UDPERR_OUT_OF_MEMORY;
+    }
     return UDP_OK;
 }
 
+UDPERR udp_group_compression_set(udp_group_t *group, int enable, void const *dictionary, size_t size) {
+    return udp_compression_set(&group->compression, enable, dictionary, size);
+}
+
+UDPERR udp_channel_configure(udp_instance_t *instance, uint8_t channel, UDPCHANNEL kind, uint8_t priority, uint16_t weight) {
+    return udp_channel_config_set(instance->channels, channel, kind, priority, weight);
+}
+
+UDPERR udp_peer_channel_enqueue(udp_peer_t *peer, uint8_t channel, udp_payload_t *payload) {
+    UDPERR err;
+    if (udp_work_defer(peer->instance, UDP_WORK_PEER_SEND, NULL, peer, channel, payload, &err)) {
+        return err;
+    }
+    if (channel == 0) {
+        return udp_peer_payload_enqueue(peer, payload);
+    }
+    udp_timing_enqueued(peer->instance->timing, payload);
+    return udp_channels_enqueue(&peer->channels, peer->instance->channels, channel, payload);
+}
+
+UDPERR udp_group_channel_enqueue(udp_group_t *group, uint8_t channel, udp_payload_t *payload) {
+    UDPERR err = UDP_OK;
+    if (udp_work_defer(group->instance, UDP_WORK_GROUP_SEND, group, NULL, channel, payload, &err)) {
+        return err;
+    }
+    for (size_t i = 0, n = group->peers.item_count; i != n; ++i) {
+        udp_peer_t *peer = *(udp_peer_t **)vector_item_get(&group->peers, i);
+        udp_payload_hold(payload);
+        UDPERR e = udp_peer_channel_enqueue(peer, channel, payload);
+        if (e != UDP_OK) {
+            err = e;
+        }
+    }
+    udp_payload_release(payload);
+    return err;
+}
+
+UDPERR udp_group_spatial_init(udp_group_t *group, float cell_size) {
+    if (group->spatial || !(cell_size > 0)) {
+        return UDPERR_INVALID_ARGUMENT;
+    }
+    group->spatial = udp_spatial_create(cell_size);
+    if (!group->spatial) {
+        return UDPERR_OUT_OF_MEMORY;
+    }
+    return UDP_OK;
+}
+
+UDPERR udp_group_peer_position_set(udp_group_t *group, udp_peer_t *peer, float x, float y, float radius) {
+    if (!group->spatial) {
+        return UDPERR_INVALID_ARGUMENT;
+    }
+    for (size_t i = 0, n = peer->groups.item_count; i != n; ++i) {
+        if (*(udp_group_t **)vector_item_get(&peer->groups, i) == group) {
+            return udp_spatial_set(group->spatial, peer, x, y, radius);
+        }
+    }
+    //  not in the group
+    return UDPERR_INVALID_ARGUMENT;
+}
+
+struct spatial_enqueue_t {
+    udp_payload_t *payload;
+    uint8_t channel;
+    UDPERR err;
+};
+
+static void udp_spatial_enqueue_visit(void *context, udp_peer_t *peer) {
+    spatial_enqueue_t *se = (spatial_enqueue_t *)context;
+    udp_payload_hold(se->payload);
+    UDPERR e = udp_peer_channel_enqueue(peer, se->channel, se->payload);
+    if (e != UDP_OK) {
+        se->err = e;
+    }
+}
+
+UDPERR udp_group_channel_enqueue_at(udp_group_t *group, uint8_t channel, float x, float y, udp_payload_t *payload) {
+    if (!group->spatial) {
+        udp_payload_release(payload);
+        return UDPERR_INVALID_ARGUMENT;
+    }
+    spatial_enqueue_t se = { payload, channel, UDP_OK };
+    udp_spatial_query(group->spatial, x, y, udp_spatial_enqueue_visit, &se);
+    udp_payload_release(payload);
+    return se.err;
+}
+
+UDPERR udp_group_payload_enqueue_at(udp_group_t *group, float x, float y, udp_payload_t *payload) {
+    return udp_group_channel_enqueue_at(group, 0, x, y, payload);
+}
+
+void udp_stats_get(udp_instance_t *instance, udp_stats_t *o_stats) {
+    udp_stats_read(&instance->stats, o_stats);
+}
+
+UDPERR udp_timing_enable(udp_instance_t *instance, int enable) {
+    return udp_timing_set(&instance->timing, enable);
+}
+
+UDPERR udp_timing_get(udp_instance_t *instance, UDPTIMING which, histogram_t *o_hist, int reset) {
+    return udp_timing_read(instance->timing, which, o_hist, reset);
+}
+
+UDPERR udp_capture_start(udp_instance_t *instance, char const *path) {
+    udp_capture_stop(instance);
+    instance->capture = udp_capture_create(path, udp_instance_now(instance));
+    if (!instance->capture) {
+        instance->params->on_error(instance->params, UDPERR_IO_ERROR, "udp_capture_start(): udp_capture_create() failed");
+        return UDPERR_IO_ERROR;
+    }
+    return UDP_OK;
+}
+
+void udp_capture_stop(udp_instance_t *instance) {
+    if (instance->capture) {
+        udp_capture_close(instance->capture);
+        instance->capture = NULL;
+    }
+}
+
+UDPERR udp_blocklist_add(udp_instance_t *instance, udp_conn_addr_t const *addr) {
+    if (!instance->filter && !(instance->filter = udp_filter_create(NULL, instance->cookie_key))) {
+        instance->params->on_error(instance->params, UDPERR_OUT_OF_MEMORY, "udp_blocklist_add(): udp_filter_create() failed");
+        return UDPERR_OUT_OF_MEMORY;
+    }
+    if (udp_filter_block(instance->filter, addr) < 0) {
+        instance->params->on_error(instance->params, UDPERR_OUT_OF_MEMORY, "udp_blocklist_add(): out of memory");
+        return UDPERR_OUT_OF_MEMORY;
+    }
+    return UDP_OK;
+}
+
+void udp_blocklist_clear(udp_instance_t *instance) {
+    if (instance->filter) {
+        udp_filter_unblock_all(instance->filter);
+    }
+}
+
+UDPERR udp_keypair_generate(unsigned char *o_public_key, unsigned char *o_private_key) {
+    if (udp_crypto_random(o_private_key, UDP_KEY_SIZE)) {
+        return UDPERR_IO_ERROR;
+    }
+    x25519_public_key(o_public_key, o_private_key);
+    return UDP_OK;
+}
+
+UDPERR udp_receive_inject(udp_instance_t *instance, udp_conn_addr_t const *from, uint8_t ecn, void const *data, size_t size) {
+    if (size > instance->buffer_size || !from->data[0]) {
+        return UDPERR_INVALID_ARGUMENT;
+    }
+    udp_stat_add(&instance->stats.packets_in, 1);
+    udp_stat_add(&instance->stats.bytes_in, size);
+    udp_receive_packet(instance, (unsigned char const *)data, size, from, ecn, 0, true, NULL, udp_instance_now(instance));
+    udp_batches_deliver(instance);
+    return UDP_OK;
+}
+
+uint32_t udp_peer_send_budget(udp_peer_t *peer) {
+    return udp_congestion_budget(&peer->congestion, udp_instance_now(peer->instance));
+}
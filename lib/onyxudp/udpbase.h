@@ -17,6 +17,8 @@
  */
 
 #include <stdint.h>
+#include <stddef.h>
+#include <onyxutil/histogram.h>
 
 #if defined(__cplusplus)
 extern "C" {
@@ -30,6 +32,8 @@ extern "C" {
     typedef struct udp_group_t udp_group_t;
     /* Represents the actual listening socket and library support for that. */
     typedef struct udp_instance_t udp_instance_t;
+    /* What datagrams are sent and received through; a socket unless you say otherwise. */
+    typedef struct udp_transport_t udp_transport_t;
 
     /* Possible errors returned by the UDP library. */
     enum UDPERR {
@@ -61,6 +65,56 @@ extern "C" {
         UDPPEER_REMOVED_FROM_GROUP = 4
     };
 
+    /* Payloads can be sent on channels (@see udp_channel_configure()), each of which 
+     * delivers its payloads in its own way.
+     */
+    enum UDPCHANNEL {
+        /* Payloads may be lost, duplicated or re-ordered. This is what channel 0 does. */
+        UDP_CHANNEL_UNRELIABLE = 0,
+        /* Only the newest payload matters. A payload that is still queued when a newer 
+         * one is queued on the same channel is dropped without being sent, and the 
+         * receiver drops payloads older than one it has already received.
+         */
+        UDP_CHANNEL_LATEST_ONLY = 1,
+        /* Payloads may be lost, but the receiver drops payloads older than one it has 
+         * already received.
+         */
+        UDP_CHANNEL_SEQUENCED = 2,
+        /* Payloads are resent until acknowledged, and delivered in the order sent, 
+         * exactly once.
+         */
+        UDP_CHANNEL_RELIABLE_ORDERED = 3
+    };
+
+    /* What udp_timing_get() can tell you about. All times are in nanoseconds. */
+    enum UDPTIMING {
+        /* Each call to udp_poll() / udp_client_poll(), all in */
+        UDP_TIMING_POLL = 0,
+        /* Each batch received from the transport (one recvmmsg() system call for a socket), 
+         * including the last one that finds nothing */
+        UDP_TIMING_RECV = 1,
+        /* Each datagram sent to the transport (one sendmmsg() system call for a socket) */
+        UDP_TIMING_SEND = 2,
+        /* Each CRC computed on send or checked on receive, or packet sealed or opened 
+         * when encrypted */
+        UDP_TIMING_CRC = 3,
+        /* Each call to your on_peer_new() (server) */
+        UDP_TIMING_ON_PEER_NEW = 4,
+        /* Each call to your on_peer_message() or on_peer_messages() (server; once per 
+         * group; not measured when it runs on udp_params_t::worker_threads) */
+        UDP_TIMING_ON_PEER_MESSAGE = 5,
+        /* Each call to your on_payload() (client) */
+        UDP_TIMING_ON_PAYLOAD = 6,
+        /* From when a payload is queued to when it goes out the socket, per payload 
+         * and peer. Resends of reliable payloads count from the original enqueue. */
+        UDP_TIMING_QUEUE = 7,
+        /* From when udp_run() wakes up with something to receive, having had nothing to 
+         * do, to the first callback for it (or handing it to a worker). @see 
+         * udp_stats_t::wakeups */
+        UDP_TIMING_WAKE = 8,
+        UDP_TIMING_COUNT = 9
+    };
+
     /* Payloads are the data within UDP packets (outside of framing/addressing information.)
      * This is what you "send" and "receive." The ownership and structure of this data is 
      * internal to the UDP library, but the structure is exposed so that you can efficiently 
@@ -82,6 +136,83 @@ extern "C" {
         uint16_t            app_version;
     } udp_payload_t;
 
+    /* A simulated bad network, for testing how your application copes with one without
+     * needing one. Point udp_params_t::impairment or udp_client_params_t::impairment at
+     * one of these, and everything that instance sends goes through it on the way to the
+     * socket. Impair both ends to impair both directions. The randomness is seeded, so a
+     * given seed and traffic pattern gives the same losses and delays every run.
+     * Datagrams leave when due, from within udp_poll() / udp_client_poll(), so poll
+     * at least as often as the timing resolution you need.
+     */
+    typedef struct udp_impairment_t {
+        /* Seed for the random choices; any value (including 0) works. */
+        uint64_t            seed;
+        /* Chance that a datagram is dropped, 0 to 1. */
+        float               loss;
+        /* Chance that a datagram arrives twice, 0 to 1. */
+        float               duplicate;
+        /* Fixed one-way delay, in microseconds. */
+        uint32_t            latency_us;
+        /* Extra delay, uniformly distributed from 0 to this many microseconds. Datagrams
+         * sent closer together than this will sometimes arrive out of order. */
+        uint32_t            jitter_us;
+        /* Link speed in bytes per second, or 0 for unlimited. Datagrams wait for the link. */
+        uint32_t            bandwidth;
+        /* How many bytes can wait to go out; beyond this, sends fail with ENOBUFS like a
+         * full socket buffer would. 0 for no limit. */
+        uint32_t            queue_bytes;
+    } udp_impairment_t;
+
+    /* How fast any one host may send to a server instance (@see udp_params_t::rate_limit).
+     * All ports of an address count as the same host. What goes over is dropped as it 
+     * comes in, before anything else looks at it. The limit is kept approximately, in a 
+     * fixed amount of memory: now and then, a host ends up sharing with one that's over 
+     * the limit, and gets limited along with it.
+     */
+    typedef struct udp_rate_limit_t {
+        /* Sustained datagrams per second. Leave room for your busiest client. */
+        float               packets_per_second;
+        /* Datagrams a host may send at once, after being quiet; at least 1. */
+        float               burst;
+    } udp_rate_limit_t;
+
+    /* Where a thread the library starts may run, and how it is scheduled. @see 
+     * udp_params_t::run_thread
+     */
+    typedef struct udp_thread_params_t {
+        /* The CPUs the thread may run on, cpu_count of them, or NULL (and 0) to let the system 
+         * decide. Pinning the polling thread to a CPU on the same node as the network card, 
+         * away from the CPUs that take its interrupts, keeps its caches warm. */
+        int const           *cpus;
+        int                 cpu_count;
+        /* If not 0, run the thread SCHED_FIFO at this priority (1..99), so it isn't preempted 
+         * by ordinary threads. That takes CAP_SYS_NICE (or an RLIMIT_RTPRIO that allows it); 
+         * without it, starting the thread fails with UDPERR_INVALID_ARGUMENT. A FIFO thread 
+         * that never blocks can starve the rest of its CPU, so give it a CPU of its own. */
+        int                 fifo_priority;
+    } udp_thread_params_t;
+
+    /* How udp_run() waits for datagrams in low latency mode (@see udp_params_t::busy_poll.) 
+     * Instead of sleeping until the socket wakes it, the thread keeps polling, backing off 
+     * in steps the longer nothing arrives: first flat out, then with a CPU pause between 
+     * polls, then giving up the CPU to other threads between polls, and last the blocking 
+     * wait of the normal mode. Each step starts after that long without anything to do; a 
+     * datagram goes back to the first. A field left 0 uses the default.
+     */
+    typedef struct udp_busy_poll_t {
+        /* SO_BUSY_POLL for the socket: how long each receive that finds nothing spins on 
+         * the network card's queue in the kernel, in microseconds (default 50.) Above the 
+         * net.core.busy_read sysctl this takes CAP_NET_ADMIN; without it, the socket isn't 
+         * changed, and udp_run() spins in user space only. */
+        uint32_t            socket_us;
+        /* When to start pausing between polls (default 50 microseconds.) */
+        uint32_t            pause_after_us;
+        /* When to start yielding the CPU between polls (default 1000 microseconds.) */
+        uint32_t            yield_after_us;
+        /* When to go back to blocking waits (default 100000 microseconds.) */
+        uint32_t            wait_after_us;
+    } udp_busy_poll_t;
+
     /* Parameters for the instantiation of the UDP library.
      * This defines how your application will use the library.
      * The pointer to this structure that you pass to udp_initialize() must be valid for the 
@@ -160,6 +291,10 @@ extern "C" {
 
         /* When a packet is received from an IP address/port that doesn't currently have an active 
          * peer attached to a group, the library will forward the payload to this callback.
+         * That happens once the sender has shown it can receive at its address, by sending 
+         * back a cookie the library challenged it with; nothing is allocated for senders 
+         * that don't (such as floods with spoofed source addresses.) The client library 
+         * answers challenges by itself.
          * If you want to refer to the payload after this callback returns, you must call 
          * udp_payload_hold() on it, and later call udp_payload_release() when done. You borrow a 
          * reference from the library while inside this callback.
@@ -181,6 +316,106 @@ extern "C" {
          * @param reason The reason code (timeout or removed)
          */
         void                (*on_peer_expired)(udp_params_t *params, udp_peer_t *peer, UDPPEER reason);
+
+        /* For testing, the bad network to send through (@see udp_impairment_t), or NULL (the 
+         * default) to send straight to the socket. The library makes a copy.
+         */
+        udp_impairment_t const *impairment;
+
+        /* Where to send and receive datagrams, or NULL (the default) for a UDP socket on port 
+         * and interface. When set, port and interface are not used, and the transport must 
+         * stay valid for the lifetime of the instance. @see udp_memnet_create() for one that 
+         * stays inside the process.
+         */
+        udp_transport_t     *transport;
+
+        /* Limit how fast each host may send (@see udp_rate_limit_t), or NULL (the default) 
+         * for no limit. The library makes a copy.
+         */
+        udp_rate_limit_t const *rate_limit;
+
+        /* The server's private key, UDP_KEY_SIZE bytes from udp_keypair_generate(), or NULL 
+         * (the default) for plain text. With a key, clients must have the public key 
+         * (@see udp_client_params_t::server_public_key): each connection gets its own keys 
+         * in the connect handshake, and every data packet is encrypted and authenticated 
+         * with ChaCha20-Poly1305 instead of carrying a CRC. That adds 16 bytes to each 
+         * packet. Plain text clients can't connect. Keep the private key secret, and give 
+         * out the public key with the client. The library makes a copy.
+         */
+        unsigned char const *private_key;
+
+        /* How many threads run group callbacks, or 0 (the default) to run them on the 
+         * polling thread. With workers, the polling thread only receives, checks, and sorts 
+         * payloads, so a slow on_peer_message() doesn't hold up the network. Each group is 
+         * given to one worker, taking turns: its on_peer_message(), on_peer_messages() and 
+         * on_peer_removed() calls happen there, one at a time and in order, so they need no 
+         * locking of their own, while other groups' run alongside. on_peer_new() and 
+         * on_peer_expired() stay on the polling thread, and may come before the messages for 
+         * the peer are done.
+         * From a worker, only call udp_payload_get(), udp_payload_hold(), 
+         * udp_payload_release(), udp_peer_payload_enqueue(), udp_peer_channel_enqueue(), 
+         * udp_group_payload_enqueue(), udp_group_channel_enqueue(), and 
+         * udp_group_peer_remove(), for peers of the group the callback is for: those are 
+         * passed to the polling thread, and happen when it next polls.
+         */
+        int                 worker_threads;
+
+        /* How many payloads' worth of receive buffer to map up front, or 0 (the default) to 
+         * receive into one buffer and copy each payload out to memory of its own. With an 
+         * arena, datagrams are received straight into payload slots, and the payloads given 
+         * to on_peer_new(), on_peer_message() and on_peer_messages() are those slots, which 
+         * saves a copy and a malloc() per payload. Payloads you hold keep their slot until 
+         * released; when all slots are in use, payloads are copied out as before (@see 
+         * udp_stats_t::arena_exhausted). udp_payload_get() never uses the arena.
+         */
+        uint32_t            receive_arena;
+        /* If not 0, map the receive arena on huge pages (MAP_HUGETLB), which saves TLB misses 
+         * at high packet rates. Those must have been reserved by the system; if there are 
+         * none, the arena asks for transparent huge pages instead.
+         */
+        int                 receive_arena_huge_pages;
+
+        /* Where the thread started by udp_run() runs, or NULL (the default) for anywhere. 
+         * It is only used during the call to udp_run().
+         */
+        udp_thread_params_t const *run_thread;
+        /* Where the worker_threads run, or NULL (the default) for anywhere. Each worker gets 
+         * one of the CPUs to itself, taking turns: worker i runs on cpus[i % cpu_count].
+         */
+        udp_thread_params_t const *worker_thread;
+        /* The NUMA nodes to keep the instance's memory on, as a bit mask (bit 0 for node 0, 
+         * and so on), or 0 (the default) to leave it to the system. udp_initialize() allocates 
+         * the instance, its buffers and the receive arena there, and the threads it starts 
+         * prefer those nodes for what they allocate. Use the node of the network card, and of 
+         * the CPUs in run_thread. This is a preference: memory comes from other nodes when 
+         * those are full. If the system doesn't support NUMA policies, udp_initialize() fails.
+         */
+        unsigned long       numa_nodes;
+
+        /* If not NULL, udp_run() busy polls the socket instead of sleeping, which spends a 
+         * CPU to get each datagram to its callback sooner (@see udp_busy_poll_t.) Give the 
+         * run_thread a CPU of its own. Without udp_run(), it only sets up the socket. The 
+         * library makes a copy.
+         */
+        udp_busy_poll_t const *busy_poll;
+
+        /* If not 0, have the kernel time stamp each datagram as it arrives (SO_TIMESTAMPNS), 
+         * which udp_payload_received_at() then tells. That costs a little on every packet 
+         * the machine receives, so it's off by default. If the system can't, payloads have 
+         * no time stamps.
+         */
+        int                 receive_timestamps;
+
+        /* If not NULL, the clock this instance goes by instead of udp_timestamp(), for 
+         * simulations and tests: with a clock that you move forward yourself, hours of 
+         * timeouts, retransmits and pacing can go by in as many udp_poll() calls as it 
+         * takes, without waiting. It returns microseconds, which must never go backwards, 
+         * and is called with clock_context from the thread that polls. udp_run() still 
+         * waits for real time. Each instance and client has its own, so give everything 
+         * that talks over one udp_memnet_t the same one.
+         */
+        uint64_t            (*clock)(void *context);
+        void                *clock_context;
     } udp_params_t;
 
     /* You pass in udp_group_params_t to a call to udp_group_create(). The pointer to this struct 
@@ -201,6 +436,12 @@ extern "C" {
      *          ...
      *      }
      */
+    /* One payload received by a peer, for udp_group_params_t::on_peer_messages(). */
+    typedef struct udp_peer_message_t {
+        udp_peer_t          *peer;
+        udp_payload_t       *payload;
+    } udp_peer_message_t;
+
     typedef struct udp_group_params_t {
         /* When payloads are received for peers in in this group, those payloads are routed to this callback.
          * @param params Your group parameters for this group.
@@ -221,8 +462,110 @@ extern "C" {
          * or from a call to udp_group_peer_remove().
          */
         void                (*on_peer_removed)(udp_group_params_t *params, udp_peer_t *peer, UDPPEER reason);
+        /* Optional: when not NULL, the payloads for peers in this group are gathered up during 
+         * each udp_poll() (or udp_receive_inject()), and delivered here all at once, in the order 
+         * they arrived, instead of to on_peer_message(). Handling them in one loop makes it 
+         * cheaper to take a lock once, or look ahead in the array.
+         * @param params Your group parameters for this group.
+         * @param messages The peers and payloads, borrowed as with on_peer_message(). The peers 
+         * stay valid until the callback returns, even if they are removed during it. Payloads 
+         * for peers that left the group before the batch was delivered are left out.
+         * @param count How many there are; at least 1.
+         */
+        void                (*on_peer_messages)(udp_group_params_t *params, udp_peer_message_t const *messages, size_t count);
     } udp_group_params_t;
 
+    /* You pass in udp_replication_params_t to udp_group_replication_init(). As with the other 
+     * params structs, the pointer must stay valid as long as the group, and you can embed it 
+     * in a struct of your own.
+     */
+    typedef struct udp_replication_params_t udp_replication_params_t;
+    struct udp_replication_params_t {
+        /* Write some fields of an entity, in whatever format you like, for sending.
+         * @param params Your replication parameters.
+         * @param id The id the entity was added with.
+         * @param entity The entity pointer the entity was added with.
+         * @param fields Which fields to write; UDP_ENTITY_ALL_FIELDS the first time an 
+         * entity is sent to a peer.
+         * @param out Where to write.
+         * @param size How much room there is.
+         * @return The number of bytes written, or 0 if they don't fit.
+         */
+        size_t              (*serialize)(udp_replication_params_t *params, uint32_t id, void *entity, uint32_t fields, void *out, size_t size);
+        /* Optional: how urgently a peer needs updates of an entity, typically based on 
+         * distance or relevance. If NULL, the priority the entity was added with is used.
+         * Returning 0 holds updates back from the peer until the priority goes up again.
+         * @param params Your replication parameters.
+         * @param peer The peer that is due updates.
+         * @param id The id the entity was added with.
+         * @param entity The entity pointer the entity was added with.
+         * @param priority The priority the entity was added with.
+         * @return The priority of the entity for this peer, for this tick.
+         */
+        float               (*priority)(udp_replication_params_t *params, udp_peer_t *peer, uint32_t id, void *entity, float priority);
+        /* The channel to send updates on; 0, or one set up with udp_channel_configure() 
+         * first. Updates are only sent once, so use a reliable channel, unless you mark 
+         * entities dirty again often enough anyway.
+         */
+        uint8_t             channel;
+        /* The most bytes to send to each peer per tick, or 0 to only go by 
+         * udp_peer_send_budget().
+         */
+        uint32_t            max_bytes_per_tick;
+    };
+
+    /* Counters describing what an instance (or client) has been doing since it was 
+     * created. @see udp_stats_get() and udp_client_stats_get().
+     */
+    typedef struct udp_stats_t {
+        /* Packets and bytes received from and sent to the socket, headers included */
+        uint64_t            packets_in;
+        uint64_t            bytes_in;
+        uint64_t            packets_out;
+        uint64_t            bytes_out;
+        /* Packets dropped because the CRC didn't match */
+        uint64_t            crc_failures;
+        /* Packets dropped because they came from an address that isn't a peer 
+         * (or connection), and weren't asking to become one */
+        uint64_t            unknown_peer_packets;
+        /* sendto() failures: the socket buffer was full (EAGAIN), the system was 
+         * out of buffers (ENOBUFS), or anything else */
+        uint64_t            send_again;
+        uint64_t            send_nobufs;
+        uint64_t            send_errors;
+        /* Payloads queued for sending, over all peers (or connections) and channels, 
+         * as of the end of the last poll */
+        uint64_t            queued_payloads;
+        /* Snapshot history blocks re-used (hits) or taken from the system (misses) */
+        uint64_t            pool_hits;
+        uint64_t            pool_misses;
+        /* Peers that moved to a new address and kept their connection (server only) */
+        uint64_t            peer_migrations;
+        /* Packets from unknown addresses answered with a connect cookie, rather than 
+         * with a new peer, because they didn't bring one back (server only) */
+        uint64_t            challenges_sent;
+        /* Packets dropped as they came in, over the rate limit, or from a blocked host 
+         * (server only; @see udp_rate_limit_t, udp_blocklist_add()) */
+        uint64_t            rate_limited_packets;
+        uint64_t            blocked_packets;
+        /* Packets dropped because they weren't sealed with the keys of the connection: 
+         * forged, damaged, replayed, or in plain text where encryption is on */
+        uint64_t            auth_failures;
+        /* Payloads copied out of the receive buffer because every slot of 
+         * udp_params_t::receive_arena was in use */
+        uint64_t            arena_exhausted;
+        /* Times udp_run() woke up to something to call back about, after having had 
+         * nothing to do, and the total nanoseconds from waking up to the first callback 
+         * (or handing one to a worker); divide for the average. UDP_TIMING_WAKE has the 
+         * spread. Counted in either mode, so the two can be compared (server only.) */
+        uint64_t            wakeups;
+        uint64_t            wake_latency_ns;
+        /* Compressed packets dropped because they were compressed with a dictionary 
+         * this end doesn't have (compression is off here, or set up with some other 
+         * dictionary), or because they didn't decompress */
+        uint64_t            decompress_failures;
+    } udp_stats_t;
+
     /* Represent an internet address in text. This will typically be stored as a dotted-quad 
      * for IPv4, or colon-hex format for IPv6. The port will be decimal digits.
      * @see udp_peer_address_format()
@@ -240,6 +583,51 @@ extern "C" {
         unsigned char data[32];
     } udp_conn_addr_t;
 
+    /* One datagram going through a udp_transport_t. */
+    typedef struct udp_datagram_t {
+        /* Where it goes to when sending, or where it came from when receiving. */
+        udp_conn_addr_t     addr;
+        /* The datagram. When receiving, the buffer to receive into. */
+        void                *data;
+        /* The size of the datagram. When receiving, set it to the size of the buffer, and the 
+         * transport sets it to the size of the datagram, which is bigger than the buffer if 
+         * the datagram didn't fit (and was cut short.) */
+        size_t              size;
+        /* The ECN bits from the IP header, when receiving; 0 if unknown. */
+        uint8_t             ecn;
+        /* When receiving, the time at which the datagram arrived, if the transport knows; 
+         * 0 if not. The library sets it to 0 before each receive. When sending, the time of 
+         * sending. Both are by the clock of the instance or client (@see 
+         * udp_params_t::clock.) */
+        uint64_t            timestamp;
+    } udp_datagram_t;
+
+    /* The operations that move datagrams in and out of an instance or a client. The library 
+     * uses a UDP socket unless you pass a transport in udp_params_t::transport or 
+     * udp_client_params_t::transport. To make your own, put this struct first in yours, 
+     * and cast back in the functions. All of them are called from the polling thread only, 
+     * and none of them may block, except wait().
+     */
+    struct udp_transport_t {
+        /* Send some datagrams, in order.
+         * @return how many were sent, from the start; or -1 with errno set if not even the 
+         * first one could be, which should be EAGAIN (or ENOBUFS) if the transport is only 
+         * full for now.
+         */
+        int                 (*send_batch)(udp_transport_t *transport, udp_datagram_t const *datagrams, int count);
+        /* Receive up to count datagrams into datagrams[0 .. count-1], whose data and size 
+         * describe the buffers to receive into.
+         * @return how many were received, 0 if there was nothing, or -1 with errno set.
+         */
+        int                 (*recv_batch)(udp_transport_t *transport, udp_datagram_t *datagrams, int count);
+        /* Wait until there may be something to receive, or timeout_us microseconds have passed.
+         * Used by udp_run() and udp_client_run() when there is nothing else to do.
+         * @return 1 if there may be something to receive, 0 if the time ran out, or -1 with 
+         * errno set.
+         */
+        int                 (*wait)(udp_transport_t *transport, uint32_t timeout_us);
+    };
+
     /* Create a new listening UDP socket, and context. You have to udp_run() it before 
      * it actually does any work! Or you can call udp_poll() on it yourself from a thread
      * of your choosing.
@@ -368,6 +756,364 @@ extern "C" {
      */
     UDPERR udp_peer_payload_enqueue(udp_peer_t *peer, udp_payload_t *payload);
 
+    /* Set up a channel for sending payloads to peers. Each peer gets its own queue 
+     * for each channel. When payloads are flushed, the channels with the highest 
+     * priority are sent first, so, for example, movement updates on a high priority 
+     * channel are never held up behind chat or bulk transfers on a lower priority 
+     * channel. Channels of the same priority share sending in proportion to their 
+     * weight. Channel 0 is what udp_peer_payload_enqueue() and udp_group_payload_enqueue() 
+     * send on; it is always UDP_CHANNEL_UNRELIABLE, and has priority 0 and weight 1 
+     * unless you configure it otherwise. Reliable channels only send while there is send 
+     * budget (@see udp_peer_send_budget()); other channels send everything queued on 
+     * each poll. The receiving end does not need to configure the channel.
+     * @param instance The instance to configure the channel for.
+     * @param channel The channel, less than UDP_MAX_CHANNELS.
+     * @param kind How payloads on the channel are delivered.
+     * @param priority Higher priority channels are sent first.
+     * @param weight The share of sending among channels of the same priority; at least 1.
+     * @return 0 for success, else an error code
+     * @note Configure channels before sending on them, and don't change the kind of a 
+     * channel once peers have received payloads on it.
+     */
+    UDPERR udp_channel_configure(udp_instance_t *instance, uint8_t channel, UDPCHANNEL kind, uint8_t priority, uint16_t weight);
+
+    /* Given a payload, enqueue it for sending to one peer on a channel.
+     * @param peer The peer to send the payload data to.
+     * @param channel The channel to send on, previously configured with udp_channel_configure().
+     * @param payload The payload to send, previously received from udp_payload_get().
+     * This call will take ownership of the refcount of the payload, you should not
+     * call udp_payload_release() on it.
+     * @return 0 for success, else an error code
+     * @note call this from the same thread that calls udp_poll() if you use udp_poll(), or
+     * from within a callback from the UDP library if you use udp_run()
+     */
+    UDPERR udp_peer_channel_enqueue(udp_peer_t *peer, uint8_t channel, udp_payload_t *payload);
+
+    /* Given a payload, enqueue it for sending to every peer within the given group, on 
+     * a channel. @see udp_peer_channel_enqueue()
+     */
+    UDPERR udp_group_channel_enqueue(udp_group_t *group, uint8_t channel, udp_payload_t *payload);
+
+    /* Make a group spatial, for interest management. Each peer in a spatial group can be 
+     * given a position and a radius of interest with udp_group_peer_position_set(), and 
+     * udp_group_payload_enqueue_at() then sends a payload about something at a given 
+     * point only to the peers whose area of interest covers that point. Finding those 
+     * peers costs about the same whatever the number of peers in the group: peers are 
+     * kept in a grid of square cells, and only peers near the point are looked at. 
+     * A good cell size is around the typical radius of interest. The plain group calls 
+     * (udp_group_payload_enqueue() and so on) still reach every peer in the group.
+     * @param group The group to make spatial.
+     * @param cell_size The size of the grid cells, in the same units as positions.
+     * @return 0 for success, else an error code (the group is already spatial, or the 
+     * cell size isn't positive.)
+     */
+    UDPERR udp_group_spatial_init(udp_group_t *group, float cell_size);
+
+    /* Set, or move, the area of interest of a peer within a spatial group. Call this 
+     * whenever the peer moves; moves within the same grid cells are very cheap. A peer 
+     * that has no position in the group gets none of the payloads sent with 
+     * udp_group_payload_enqueue_at(). The position is forgotten when the peer leaves 
+     * the group.
+     * @param group The spatial group, which the peer must be in.
+     * @param peer The peer to position.
+     * @param x The peer's position.
+     * @param y The peer's position.
+     * @param radius How far from its position the peer is interested in things.
+     * @return 0 for success, else an error code
+     */
+    UDPERR udp_group_peer_position_set(udp_group_t *group, udp_peer_t *peer, float x, float y, float radius);
+
+    /* Given a payload about something at a point, enqueue it for sending to every peer 
+     * in a spatial group whose area of interest covers that point.
+     * @param group The spatial group to send the payload to.
+     * @param x Where the payload is about.
+     * @param y Where the payload is about.
+     * @param payload The payload to send, previously received from udp_payload_get(). 
+     * This call will take ownership of the refcount of the payload, you should not
+     * call udp_payload_release() on it.
+     * @return 0 for success, else an error code
+     * @note call this from the same thread that calls udp_poll() if you use udp_poll(), or
+     * from within a callback from the UDP library if you use udp_run()
+     */
+    UDPERR udp_group_payload_enqueue_at(udp_group_t *group, float x, float y, udp_payload_t *payload);
+
+    /* Like udp_group_payload_enqueue_at(), but on a channel. @see udp_peer_channel_enqueue()
+     */
+    UDPERR udp_group_channel_enqueue_at(udp_group_t *group, uint8_t channel, float x, float y, udp_payload_t *payload);
+
+    /* Send a snapshot of some state to every peer within the given group. Typically you 
+     * call this once per tick with the full state of the world as seen by the group. Each 
+     * peer is sent the difference between this snapshot and the last snapshot that peer 
+     * acknowledged receiving (or the full snapshot, if there is no such snapshot in the 
+     * last UDP_SNAPSHOT_HISTORY snapshots of the group), so the cost on the wire depends 
+     * on how much changed, not on the size of the state. Peers with the same baseline 
+     * share the encoded packets. Snapshots bigger than a payload are split across packets.
+     * The client library puts the snapshot back together and hands it to on_snapshot().
+     * Snapshots are unreliable; a lost snapshot is simply superseded by the next one.
+     * @param group The group to send the snapshot to.
+     * @param data The snapshot. This is copied; you can re-use the buffer right away.
+     * @param size The size of the snapshot, at most UDP_MAX_SNAPSHOT_SIZE.
+     * @return 0 for success, else an error code
+     * @note call this from the same thread that calls udp_poll() if you use udp_poll(), or
+     * from within a callback from the UDP library if you use udp_run()
+     */
+    UDPERR udp_group_snapshot_send(udp_group_t *group, void const *data, size_t size);
+
+    /* Snapshots from different groups are told apart on the receiving end by a stream 
+     * identifier. If the client needs to know which group a snapshot came from, send it 
+     * this value in a payload of your own.
+     * @param group The group to get the snapshot stream identifier of.
+     * @return The stream identifier passed to on_snapshot() for snapshots of this group.
+     */
+    uint16_t udp_group_snapshot_stream(udp_group_t *group);
+
+    /* Turn on compression of the payloads sent to the peers of a group. Compression is 
+     * fast (on the order of a microsecond for a full payload), and is only used for 
+     * payloads it makes smaller. Packets are too small for general compression to do 
+     * well on their own; for best results, pass a dictionary of data that typically 
+     * shows up in your payloads, built with compress_dict_train() (see 
+     * onyxutil/compress.h) from captured traffic. The client must turn on compression 
+     * with the same dictionary, using udp_client_connection_compression_set(); packets 
+     * say which dictionary they were compressed with, and those that don't match are 
+     * dropped, and counted in udp_stats_t::decompress_failures. A peer in more than one 
+     * group is sent payloads compressed with the dictionary of the first group it was 
+     * added to that has compression on, and may send with the dictionary of any of them.
+     * @param group The group to set compression for.
+     * @param enable Non-zero to turn compression on, 0 to turn it off.
+     * @param dictionary The dictionary to compress with, or NULL for none. This is copied.
+     * @param size The size of the dictionary, at most COMPRESS_MAX_DICT_SIZE.
+     * @return 0 for success, else an error code
+     * @note call this from the same thread that calls udp_poll() if you use udp_poll(), or
+     * from within a callback from the UDP library if you use udp_run()
+     */
+    UDPERR udp_group_compression_set(udp_group_t *group, int enable, void const *dictionary, size_t size);
+
+    /* Find out how many bytes the library estimates can be sent to a peer right now, 
+     * without building up queues in the network. The estimate is derived from growth in 
+     * the round-trip time and from ECN congestion marks, and refills over time at the 
+     * estimated available bandwidth. Everything flushed to the peer is charged against 
+     * it, including packet headers. Queued payloads are still sent when the budget is 
+     * exhausted; the budget is for the application to decide what is worth sending this 
+     * tick (drop less important updates, lower the update rate, etc.)
+     * @param peer The peer you want to send to.
+     * @return The number of payload+header bytes that fit in the current budget.
+     * @note call this from the same thread that calls udp_poll() if you use udp_poll(), or
+     * from within a callback from the UDP library if you use udp_run()
+     */
+    uint32_t udp_peer_send_budget(udp_peer_t *peer);
+
+    /* Turn on entity replication for a group. Instead of serializing the whole world for 
+     * every peer, you add your entities to the group, mark the fields that change as dirty, 
+     * and call udp_group_replication_tick() once per tick. Each peer is sent what changed 
+     * since it last heard about each entity, most urgent entities first, up to what its 
+     * send budget allows; entities that don't make it accumulate priority until they do. 
+     * A peer that joins the group is sent every entity in full, and peers are told about 
+     * entities that are removed. Updates for the same peer are packed together into 
+     * payloads; read them with udp_entity_update_next().
+     * @param group The group to replicate to.
+     * @param params How to serialize entities and where to send them.
+     * @return 0 for success, else an error code
+     */
+    UDPERR udp_group_replication_init(udp_group_t *group, udp_replication_params_t *params);
+
+    /* Start replicating an entity to the peers of a group.
+     * @param group The group, with replication turned on.
+     * @param id An id for the entity, unique within the group.
+     * @param entity Your entity. This is passed back to your callbacks.
+     * @param priority How urgent updates of the entity are; how much priority it 
+     * accumulates per tick while it has updates waiting. Must be more than 0.
+     * @return 0 for success, else an error code
+     */
+    UDPERR udp_group_entity_add(udp_group_t *group, uint32_t id, void *entity, float priority);
+
+    /* Stop replicating an entity. Peers that were sent the entity are sent a removal 
+     * (an update with no fields) at the next tick.
+     * @param group The group the entity was added to.
+     * @param id The id of the entity.
+     * @return 0 for success, else an error code
+     */
+    UDPERR udp_group_entity_remove(udp_group_t *group, uint32_t id);
+
+    /* Mark fields of an entity as changed. Cheap to call; nothing is serialized until 
+     * a peer is actually sent the entity.
+     * @param group The group the entity was added to.
+     * @param id The id of the entity.
+     * @param fields A bit for each field (or set of fields, as you see fit) that changed.
+     * @return 0 for success, else an error code
+     */
+    UDPERR udp_group_entity_dirty(udp_group_t *group, uint32_t id, uint32_t fields);
+
+    /* Queue updates for each peer in the group, filling its send budget (and at most 
+     * max_bytes_per_tick) with its most urgent entities. Call once per tick, before 
+     * udp_poll().
+     * @param group The group, with replication turned on.
+     * @return The number of entity updates (including removals) queued, or -1 for error.
+     * @note call this from the same thread that calls udp_poll() if you use udp_poll(), or
+     * from within a callback from the UDP library if you use udp_run()
+     */
+    int udp_group_replication_tick(udp_group_t *group);
+
+    /* One entity update, out of a payload sent by udp_group_replication_tick(). */
+    typedef struct udp_entity_update_t {
+        uint32_t            id;
+        /* The fields that were serialized, or 0 if the entity was removed. */
+        uint32_t            fields;
+        /* What serialize() wrote. */
+        void const          *data;
+        size_t              size;
+    } udp_entity_update_t;
+
+    /* Read the entity updates in a received payload.
+     *
+     *      size_t offset = 0;
+     *      udp_entity_update_t u;
+     *      while (udp_entity_update_next(payload->data, payload->size, &offset, &u) > 0) {
+     *          ...
+     *      }
+     *
+     * @param data The payload data.
+     * @param size The payload size.
+     * @param offset Where to read from; start at 0. This is advanced past the update.
+     * @param update Where to put the update.
+     * @return 1 if an update was read, 0 at the end of the data, -1 if the data is malformed.
+     */
+    int udp_entity_update_next(void const *data, size_t size, size_t *offset, udp_entity_update_t *update);
+
+    /* Read the statistics counters of an instance. Unlike the rest of the API, this 
+     * can be called from any thread, at any time, without holding up the thread that 
+     * polls the instance; the counters are read without locking.
+     * @param instance The instance to read counters of.
+     * @param o_stats Where to put the counters.
+     */
+    void udp_stats_get(udp_instance_t *instance, udp_stats_t *o_stats);
+
+    /* Turn timing of the inner workings of udp_poll() on or off. Each measurement 
+     * (@see UDPTIMING) goes into a log-bucketed histogram (@see onyxutil/histogram.h), 
+     * which is cheap enough to leave on in production: the cost is a couple of reads of 
+     * the clock per measurement. Turning timing off throws away what was measured.
+     * @param instance The instance to time.
+     * @param enable Non-zero to turn timing on, 0 to turn it off.
+     * @return 0 for success, else an error code
+     */
+    UDPERR udp_timing_enable(udp_instance_t *instance, int enable);
+
+    /* Get a copy of one of the timing histograms, and optionally start it over, so you 
+     * can report, say, percentiles per second.
+     * @param instance The instance to get timing for.
+     * @param which Which histogram to get.
+     * @param o_hist Where to copy the histogram.
+     * @param reset Non-zero to reset the histogram after copying it.
+     * @return 0 for success, else an error code (timing isn't on, or which is out of range.)
+     * @note call this from the same thread that calls udp_poll() if you use udp_poll(), or
+     * from within a callback from the UDP library if you use udp_run()
+     */
+    UDPERR udp_timing_get(udp_instance_t *instance, UDPTIMING which, histogram_t *o_hist, int reset);
+
+    /* Record every datagram the instance receives from now on -- when, from where, and 
+     * all the bytes -- to a capture file, so the traffic can be replayed later with the 
+     * udpreplay tool (@see onyxudp/capture.h for the format.) Any capture already going 
+     * is stopped first. If writing fails (say, the disk is full) the capture stops, and 
+     * on_error() is called.
+     * @param instance The instance to capture for.
+     * @param path The file to create; an existing file is overwritten.
+     * @return 0 for success, else an error code
+     * @note call this from the same thread that calls udp_poll() if you use udp_poll(), or
+     * from within a callback from the UDP library if you use udp_run()
+     */
+    UDPERR udp_capture_start(udp_instance_t *instance, char const *path);
+
+    /* Stop capturing, and close the capture file. Does nothing if not capturing.
+     * @note call this from the same thread that calls udp_poll() if you use udp_poll(), or
+     * from within a callback from the UDP library if you use udp_run()
+     */
+    void udp_capture_stop(udp_instance_t *instance);
+
+    /* Drop everything from the host of the address (any port) from now on, as it comes 
+     * in, before anything else looks at it. Use it for sources that misbehave.
+     * @param instance The instance that should stop listening to the host.
+     * @param addr An address of the host, such as that of a peer.
+     * @return 0 for success, else an error code
+     * @note The blocklist is kept approximately, in 8 kB: after a few thousand hosts, other 
+     * hosts start getting blocked too, by chance. Hosts can't be taken off it one by one; 
+     * only all at once, with udp_blocklist_clear().
+     * @note call this from the same thread that calls udp_poll() if you use udp_poll(), or
+     * from within a callback from the UDP library if you use udp_run()
+     */
+    UDPERR udp_blocklist_add(udp_instance_t *instance, udp_conn_addr_t const *addr);
+
+    /* Take all hosts off the blocklist. @see udp_blocklist_add()
+     * @note call this from the same thread that calls udp_poll() if you use udp_poll(), or
+     * from within a callback from the UDP library if you use udp_run()
+     */
+    void udp_blocklist_clear(udp_instance_t *instance);
+
+    /* Make a key pair for udp_params_t::private_key and udp_client_params_t::server_public_key.
+     * @param o_public_key Where the public key goes, UDP_KEY_SIZE bytes.
+     * @param o_private_key Where the private key goes, UDP_KEY_SIZE bytes.
+     * @return 0 for success, or UDPERR_IO_ERROR if the system has no random numbers to give.
+     */
+    UDPERR udp_keypair_generate(unsigned char *o_public_key, unsigned char *o_private_key);
+
+    /* Hand the instance a datagram as if it had just come in on the socket. This is how 
+     * captured traffic is replayed; it is processed (and can create peers, and call your 
+     * callbacks) right away, from within this call. The connect cookies in injected 
+     * datagrams aren't checked; they were made by whichever instance captured them.
+     * Encrypted traffic doesn't replay past the handshakes, because each connection 
+     * gets new keys.
+     * @param instance The instance that receives the datagram.
+     * @param from The address the datagram came from.
+     * @param ecn The ECN bits from the IP header the datagram came in, or 0 if unknown.
+     * @param data The datagram, including the UDP library headers.
+     * @param size The size of the datagram.
+     * @return 0 for success, or an error code if the datagram is too big for the instance.
+     * @note call this from the same thread that calls udp_poll() if you use udp_poll(), or
+     * from within a callback from the UDP library if you use udp_run()
+     */
+    UDPERR udp_receive_inject(udp_instance_t *instance, udp_conn_addr_t const *from, uint8_t ecn, void const *data, size_t size);
+
+    /* An in-memory network, for running servers and clients in one process without any 
+     * system calls: to measure what the library itself costs, or to test without the timing 
+     * of a real network. Each endpoint is a udp_transport_t with the address 127.0.0.1:port 
+     * (only the port matters), so clients find servers with udp_client_address_resolve() as 
+     * usual. A datagram goes into a fixed-size queue at the endpoint it is sent to; when that 
+     * is full, or nobody has that port, it is dropped, as it would be on a real network.
+     * Any thread can send to any endpoint without taking a lock, while each endpoint is 
+     * received from by the one thread that polls it.
+     */
+    typedef struct udp_memnet_t udp_memnet_t;
+
+    /* Make an empty network.
+     * @param queue_length How many datagrams can wait at each endpoint; rounded up to a power 
+     * of two.
+     * @param max_datagram_size The biggest datagram the network carries; bigger ones are cut 
+     * short, like a receive buffer that's too small would. Use at least the max_payload_size 
+     * plus 32 bytes of headers, or 80 if encrypted.
+     * @return the network, or NULL if out of memory.
+     */
+    udp_memnet_t *udp_memnet_create(uint32_t queue_length, uint16_t max_datagram_size);
+
+    /* Add an endpoint to the network. Add all the endpoints before traffic starts.
+     * @param net The network.
+     * @param port The port of the endpoint, or 0 to pick one that isn't taken.
+     * @return the endpoint, which stays valid until the network is destroyed; or NULL if out 
+     * of memory or the port is taken.
+     */
+    udp_transport_t *udp_memnet_endpoint(udp_memnet_t *net, uint16_t port);
+
+    /* Add an endpoint whose queue is queue_length long (rounded up to a power of two) 
+     * instead of the network's, like a server that many clients send to would get a bigger 
+     * receive buffer than they do. Otherwise the same as udp_memnet_endpoint().
+     */
+    udp_transport_t *udp_memnet_endpoint_queue(udp_memnet_t *net, uint16_t port, uint32_t queue_length);
+
+    /* @return how many datagrams were dropped because the queue at the endpoint was full, 
+     * or nobody had the port.
+     */
+    uint64_t udp_memnet_dropped(udp_memnet_t const *net);
+
+    /* Free the network and its endpoints. Terminate everything that uses them first. */
+    void udp_memnet_destroy(udp_memnet_t *net);
+
     /* Get or make an empty payload object that you can put data into.
      * @param instance The context within which to get the payload. The payload can be 
      * sent only to peers/groups that belong to that instance.
@@ -394,6 +1140,24 @@ extern "C" {
      */
     void udp_payload_hold(udp_payload_t *payload);
 
+    /* When a received payload arrived at the machine, as a udp_timestamp(), so that 
+     * udp_timestamp() minus this is how long it waited in the socket buffer (and the 
+     * library) before getting to you. Time stamps come from the kernel, with 
+     * udp_params_t::receive_timestamps (or udp_client_params_t::receive_timestamps); the 
+     * memory network (@see udp_memnet_create()) stamps datagrams when they're sent.
+     * @param payload A payload passed to one of your callbacks.
+     * @return The time, in microseconds, or 0 if it's not known: no time stamps, or the 
+     * payload came from udp_payload_get(), udp_receive_inject(), or was put together from 
+     * several datagrams.
+     */
+    uint64_t udp_payload_received_at(udp_payload_t const *payload);
+
+    /* The channel a received payload came in on. @see udp_channel_configure()
+     * @param payload A payload passed to one of your callbacks.
+     * @return The channel, or 0 if it didn't come in on a channel.
+     */
+    uint8_t udp_payload_channel(udp_payload_t const *payload);
+
     /* Given a UDP peer, format their address in a semi-readable format. Typically, this will 
      * convert an IP address into dotted-quad or colon-hex format, and the port number to 
      * decimal format.
@@ -407,14 +1171,30 @@ extern "C" {
     /* Access to the internal UDP system clock.
      * @return a timestamp in microseconds.
      * @note This timestamp starts at 0 when udp_initialize() is called.
+     * @note The clock is read once at the start of each udp_poll() (or udp_client_poll()), 
+     * and every timer, timeout and send budget in that poll, callbacks included, goes by 
+     * that time. Calling this always reads the clock. Instances and clients with their own 
+     * clock (@see udp_params_t::clock) go by that instead.
      */
     uint64_t udp_timestamp();
 
     enum {
         UDP_DEFAULT_MAX_PAYLOAD_SIZE = 1200,
-        UDP_MIN_PAYLOAD_SIZE = 32
+        UDP_MIN_PAYLOAD_SIZE = 32,
+        /* The biggest snapshot that can be sent with udp_group_snapshot_send() */
+        UDP_MAX_SNAPSHOT_SIZE = 32768,
+        /* How many snapshots back a baseline can be found */
+        UDP_SNAPSHOT_HISTORY = 32,
+        /* Channels are numbered 0 .. UDP_MAX_CHANNELS-1 */
+        UDP_MAX_CHANNELS = 16,
+        /* The size of the keys for udp_params_t::private_key and 
+         * udp_client_params_t::server_public_key */
+        UDP_KEY_SIZE = 32
     };
 
+    /* The fields passed to serialize() the first time an entity is sent to a peer */
+#define UDP_ENTITY_ALL_FIELDS 0xffffffffu
+
 #if defined(__cplusplus)
 }
 #endif
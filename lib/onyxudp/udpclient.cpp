@@ -1,7 +1,13 @@
+
 #include "udpclient.h"
 #include "udpbase.h"
 #include "protocol.h"
 #include "types.h"
+#include "socket.h"
+#include "congestion.h"
+#include "stats.h"
+#include "timing.h"
+#include "thread.h"
 
 #include <onyxutil/vector.h>
 #include <onyxutil/hashtable.h>
@@ -12,14 +18,15 @@
 #include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 
 
-size_t connection_hash(void const *data, size_t sz) {
-    return hash_pod(data, sizeof(udp_conn_addr_t));
-}
+//  Don't starve the timers and the send side when flooded
+#define POLL_MAX_RECEIVE 64
 
-int connection_comp(void const *a, void const *b, size_t sz) {
-    return memcmp(a, b, sizeof(udp_conn_addr_t));
+/* The time of the poll in progress, if any; else what the clock says. */
+static uint64_t udp_client_now(udp_client_t *client) {
+    return client->polling ? client->now : udp_clock_read(client->params->clock, client->params->clock_context);
 }
 
 static void remove_connection_from_client(udp_client_connection_t *conn) {
@@ -34,14 +41,67 @@ static void free_client_connection(udp_client_connection_t *conn) {
     }
     size_t n = conn->outgoing.item_count;
     for (size_t i = 0; i != n; ++i) {
-        udp_payload_t *payload = (udp_payload_t *)vector_item_get(&conn->outgoing, i);
+        udp_payload_t *payload = *(udp_payload_t **)vector_item_get(&conn->outgoing, i);
         udp_payload_release(payload);
     }
     vector_deinit(&conn->outgoing);
+    for (size_t i = 0, nb = conn->batch.item_count; i != nb; ++i) {
+        udp_payload_release(*(udp_payload_t **)vector_item_get(&conn->batch, i));
+    }
+    vector_deinit(&conn->batch);
+    udp_client_snapshot_streams_free(conn);
+    udp_channels_deinit(&conn->channels);
+    udp_compression_set(&conn->compression, 0, NULL, 0);
+    udp_crypto_destroy(conn->crypto);
     memset(conn, 0xff, sizeof(*conn));
     free(conn);
 }
 
+/* Open the client socket, calling on_error on failure.
+ * @return the socket, or -1.
+ */
+static int udp_client_socket_open(udp_client_params_t *params, int *o_family) {
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    addrinfo *ai = 0;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV | AI_V4MAPPED | AI_ADDRCONFIG;
+    int gaierr = getaddrinfo(params->interface, "0", &hints, &ai);
+    if (gaierr != 0) {
+        params->on_error(params, UDPERR_ADDRESS_ERROR, "udp_client_initialize(): getaddrinfo() failed");
+        return -1;
+    }
+    int sock = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (sock < 0) {
+        params->on_error(params, UDPERR_SOCKET_ERROR, "udp_client_initialize(): socket() failed");
+        freeaddrinfo(ai);
+        return -1;
+    }
+    if (ai->ai_family == AF_INET6) {
+        int off = 0;
+        ::setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&off, sizeof(off));
+    }
+    if (params->interface && ::bind(sock, ai->ai_addr, ai->ai_addrlen) < 0) {
+        params->on_error(params, UDPERR_SOCKET_ERROR, "udp_client_initialize(): bind() failed");
+        freeaddrinfo(ai);
+        close(sock);
+        return -1;
+    }
+    *o_family = ai->ai_family;
+    freeaddrinfo(ai);
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0) {
+        params->on_error(params, UDPERR_IO_ERROR, "udp_client_initialize(): fcntl() failed");
+        close(sock);
+        return -1;
+    }
+    //  Not fatal; congestion control falls back to delay only.
+    udp_socket_enable_ecn(sock, *o_family);
+    if (params->receive_timestamps) {
+        udp_socket_enable_timestamps(sock);
+    }
+    return sock;
+}
+
 udp_client_t *udp_client_initialize(udp_client_params_t *params) {
     if (!params->max_payload_size) {
         params->max_payload_size = UDP_DEFAULT_MAX_PAYLOAD_SIZE;
@@ -50,6 +110,7 @@ udp_client_t *udp_client_initialize(udp_client_params_t *params) {
         params->on_error(params, UDPERR_INVALID_ARGUMENT, "udp_client_initialize(): min_payload_size too small");
         return NULL;
     }
+    udp_timestamp();
     udp_client_t *client = (udp_client_t *)malloc(sizeof(udp_client_t));
     if (!client) {
         params->on_error(params, UDPERR_OUT_OF_MEMORY, "udp_client_initialize(): malloc() failed");
@@ -57,29 +118,34 @@ udp_client_t *udp_client_initialize(udp_client_params_t *params) {
     }
     memset(client, 0, sizeof(*client));
     client->params = params;
-    addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    addrinfo *ai = 0;
-    hints.ai_socktype = SOCK_DGRAM;
-    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV | AI_V4MAPPED | AI_ADDRCONFIG;
-    int gaierr = getaddrinfo(NULL, "0", &hints, &ai);
-    if (gaierr != 0) {
-        params->on_error(params, UDPERR_ADDRESS_ERROR, "udp_client_initialize(): getaddrinfo() failed");
+    if (params->server_public_key) {
+        memcpy(client->server_public_key, params->server_public_key, UDP_KEY_SIZE);
+        client->encrypted = true;
+    }
+    //  room for a handshake, which is the biggest there is when encrypted
+    client->buffer_size = sizeof(data_header) + sizeof(channel_header) + params->max_payload_size + UDP_CRYPTO_HELLO_SIZE;
+    client->recv_buffer = (unsigned char *)malloc(client->buffer_size * UDP_RECV_BATCH);
+    client->send_buffer = (unsigned char *)malloc(client->buffer_size);
+    if (!client->recv_buffer || !client->send_buffer) {
+        params->on_error(params, UDPERR_OUT_OF_MEMORY, "udp_client_initialize(): malloc() failed");
+        free(client->recv_buffer);
+        free(client->send_buffer);
         free(client);
         return NULL;
     }
-    client->socket = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-    if (client->socket < 0) {
-        params->on_error(params, UDPERR_SOCKET_ERROR, "udp_client_initialize(): socket() failed");
-        freeaddrinfo(ai);
+    int family = 0;
+    int sock = -1;
+    if (!params->transport && (sock = udp_client_socket_open(params, &family)) < 0) {
+        free(client->recv_buffer);
+        free(client->send_buffer);
         free(client);
         return NULL;
     }
-    if (ai->ai_family == AF_INET6) {
-        int off = 0;
-        ::setsockopt(client->socket, IPPROTO_IPV6, IPV6_V6ONLY, (char *)&off, sizeof(off));
-    }
-    freeaddrinfo(ai);
+    udp_socket_transport_init(&client->sock, sock, family, params->clock, params->clock_context);
+    client->transport = params->transport ? params->transport : &client->sock.transport;
+    udp_channel_config_init(client->channels);
+    vector_init(&client->batch_conns, sizeof(udp_conn_addr_t));
+    vector_init(&client->batch_scratch, sizeof(udp_payload_t *));
     hash_table_t *ok = hash_table_init(
             &client->connections,
             sizeof(udp_client_connection_t),
@@ -89,6 +155,22 @@ udp_client_t *udp_client_initialize(udp_client_params_t *params) {
             );
     if (!ok) {
         params->on_error(params, UDPERR_OUT_OF_MEMORY, "udp_client_initialize(): hash_table_init() failed");
+        if (sock >= 0) {
+            close(sock);
+        }
+        free(client->recv_buffer);
+        free(client->send_buffer);
+        free(client);
+        return NULL;
+    }
+    if (params->impairment && !(client->impair = udp_impair_create(params->impairment))) {
+        params->on_error(params, UDPERR_OUT_OF_MEMORY, "udp_client_initialize(): udp_impair_create() failed");
+        hash_table_deinit(&client->connections);
+        if (sock >= 0) {
+            close(sock);
+        }
+        free(client->recv_buffer);
+        free(client->send_buffer);
         free(client);
         return NULL;
     }
@@ -96,12 +178,31 @@ udp_client_t *udp_client_initialize(udp_client_params_t *params) {
 }
 
 void udp_client_terminate(udp_client_t *client) {
+    __atomic_store_n(&client->running, 0, __ATOMIC_RELEASE);
+    if (client->thread) {
+        void *status = 0;
+        pthread_join(client->thread, &status);
+        client->thread = 0;
+    }
     hash_iterator_t iter;
     for (void *conn = hash_table_begin(&client->connections, &iter); conn; conn = hash_table_next(&iter)) {
         free_client_connection((udp_client_connection_t *)conn);
     }
     hash_table_deinit(&client->connections);
-    close(client->socket);
+    vector_deinit(&client->batch_conns);
+    vector_deinit(&client->batch_scratch);
+    if (client->sock.socket >= 0) {
+        close(client->sock.socket);
+    }
+    free(client->recv_buffer);
+    free(client->send_buffer);
+    free(client->snapshot_buffer);
+    free(client->decompress_buffer);
+    free(client->decrypt_buffer);
+    free(client->timing);
+    if (client->impair) {
+        udp_impair_destroy(client->impair);
+    }
     memset(client, 0xff, sizeof(*client));
     free(client);
 }
@@ -120,10 +221,8 @@ UDPERR udp_client_address_resolve(udp_addr_t *in_addr, udp_conn_addr_t *out_addr
         freeaddrinfo(ai);
         return UDPERR_ADDRESS_ERROR;
     }
-    memset(out_addr, 0, sizeof(*out_addr));
-    out_addr->data[0] = 1;
-    out_addr->data[1] = ai->ai_addrlen;
-    memcpy(&out_addr->data[2], ai->ai_addr, ai->ai_addrlen);
+    //  same normalization as received source addresses, so they hash the same
+    udp_conn_addr_set(out_addr, ai->ai_addr, ai->ai_addrlen);
     freeaddrinfo(ai);
     return UDP_OK;
 }
@@ -136,61 +235,179 @@ udp_client_connection_t *udp_client_connect(udp_client_t *client, udp_conn_addr_
         }
         return NULL;
     }
-    if (payload == NULL) {
-        payload = udp_client_payload_get(client);
-        if (!payload) {
-            return NULL;
-        }
-        command_header hdr = { 0, UDP_CMD_CONNECT, client->params->app_id, client->params->app_version };
-        assert(sizeof(hdr) == 8);
-        hdr.crc16 = update_crc16(&hdr.command, 6, 0);
-        memcpy(payload->data, &hdr, 8);
-        payload->size = 8;
-    }
+    //  A NULL payload means the connection is made with UDP_CMD_CONNECT packets.
     udp_client_connection_t *conn = (udp_client_connection_t *)malloc(sizeof(udp_client_connection_t));
     if (!conn) {
         client->params->on_error(client->params, UDPERR_OUT_OF_MEMORY, "udp_client_connect(): malloc() failed");
-        udp_payload_release(payload);
+        if (payload) {
+            udp_payload_release(payload);
+        }
         return NULL;
     }
     memset(conn, 0, sizeof(*conn));
     memcpy(&conn->addr, addr, sizeof(*addr));
     conn->client = client;
     conn->conn_payload = payload;
+    conn->state = UDPCNS_PRECONNECT;
+    udp_congestion_init(&conn->congestion, udp_client_now(client));
+    vector_init(&conn->snapshot_streams, sizeof(udp_client_snapshot_stream_t *));
+    udp_channels_init(&conn->channels);
+    vector_init(&conn->batch, sizeof(udp_payload_t *));
     if (vector_init(&conn->outgoing, sizeof(udp_payload_t *)) < 0) {
         client->params->on_error(client->params, UDPERR_OUT_OF_MEMORY, "udp_client_connect(): vector_init() failed");
-        udp_payload_release(payload);
+        if (payload) {
+            udp_payload_release(payload);
+        }
         free(conn);
         return NULL;
     }
+    if (client->encrypted && !(conn->crypto = udp_crypto_client_create(client->server_public_key))) {
+        client->params->on_error(client->params, UDPERR_INVALID_ARGUMENT, "udp_client_connect(): udp_crypto_client_create() failed");
+        conn->conn_payload = NULL;
+        if (payload) {
+            udp_payload_release(payload);
+        }
+        free_client_connection(conn);
+        return NULL;
+    }
     void *prev = hash_table_assign(&client->connections, conn);
-    assert(prev == conn);
+    if (prev != conn) {
+        client->params->on_error(client->params, UDPERR_OUT_OF_MEMORY, "udp_client_connect(): hash_table_assign() failed");
+        conn->conn_payload = NULL;
+        if (payload) {
+            udp_payload_release(payload);
+        }
+        free_client_connection(conn);
+        return NULL;
+    }
     return conn;
 }
 
-UDPERR udp_client_disconnect(udp_client_connection_t *conn) {
-    command_header hdr = { 0, UDP_CMD_DISCONNECT, conn->client->params->app_id, conn->client->params->app_version };
-    assert(sizeof(hdr) == 8);
-    hdr.crc16 = update_crc16(&hdr.command, 6, 0);
-    int i = sendto(conn->client->socket, &hdr, sizeof(hdr), 0, (sockaddr const *)&conn->addr.data[2], conn->addr.data[1]);
-    if (i != sizeof(hdr)) {
-        conn->client->params->on_error(conn->client->params, UDPERR_SOCKET_ERROR, "udp_client_disconnect(): sendto() failed");
+/* Send one datagram, through the simulated network if there is one. */
+static int udp_client_send(udp_client_t *client, void const *buf, size_t size, udp_conn_addr_t const *to, uint64_t now) {
+    if (client->impair) {
+        return udp_impair_send(client->impair, buf, size, to, now);
+    }
+    return udp_transport_send(client->transport, buf, size, to, now);
+}
+
+/* The sealed version of a control packet, for encrypted connections, where the server
+ * ignores the plain ones (@see UDP_DATA_FLAG_COMMAND.)
+ */
+static void udp_client_sealed_command_send(udp_client_connection_t *conn, uint16_t command, uint64_t now) {
+    udp_client_t *client = conn->client;
+    data_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.app_id = client->params->app_id;
+    hdr.app_version = client->params->app_version;
+    hdr.flags = UDP_DATA_FLAG_COMMAND | UDP_DATA_FLAG_ENCRYPTED;
+    hdr.connection_id = conn->connection_id;
+    udp_congestion_header_fill(&conn->congestion, &hdr, now);
+    unsigned char *buf = client->send_buffer;
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), &command, sizeof(command));
+    uint64_t t = udp_timing_start(client->timing);
+    size_t size = udp_crypto_seal(conn->crypto, buf, sizeof(hdr) + sizeof(command));
+    udp_timing_end(client->timing, UDP_TIMING_CRC, t);
+    t = udp_timing_start(client->timing);
+    int r = udp_client_send(client, buf, size, &conn->addr, now);
+    udp_timing_end(client->timing, UDP_TIMING_SEND, t);
+    if (r == (int)size) {
+        conn->last_transmit = now;
+        udp_congestion_charge(&conn->congestion, (uint32_t)size);
+        udp_stat_sent(&client->stats, size);
+        return;
+    }
+    udp_stat_send_error(&client->stats, errno);
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+        client->params->on_error(client->params, UDPERR_SOCKET_ERROR, "udp_client_sealed_command_send(): sendto() failed");
+    }
+}
+
+static void udp_client_command_send(udp_client_connection_t *conn, uint16_t command, uint64_t now) {
+    udp_client_t *client = conn->client;
+    if (conn->crypto) {
+        //  without keys yet, there's nothing the server would listen to
+        if (conn->crypto->keyed) {
+            udp_client_sealed_command_send(conn, command, now);
+        }
+        return;
+    }
+    command_header hdr = { 0, command, client->params->app_id, client->params->app_version, conn->connection_id };
+    assert(sizeof(hdr) == 12);
+    uint64_t t = udp_timing_start(client->timing);
+    hdr.crc16 = update_crc16(&hdr.command, 10, 0);
+    udp_timing_end(client->timing, UDP_TIMING_CRC, t);
+    t = udp_timing_start(client->timing);
+    int i = udp_client_send(client, &hdr, sizeof(hdr), &conn->addr, now);
+    udp_timing_end(client->timing, UDP_TIMING_SEND, t);
+    if (i == sizeof(hdr)) {
+        conn->last_transmit = now;
+        udp_congestion_charge(&conn->congestion, sizeof(hdr));
+        udp_stat_sent(&client->stats, sizeof(hdr));
+        return;
+    }
+    udp_stat_send_error(&client->stats, errno);
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+        client->params->on_error(client->params, UDPERR_SOCKET_ERROR, "udp_client_command_send(): sendto() failed");
     }
+}
+
+UDPERR udp_client_disconnect(udp_client_connection_t *conn) {
+    udp_client_command_send(conn, UDP_CMD_DISCONNECT, udp_client_now(conn->client));
     remove_connection_from_client(conn);
     free_client_connection(conn);
     return UDP_OK;
 }
 
 UDPERR udp_client_payload_send(udp_client_connection_t *conn, udp_payload_t *payload) {
-    return UDPERR_INVALID_ARGUMENT; // TODO
+    udp_timing_enqueued(conn->client->timing, payload);
+    if (vector_item_append(&conn->outgoing, &payload) == 0) {
+        udp_payload_release(payload);
+        conn->client->params->on_error(conn->client->params, UDPERR_OUT_OF_MEMORY, "udp_client_payload_send(): vector_item_append() failed");
+        return UDPERR_OUT_OF_MEMORY;
+    }
+    return UDP_OK;
+}
+
+UDPERR udp_client_channel_configure(udp_client_t *client, uint8_t channel, UDPCHANNEL kind, uint8_t priority, uint16_t weight) {
+    return udp_channel_config_set(client->channels, channel, kind, priority, weight);
+}
+
+UDPERR udp_client_channel_send(udp_client_connection_t *conn, uint8_t channel, udp_payload_t *payload) {
+    if (channel == 0) {
+        return udp_client_payload_send(conn, payload);
+    }
+    udp_timing_enqueued(conn->client->timing, payload);
+    return udp_channels_enqueue(&conn->channels, conn->client->channels, channel, payload);
+}
+
+UDPERR udp_client_connection_compression_set(udp_client_connection_t *conn, int enable, void const *dictionary, size_t size) {
+    return udp_compression_set(&conn->compression, enable, dictionary, size);
+}
+
+uint32_t udp_client_connection_send_budget(udp_client_connection_t *conn) {
+    return udp_congestion_budget(&conn->congestion, udp_client_now(conn->client));
+}
+
+void udp_client_stats_get(udp_client_t *client, udp_stats_t *o_stats) {
+    udp_stats_read(&client->stats, o_stats);
+}
+
+UDPERR udp_client_timing_enable(udp_client_t *client, int enable) {
+    return udp_timing_set(&client->timing, enable);
+}
+
+UDPERR udp_client_timing_get(udp_client_t *client, UDPTIMING which, histogram_t *o_hist, int reset) {
+    return udp_timing_read(client->timing, which, o_hist, reset);
 }
 
 static void *udp_client_run_func(void *iptr) {
     udp_client_t *client = (udp_client_t *)iptr;
-    while (client->running) {
+    while (__atomic_load_n(&client->running, __ATOMIC_ACQUIRE)) {
         int n = udp_client_poll(client);
-        if ((n == 0) && client->running) {
-            usleep(1000);
+        if ((n == 0) && __atomic_load_n(&client->running, __ATOMIC_ACQUIRE)) {
+            client->transport->wait(client->transport, 1000);
         }
     }
     return NULL;
@@ -201,11 +418,11 @@ UDPERR udp_client_run(udp_client_t *client) {
         return UDPERR_INVALID_ARGUMENT;
     }
     client->running = true;
-    int i = pthread_create(&client->thread, NULL, udp_client_run_func, client);
+    int i = udp_thread_start(&client->thread, udp_client_run_func, client, client->params->run_thread, -1, client->params->numa_nodes);
     if (i != 0) {
         client->running = false;
         client->thread = 0;
-        return UDPERR_IO_ERROR;
+        return (i == EINVAL || i == EPERM) ? UDPERR_INVALID_ARGUMENT : UDPERR_IO_ERROR;
     }
     return UDP_OK;
 }
@@ -215,59 +432,102 @@ UDPERR udp_client_run(udp_client_t *client) {
 #define CONNECT_RETRANSMIT_INTERVAL_INCREMENT 20000
 #define CONNECT_RETRANSMIT_COUNT 10
 
-int udpcns_initial(udp_client_connection_t *conn, uint64_t now) {
+/* The encrypted version of the connect: our half of the handshake, with the connection
+ * payload (if any) sealed in it. It comes out the same every time, so the server can
+ * tell a retransmit from a new connection.
+ */
+static void udp_client_handshake_send(udp_client_connection_t *conn, uint64_t now) {
+    udp_client_t *client = conn->client;
+    data_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.app_id = client->params->app_id;
+    hdr.app_version = client->params->app_version;
+    hdr.flags = UDP_DATA_FLAG_HANDSHAKE;
+    hdr.connection_id = conn->connection_id;
+    if (conn->connection_id) {
+        hdr.flags |= UDP_DATA_FLAG_COOKIE;
+    }
+    udp_congestion_header_fill(&conn->congestion, &hdr, now);
+    unsigned char *buf = client->send_buffer;
+    memcpy(buf, &hdr, sizeof(hdr));
+    udp_payload_t *payload = conn->conn_payload;
+    uint64_t t = udp_timing_start(client->timing);
+    size_t size = sizeof(hdr) + udp_crypto_client_hello(conn->crypto, payload ? payload->data : buf, payload ? payload->size : 0, buf + sizeof(hdr));
+    uint32_t crc = update_crc32(buf + 4, size - 4, 0);
+    udp_timing_end(client->timing, UDP_TIMING_CRC, t);
+    memcpy(buf, &crc, 4);
+    t = udp_timing_start(client->timing);
+    int r = udp_client_send(client, buf, size, &conn->addr, now);
+    udp_timing_end(client->timing, UDP_TIMING_SEND, t);
+    if (r == (int)size) {
+        udp_congestion_charge(&conn->congestion, (uint32_t)size);
+        udp_stat_sent(&client->stats, size);
+        return;
+    }
+    udp_stat_send_error(&client->stats, errno);
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+        client->params->on_error(client->params, UDPERR_SOCKET_ERROR, "udp_client_handshake_send(): sendto() failed");
+    }
+}
+
+static int udp_client_connect_transmit(udp_client_connection_t *conn, uint64_t now) {
+    conn->last_transmit = now;
+    if (conn->ntransmit >= CONNECT_RETRANSMIT_COUNT) {
+        //  timed out -- kill it
+        return -1;
+    }
+    conn->ntransmit++;
+    if (conn->crypto) {
+        udp_client_handshake_send(conn, now);
+        return 1;
+    }
+    if (!conn->conn_payload) {
+        udp_client_command_send(conn, UDP_CMD_CONNECT, now);
+        return 1;
+    }
+    udp_payload_hold(conn->conn_payload);
+    if (udp_client_payload_send(conn, conn->conn_payload) != UDP_OK) {
+        return -1;
+    }
+    return 1;
+}
+
+static int udpcns_initial(udp_client_connection_t *conn, uint64_t now) {
     if (now - conn->last_transmit > (CONNECT_RETRANSMIT_INTERVAL + conn->ntransmit * CONNECT_RETRANSMIT_INTERVAL_INCREMENT)) {
-        conn->last_transmit = now;
-        if (conn->ntransmit < CONNECT_RETRANSMIT_COUNT) {
-            conn->ntransmit++;
-            udp_payload_hold(conn->conn_payload);
-            if (udp_client_payload_send(conn, conn->conn_payload) != UDP_OK) {
-                return -1;
-            }
-        } else {
-            //  timed out -- kill it
-            return -1;
-        }
+        return udp_client_connect_transmit(conn, now);
     }
+    return 0;
 }
 
-int udpcns_preconnect(udp_client_connection_t *conn, uint64_t now) {
+static int udpcns_preconnect(udp_client_connection_t *conn, uint64_t now) {
     conn->state = UDPCNS_INITIAL;
-    return udpcns_initial(conn, now);
+    return udp_client_connect_transmit(conn, now);
 }
 
 #define IDLE_RETRANSMIT_INTERVAL 600000
 #define IDLE_TIMEOUT_INTERVAL 5000000
 
-int udpcns_connected(udp_client_connection_t *conn, uint64_t now) {
+static int udpcns_connected(udp_client_connection_t *conn, uint64_t now) {
     if (now - conn->last_receive > IDLE_TIMEOUT_INTERVAL) {
         //  timed out -- go away
-        return -1
+        return -1;
     }
     if (now - conn->last_transmit > IDLE_RETRANSMIT_INTERVAL) {
-        conn->last_transmit = now;
-        udp_payload *pl = udp_client_payload_get(conn->client);
-        command_header h = { 0, UDP_CMD_IDLE, conn->client->app_id, conn->client->app_version };
-        assert(sizeof(h) == 8);
-        h.crc16 = update_crc16(&h->command, 6);
-        pl->data_size = sizeof(command_header);
-        memcpy(pl->data, &h, sizeof(h));
-        if (vector_item_append(&conn->outgoing, &pl, 1) == 0) {
-            udp_payload_release(pl);
-            conn->client->params->on_error(conn->client->params, UDPERR_OUT_OF_MEMORY, "udpcns_connected(): idle packet could not be enqueued");
-            return -1;
-        }
+        udp_client_command_send(conn, UDP_CMD_IDLE, now);
+        return 1;
     }
+    return 0;
 }
 
-int udpcns_final(udp_client_connection_t *conn, uint64_t) {
+static int udpcns_final(udp_client_connection_t *conn, uint64_t) {
+    return 0;
 }
 
-int udpcns_dead(udp_client_connection_t *conn, uint64_t) {
+static int udpcns_dead(udp_client_connection_t *conn, uint64_t) {
     return -1;
 }
 
-int (*(udp_client_poll_connection[]))(udp_client_connection_t *conn, uint64_t now) = {
+static int (*udp_client_poll_connection[])(udp_client_connection_t *conn, uint64_t now) = {
     udpcns_preconnect,
     udpcns_initial,
     udpcns_connected,
@@ -275,36 +535,436 @@ int (*(udp_client_poll_connection[]))(udp_client_connection_t *conn, uint64_t no
     udpcns_dead
 };
 
-void udp_client_connection_destroy(udp_client_connection_t *conn, UDPPEER reason) {
-    if (conn->state >= UDPCNS_CONNECTED) {
-        conn->client->params->on_disconnect(conn->client->params, conn, reason);
+static void udp_client_connection_destroy(udp_client_connection_t *conn, UDPPEER reason) {
+    //  also for attempts that never got through; the application holds the pointer
+    //  from udp_client_connect() either way
+    conn->client->params->on_disconnect(conn->client->params, conn, reason);
+    hash_table_remove(&conn->client->connections, conn);
+    free_client_connection(conn);
+}
+
+/* @return 1 if sent (or dropped for good), 0 if the socket is full and the payload
+ * should be retried later.
+ */
+static int udp_client_connection_payload_send(udp_client_connection_t *conn, udp_payload_t *payload, channel_header const *chdr, uint64_t now) {
+    udp_client_t *client = conn->client;
+    data_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.app_id = client->params->app_id;
+    hdr.app_version = client->params->app_version;
+    hdr.flags = ((udp_payload_owner_t *)(payload + 1))->flags;
+    hdr.connection_id = conn->connection_id;
+    if (conn->crypto) {
+        hdr.flags |= UDP_DATA_FLAG_ENCRYPTED;
+    } else if (conn->state < UDPCNS_CONNECTED && conn->connection_id) {
+        hdr.flags |= UDP_DATA_FLAG_COOKIE;
     }
-    hash_table_remove(&conn->client->connections, this);
-    if (conn->conn_payload) {
-        udp_payload_release(conn->conn_payload);
+    udp_congestion_header_fill(&conn->congestion, &hdr, now);
+    unsigned char *buf = client->send_buffer;
+    size_t header_size = sizeof(hdr);
+    if (chdr) {
+        hdr.flags |= UDP_DATA_FLAG_CHANNEL;
+        memcpy(buf + header_size, chdr, sizeof(*chdr));
+        header_size += sizeof(*chdr);
     }
-    for (size_t i = 0, n = conn->outgoing.item_count; i != n; ++i) {
-        udp_payload_release((udp_payload_t *)vector_item_get(&conn->outgoing, i));
+    //  The server only knows to decompress once the peer is in a group, so
+    //  connection payloads always go out as-is.
+    size_t n = 0;
+    if (conn->compression && conn->state == UDPCNS_CONNECTED) {
+        n = udp_compress_payload(conn->compression, payload, buf + header_size);
     }
-    vector_deinit(&conn->outgoing);
-    free(conn);
+    if (n) {
+        hdr.flags |= UDP_DATA_FLAG_COMPRESSED;
+    } else {
+        memcpy(buf + header_size, payload->data, payload->size);
+        n = payload->size;
+    }
+    memcpy(buf, &hdr, sizeof(hdr));
+    size_t size = header_size + n;
+    uint64_t t = udp_timing_start(client->timing);
+    if (conn->crypto) {
+        size = udp_crypto_seal(conn->crypto, buf, size);
+    } else {
+        uint32_t crc = update_crc32(buf + 4, size - 4, 0);
+        memcpy(buf, &crc, 4);
+    }
+    udp_timing_end(client->timing, UDP_TIMING_CRC, t);
+    t = udp_timing_start(client->timing);
+    int r = udp_client_send(client, buf, size, &conn->addr, now);
+    udp_timing_end(client->timing, UDP_TIMING_SEND, t);
+    if (r < 0) {
+        udp_stat_send_error(&client->stats, errno);
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+            return 0;
+        }
+        client->params->on_error(client->params, UDPERR_SOCKET_ERROR, "udp_client_connection_payload_send(): sendto() failed");
+        return 1;
+    }
+    conn->last_transmit = now;
+    udp_congestion_charge(&conn->congestion, (uint32_t)size);
+    udp_stat_sent(&client->stats, size);
+    udp_timing_sent(client->timing, payload);
+    return 1;
+}
+
+static int udp_client_connection_channel_send(void *context, udp_payload_t *payload, channel_header const *chdr, uint64_t now) {
+    return udp_client_connection_payload_send((udp_client_connection_t *)context, payload, chdr, now);
+}
+
+/* @see udp_peer_channel_acks_send() */
+static void udp_client_connection_channel_acks_send(udp_client_connection_t *conn, uint64_t now) {
+    udp_channel_acks_t acks;
+    udp_client_connection_payload_send(conn, udp_channel_acks_get(&acks, &conn->channels, conn->client->params->max_payload_size), NULL, now);
+}
+
+/* Send the cookie of a challenge back, from wherever we are now (@see UDP_DATA_FLAG_MIGRATE.) */
+static void udp_client_connection_migrate_send(udp_client_connection_t *conn, uint32_t cookie, uint64_t now) {
+    udp_payload_t *payload = udp_client_payload_get(conn->client);
+    if (!payload) {
+        return;
+    }
+    ((udp_payload_owner_t *)(payload + 1))->flags = UDP_DATA_FLAG_MIGRATE;
+    memcpy(payload->data, &cookie, sizeof(cookie));
+    payload->size = sizeof(cookie);
+    udp_client_connection_payload_send(conn, payload, NULL, now);
+    udp_payload_release(payload);
+}
+
+static int udp_client_connection_flush(udp_client_connection_t *conn, uint64_t now) {
+    if (conn->crypto && !conn->crypto->keyed) {
+        //  nothing can go out before the handshake has made the keys
+        return 0;
+    }
+    if (conn->channels.acks_pending) {
+        udp_client_connection_channel_acks_send(conn, now);
+    }
+    if (conn->state != UDPCNS_CONNECTED) {
+        //  Channel payloads wait until the server has accepted the peer, so that
+        //  the first one doesn't end up in on_peer_new() without its channel.
+        udp_channel_config_t plain[UDP_MAX_CHANNELS];
+        udp_channel_config_init(plain);
+        plain[0] = conn->client->channels[0];
+        return udp_channels_flush(&conn->channels, plain, &conn->outgoing, &conn->congestion, udp_client_connection_channel_send, conn, now);
+    }
+    return udp_channels_flush(&conn->channels, conn->client->channels, &conn->outgoing, &conn->congestion, udp_client_connection_channel_send, conn, now);
+}
+
+static void udp_client_connection_established(udp_client_connection_t *conn, uint32_t connection_id, uint64_t now) {
+    conn->last_receive = now;
+    if (connection_id) {
+        //  the server may have restarted, and handed out a new one
+        conn->connection_id = connection_id;
+    }
+    if (conn->state < UDPCNS_CONNECTED) {
+        conn->state = UDPCNS_CONNECTED;
+        if (conn->conn_payload) {
+            udp_payload_release(conn->conn_payload);
+            conn->conn_payload = NULL;
+        }
+    }
+}
+
+static unsigned char *udp_client_decrypt_buffer(udp_client_t *client) {
+    if (!client->decrypt_buffer && !(client->decrypt_buffer = (unsigned char *)malloc(client->buffer_size))) {
+        client->params->on_error(client->params, UDPERR_OUT_OF_MEMORY, "udp_client_decrypt_buffer(): malloc() failed");
+    }
+    return client->decrypt_buffer;
+}
+
+/* Hand a payload to on_payload(), or hold it for on_payloads(). */
+static void udp_client_payload_deliver(udp_client_connection_t *conn, udp_payload_t *payload) {
+    udp_client_t *client = conn->client;
+    udp_client_params_t *params = client->params;
+    if (!params->on_payloads) {
+        uint64_t t = udp_timing_start(client->timing);
+        params->on_payload(params, conn, payload);
+        udp_timing_end(client->timing, UDP_TIMING_ON_PAYLOAD, t);
+        return;
+    }
+    if ((!conn->batch.item_count && !vector_item_append(&client->batch_conns, &conn->addr)) ||
+            !vector_item_append(&conn->batch, &payload)) {
+        params->on_error(params, UDPERR_OUT_OF_MEMORY, "udp_client_poll(): vector_item_append() failed");
+        return;
+    }
+    udp_payload_hold(payload);
+}
+
+static void udp_client_receive_packet(udp_client_t *client, unsigned char const *buf, size_t size, udp_conn_addr_t const *from, uint8_t ecn, uint64_t received, uint64_t now) {
+    udp_client_params_t *params = client->params;
+    udp_client_connection_t *conn = (udp_client_connection_t *)hash_table_find(&client->connections, (void *)from);
+    if (!conn) {
+        //  not someone we're talking to
+        udp_stat_add(&client->stats.unknown_peer_packets, 1);
+        return;
+    }
+    if (size == sizeof(command_header)) {
+        command_header hdr;
+        memcpy(&hdr, buf, sizeof(hdr));
+        uint64_t t = udp_timing_start(client->timing);
+        uint16_t crc = update_crc16(&hdr.command, 10, 0);
+        udp_timing_end(client->timing, UDP_TIMING_CRC, t);
+        if (crc != hdr.crc16) {
+            udp_stat_add(&client->stats.crc_failures, 1);
+            return;
+        }
+        if (hdr.app_id != params->app_id) {
+            return;
+        }
+        if (hdr.command == UDP_CMD_CHALLENGE) {
+            //  Try again right away, this time with the cookie. Only for a new cookie, so
+            //  repeated challenges don't use up the retransmits; if we're out of those,
+            //  udpcns_initial() gives up on the connection.
+            if (conn->state == UDPCNS_INITIAL && hdr.connection_id && hdr.connection_id != conn->connection_id) {
+                conn->connection_id = hdr.connection_id;
+                udp_client_connect_transmit(conn, now);
+            } else if (conn->state == UDPCNS_CONNECTED && !conn->crypto && hdr.connection_id) {
+                //  our address has changed; show the server that we're really here
+                udp_client_connection_migrate_send(conn, hdr.connection_id, now);
+            }
+            return;
+        }
+        if (conn->crypto) {
+            //  Anybody can write a command. Only the handshake connects, and only sealed
+            //  packets keep the connection up or end it.
+            udp_stat_add(&client->stats.auth_failures, 1);
+            return;
+        }
+        udp_congestion_ecn_receive(&conn->congestion, ecn);
+        if (hdr.command == UDP_CMD_DISCONNECT) {
+            udp_client_connection_destroy(conn, UDPPEER_CLIENT_DISCONNECTED);
+            return;
+        }
+        udp_client_connection_established(conn, hdr.connection_id, now);
+        return;
+    }
+    if (size < sizeof(data_header)) {
+        return;
+    }
+    data_header hdr;
+    memcpy(&hdr, buf, sizeof(hdr));
+    size_t header_size = sizeof(hdr) + ((hdr.flags & UDP_DATA_FLAG_CHANNEL) ? sizeof(channel_header) : 0);
+    //  and what encryption adds around the payload (@see udp_receive_packet())
+    bool sealed = conn->crypto && (hdr.flags & UDP_DATA_FLAG_ENCRYPTED);
+    bool handshake = conn->crypto && (hdr.flags & UDP_DATA_FLAG_HANDSHAKE);
+    size_t overhead = sealed ? UDP_CRYPTO_TAG_SIZE : handshake ? UDP_CRYPTO_REPLY_SIZE : 0;
+    if (size < header_size + overhead || size - header_size - overhead > params->max_payload_size) {
+        return;
+    }
+    uint64_t t = udp_timing_start(client->timing);
+    if (sealed) {
+        unsigned char *plain = udp_client_decrypt_buffer(client);
+        size = plain ? udp_crypto_open(conn->crypto, buf, size, plain) : 0;
+        udp_timing_end(client->timing, UDP_TIMING_CRC, t);
+        if (!size) {
+            udp_stat_add(&client->stats.auth_failures, 1);
+            return;
+        }
+        buf = plain;
+    } else {
+        uint32_t crc = update_crc32(buf + 4, size - 4, 0);
+        udp_timing_end(client->timing, UDP_TIMING_CRC, t);
+        if (crc != hdr.crc32) {
+            udp_stat_add(&client->stats.crc_failures, 1);
+            return;
+        }
+        if (conn->crypto && !handshake) {
+            //  plain text, from a server without the key, or forged
+            udp_stat_add(&client->stats.auth_failures, 1);
+            return;
+        }
+    }
+    if (hdr.app_id != params->app_id) {
+        return;
+    }
+    if (handshake) {
+        t = udp_timing_start(client->timing);
+        int r = udp_crypto_client_finish(conn->crypto, client->server_public_key, buf + sizeof(hdr), size - sizeof(hdr), hdr.connection_id);
+        udp_timing_end(client->timing, UDP_TIMING_CRC, t);
+        if (r < 0) {
+            //  not from the server with the private key
+            udp_stat_add(&client->stats.auth_failures, 1);
+            return;
+        }
+        udp_congestion_header_receive(&conn->congestion, &hdr, ecn, now);
+        if (conn->state < UDPCNS_CONNECTED) {
+            udp_client_connection_established(conn, hdr.connection_id, now);
+        }
+        return;
+    }
+    if (hdr.flags & UDP_DATA_FLAG_COMPRESSED) {
+        //  also fails if the server has some other dictionary than we do
+        size = conn->compression ? udp_decompress_packet(conn->compression, &buf, size, header_size, &client->decompress_buffer, params->max_payload_size) : 0;
+        if (!size) {
+            udp_stat_add(&client->stats.decompress_failures, 1);
+            return;
+        }
+    }
+    if (hdr.flags & UDP_DATA_FLAG_COMMAND) {
+        uint16_t command = UDP_CMD_IDLE;
+        if (size - sizeof(hdr) >= sizeof(command)) {
+            memcpy(&command, buf + sizeof(hdr), sizeof(command));
+        }
+        if (command == UDP_CMD_DISCONNECT) {
+            udp_client_connection_destroy(conn, UDPPEER_CLIENT_DISCONNECTED);
+            return;
+        }
+        udp_congestion_header_receive(&conn->congestion, &hdr, ecn, now);
+        udp_client_connection_established(conn, hdr.connection_id, now);
+        return;
+    }
+    if (hdr.flags & UDP_DATA_FLAG_SNAPSHOT) {
+        udp_congestion_header_receive(&conn->congestion, &hdr, ecn, now);
+        udp_client_connection_established(conn, hdr.connection_id, now);
+        udp_client_snapshot_receive(conn, buf + sizeof(hdr), size - sizeof(hdr));
+        return;
+    }
+    if (hdr.flags & UDP_DATA_FLAG_CHANNEL_ACK) {
+        udp_congestion_header_receive(&conn->congestion, &hdr, ecn, now);
+        udp_client_connection_established(conn, hdr.connection_id, now);
+        udp_channels_ack_receive(&conn->channels, buf + sizeof(hdr), size - sizeof(hdr));
+        return;
+    }
+    udp_payload_t *payload = udp_client_payload_get(client);
+    if (!payload) {
+        params->on_error(params, UDPERR_OUT_OF_MEMORY, "udp_client_receive_packet(): udp_client_payload_get() failed");
+        return;
+    }
+    payload->size = (uint16_t)(size - header_size);
+    payload->app_id = hdr.app_id;
+    payload->app_version = hdr.app_version;
+    ((udp_payload_owner_t *)(payload + 1))->received = received;
+    memcpy(payload->data, buf + header_size, payload->size);
+    udp_congestion_header_receive(&conn->congestion, &hdr, ecn, now);
+    udp_client_connection_established(conn, hdr.connection_id, now);
+    if (hdr.flags & UDP_DATA_FLAG_CHANNEL) {
+        channel_header chdr;
+        memcpy(&chdr, buf + sizeof(hdr), sizeof(chdr));
+        vector_t ready;
+        vector_init(&ready, sizeof(udp_payload_t *));
+        udp_channels_receive(&conn->channels, &chdr, payload, &ready);
+        //  The application may disconnect from within on_payload(), so check that
+        //  the connection is still there before delivering the next one.
+        udp_conn_addr_t addr = conn->addr;
+        for (size_t i = 0, n = ready.item_count; i != n; ++i) {
+            udp_payload_t *pl = *(udp_payload_t **)vector_item_get(&ready, i);
+            if (hash_table_find(&client->connections, &addr) == conn) {
+                udp_client_payload_deliver(conn, pl);
+            }
+            udp_payload_release(pl);
+        }
+        vector_deinit(&ready);
+    } else {
+        udp_client_payload_deliver(conn, payload);
+    }
+    udp_payload_release(payload);
+}
+
+/* Call on_payloads() for each connection that has a batch. */
+static void udp_client_batches_deliver(udp_client_t *client) {
+    udp_client_params_t *params = client->params;
+    for (size_t i = 0, n = client->batch_conns.item_count; i != n; ++i) {
+        //  by address, because the connection may have gone since
+        udp_client_connection_t *conn = (udp_client_connection_t *)hash_table_find(&client->connections, vector_item_get(&client->batch_conns, i));
+        if (!conn || !conn->batch.item_count) {
+            continue;
+        }
+        //  take the batch; the callback may disconnect, which frees conn->batch
+        vector_t batch = conn->batch;
+        conn->batch = client->batch_scratch;
+        vector_init(&client->batch_scratch, sizeof(udp_payload_t *));
+        udp_payload_t **payloads = (udp_payload_t **)vector_item_get(&batch, 0);
+        uint64_t t = udp_timing_start(client->timing);
+        params->on_payloads(params, conn, payloads, batch.item_count);
+        udp_timing_end(client->timing, UDP_TIMING_ON_PAYLOAD, t);
+        for (size_t j = 0, m = batch.item_count; j != m; ++j) {
+            udp_payload_release(payloads[j]);
+        }
+        vector_item_remove(&batch, 0, batch.item_count);
+        vector_deinit(&client->batch_scratch);
+        client->batch_scratch = batch;
+    }
+    vector_item_remove(&client->batch_conns, 0, client->batch_conns.item_count);
+}
+
+static int udp_client_poll_receive(udp_client_t *client, uint64_t now) {
+    int n = 0;
+    udp_datagram_t batch[UDP_RECV_BATCH];
+    while (n != POLL_MAX_RECEIVE) {
+        int want = POLL_MAX_RECEIVE - n < UDP_RECV_BATCH ? POLL_MAX_RECEIVE - n : UDP_RECV_BATCH;
+        for (int i = 0; i != want; ++i) {
+            batch[i].data = client->recv_buffer + i * client->buffer_size;
+            batch[i].size = client->buffer_size;
+            batch[i].timestamp = 0;
+        }
+        uint64_t t = udp_timing_start(client->timing);
+        int r = client->transport->recv_batch(client->transport, batch, want);
+        udp_timing_end(client->timing, UDP_TIMING_RECV, t);
+        if (r <= 0) {
+            if (r < 0) {
+                client->params->on_error(client->params, UDPERR_SOCKET_ERROR, "udp_client_poll(): receive failed");
+            }
+            break;
+        }
+        n += r;
+        for (int i = 0; i != r; ++i) {
+            udp_datagram_t const *dg = &batch[i];
+            udp_stat_add(&client->stats.packets_in, 1);
+            udp_stat_add(&client->stats.bytes_in, (uint64_t)dg->size);
+            if (dg->size > client->buffer_size || !dg->addr.data[0]) {
+                continue;
+            }
+            udp_client_receive_packet(client, (unsigned char const *)dg->data, dg->size, &dg->addr, dg->ecn, dg->timestamp, now);
+        }
+        if (r != want) {
+            break;
+        }
+    }
+    return n;
 }
 
 int udp_client_poll(udp_client_t *client) {
+    uint64_t t = udp_timing_start(client->timing);
+    uint64_t now = udp_clock_read(client->params->clock, client->params->clock_context);
+    client->now = now;
+    client->polling = true;
+    int done = udp_client_poll_receive(client, now);
+    if (client->batch_conns.item_count) {
+        udp_client_batches_deliver(client);
+    }
+    //  As in udp_poll_peers(), timed out connections are destroyed after iterating,
+    //  because on_disconnect() may get rid of other connections.
+    vector_t expired;
+    vector_init(&expired, sizeof(udp_conn_addr_t));
+    uint64_t queued = 0;
     hash_iterator_t iter;
-    int done = 0;
     for (
             udp_client_connection_t *conn = (udp_client_connection_t *)hash_table_begin(&client->connections, &iter);
             conn != NULL;
-            conn = hash_table_next(&iter)) {
+            conn = (udp_client_connection_t *)hash_table_next(&iter)) {
         assert(conn->state >= 0 && conn->state < sizeof(udp_client_poll_connection)/sizeof(udp_client_poll_connection[0]));
         int n = udp_client_poll_connection[conn->state](conn, now);
         if (n == -1) {
-            udp_client_connection_destroy(conn, UDPPEER_TIMEDOUT);
+            vector_item_append(&expired, &conn->addr);
         } else {
             done += n;
+            udp_client_snapshot_ack_flush(conn);
+            done += udp_client_connection_flush(conn, now);
+            queued += conn->outgoing.item_count + udp_channels_queued(&conn->channels);
+        }
+    }
+    udp_stat_set(&client->stats.queued_payloads, queued);
+    for (size_t i = 0, ne = expired.item_count; i != ne; ++i) {
+        //  an earlier on_disconnect() may have gotten rid of it already
+        udp_client_connection_t *conn = (udp_client_connection_t *)hash_table_find(&client->connections, vector_item_get(&expired, i));
+        if (conn) {
+            udp_client_connection_destroy(conn, UDPPEER_TIMEDOUT);
         }
     }
+    vector_deinit(&expired);
+    if (client->impair) {
+        done += udp_impair_flush(client->impair, client->transport, now);
+    }
+    client->polling = false;
+    udp_timing_end(client->timing, UDP_TIMING_POLL, t);
     return done;
 }
-
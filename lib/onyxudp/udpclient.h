@@ -69,12 +69,85 @@ extern "C" {
 
         /* When a connection has been idle for too long, or sometimes because of detectable network errors, 
          * a connection will be detected as "down" and removed. Here is how the application is told about 
-         * this. This will also be called when manually diconnecting.
+         * this. This will also be called when manually diconnecting, and when a connection attempt 
+         * times out without ever hearing back from the server.
          * @param params The client that had the connection open.
          * @param conn The connection that lapsed.
          * @param reason Why the connection lapsed.
          */
         void                (*on_disconnect)(udp_client_params_t *params, udp_client_connection_t *conn, UDPPEER reason);
+
+        /* When the server sends a snapshot with udp_group_snapshot_send(), it is put back together 
+         * from the delta against an earlier snapshot, and delivered here. Snapshots are delivered 
+         * in order; one that arrives after a newer snapshot has been delivered is dropped. The 
+         * library acknowledges the snapshot to the server, which will then send later snapshots 
+         * as deltas against it. May be NULL if the server doesn't use snapshots.
+         * @param params The client that received the snapshot.
+         * @param conn The connection that the snapshot was received on.
+         * @param stream Which snapshot stream (server group) this is, @see udp_group_snapshot_stream().
+         * @param sequence The sequence number of the snapshot, increasing by one per snapshot sent.
+         * @param data The snapshot data. This is only valid for the duration of the callback.
+         * @param size The size of the snapshot data.
+         */
+        void                (*on_snapshot)(udp_client_params_t *params, udp_client_connection_t *conn, uint16_t stream, uint32_t sequence, void const *data, size_t size);
+
+        /* For testing, the bad network to send through (@see udp_impairment_t), or NULL (the 
+         * default) to send straight to the socket. The library makes a copy.
+         */
+        udp_impairment_t const *impairment;
+
+        /* If interface is not NULL, then the socket is bound to this local address (with a port 
+         * picked by the system) before anything is sent. When it is NULL, the system picks both 
+         * when the first packet goes out. Each local address has its own range of ephemeral ports, 
+         * so a process that needs more clients than there are ports (a load generator, say) can 
+         * spread them over several addresses, such as "127.0.0.2", "127.0.0.3", ...
+         */
+        char const          *interface;
+
+        /* Where to send and receive datagrams, or NULL (the default) for a UDP socket. When set, 
+         * interface is not used, and the transport must stay valid for the lifetime of the 
+         * client. @see udp_transport_t
+         */
+        udp_transport_t     *transport;
+
+        /* The public key of the server (@see udp_params_t::private_key), UDP_KEY_SIZE bytes, 
+         * or NULL (the default) to talk in plain text. With a key, the connection payload and 
+         * everything after it is encrypted, and the client only connects to the server that 
+         * has the matching private key. The library makes a copy.
+         */
+        unsigned char const *server_public_key;
+
+        /* Optional: when not NULL, the payloads received on each connection are gathered up 
+         * during each udp_client_poll(), and delivered here all at once, in the order they 
+         * arrived, instead of to on_payload(). The payloads are borrowed as with on_payload(). 
+         * It's fine to disconnect during the callback.
+         * @param params The client that received the payloads.
+         * @param conn The connection that they were received on.
+         * @param payloads The payloads.
+         * @param count How many there are; at least 1.
+         */
+        void                (*on_payloads)(udp_client_params_t *params, udp_client_connection_t *conn, udp_payload_t * const *payloads, size_t count);
+
+        /* Where the thread started by udp_client_run() runs, or NULL (the default) for 
+         * anywhere. @see udp_thread_params_t. It is only used during the call to 
+         * udp_client_run().
+         */
+        udp_thread_params_t const *run_thread;
+        /* The NUMA nodes the client thread prefers for its memory, as a bit mask, or 0 (the 
+         * default) for no preference. @see udp_params_t::numa_nodes
+         */
+        unsigned long       numa_nodes;
+
+        /* If not 0, have the kernel time stamp datagrams as they arrive. @see 
+         * udp_params_t::receive_timestamps, udp_payload_received_at()
+         */
+        int                 receive_timestamps;
+
+        /* If not NULL, the clock this client goes by instead of udp_timestamp(). @see 
+         * udp_params_t::clock
+         */
+        uint64_t            (*clock)(void *context);
+        void                *clock_context;
     } udp_client_params_t;
     
     /* Allocate a UDP client. This opens a socket, which can be used to connect to zero or more 
@@ -135,6 +208,54 @@ extern "C" {
      */
     UDPERR udp_client_payload_send(udp_client_connection_t *conn, udp_payload_t *payload);
 
+    /* @see udp_channel_configure()
+     * @param client The client to configure the channel for.
+     */
+    UDPERR udp_client_channel_configure(udp_client_t *client, uint8_t channel, UDPCHANNEL kind, uint8_t priority, uint16_t weight);
+
+    /* Send a payload to the given connection on a channel. Channel payloads are held 
+     * until the connection is established.
+     * @see udp_client_payload_send()
+     * @param conn the connection to send to
+     * @param channel the channel, previously configured with udp_client_channel_configure()
+     * @param payload the payload to send
+     */
+    UDPERR udp_client_channel_send(udp_client_connection_t *conn, uint8_t channel, udp_payload_t *payload);
+
+    /* @see udp_group_compression_set()
+     * Payloads are only compressed once the connection is established, so the server 
+     * has had a chance to put the peer in a group with compression on.
+     * @param conn The connection to set compression for.
+     * @param enable Non-zero to turn compression on, 0 to turn it off.
+     * @param dictionary The dictionary to compress with, or NULL for none. This is copied, 
+     * and must be the same as the one the server uses.
+     * @param size The size of the dictionary.
+     * @return 0 for success, else an error code
+     */
+    UDPERR udp_client_connection_compression_set(udp_client_connection_t *conn, int enable, void const *dictionary, size_t size);
+
+    /* @see udp_peer_send_budget()
+     * @param conn The connection you want to send to.
+     * @return The number of payload+header bytes that fit in the current budget for the 
+     * connection.
+     */
+    uint32_t udp_client_connection_send_budget(udp_client_connection_t *conn);
+
+    /* Read the statistics counters of a client, from any thread. @see udp_stats_get()
+     * @param client The client to read counters of.
+     * @param o_stats Where to put the counters.
+     */
+    void udp_client_stats_get(udp_client_t *client, udp_stats_t *o_stats);
+
+    /* Turn timing of the inner workings of udp_client_poll() on or off.
+     * @see udp_timing_enable()
+     */
+    UDPERR udp_client_timing_enable(udp_client_t *client, int enable);
+
+    /* Get a copy of one of the timing histograms of a client. @see udp_timing_get()
+     */
+    UDPERR udp_client_timing_get(udp_client_t *client, UDPTIMING which, histogram_t *o_hist, int reset);
+
     /* Run client service in a thread of its own. Callbacks to your application will be made on that 
      * thread. The only function valid to call from your main thread in this case is udp_client_terminate().
      * All other calls should be done in response to callbacks (of which on_idle() may be convenient.)
@@ -0,0 +1,215 @@
+#include "worker.h"
+#include "thread.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+
+struct udp_worker_t {
+    udp_workers_t       *pool;
+    pthread_t           thread;
+    bool                started;
+    pthread_mutex_t     lock;
+    /* signalled when there is work, or it's time to stop */
+    pthread_cond_t      wake;
+    /* signalled when a batch is done */
+    pthread_cond_t      idle;
+    /* udp_work_t to do */
+    vector_t            queue;
+    bool                busy;
+    bool                stopping;
+    /* udp_work_t to send back, gathered during a batch; worker thread only */
+    vector_t            out;
+};
+
+struct udp_workers_t {
+    udp_worker_t        *workers;
+    int                 count;
+    int                 next;
+    void                (*run)(void *context, udp_work_t const *work);
+    void                *context;
+    pthread_mutex_t     lock;
+    /* udp_work_t that came back */
+    vector_t            done;
+};
+
+static __thread udp_worker_t *udp_worker_current;
+
+static void vector_swap(vector_t *a, vector_t *b) {
+    vector_t t = *a;
+    *a = *b;
+    *b = t;
+}
+
+static void udp_worker_publish(udp_worker_t *w) {
+    udp_workers_t *pool = w->pool;
+    if (!w->out.item_count) {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    if (!pool->done.item_count) {
+        vector_swap(&pool->done, &w->out);
+    } else {
+        //  if this fails, peers stay busy and are never freed; better than freeing too early
+        vector_item_insert(&pool->done, pool->done.item_count, vector_item_get(&w->out, 0), w->out.item_count);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    vector_item_remove(&w->out, 0, w->out.item_count);
+}
+
+static void *udp_worker_func(void *arg) {
+    udp_worker_t *w = (udp_worker_t *)arg;
+    udp_workers_t *pool = w->pool;
+    udp_worker_current = w;
+    vector_t batch;
+    vector_init(&batch, sizeof(udp_work_t));
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->queue.item_count && !w->stopping) {
+            pthread_cond_wait(&w->wake, &w->lock);
+        }
+        if (!w->queue.item_count) {
+            //  stopping, and nothing left to do
+            break;
+        }
+        vector_swap(&batch, &w->queue);
+        w->busy = true;
+        pthread_mutex_unlock(&w->lock);
+        for (size_t i = 0, n = batch.item_count; i != n; ++i) {
+            udp_work_t *work = (udp_work_t *)vector_item_get(&batch, i);
+            pool->run(pool->context, work);
+            udp_work_t done = *work;
+            done.kind = UDP_WORK_DONE;
+            vector_item_append(&w->out, &done);
+        }
+        vector_item_remove(&batch, 0, batch.item_count);
+        udp_worker_publish(w);
+        pthread_mutex_lock(&w->lock);
+        w->busy = false;
+        pthread_cond_broadcast(&w->idle);
+    }
+    pthread_mutex_unlock(&w->lock);
+    vector_deinit(&batch);
+    return NULL;
+}
+
+udp_workers_t *udp_workers_create(int count, void (*run)(void *context, udp_work_t const *work), void *context, udp_thread_params_t const *placement, unsigned long numa_nodes) {
+    udp_workers_t *pool = (udp_workers_t *)calloc(1, sizeof(udp_workers_t));
+    if (!pool) {
+        return NULL;
+    }
+    pool->workers = (udp_worker_t *)calloc(count, sizeof(udp_worker_t));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+    pool->count = count;
+    pool->run = run;
+    pool->context = context;
+    pthread_mutex_init(&pool->lock, NULL);
+    vector_init(&pool->done, sizeof(udp_work_t));
+    for (int i = 0; i != count; ++i) {
+        udp_worker_t *w = &pool->workers[i];
+        w->pool = pool;
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->wake, NULL);
+        pthread_cond_init(&w->idle, NULL);
+        vector_init(&w->queue, sizeof(udp_work_t));
+        vector_init(&w->out, sizeof(udp_work_t));
+    }
+    for (int i = 0; i != count; ++i) {
+        udp_worker_t *w = &pool->workers[i];
+        if (udp_thread_start(&w->thread, udp_worker_func, w, placement, i, numa_nodes) != 0) {
+            udp_workers_destroy(pool);
+            return NULL;
+        }
+        w->started = true;
+    }
+    return pool;
+}
+
+void udp_workers_stop(udp_workers_t *pool) {
+    for (int i = 0; i != pool->count; ++i) {
+        udp_worker_t *w = &pool->workers[i];
+        pthread_mutex_lock(&w->lock);
+        w->stopping = true;
+        pthread_cond_signal(&w->wake);
+        pthread_mutex_unlock(&w->lock);
+    }
+    for (int i = 0; i != pool->count; ++i) {
+        udp_worker_t *w = &pool->workers[i];
+        if (w->started) {
+            pthread_join(w->thread, NULL);
+            w->started = false;
+        }
+    }
+}
+
+void udp_workers_destroy(udp_workers_t *pool) {
+    if (!pool) {
+        return;
+    }
+    udp_workers_stop(pool);
+    for (int i = 0; i != pool->count; ++i) {
+        udp_worker_t *w = &pool->workers[i];
+        vector_deinit(&w->queue);
+        vector_deinit(&w->out);
+        pthread_cond_destroy(&w->wake);
+        pthread_cond_destroy(&w->idle);
+        pthread_mutex_destroy(&w->lock);
+    }
+    vector_deinit(&pool->done);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool);
+}
+
+int udp_workers_assign(udp_workers_t *pool) {
+    int worker = pool->next;
+    pool->next = (pool->next + 1) % pool->count;
+    return worker;
+}
+
+int udp_workers_post(udp_workers_t *pool, int worker, udp_work_t const *work) {
+    udp_worker_t *w = &pool->workers[worker];
+    pthread_mutex_lock(&w->lock);
+    size_t n = vector_item_append(&w->queue, work);
+    pthread_mutex_unlock(&w->lock);
+    if (n == 1) {
+        //  it may be asleep; if there was work already, it isn't
+        pthread_cond_signal(&w->wake);
+    }
+    return n ? 0 : -1;
+}
+
+int udp_workers_defer(udp_work_t const *work) {
+    udp_worker_t *w = udp_worker_current;
+    if (!w) {
+        return 0;
+    }
+    return vector_item_append(&w->out, work) ? 1 : -1;
+}
+
+void udp_workers_collect(udp_workers_t *pool, vector_t *io_done) {
+    pthread_mutex_lock(&pool->lock);
+    if (!io_done->item_count) {
+        vector_swap(&pool->done, io_done);
+    } else if (pool->done.item_count &&
+            vector_item_insert(io_done, io_done->item_count, vector_item_get(&pool->done, 0), pool->done.item_count)) {
+        //  if that failed, it's left for next time
+        vector_item_remove(&pool->done, 0, pool->done.item_count);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void udp_workers_drain(udp_workers_t *pool) {
+    for (int i = 0; i != pool->count; ++i) {
+        udp_worker_t *w = &pool->workers[i];
+        pthread_mutex_lock(&w->lock);
+        while (w->queue.item_count || w->busy) {
+            pthread_cond_wait(&w->idle, &w->lock);
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+}
@@ -0,0 +1,96 @@
+#if !defined(onyxudp_worker_h)
+#define onyxudp_worker_h
+
+/* Internal support for udp_params_t::worker_threads.
+ *
+ * The polling thread hands group callbacks to a pool of threads, as udp_work_t items.
+ * Each group always goes to the same thread, so a group's callbacks run one at a time
+ * and in order, while those of different groups run side by side. What a callback asks
+ * of the library (sending, mostly) can't touch the polling thread's state from there,
+ * so that goes back to the polling thread as udp_work_t too, followed by a note that the
+ * callback is done, so the polling thread can let go of the peer and payload. Since
+ * each worker sends its results back in order, the peer and group are still there when
+ * the polling thread gets to them.
+ *
+ * Both ways, work goes through a vector behind a mutex, taken whole by the other side.
+ * A worker is only woken when its queue goes from empty to not, so a busy one costs
+ * the polling thread a lock and an append per callback.
+ */
+
+#include <stdint.h>
+#include <onyxutil/vector.h>
+
+typedef struct udp_group_t udp_group_t;
+typedef struct udp_peer_t udp_peer_t;
+typedef struct udp_payload_t udp_payload_t;
+typedef struct udp_peer_message_t udp_peer_message_t;
+typedef struct udp_thread_params_t udp_thread_params_t;
+
+enum UDPWORK {
+    /* to a worker: call on_peer_message() */
+    UDP_WORK_MESSAGE = 0,
+    /* to a worker: call on_peer_removed() */
+    UDP_WORK_REMOVED = 1,
+    /* back: a MESSAGE, MESSAGES or REMOVED is done; let go of the peers and payloads */
+    UDP_WORK_DONE = 2,
+    /* back: udp_peer_channel_enqueue() */
+    UDP_WORK_PEER_SEND = 3,
+    /* back: udp_group_channel_enqueue() */
+    UDP_WORK_GROUP_SEND = 4,
+    /* back: udp_group_peer_remove() */
+    UDP_WORK_PEER_REMOVE = 5,
+    /* to a worker: call on_peer_messages() */
+    UDP_WORK_MESSAGES = 6
+};
+
+typedef struct udp_work_t {
+    uint8_t             kind;
+    uint8_t             channel;
+    /* UDPPEER, for UDP_WORK_REMOVED */
+    uint16_t            reason;
+    udp_group_t         *group;
+    udp_peer_t          *peer;
+    udp_payload_t       *payload;
+    /* for UDP_WORK_MESSAGES, instead of peer and payload; malloc()ed, each one held */
+    udp_peer_message_t  *messages;
+    size_t              count;
+} udp_work_t;
+
+typedef struct udp_workers_t udp_workers_t;
+
+/* Start count threads, which do each udp_work_t they're given with run(context, work).
+ * Worker i runs on the i-th of placement's CPUs (modulo their count), if placement isn't
+ * NULL, and prefers numa_nodes for its memory (@see udp_thread_start()).
+ * @return NULL if out of memory or threads, or the placement isn't allowed.
+ */
+udp_workers_t *udp_workers_create(int count, void (*run)(void *context, udp_work_t const *work), void *context, udp_thread_params_t const *placement, unsigned long numa_nodes);
+
+/* Finish the work handed out, and stop the threads. What came back is left for a last
+ * udp_workers_collect().
+ */
+void udp_workers_stop(udp_workers_t *workers);
+void udp_workers_destroy(udp_workers_t *workers);
+
+/* @return the worker for the next group, taking turns. */
+int udp_workers_assign(udp_workers_t *workers);
+
+/* Hand work to a worker.
+ * @return 0, or -1 if out of memory.
+ */
+int udp_workers_post(udp_workers_t *workers, int worker, udp_work_t const *work);
+
+/* Called from anywhere: if this is a worker thread, queue work to go back to the
+ * polling thread.
+ * @return 1 if queued, 0 if this isn't a worker thread, -1 if out of memory.
+ */
+int udp_workers_defer(udp_work_t const *work);
+
+/* Take what has come back, in the order it was done by each worker, and append it to
+ * *io_done, which holds udp_work_t.
+ */
+void udp_workers_collect(udp_workers_t *workers, vector_t *io_done);
+
+/* Wait until everything handed out so far is done. */
+void udp_workers_drain(udp_workers_t *workers);
+
+#endif  //  onyxudp_worker_h
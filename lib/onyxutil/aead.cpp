@@ -0,0 +1,289 @@
+#include "aead.h"
+
+#include <string.h>
+
+
+static inline uint32_t load32(unsigned char const *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline void store32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static inline void store64(unsigned char *p, uint64_t v) {
+    store32(p, (uint32_t)v);
+    store32(p + 4, (uint32_t)(v >> 32));
+}
+
+#define ROTL(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTERROUND(a, b, c, d) \
+    do { \
+        a += b; d ^= a; d = ROTL(d, 16); \
+        c += d; b ^= c; b = ROTL(b, 12); \
+        a += b; d ^= a; d = ROTL(d, 8); \
+        c += d; b ^= c; b = ROTL(b, 7); \
+    } while (0)
+#define DOUBLEROUND(x) \
+    do { \
+        QUARTERROUND(x[0], x[4], x[8], x[12]); \
+        QUARTERROUND(x[1], x[5], x[9], x[13]); \
+        QUARTERROUND(x[2], x[6], x[10], x[14]); \
+        QUARTERROUND(x[3], x[7], x[11], x[15]); \
+        QUARTERROUND(x[0], x[5], x[10], x[15]); \
+        QUARTERROUND(x[1], x[6], x[11], x[12]); \
+        QUARTERROUND(x[2], x[7], x[8], x[13]); \
+        QUARTERROUND(x[3], x[4], x[9], x[14]); \
+    } while (0)
+
+static void chacha20_init(uint32_t *state, unsigned char const *key, uint32_t counter, unsigned char const *nonce) {
+    //  "expand 32-byte k"
+    state[0] = 0x61707865;
+    state[1] = 0x3320646e;
+    state[2] = 0x79622d32;
+    state[3] = 0x6b206574;
+    for (int i = 0; i != 8; ++i) {
+        state[4 + i] = load32(key + 4 * i);
+    }
+    state[12] = counter;
+    for (int i = 0; i != 3; ++i) {
+        state[13 + i] = load32(nonce + 4 * i);
+    }
+}
+
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+
+//  Four consecutive blocks of key stream, one per vector lane, so every operation
+//  in the rounds works on all four at once.
+static void chacha20_blocks4(unsigned char *out, uint32_t const *state) {
+    u32x4 in[16], x[16];
+    for (int i = 0; i != 16; ++i) {
+        u32x4 v = { state[i], state[i], state[i], state[i] };
+        in[i] = v;
+    }
+    u32x4 lanes = { 0, 1, 2, 3 };
+    in[12] += lanes;
+    for (int i = 0; i != 16; ++i) {
+        x[i] = in[i];
+    }
+    for (int i = 0; i != 10; ++i) {
+        DOUBLEROUND(x);
+    }
+    for (int i = 0; i != 16; ++i) {
+        x[i] += in[i];
+    }
+    for (int b = 0; b != 4; ++b) {
+        for (int i = 0; i != 16; ++i) {
+            store32(out + 64 * b + 4 * i, x[i][b]);
+        }
+    }
+}
+
+void chacha20_xor(unsigned char *out, unsigned char const *in, size_t size, unsigned char const *key, unsigned char const *nonce, uint32_t counter) {
+    uint32_t state[16];
+    unsigned char stream[256];
+    chacha20_init(state, key, counter, nonce);
+    while (size) {
+        chacha20_blocks4(stream, state);
+        state[12] += 4;
+        size_t n = size < sizeof(stream) ? size : sizeof(stream);
+        for (size_t i = 0; i != n; ++i) {
+            out[i] = in[i] ^ stream[i];
+        }
+        out += n;
+        in += n;
+        size -= n;
+    }
+    memset(stream, 0, sizeof(stream));
+}
+
+void hchacha20(unsigned char *out, unsigned char const *key, unsigned char const *in) {
+    uint32_t x[16];
+    chacha20_init(x, key, load32(in), in + 4);
+    for (int i = 0; i != 10; ++i) {
+        DOUBLEROUND(x);
+    }
+    for (int i = 0; i != 4; ++i) {
+        store32(out + 4 * i, x[i]);
+        store32(out + 16 + 4 * i, x[12 + i]);
+    }
+}
+
+//  Poly1305, in 26-bit limbs so that products fit in 64 bits.
+
+struct poly1305_state {
+    uint32_t r[5];
+    uint32_t h[5];
+    uint32_t pad[4];
+    size_t leftover;
+    unsigned char buffer[16];
+};
+
+static void poly1305_init(poly1305_state *st, unsigned char const *key) {
+    //  r gets clamped, as the spec requires
+    st->r[0] = (load32(key + 0)) & 0x3ffffff;
+    st->r[1] = (load32(key + 3) >> 2) & 0x3ffff03;
+    st->r[2] = (load32(key + 6) >> 4) & 0x3ffc0ff;
+    st->r[3] = (load32(key + 9) >> 6) & 0x3f03fff;
+    st->r[4] = (load32(key + 12) >> 8) & 0x00fffff;
+    for (int i = 0; i != 5; ++i) {
+        st->h[i] = 0;
+    }
+    for (int i = 0; i != 4; ++i) {
+        st->pad[i] = load32(key + 16 + 4 * i);
+    }
+    st->leftover = 0;
+}
+
+static void poly1305_blocks(poly1305_state *st, unsigned char const *m, size_t size, uint32_t hibit) {
+    uint32_t r0 = st->r[0], r1 = st->r[1], r2 = st->r[2], r3 = st->r[3], r4 = st->r[4];
+    uint32_t s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+    while (size >= 16) {
+        h0 += (load32(m + 0)) & 0x3ffffff;
+        h1 += (load32(m + 3) >> 2) & 0x3ffffff;
+        h2 += (load32(m + 6) >> 4) & 0x3ffffff;
+        h3 += (load32(m + 9) >> 6) & 0x3ffffff;
+        h4 += (load32(m + 12) >> 8) | hibit;
+
+        uint64_t d0 = (uint64_t)h0 * r0 + (uint64_t)h1 * s4 + (uint64_t)h2 * s3 + (uint64_t)h3 * s2 + (uint64_t)h4 * s1;
+        uint64_t d1 = (uint64_t)h0 * r1 + (uint64_t)h1 * r0 + (uint64_t)h2 * s4 + (uint64_t)h3 * s3 + (uint64_t)h4 * s2;
+        uint64_t d2 = (uint64_t)h0 * r2 + (uint64_t)h1 * r1 + (uint64_t)h2 * r0 + (uint64_t)h3 * s4 + (uint64_t)h4 * s3;
+        uint64_t d3 = (uint64_t)h0 * r3 + (uint64_t)h1 * r2 + (uint64_t)h2 * r1 + (uint64_t)h3 * r0 + (uint64_t)h4 * s4;
+        uint64_t d4 = (uint64_t)h0 * r4 + (uint64_t)h1 * r3 + (uint64_t)h2 * r2 + (uint64_t)h3 * r1 + (uint64_t)h4 * r0;
+
+        uint32_t c = (uint32_t)(d0 >> 26); h0 = (uint32_t)d0 & 0x3ffffff;
+        d1 += c; c = (uint32_t)(d1 >> 26); h1 = (uint32_t)d1 & 0x3ffffff;
+        d2 += c; c = (uint32_t)(d2 >> 26); h2 = (uint32_t)d2 & 0x3ffffff;
+        d3 += c; c = (uint32_t)(d3 >> 26); h3 = (uint32_t)d3 & 0x3ffffff;
+        d4 += c; c = (uint32_t)(d4 >> 26); h4 = (uint32_t)d4 & 0x3ffffff;
+        h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+        h1 += c;
+
+        m += 16;
+        size -= 16;
+    }
+    st->h[0] = h0;
+    st->h[1] = h1;
+    st->h[2] = h2;
+    st->h[3] = h3;
+    st->h[4] = h4;
+}
+
+static void poly1305_update(poly1305_state *st, unsigned char const *m, size_t size) {
+    if (st->leftover) {
+        size_t want = 16 - st->leftover;
+        if (want > size) {
+            want = size;
+        }
+        memcpy(st->buffer + st->leftover, m, want);
+        st->leftover += want;
+        m += want;
+        size -= want;
+        if (st->leftover < 16) {
+            return;
+        }
+        poly1305_blocks(st, st->buffer, 16, 1 << 24);
+        st->leftover = 0;
+    }
+    size_t whole = size & ~(size_t)15;
+    poly1305_blocks(st, m, whole, 1 << 24);
+    memcpy(st->buffer, m + whole, size - whole);
+    st->leftover = size - whole;
+}
+
+static void poly1305_finish(poly1305_state *st, unsigned char *tag) {
+    if (st->leftover) {
+        //  the last partial block is padded with a 1 and zeros, instead of the high bit
+        st->buffer[st->leftover] = 1;
+        memset(st->buffer + st->leftover + 1, 0, 15 - st->leftover);
+        poly1305_blocks(st, st->buffer, 16, 0);
+    }
+    uint32_t h0 = st->h[0], h1 = st->h[1], h2 = st->h[2], h3 = st->h[3], h4 = st->h[4];
+    uint32_t c;
+    c = h1 >> 26; h1 &= 0x3ffffff;
+    h2 += c; c = h2 >> 26; h2 &= 0x3ffffff;
+    h3 += c; c = h3 >> 26; h3 &= 0x3ffffff;
+    h4 += c; c = h4 >> 26; h4 &= 0x3ffffff;
+    h0 += c * 5; c = h0 >> 26; h0 &= 0x3ffffff;
+    h1 += c;
+
+    //  h - p, which is what we want unless it's negative
+    uint32_t g0 = h0 + 5; c = g0 >> 26; g0 &= 0x3ffffff;
+    uint32_t g1 = h1 + c; c = g1 >> 26; g1 &= 0x3ffffff;
+    uint32_t g2 = h2 + c; c = g2 >> 26; g2 &= 0x3ffffff;
+    uint32_t g3 = h3 + c; c = g3 >> 26; g3 &= 0x3ffffff;
+    uint32_t g4 = h4 + c - (1 << 26);
+    uint32_t mask = (g4 >> 31) - 1;
+    h0 = (h0 & ~mask) | (g0 & mask);
+    h1 = (h1 & ~mask) | (g1 & mask);
+    h2 = (h2 & ~mask) | (g2 & mask);
+    h3 = (h3 & ~mask) | (g3 & mask);
+    h4 = (h4 & ~mask) | (g4 & mask);
+
+    //  back to 32-bit words, mod 2^128, plus the pad
+    uint32_t w0 = h0 | (h1 << 26);
+    uint32_t w1 = (h1 >> 6) | (h2 << 20);
+    uint32_t w2 = (h2 >> 12) | (h3 << 14);
+    uint32_t w3 = (h3 >> 18) | (h4 << 8);
+    uint64_t f = (uint64_t)w0 + st->pad[0];
+    store32(tag + 0, (uint32_t)f);
+    f = (uint64_t)w1 + st->pad[1] + (f >> 32);
+    store32(tag + 4, (uint32_t)f);
+    f = (uint64_t)w2 + st->pad[2] + (f >> 32);
+    store32(tag + 8, (uint32_t)f);
+    f = (uint64_t)w3 + st->pad[3] + (f >> 32);
+    store32(tag + 12, (uint32_t)f);
+    memset(st, 0, sizeof(*st));
+}
+
+void poly1305(unsigned char *tag, void const *data, size_t size, unsigned char const *key) {
+    poly1305_state st;
+    poly1305_init(&st, key);
+    poly1305_update(&st, (unsigned char const *)data, size);
+    poly1305_finish(&st, tag);
+}
+
+//  The tag covers the additional data and the cipher text, each padded to 16 bytes,
+//  and then both their sizes. The Poly1305 key is the first block of key stream.
+static void aead_tag(unsigned char *tag, void const *ad, size_t ad_size, unsigned char const *ct, size_t size, unsigned char const *key, unsigned char const *nonce) {
+    static unsigned char const zeros[16] = { 0 };
+    unsigned char otk[64];
+    memset(otk, 0, sizeof(otk));
+    chacha20_xor(otk, otk, sizeof(otk), key, nonce, 0);
+    poly1305_state st;
+    poly1305_init(&st, otk);
+    poly1305_update(&st, (unsigned char const *)ad, ad_size);
+    poly1305_update(&st, zeros, (16 - (ad_size & 15)) & 15);
+    poly1305_update(&st, ct, size);
+    poly1305_update(&st, zeros, (16 - (size & 15)) & 15);
+    unsigned char sizes[16];
+    store64(sizes, ad_size);
+    store64(sizes + 8, size);
+    poly1305_update(&st, sizes, sizeof(sizes));
+    poly1305_finish(&st, tag);
+    memset(otk, 0, sizeof(otk));
+}
+
+void aead_seal(unsigned char *out, unsigned char *tag, void const *ad, size_t ad_size, unsigned char const *in, size_t size, unsigned char const *key, unsigned char const *nonce) {
+    chacha20_xor(out, in, size, key, nonce, 1);
+    aead_tag(tag, ad, ad_size, out, size, key, nonce);
+}
+
+int aead_open(unsigned char *out, unsigned char const *tag, void const *ad, size_t ad_size, unsigned char const *in, size_t size, unsigned char const *key, unsigned char const *nonce) {
+    unsigned char expected[AEAD_TAG_SIZE];
+    aead_tag(expected, ad, ad_size, in, size, key, nonce);
+    //  compare without an early out, so the time taken says nothing about the tag
+    unsigned char diff = 0;
+    for (int i = 0; i != AEAD_TAG_SIZE; ++i) {
+        diff |= expected[i] ^ tag[i];
+    }
+    if (diff) {
+        return -1;
+    }
+    chacha20_xor(out, in, size, key, nonce, 1);
+    return 0;
+}
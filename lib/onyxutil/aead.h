@@ -0,0 +1,59 @@
+/* ChaCha20-Poly1305 authenticated encryption, as in RFC 8439, and the pieces it is
+ * made of.
+ *
+ * ChaCha20 generates its key stream four blocks at a time, one block per lane of a
+ * 4 x 32-bit vector (GCC vector extensions), so it runs on SSE2 on x86-64 and on
+ * NEON on ARM without anything special in the build; with -mavx2 the compiler can
+ * widen it further. Poly1305 is the 32-bit "donna" formulation.
+ *
+ * Neither the key stream nor the MAC depends on secret-dependent branches or table
+ * lookups, so the timing doesn't leak keys.
+ */
+
+#if !defined(onyxutil_aead_h)
+#define onyxutil_aead_h
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    enum {
+        AEAD_KEY_SIZE = 32,
+        AEAD_NONCE_SIZE = 12,
+        AEAD_TAG_SIZE = 16
+    };
+
+    /* XOR size bytes of in with the ChaCha20 key stream, starting at block counter,
+     * into out. out may be the same as in.
+     */
+    void chacha20_xor(unsigned char *out, unsigned char const *in, size_t size, unsigned char const *key, unsigned char const *nonce, uint32_t counter);
+
+    /* HChaCha20: derive a 32-byte key from a key and 16 bytes of input. The result
+     * can't be told apart from random without the key, so it works for deriving
+     * keys from a shared secret and a label.
+     */
+    void hchacha20(unsigned char *out, unsigned char const *key, unsigned char const *in);
+
+    /* The one-time authenticator. Never use a key for more than one message. */
+    void poly1305(unsigned char *tag, void const *data, size_t size, unsigned char const *key);
+
+    /* Encrypt size bytes of in into out (which may be in), and compute a tag over
+     * the additional data and the cipher text. Never use a key and nonce for more
+     * than one message.
+     */
+    void aead_seal(unsigned char *out, unsigned char *tag, void const *ad, size_t ad_size, unsigned char const *in, size_t size, unsigned char const *key, unsigned char const *nonce);
+
+    /* Check the tag, and if it's good, decrypt size bytes of in into out (which may
+     * be in.)
+     * @return 0 for success, -1 if the tag doesn't match (and out is not written.)
+     */
+    int aead_open(unsigned char *out, unsigned char const *tag, void const *ad, size_t ad_size, unsigned char const *in, size_t size, unsigned char const *key, unsigned char const *nonce);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif  //  onyxutil_aead_h
@@ -0,0 +1,295 @@
+
+#include "compress.h"
+#include <string.h>
+
+
+#define COMPRESS_MIN_MATCH 4
+#define COMPRESS_MAX_OFFSET 65535
+//  After this many literals in a row without a match, start skipping ahead
+//  faster; data that doesn't compress shouldn't cost much time.
+#define COMPRESS_SKIP_SHIFT 6
+
+//  Training looks at byte strings of this length ...
+#define TRAIN_KMER 8
+//  ... and builds the dictionary out of segments of this length.
+#define TRAIN_SEGMENT 32
+#define TRAIN_HASH_BITS 16
+
+static inline uint32_t read32(unsigned char const *p) {
+    uint32_t r;
+    memcpy(&r, p, 4);
+    return r;
+}
+
+static inline uint32_t hash32(uint32_t v, int bits) {
+    return (v * 2654435761u) >> (32 - bits);
+}
+
+/* The compressor sees the dictionary and the data as one buffer; "virtual"
+ * positions below dsize are in the dictionary.
+ */
+static inline unsigned char vbyte(unsigned char const *dict, size_t dsize, unsigned char const *data, size_t v) {
+    return v < dsize ? dict[v] : data[v - dsize];
+}
+
+int compress_dict_init(compress_dict_t *dict, void const *data, size_t size) {
+    memset(dict, 0, sizeof(*dict));
+    if (size > COMPRESS_MAX_DICT_SIZE) {
+        return -1;
+    }
+    if (size) {
+        dict->data = (unsigned char *)malloc(size);
+        if (!dict->data) {
+            return -1;
+        }
+        memcpy(dict->data, data, size);
+        dict->size = size;
+    }
+    for (size_t i = 0; i + COMPRESS_MIN_MATCH <= size; ++i) {
+        dict->table[hash32(read32(dict->data + i), COMPRESS_HASH_BITS)] = (uint16_t)(i + 1);
+    }
+    return 0;
+}
+
+void compress_dict_deinit(compress_dict_t *dict) {
+    if (!dict) {
+        return;
+    }
+    free(dict->data);
+    dict->data = NULL;
+    dict->size = 0;
+}
+
+size_t compress_bound(size_t size) {
+    return size + size / 255 + 16;
+}
+
+static inline size_t put_length(unsigned char *out, size_t o, size_t out_size, size_t len) {
+    while (len >= 255) {
+        if (o == out_size) {
+            return 0;
+        }
+        out[o++] = 255;
+        len -= 255;
+    }
+    if (o == out_size) {
+        return 0;
+    }
+    out[o++] = (unsigned char)len;
+    return o;
+}
+
+/* Emit one sequence. A match_len of 0 means the last sequence (literals only.)
+ * @return the new output position, or 0 if out of space.
+ */
+static size_t put_sequence(unsigned char *out, size_t o, size_t out_size, unsigned char const *lit, size_t lit_len, size_t offset, size_t match_len) {
+    if (o == out_size) {
+        return 0;
+    }
+    size_t ml = match_len ? match_len - COMPRESS_MIN_MATCH : 0;
+    out[o++] = (unsigned char)(((lit_len < 15 ? lit_len : 15) << 4) | (ml < 15 ? ml : 15));
+    if (lit_len >= 15) {
+        o = put_length(out, o, out_size, lit_len - 15);
+        if (!o) {
+            return 0;
+        }
+    }
+    if (out_size - o < lit_len) {
+        return 0;
+    }
+    memcpy(out + o, lit, lit_len);
+    o += lit_len;
+    if (!match_len) {
+        return o;
+    }
+    if (out_size - o < 2) {
+        return 0;
+    }
+    out[o++] = (unsigned char)(offset & 0xff);
+    out[o++] = (unsigned char)(offset >> 8);
+    if (ml >= 15) {
+        o = put_length(out, o, out_size, ml - 15);
+    }
+    return o;
+}
+
+size_t compress_block(compress_dict_t const *dict, void const *data, size_t size, void *out, size_t out_size) {
+    unsigned char const *src = (unsigned char const *)data;
+    unsigned char *dst = (unsigned char *)out;
+    unsigned char const *dd = dict ? dict->data : NULL;
+    size_t dsize = dict ? dict->size : 0;
+    if (size > COMPRESS_MAX_BLOCK_SIZE || dsize + size > 65535) {
+        return 0;
+    }
+    uint16_t table[1 << COMPRESS_HASH_BITS];
+    if (dict) {
+        memcpy(table, dict->table, sizeof(table));
+    } else {
+        memset(table, 0, sizeof(table));
+    }
+    size_t o = 0;
+    size_t anchor = 0;
+    size_t i = 0;
+    while (i + COMPRESS_MIN_MATCH <= size) {
+        size_t v = dsize + i;
+        uint32_t h = hash32(read32(src + i), COMPRESS_HASH_BITS);
+        size_t cand = table[h];
+        table[h] = (uint16_t)(v + 1);
+        if (cand) {
+            size_t c = cand - 1;
+            size_t len = 0;
+            while (i + len < size && vbyte(dd, dsize, src, c + len) == src[i + len]) {
+                ++len;
+            }
+            if (len >= COMPRESS_MIN_MATCH && v - c <= COMPRESS_MAX_OFFSET) {
+                o = put_sequence(dst, o, out_size, src + anchor, i - anchor, v - c, len);
+                if (!o) {
+                    return 0;
+                }
+                i += len;
+                anchor = i;
+                continue;
+            }
+        }
+        i += 1 + ((i - anchor) >> COMPRESS_SKIP_SHIFT);
+    }
+    return put_sequence(dst, o, out_size, src + anchor, size - anchor, 0, 0);
+}
+
+static inline int get_length(unsigned char const *in, size_t *i, size_t size, size_t *len) {
+    unsigned char c;
+    do {
+        if (*i == size) {
+            return -1;
+        }
+        c = in[(*i)++];
+        *len += c;
+    } while (c == 255);
+    return 0;
+}
+
+int decompress_block(compress_dict_t const *dict, void const *data, size_t size, void *out, size_t out_size) {
+    unsigned char const *src = (unsigned char const *)data;
+    unsigned char *dst = (unsigned char *)out;
+    unsigned char const *dd = dict ? dict->data : NULL;
+    size_t dsize = dict ? dict->size : 0;
+    size_t i = 0, o = 0;
+    while (i < size) {
+        unsigned char token = src[i++];
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && get_length(src, &i, size, &lit_len) < 0) {
+            return -1;
+        }
+        if (lit_len > size - i || lit_len > out_size - o) {
+            return -1;
+        }
+        memcpy(dst + o, src + i, lit_len);
+        i += lit_len;
+        o += lit_len;
+        if (i == size) {
+            break;
+        }
+        if (size - i < 2) {
+            return -1;
+        }
+        size_t offset = src[i] | ((size_t)src[i + 1] << 8);
+        i += 2;
+        size_t len = token & 15;
+        if (len == 15 && get_length(src, &i, size, &len) < 0) {
+            return -1;
+        }
+        len += COMPRESS_MIN_MATCH;
+        if (offset == 0 || offset > o + dsize || len > out_size - o) {
+            return -1;
+        }
+        //  byte at a time; matches may overlap what they produce, or start in the dictionary
+        for (size_t e = o + len; o != e; ++o) {
+            dst[o] = offset > o ? dd[dsize + o - offset] : dst[o - offset];
+        }
+    }
+    return (int)o;
+}
+
+struct train_segment_t {
+    uint32_t    score;
+    uint32_t    length;
+    unsigned char const *data;
+};
+
+static int train_segment_comp(void const *a, void const *b) {
+    uint32_t sa = ((train_segment_t const *)a)->score;
+    uint32_t sb = ((train_segment_t const *)b)->score;
+    return sa > sb ? -1 : sa < sb ? 1 : 0;
+}
+
+static inline uint32_t kmer_hash(unsigned char const *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return (uint32_t)((v * 0x9E3779B97F4A7C15ull) >> (64 - TRAIN_HASH_BITS));
+}
+
+size_t compress_dict_train(void const * const *samples, size_t const *sizes, size_t count, void *out, size_t out_size) {
+    size_t nsegments = 0;
+    for (size_t s = 0; s != count; ++s) {
+        if (sizes[s] >= TRAIN_KMER) {
+            nsegments += (sizes[s] - TRAIN_KMER) / (TRAIN_SEGMENT / 2) + 1;
+        }
+    }
+    uint16_t *counts = (uint16_t *)calloc(1 << TRAIN_HASH_BITS, sizeof(uint16_t));
+    unsigned char *used = (unsigned char *)calloc(1 << TRAIN_HASH_BITS, 1);
+    train_segment_t *segments = (train_segment_t *)malloc((nsegments ? nsegments : 1) * sizeof(train_segment_t));
+    size_t pos = out_size;
+    if (!counts || !used || !segments) {
+        goto done;
+    }
+    //  how common is each byte string?
+    for (size_t s = 0; s != count; ++s) {
+        unsigned char const *p = (unsigned char const *)samples[s];
+        for (size_t j = 0; j + TRAIN_KMER <= sizes[s]; ++j) {
+            uint16_t &c = counts[kmer_hash(p + j)];
+            if (c != 0xffff) {
+                ++c;
+            }
+        }
+    }
+    //  score overlapping segments by how common the strings in them are; strings
+    //  seen only once are worth nothing
+    nsegments = 0;
+    for (size_t s = 0; s != count; ++s) {
+        unsigned char const *p = (unsigned char const *)samples[s];
+        for (size_t off = 0; off + TRAIN_KMER <= sizes[s]; off += TRAIN_SEGMENT / 2) {
+            train_segment_t &seg = segments[nsegments++];
+            seg.data = p + off;
+            seg.length = (uint32_t)(sizes[s] - off < TRAIN_SEGMENT ? sizes[s] - off : TRAIN_SEGMENT);
+            seg.score = 0;
+            for (size_t j = 0; j + TRAIN_KMER <= seg.length; ++j) {
+                seg.score += counts[kmer_hash(seg.data + j)] - 1;
+            }
+        }
+    }
+    qsort(segments, nsegments, sizeof(train_segment_t), train_segment_comp);
+    //  fill from the end, best first, skipping segments that are mostly repeats
+    //  of what's already in there
+    for (size_t k = 0; k != nsegments && segments[k].score; ++k) {
+        train_segment_t const &seg = segments[k];
+        size_t total = 0, fresh = 0;
+        for (size_t j = 0; j + TRAIN_KMER <= seg.length; ++j) {
+            ++total;
+            fresh += !used[kmer_hash(seg.data + j)];
+        }
+        if (fresh * 2 < total || seg.length > pos) {
+            continue;
+        }
+        pos -= seg.length;
+        memcpy((unsigned char *)out + pos, seg.data, seg.length);
+        for (size_t j = 0; j + TRAIN_KMER <= seg.length; ++j) {
+            used[kmer_hash(seg.data + j)] = 1;
+        }
+    }
+    memmove(out, (unsigned char *)out + pos, out_size - pos);
+done:
+    free(counts);
+    free(used);
+    free(segments);
+    return out_size - pos;
+}
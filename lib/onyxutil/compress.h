@@ -0,0 +1,105 @@
+/* A fast LZ77-style block compressor, in the spirit of LZ4, meant for
+ * compressing individual packets. Packets are too small to build up much
+ * context of their own, so the compressor can be primed with a dictionary
+ * of data that typically shows up in packets; matches can then reach back
+ * into the dictionary. Use compress_dict_train() to build a dictionary from
+ * a set of captured packets.
+ *
+ * The compressed format is a sequence of:
+ *
+ * token (1 byte: literal count in the high nibble, match length - 4 in the low)
+ * <more literal count, if the high nibble is 15: bytes of 255, then the rest>
+ * <literal count bytes of literals>
+ * match offset (2 bytes, little-endian, 1 .. 65535)
+ * <more match length, if the low nibble is 15: bytes of 255, then the rest>
+ *
+ * The last sequence ends after its literals, with no match. An offset that
+ * reaches back before the start of the data refers to the end of the
+ * dictionary.
+ */
+
+#if !defined(onyxutil_compress_h)
+#define onyxutil_compress_h
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    enum {
+        COMPRESS_HASH_BITS = 12,
+        /* The biggest dictionary compress_dict_init() takes. */
+        COMPRESS_MAX_DICT_SIZE = 16384,
+        /* The most data compress_block() takes (with a full size dictionary) */
+        COMPRESS_MAX_BLOCK_SIZE = 65535 - COMPRESS_MAX_DICT_SIZE
+    };
+
+    typedef struct compress_dict_t {
+        unsigned char   *data;
+        size_t          size;
+        /* The match finder table, pre-loaded with the dictionary, so each
+         * compress_block() call starts from a copy of it.
+         */
+        uint16_t        table[1 << COMPRESS_HASH_BITS];
+    } compress_dict_t;
+
+    /* Initialize a dictionary for compress_block() and decompress_block().
+     * @param dict The dictionary to initialize.
+     * @param data The dictionary data. This is copied.
+     * @param size The size of the dictionary data, at most COMPRESS_MAX_DICT_SIZE.
+     * @return 0 on success, -1 if out of memory or the dictionary is too big.
+     */
+    int compress_dict_init(compress_dict_t *dict, void const *data, size_t size);
+
+    /* Free memory allocated by compress_dict_init().
+     * @param dict The dictionary to deinitialize.
+     */
+    void compress_dict_deinit(compress_dict_t *dict);
+
+    /* Build a dictionary out of sample data (typically, captured packets.)
+     * Byte strings that show up often across the samples are put in the
+     * dictionary, the most common ones at the end, where they are cheapest
+     * to reach.
+     * @param samples Pointers to the samples.
+     * @param sizes The size of each sample.
+     * @param count The number of samples.
+     * @param out Where to put the dictionary.
+     * @param out_size The biggest dictionary to build.
+     * @return The size of the built dictionary.
+     */
+    size_t compress_dict_train(void const * const *samples, size_t const *sizes, size_t count, void *out, size_t out_size);
+
+    /* @return the largest number of bytes compress_block() can produce for the
+     * given data size.
+     */
+    size_t compress_bound(size_t size);
+
+    /* Compress data.
+     * @param dict The dictionary, or NULL for none.
+     * @param data The data to compress.
+     * @param size The size of the data, at most COMPRESS_MAX_BLOCK_SIZE.
+     * @param out Where to put the compressed data.
+     * @param out_size The size of the out buffer.
+     * @return the size of the compressed data, or 0 if it doesn't fit in out_size
+     * (so passing out_size = size - 1 means "only if it gets smaller.")
+     */
+    size_t compress_block(compress_dict_t const *dict, void const *data, size_t size, void *out, size_t out_size);
+
+    /* Decompress data produced by compress_block().
+     * @param dict The dictionary used to compress the data, or NULL for none.
+     * @param data The compressed data.
+     * @param size The size of the compressed data.
+     * @param out Where to put the decompressed data.
+     * @param out_size The size of the out buffer.
+     * @return the size of the decompressed data, or -1 if the data is malformed
+     * or doesn't fit in out_size.
+     */
+    int decompress_block(compress_dict_t const *dict, void const *data, size_t size, void *out, size_t out_size);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif  //  onyxutil_compress_h
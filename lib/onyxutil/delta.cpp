@@ -0,0 +1,127 @@
+
+#include "delta.h"
+#include <string.h>
+#include <stdint.h>
+
+
+//  A zero run shorter than this costs as much to encode as to keep in the literal.
+#define DELTA_MIN_ZERO_RUN 3
+
+static inline unsigned char xor_at(unsigned char const *base, size_t base_size, unsigned char const *data, size_t i) {
+    return i < base_size ? (data[i] ^ base[i]) : data[i];
+}
+
+static inline size_t put_varint(unsigned char *out, size_t o, size_t out_size, size_t v) {
+    while (v >= 0x80) {
+        if (o == out_size) {
+            return 0;
+        }
+        out[o++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    if (o == out_size) {
+        return 0;
+    }
+    out[o++] = (unsigned char)v;
+    return o;
+}
+
+static inline int get_varint(unsigned char const *in, size_t *i, size_t in_size, size_t *v) {
+    size_t r = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (*i == in_size) {
+            return -1;
+        }
+        unsigned char c = in[(*i)++];
+        r |= (size_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *v = r;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* out[from..to) = base[from..to), zero extended */
+static void copy_base(unsigned char *out, unsigned char const *base, size_t base_size, size_t from, size_t to) {
+    if (from < base_size) {
+        size_t n = (to < base_size ? to : base_size) - from;
+        memcpy(out + from, base + from, n);
+        from += n;
+    }
+    if (from < to) {
+        memset(out + from, 0, to - from);
+    }
+}
+
+size_t delta_encode_bound(size_t size) {
+    return size + size / 128 + 16;
+}
+
+size_t delta_encode(void const *base, size_t base_size, void const *data, size_t size, void *out, size_t out_size) {
+    unsigned char const *b = (unsigned char const *)base;
+    unsigned char const *d = (unsigned char const *)data;
+    unsigned char *o = (unsigned char *)out;
+    if (!b) {
+        base_size = 0;
+    }
+    size_t pos = 0;
+    size_t n = 0;
+    while (pos < size) {
+        size_t z = pos;
+        while (z < size && xor_at(b, base_size, d, z) == 0) {
+            ++z;
+        }
+        if (z == size) {
+            //  trailing zeros are implied
+            break;
+        }
+        //  the literal ends at the last non-zero byte before a long enough zero run
+        size_t end = z + 1;
+        for (size_t i = end; i < size && i - end < DELTA_MIN_ZERO_RUN; ++i) {
+            if (xor_at(b, base_size, d, i) != 0) {
+                end = i + 1;
+            }
+        }
+        n = put_varint(o, n, out_size, z - pos);
+        if (!n) {
+            return 0;
+        }
+        n = put_varint(o, n, out_size, end - z);
+        if (!n || out_size - n < end - z) {
+            return 0;
+        }
+        for (size_t i = z; i != end; ++i) {
+            o[n++] = xor_at(b, base_size, d, i);
+        }
+        pos = end;
+    }
+    return n;
+}
+
+int delta_decode(void const *base, size_t base_size, void const *delta, size_t delta_size, void *out, size_t size) {
+    unsigned char const *b = (unsigned char const *)base;
+    unsigned char const *d = (unsigned char const *)delta;
+    unsigned char *o = (unsigned char *)out;
+    if (!b) {
+        base_size = 0;
+    }
+    size_t pos = 0;
+    size_t i = 0;
+    while (i < delta_size) {
+        size_t zeros = 0, literal = 0;
+        if (get_varint(d, &i, delta_size, &zeros) < 0 || get_varint(d, &i, delta_size, &literal) < 0) {
+            return -1;
+        }
+        if (zeros > size - pos || literal > size - pos - zeros || literal > delta_size - i) {
+            return -1;
+        }
+        copy_base(o, b, base_size, pos, pos + zeros);
+        pos += zeros;
+        for (size_t e = pos + literal; pos != e; ++pos) {
+            o[pos] = d[i++] ^ (pos < base_size ? b[pos] : 0);
+        }
+    }
+    copy_base(o, b, base_size, pos, size);
+    return 0;
+}
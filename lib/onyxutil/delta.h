@@ -0,0 +1,60 @@
+
+/* Delta coding of a buffer against a previous version of the same buffer.
+ *
+ * The new data is XOR-ed with the old data (the "baseline"), which turns
+ * everything that didn't change into zero bytes, and the result is run-length
+ * encoded as a sequence of:
+ *
+ * zero_count (varint)
+ * literal_count (varint)
+ * <literal_count bytes of XOR-ed data>
+ *
+ * until the full size is covered. A varint is 7 bits per byte, low bits first,
+ * with the high bit set on all bytes but the last.
+ *
+ * Bytes beyond the end of the baseline are XOR-ed with zero, so a delta against
+ * an empty baseline is just a run-length encoding of the data itself.
+ */
+
+#if !defined(onyxutil_delta_h)
+#define onyxutil_delta_h
+
+#include <stdlib.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    /* @return the largest number of bytes delta_encode() can produce for the given
+     * data size.
+     */
+    size_t delta_encode_bound(size_t size);
+
+    /* Encode data as a delta against base.
+     * @param base The baseline, or NULL for none.
+     * @param base_size The size of the baseline.
+     * @param data The new data.
+     * @param size The size of the new data.
+     * @param out Where to put the encoded delta.
+     * @param out_size The size of the out buffer.
+     * @return the number of bytes written to out, or 0 if out is too small.
+     * @note An empty delta (size == 0) encodes to 0 bytes.
+     */
+    size_t delta_encode(void const *base, size_t base_size, void const *data, size_t size, void *out, size_t out_size);
+
+    /* Decode a delta produced by delta_encode().
+     * @param base The baseline used when encoding, or NULL for none.
+     * @param base_size The size of the baseline.
+     * @param delta The encoded delta.
+     * @param delta_size The size of the encoded delta.
+     * @param out Where to put the decoded data.
+     * @param size The size of the decoded data (this is not part of the encoding.)
+     * @return 0 on success, -1 if the delta is malformed.
+     */
+    int delta_decode(void const *base, size_t base_size, void const *delta, size_t delta_size, void *out, size_t size);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif  //  onyxutil_delta_h
@@ -37,11 +37,33 @@ void hash_table_deinit(hash_table_t *table) {
             free(n);
         }
     }
+    free(table->top);
     memset(table, 0, sizeof(*table));
 }
 
+//  Double the buckets when there are more items than buckets. Tables don't shrink, so
+//  removing the current item while iterating never moves the others around.
 static void maybe_rehash(hash_table_t *table) {
-
+    if (table->item_count <= table->top_size) {
+        return;
+    }
+    size_t size = table->top_size * 2;
+    hash_node_t **top = (hash_node_t **)calloc(size, sizeof(hash_node_t *));
+    if (!top) {
+        //  longer chains are slower, but still right
+        return;
+    }
+    for (size_t i = 0; i != table->top_size; ++i) {
+        for (hash_node_t *q, *n = table->top[i]; n; n = q) {
+            q = n->next;
+            size_t slot = n->code & (size - 1);
+            n->next = top[slot];
+            top[slot] = n;
+        }
+    }
+    free(table->top);
+    table->top = top;
+    table->top_size = size;
 }
 
 
@@ -1,6 +1,6 @@
-/* This hashtable has a simple implementation, and keeps the load factor at 1 for a 
- * reasonable memory/performance trade-off. Improvements that could be made but haven't 
- * been include:
+/* This hashtable has a simple implementation, and keeps the load factor at 1 (it grows, 
+ * but doesn't shrink) for a reasonable memory/performance trade-off. Improvements that 
+ * could be made but haven't been include:
  * - Pooling memory allocator (maybe -- has space trade-offs)
  * - Incremental re-hashing on size changes (amortize cost of growing/shrinking)
  */
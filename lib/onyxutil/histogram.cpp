@@ -0,0 +1,97 @@
+
+#include "histogram.h"
+#include <string.h>
+
+
+#define HALF_SUB_BUCKETS (HISTOGRAM_SUB_BUCKETS / 2)
+#define MAX_VALUE ((((uint64_t)1) << HISTOGRAM_MAX_BITS) - 1)
+
+static inline int bucket_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (int)value;
+    }
+    if (value > MAX_VALUE) {
+        value = MAX_VALUE;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - (HISTOGRAM_SUB_BUCKET_BITS - 1);
+    //  the top HISTOGRAM_SUB_BUCKET_BITS bits of the value, HALF_SUB_BUCKETS .. HISTOGRAM_SUB_BUCKETS-1
+    int top = (int)(value >> shift);
+    return HISTOGRAM_SUB_BUCKETS + (msb - HISTOGRAM_SUB_BUCKET_BITS) * HALF_SUB_BUCKETS + (top - HALF_SUB_BUCKETS);
+}
+
+/* The middle of the range of values counted in a bucket. */
+static inline uint64_t bucket_value(int index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return (uint64_t)index;
+    }
+    int k = index - HISTOGRAM_SUB_BUCKETS;
+    int msb = k / HALF_SUB_BUCKETS + HISTOGRAM_SUB_BUCKET_BITS;
+    int shift = msb - (HISTOGRAM_SUB_BUCKET_BITS - 1);
+    uint64_t lower = (uint64_t)(k % HALF_SUB_BUCKETS + HALF_SUB_BUCKETS) << shift;
+    return lower + ((((uint64_t)1) << shift) >> 1);
+}
+
+void histogram_reset(histogram_t *hist) {
+    memset(hist, 0, sizeof(*hist));
+}
+
+void histogram_record(histogram_t *hist, uint64_t value) {
+    if (!hist->count || value < hist->min) {
+        hist->min = value;
+    }
+    if (value > hist->max) {
+        hist->max = value;
+    }
+    ++hist->count;
+    hist->sum += value;
+    ++hist->buckets[bucket_index(value)];
+}
+
+void histogram_merge(histogram_t *hist, histogram_t const *other) {
+    if (!other->count) {
+        return;
+    }
+    if (!hist->count || other->min < hist->min) {
+        hist->min = other->min;
+    }
+    if (other->max > hist->max) {
+        hist->max = other->max;
+    }
+    hist->count += other->count;
+    hist->sum += other->sum;
+    for (int i = 0; i != HISTOGRAM_BUCKETS; ++i) {
+        hist->buckets[i] += other->buckets[i];
+    }
+}
+
+uint64_t histogram_percentile(histogram_t const *hist, double percentile) {
+    if (!hist->count) {
+        return 0;
+    }
+    if (percentile < 0) {
+        percentile = 0;
+    }
+    //  the rank of the value we want, 1-based
+    uint64_t rank = (uint64_t)(percentile / 100.0 * hist->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    if (rank >= hist->count) {
+        return hist->max;
+    }
+    uint64_t seen = 0;
+    for (int i = 0; i != HISTOGRAM_BUCKETS; ++i) {
+        seen += hist->buckets[i];
+        if (seen >= rank) {
+            uint64_t v = bucket_value(i);
+            //  the exact extremes are known, and beat the bucket estimate
+            return v < hist->min ? hist->min : v > hist->max ? hist->max : v;
+        }
+    }
+    return hist->max;
+}
+
+double histogram_mean(histogram_t const *hist) {
+    return hist->count ? (double)hist->sum / hist->count : 0.0;
+}
@@ -0,0 +1,67 @@
+/* A log-bucketed histogram in the style of HdrHistogram, for recording
+ * latencies. Values below HISTOGRAM_SUB_BUCKETS are counted exactly; above
+ * that, each power of two is split into HISTOGRAM_SUB_BUCKETS / 2 buckets, so
+ * any value is counted to within about 1.6% of its real value, whatever its
+ * magnitude. Recording a value is a few instructions and never allocates, so
+ * histograms can be left on in production.
+ */
+
+#if !defined(onyxutil_histogram_h)
+#define onyxutil_histogram_h
+
+#include <stdlib.h>
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    enum {
+        HISTOGRAM_SUB_BUCKET_BITS = 7,
+        HISTOGRAM_SUB_BUCKETS = 1 << HISTOGRAM_SUB_BUCKET_BITS,
+        /* Values of 2^HISTOGRAM_MAX_BITS and up are counted as the largest value. */
+        HISTOGRAM_MAX_BITS = 36,
+        HISTOGRAM_BUCKETS = HISTOGRAM_SUB_BUCKETS + (HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BUCKET_BITS) * (HISTOGRAM_SUB_BUCKETS / 2)
+    };
+
+    typedef struct histogram_t {
+        uint64_t    count;
+        uint64_t    sum;
+        uint64_t    min;
+        uint64_t    max;
+        uint64_t    buckets[HISTOGRAM_BUCKETS];
+    } histogram_t;
+
+    /* Empty a histogram.
+     * @param hist The histogram to clear.
+     */
+    void histogram_reset(histogram_t *hist);
+
+    /* Count one value.
+     * @param hist The histogram to record into.
+     * @param value The value to count.
+     */
+    void histogram_record(histogram_t *hist, uint64_t value);
+
+    /* Add all the counts of one histogram to another.
+     * @param hist The histogram to add to.
+     * @param other The histogram to add.
+     */
+    void histogram_merge(histogram_t *hist, histogram_t const *other);
+
+    /* Find the value below which a given fraction of the counted values fall.
+     * @param hist The histogram to look in.
+     * @param percentile The percentile, 0 to 100 (so 99.9 for p999.)
+     * @return The value, accurate to within the bucket size, or 0 if the histogram
+     * is empty.
+     */
+    uint64_t histogram_percentile(histogram_t const *hist, double percentile);
+
+    /* @return the average of the counted values, or 0 if the histogram is empty. */
+    double histogram_mean(histogram_t const *hist);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif  //  onyxutil_histogram_h
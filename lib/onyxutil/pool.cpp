@@ -0,0 +1,73 @@
+
+#include "pool.h"
+#include <string.h>
+
+
+#define POOL_DEFAULT_CHUNK_COUNT 16
+
+/* Each chunk starts with a pointer to the next chunk, padded out so the
+ * blocks that follow stay aligned.
+ */
+struct pool_chunk_t {
+    pool_chunk_t    *next;
+    double          _align;
+};
+
+int pool_init(pool_t *pool, size_t block_size, size_t chunk_count) {
+    memset(pool, 0, sizeof(*pool));
+    if (block_size == 0) {
+        return -1;
+    }
+    //  round up so free blocks can hold the free list link, and stay aligned
+    block_size = (block_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    pool->block_size = block_size;
+    pool->chunk_count = chunk_count ? chunk_count : POOL_DEFAULT_CHUNK_COUNT;
+    return 0;
+}
+
+void pool_deinit(pool_t *pool) {
+    if (!pool) {
+        return;
+    }
+    for (pool_chunk_t *q, *c = (pool_chunk_t *)pool->chunks; c; c = q) {
+        q = c->next;
+        free(c);
+    }
+    pool->chunks = NULL;
+    pool->free_list = NULL;
+    pool->item_count = 0;
+}
+
+void *pool_alloc(pool_t *pool) {
+    if (!pool->free_list) {
+        pool_chunk_t *c = (pool_chunk_t *)malloc(sizeof(pool_chunk_t) + pool->block_size * pool->chunk_count);
+        if (!c) {
+            return NULL;
+        }
+        c->next = (pool_chunk_t *)pool->chunks;
+        pool->chunks = c;
+        //  thread the new blocks onto the free list, first block first
+        char *base = (char *)(c + 1);
+        for (size_t i = pool->chunk_count; i > 0; --i) {
+            void *block = base + (i - 1) * pool->block_size;
+            *(void **)block = pool->free_list;
+            pool->free_list = block;
+        }
+        ++pool->misses;
+    } else {
+        ++pool->hits;
+    }
+    void *ret = pool->free_list;
+    pool->free_list = *(void **)ret;
+    ++pool->item_count;
+    return ret;
+}
+
+void pool_free(pool_t *pool, void *block) {
+    if (!block) {
+        return;
+    }
+    *(void **)block = pool->free_list;
+    pool->free_list = block;
+    --pool->item_count;
+}
@@ -0,0 +1,66 @@
+
+/* A pool hands out fixed-size blocks of memory, and keeps freed blocks on a
+ * free list for re-use, rather than returning them to malloc(). Blocks are
+ * carved out of bigger chunks, which are only returned to the system when the
+ * pool is deinitialized.
+ */
+
+#if !defined(onyxutil_pool_h)
+#define onyxutil_pool_h
+
+#include <stdlib.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    typedef struct pool_t {
+        /* The size of each block handed out by the pool */
+        size_t  block_size;
+        /* How many blocks to allocate from the system at a time */
+        size_t  chunk_count;
+        /* Used internally by the library */
+        void    *free_list;
+        void    *chunks;
+        /* Number of blocks currently handed out */
+        size_t  item_count;
+        /* Number of pool_alloc() calls satisfied from the free list (hits) or
+         * that needed a new chunk from the system (misses.)
+         */
+        size_t  hits;
+        size_t  misses;
+    } pool_t;
+
+    /* Initialize a pool to hand out blocks of block_size bytes.
+     * @param pool The pool to initialize.
+     * @param block_size The size of each block. Blocks are aligned to at least pointer size.
+     * @param chunk_count How many blocks to allocate from the system at a time. 0 means
+     * a default value.
+     * @return 0 on success, -1 on error (block_size is 0.)
+     * @note The pool does not allocate memory until the first call to pool_alloc().
+     */
+    int pool_init(pool_t *pool, size_t block_size, size_t chunk_count);
+
+    /* Free all memory allocated by the pool, including blocks that are still
+     * handed out.
+     * @param pool The pool to free.
+     */
+    void pool_deinit(pool_t *pool);
+
+    /* Get a block from the pool.
+     * @param pool The pool to allocate from.
+     * @return A block of pool->block_size bytes, or NULL if out of memory.
+     */
+    void *pool_alloc(pool_t *pool);
+
+    /* Return a block to the pool.
+     * @param pool The pool the block was allocated from.
+     * @param block The block to return. NULL is allowed, and ignored.
+     */
+    void pool_free(pool_t *pool, void *block);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif  //  onyxutil_pool_h
@@ -0,0 +1,57 @@
+#include "siphash.h"
+
+#include <string.h>
+
+
+static inline uint64_t rotl(uint64_t x, int b) {
+    return (x << b) | (x >> (64 - b));
+}
+
+static inline uint64_t load64(unsigned char const *p) {
+    //  little-endian; see onyxudp/protocol.h for why that's all we do
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+#define SIPROUND \
+    do { \
+        v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32); \
+        v2 += v3; v3 = rotl(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = rotl(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32); \
+    } while (0)
+
+uint64_t siphash24(void const *key, void const *data, size_t size) {
+    unsigned char const *k = (unsigned char const *)key;
+    unsigned char const *d = (unsigned char const *)data;
+    uint64_t k0 = load64(k);
+    uint64_t k1 = load64(k + 8);
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+    size_t whole = size & ~(size_t)7;
+    for (size_t i = 0; i != whole; i += 8) {
+        uint64_t m = load64(d + i);
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+    //  the last block has the leftover bytes, and the length in the top byte
+    uint64_t b = (uint64_t)size << 56;
+    for (size_t i = whole; i != size; ++i) {
+        b |= (uint64_t)d[i] << (8 * (i - whole));
+    }
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
@@ -0,0 +1,25 @@
+#if !defined(onyxutil_siphash_h)
+#define onyxutil_siphash_h
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    /* SipHash-2-4, a keyed hash of short messages (Aumasson and Bernstein.) Without the 
+     * key, the result can't be predicted or forged, so it works as a message 
+     * authentication code, and it's cheap enough to run on every incoming packet.
+     * @param key 16 bytes of secret key
+     * @param data the message
+     * @param size the size of the message
+     * @return the 64-bit hash
+     */
+    uint64_t siphash24(void const *key, void const *data, size_t size);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif  //  onyxutil_siphash_h
@@ -0,0 +1,169 @@
+#include "x25519.h"
+
+#include <string.h>
+
+
+//  Field elements mod 2^255 - 19, in 16 signed limbs of (nominally) 16 bits.
+typedef int64_t gf[16];
+
+static gf const gf_121665 = { 0xdb41, 1 };
+
+static void carry(gf o) {
+    for (int i = 0; i != 16; ++i) {
+        o[i] += (int64_t)1 << 16;
+        int64_t c = o[i] >> 16;
+        //  the carry out of the top limb wraps around times 38 (2^256 = 38 mod p)
+        o[(i + 1) * (i < 15)] += c - 1 + 37 * (c - 1) * (i == 15);
+        o[i] -= c * 65536;
+    }
+}
+
+//  Swap p and q if b is 1, without branching on b.
+static void cswap(gf p, gf q, int b) {
+    int64_t mask = ~((int64_t)b - 1);
+    for (int i = 0; i != 16; ++i) {
+        int64_t t = mask & (p[i] ^ q[i]);
+        p[i] ^= t;
+        q[i] ^= t;
+    }
+}
+
+static void pack(unsigned char *o, gf const n) {
+    gf m, t;
+    for (int i = 0; i != 16; ++i) {
+        t[i] = n[i];
+    }
+    carry(t);
+    carry(t);
+    carry(t);
+    //  subtract p, twice, keeping the result when it doesn't go negative
+    for (int j = 0; j != 2; ++j) {
+        m[0] = t[0] - 0xffed;
+        for (int i = 1; i != 15; ++i) {
+            m[i] = t[i] - 0xffff - ((m[i - 1] >> 16) & 1);
+            m[i - 1] &= 0xffff;
+        }
+        m[15] = t[15] - 0x7fff - ((m[14] >> 16) & 1);
+        int b = (int)((m[15] >> 16) & 1);
+        m[14] &= 0xffff;
+        cswap(t, m, 1 - b);
+    }
+    for (int i = 0; i != 16; ++i) {
+        o[2 * i] = (unsigned char)(t[i] & 0xff);
+        o[2 * i + 1] = (unsigned char)(t[i] >> 8);
+    }
+}
+
+static void unpack(gf o, unsigned char const *n) {
+    for (int i = 0; i != 16; ++i) {
+        o[i] = n[2 * i] + ((int64_t)n[2 * i + 1] << 8);
+    }
+    o[15] &= 0x7fff;
+}
+
+static void add(gf o, gf const a, gf const b) {
+    for (int i = 0; i != 16; ++i) {
+        o[i] = a[i] + b[i];
+    }
+}
+
+static void sub(gf o, gf const a, gf const b) {
+    for (int i = 0; i != 16; ++i) {
+        o[i] = a[i] - b[i];
+    }
+}
+
+static void mul(gf o, gf const a, gf const b) {
+    int64_t t[31];
+    for (int i = 0; i != 31; ++i) {
+        t[i] = 0;
+    }
+    for (int i = 0; i != 16; ++i) {
+        for (int j = 0; j != 16; ++j) {
+            t[i + j] += a[i] * b[j];
+        }
+    }
+    for (int i = 0; i != 15; ++i) {
+        t[i] += 38 * t[i + 16];
+    }
+    for (int i = 0; i != 16; ++i) {
+        o[i] = t[i];
+    }
+    carry(o);
+    carry(o);
+}
+
+static void square(gf o, gf const a) {
+    mul(o, a, a);
+}
+
+//  a^(p-2), which is 1/a
+static void invert(gf o, gf const a) {
+    gf c;
+    for (int i = 0; i != 16; ++i) {
+        c[i] = a[i];
+    }
+    for (int i = 253; i >= 0; --i) {
+        square(c, c);
+        if (i != 2 && i != 4) {
+            mul(c, c, a);
+        }
+    }
+    for (int i = 0; i != 16; ++i) {
+        o[i] = c[i];
+    }
+}
+
+int x25519(unsigned char *out, unsigned char const *scalar, unsigned char const *point) {
+    unsigned char z[32];
+    memcpy(z, scalar, 32);
+    z[31] = (z[31] & 127) | 64;
+    z[0] &= 248;
+    gf x, a, b, c, d, e, f;
+    unpack(x, point);
+    for (int i = 0; i != 16; ++i) {
+        b[i] = x[i];
+        d[i] = a[i] = c[i] = 0;
+    }
+    a[0] = d[0] = 1;
+    //  the Montgomery ladder, the same steps whatever the bits are
+    for (int i = 254; i >= 0; --i) {
+        int r = (z[i >> 3] >> (i & 7)) & 1;
+        cswap(a, b, r);
+        cswap(c, d, r);
+        add(e, a, c);
+        sub(a, a, c);
+        add(c, b, d);
+        sub(b, b, d);
+        square(d, e);
+        square(f, a);
+        mul(a, c, a);
+        mul(c, b, e);
+        add(e, a, c);
+        sub(a, a, c);
+        square(b, a);
+        sub(c, d, f);
+        mul(a, c, gf_121665);
+        add(a, a, d);
+        mul(c, c, a);
+        mul(a, d, f);
+        mul(d, b, x);
+        square(b, e);
+        cswap(a, b, r);
+        cswap(c, d, r);
+    }
+    invert(c, c);
+    mul(a, a, c);
+    pack(out, a);
+    memset(z, 0, sizeof(z));
+    unsigned char any = 0;
+    for (int i = 0; i != 32; ++i) {
+        any |= out[i];
+    }
+    return any ? 0 : -1;
+}
+
+void x25519_public_key(unsigned char *out, unsigned char const *scalar) {
+    static unsigned char const base[32] = { 9 };
+    x25519(out, scalar, base);
+}
@@ -0,0 +1,38 @@
+/* X25519 Diffie-Hellman (RFC 7748): two sides each make a key pair, swap public 
+ * keys, and each combines its own private key with the other's public key to get the 
+ * same shared secret, which nobody who only saw the public keys can compute.
+ *
+ * This is the compact, constant-time formulation from TweetNaCl (16 limbs of 16 
+ * bits); it's not the fastest, but a handshake only needs two of them.
+ */
+
+#if !defined(onyxutil_x25519_h)
+#define onyxutil_x25519_h
+
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+    enum {
+        X25519_KEY_SIZE = 32
+    };
+
+    /* Multiply the point (public key) by the scalar (private key.)
+     * @param out the shared secret (or, with point 9, the public key)
+     * @param scalar 32 bytes of private key; any 32 random bytes will do
+     * @param point the other side's public key
+     * @return 0, or -1 if the result is all zeros, which means the point was made up 
+     * to force a known secret
+     */
+    int x25519(unsigned char *out, unsigned char const *scalar, unsigned char const *point);
+
+    /* The public key that goes with a private key. */
+    void x25519_public_key(unsigned char *out, unsigned char const *scalar);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif  //  onyxutil_x25519_h
@@ -15,11 +15,11 @@ LIBS_app_$(APPNAME):=$(LIBS)
 TARGETS:=$(TARGETS) obj/$(APPNAME)
 
 obj/$(APPNAME):	$(OBJ_app_$(APPNAME)) $(foreach l,$(LIBS),obj/lib$l.a)
-	g++ $(OBJ_app_$(basename $@)) $(foreach l,$(LIBS_app_$(basename $@)),-l$l) $(LFLAGS_app_$(basename $@)) -Lobj -MMD -o $@
+	g++ $(OBJ_app_$(patsubst obj/%,%,$@)) $(foreach l,$(LIBS_app_$(patsubst obj/%,%,$@)),-l$l) $(LFLAGS_app_$(patsubst obj/%,%,$@)) -Lobj -MMD -o $@
 
 obj/app/$(APPNAME)/%.o:	app/$(APPNAME)/%.cpp make/Reset.mk make/App.mk
 	@mkdir -p $(dir $@)
 	g++ $(CFLAGS_app_$(patsubst obj/app/%/,%,$(dir $@))) -Ilib -MMD -c -o $@ $<
 
--include $(patsubst %.o,%.d,$(OBJ_app_$(APPNAME))
+-include $(patsubst %.o,%.d,$(OBJ_app_$(APPNAME)))
 -include make/Reset.mk
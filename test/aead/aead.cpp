@@ -0,0 +1,108 @@
+#include <onyxutil/aead.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+//  Test vectors from RFC 8439, and draft-irtf-cfrg-xchacha for HChaCha20.
+
+void unhex(unsigned char *out, char const *s) {
+    for (size_t i = 0; s[2 * i]; ++i) {
+        unsigned v;
+        sscanf(s + 2 * i, "%2x", &v);
+        out[i] = (unsigned char)v;
+    }
+}
+
+char const sunscreen[] = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, sunscreen would be it.";
+
+/* 2.4.2 */
+void test_chacha20() {
+    unsigned char key[32], nonce[12], out[sizeof(sunscreen) - 1], expected[sizeof(out)];
+    for (int i = 0; i != 32; ++i) {
+        key[i] = (unsigned char)i;
+    }
+    unhex(nonce, "000000000000004a00000000");
+    unhex(expected,
+        "6e2e359a2568f98041ba0728dd0d6981e97e7aec1d4360c20a27afccfd9fae0b"
+        "f91b65c5524733ab8f593dabcd62b3571639d624e65152ab8f530c359f0861d8"
+        "07ca0dbf500d6a6156a38e088a22b65e52bc514d16ccf806818ce91ab7793736"
+        "5af90bbf74a35be6b40b8eedf2785e42874d");
+    chacha20_xor(out, (unsigned char const *)sunscreen, sizeof(out), key, nonce, 1);
+    assert(!memcmp(out, expected, sizeof(out)));
+    //  in place, in pieces that don't line up with the blocks, gets the same
+    memcpy(out, sunscreen, sizeof(out));
+    chacha20_xor(out, out, sizeof(out), key, nonce, 1);
+    assert(!memcmp(out, expected, sizeof(out)));
+}
+
+/* 2.5.2 */
+void test_poly1305() {
+    unsigned char key[32], tag[16], expected[16];
+    unhex(key, "85d6be7857556d337f4452fe42d506a80103808afb0db2fd4abff6af4149f51b");
+    unhex(expected, "a8061dc1305136c6c22b8baf0c0127a9");
+    poly1305(tag, "Cryptographic Forum Research Group", 34, key);
+    assert(!memcmp(tag, expected, 16));
+}
+
+void test_hchacha20() {
+    unsigned char key[32], in[16], out[32], expected[32];
+    for (int i = 0; i != 32; ++i) {
+        key[i] = (unsigned char)i;
+    }
+    unhex(in, "000000090000004a0000000031415927");
+    unhex(expected, "82413b4227b27bfed30e42508a877d73a0f9e4d58a74a853c12ec41326d3ecdc");
+    hchacha20(out, key, in);
+    assert(!memcmp(out, expected, 32));
+}
+
+/* 2.8.2, and what happens when anything is changed */
+void test_aead() {
+    unsigned char key[32], nonce[12], ad[12], tag[16], expected_tag[16];
+    unsigned char ct[sizeof(sunscreen) - 1], pt[sizeof(ct)];
+    for (int i = 0; i != 32; ++i) {
+        key[i] = (unsigned char)(0x80 + i);
+    }
+    unhex(nonce, "070000004041424344454647");
+    unhex(ad, "50515253c0c1c2c3c4c5c6c7");
+    unhex(expected_tag, "1ae10b594f09e26a7e902ecbd0600691");
+    aead_seal(ct, tag, ad, sizeof(ad), (unsigned char const *)sunscreen, sizeof(ct), key, nonce);
+    assert(!memcmp(tag, expected_tag, 16));
+    unsigned char expected_start[16];
+    unhex(expected_start, "d31a8d34648e60db7b86afbc53ef7ec2");
+    assert(!memcmp(ct, expected_start, 16));
+
+    assert(aead_open(pt, tag, ad, sizeof(ad), ct, sizeof(ct), key, nonce) == 0);
+    assert(!memcmp(pt, sunscreen, sizeof(pt)));
+
+    memset(pt, 0, sizeof(pt));
+    ct[50] ^= 4;
+    assert(aead_open(pt, tag, ad, sizeof(ad), ct, sizeof(ct), key, nonce) == -1);
+    ct[50] ^= 4;
+    ad[3] ^= 1;
+    assert(aead_open(pt, tag, ad, sizeof(ad), ct, sizeof(ct), key, nonce) == -1);
+    ad[3] ^= 1;
+    nonce[11] ^= 1;
+    assert(aead_open(pt, tag, ad, sizeof(ad), ct, sizeof(ct), key, nonce) == -1);
+    nonce[11] ^= 1;
+    tag[15] ^= 0x80;
+    assert(aead_open(pt, tag, ad, sizeof(ad), ct, sizeof(ct), key, nonce) == -1);
+    tag[15] ^= 0x80;
+    //  a failed open leaves the output alone
+    for (size_t i = 0; i != sizeof(pt); ++i) {
+        assert(pt[i] == 0);
+    }
+
+    //  nothing to encrypt still authenticates the additional data
+    assert(aead_open(NULL, tag, ad, sizeof(ad), ct, 0, key, nonce) == -1);
+    aead_seal(NULL, tag, ad, sizeof(ad), NULL, 0, key, nonce);
+    assert(aead_open(NULL, tag, ad, sizeof(ad), NULL, 0, key, nonce) == 0);
+}
+
+int main() {
+    test_chacha20();
+    test_poly1305();
+    test_hchacha20();
+    test_aead();
+    return 0;
+}
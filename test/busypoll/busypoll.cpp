@@ -0,0 +1,163 @@
+#include <onyxudp/udpbase.h>
+#include <onyxudp/udpclient.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+
+enum { MESSAGES = 20 };
+
+struct server {
+    udp_params_t params;
+    udp_busy_poll_t busy_poll;
+    udp_group_params_t gp;
+    udp_instance_t *instance;
+    udp_group_t *group;
+    int peers;
+    int messages;
+    int errors;
+};
+
+server srv;
+
+struct client {
+    udp_client_params_t params;
+    udp_client_t *client;
+    udp_client_connection_t *conn;
+    int payloads;
+    int errors;
+};
+
+client cli;
+
+void on_error(udp_params_t *params, UDPERR err, char const *text) {
+    fprintf(stderr, "SERVER ERROR: %d (%s)\n", err, text);
+    srv.errors++;
+}
+
+void on_idle(udp_params_t *params) {
+}
+
+void on_peer_new(udp_params_t *params, udp_peer_t *peer, udp_payload_t *payload) {
+    assert(udp_group_peer_add(srv.group, peer) == UDP_OK);
+    __atomic_add_fetch(&srv.peers, 1, __ATOMIC_SEQ_CST);
+}
+
+void on_peer_expired(udp_params_t *params, udp_peer_t *peer, UDPPEER reason) {
+}
+
+void on_peer_message(udp_group_params_t *gpar, udp_peer_t *peer, udp_payload_t *payload) {
+    srv.messages++;
+    udp_payload_t *pl = udp_payload_get(srv.instance);
+    memcpy(pl->data, payload->data, payload->size);
+    pl->size = payload->size;
+    assert(udp_peer_payload_enqueue(peer, pl) == UDP_OK);
+}
+
+void on_peer_removed(udp_group_params_t *gpar, udp_peer_t *peer, UDPPEER reason) {
+}
+
+void c_on_error(udp_client_params_t *cparm, UDPERR err, char const *text) {
+    fprintf(stderr, "CLIENT ERROR: %d (%s)\n", err, text);
+    cli.errors++;
+}
+
+void c_on_idle(udp_client_params_t *cparm) {
+}
+
+void c_on_payload(udp_client_params_t *cparm, udp_client_connection_t *conn, udp_payload_t *payload) {
+    assert(payload->size == 32);
+    cli.payloads++;
+}
+
+void c_on_disconnect(udp_client_params_t *cparm, udp_client_connection_t *conn, UDPPEER reason) {
+}
+
+void c_on_snapshot(udp_client_params_t *cparm, udp_client_connection_t *conn, uint16_t stream, uint32_t sequence, void const *data, size_t size) {
+}
+
+/* Echo messages through udp_run(), some close together, some far enough apart that
+ * the busy poll backs off all the way to waiting; every wake-up is counted.
+ */
+void test_echo(bool busy) {
+    memset(&srv, 0, sizeof(srv));
+    srv.params.port = 12351;
+    srv.params.app_id = 48;
+    srv.params.app_version = 1;
+    srv.params.interface = "127.0.0.1";
+    srv.params.on_error = on_error;
+    srv.params.on_idle = on_idle;
+    srv.params.on_peer_new = on_peer_new;
+    srv.params.on_peer_expired = on_peer_expired;
+    if (busy) {
+        srv.busy_poll.pause_after_us = 200;
+        srv.busy_poll.yield_after_us = 400;
+        srv.busy_poll.wait_after_us = 2000;
+        srv.params.busy_poll = &srv.busy_poll;
+    }
+    srv.instance = udp_initialize(&srv.params);
+    assert(srv.instance != NULL);
+    srv.gp.on_peer_message = on_peer_message;
+    srv.gp.on_peer_removed = on_peer_removed;
+    srv.group = udp_group_create(srv.instance, &srv.gp);
+    assert(srv.group != NULL);
+    udp_stats_t stats;
+    udp_stats_get(srv.instance, &stats);
+    assert(stats.wakeups == 0 && stats.wake_latency_ns == 0);
+    assert(udp_run(srv.instance) == UDP_OK);
+
+    memset(&cli, 0, sizeof(cli));
+    cli.params.app_id = 48;
+    cli.params.app_version = 1;
+    cli.params.on_error = c_on_error;
+    cli.params.on_idle = c_on_idle;
+    cli.params.on_payload = c_on_payload;
+    cli.params.on_disconnect = c_on_disconnect;
+    cli.params.on_snapshot = c_on_snapshot;
+    cli.client = udp_client_initialize(&cli.params);
+    assert(cli.client != NULL);
+    udp_addr_t afmt;
+    udp_conn_addr_t addr;
+    sprintf(afmt.addr, "127.0.0.1");
+    sprintf(afmt.port, "12351");
+    assert(udp_client_address_resolve(&afmt, &addr) == UDP_OK);
+    cli.conn = udp_client_connect(cli.client, &addr, NULL);
+    assert(cli.conn != NULL);
+    for (int i = 0; i != 5000 && !__atomic_load_n(&srv.peers, __ATOMIC_SEQ_CST); ++i) {
+        udp_client_poll(cli.client);
+        usleep(1000);
+    }
+    assert(srv.peers == 1);
+
+    for (int m = 0; m != MESSAGES; ++m) {
+        udp_payload_t *pl = udp_client_payload_get(cli.client);
+        memset(pl->data, m, 32);
+        pl->size = 32;
+        assert(udp_client_payload_send(cli.conn, pl) == UDP_OK);
+        for (int i = 0; i != 50000 && cli.payloads != m + 1; ++i) {
+            udp_client_poll(cli.client);
+            usleep(100);
+        }
+        assert(cli.payloads == m + 1);
+        if (m & 1) {
+            //  long enough for the server to go back to blocking
+            usleep(5000);
+        }
+    }
+
+    udp_stats_get(srv.instance, &stats);
+    assert(stats.wakeups >= 1 && stats.wakeups <= stats.packets_in);
+    assert(stats.wake_latency_ns > 0);
+    udp_client_terminate(cli.client);
+    udp_terminate(srv.instance);
+    assert(srv.messages == MESSAGES);
+    assert(srv.errors == 0 && cli.errors == 0);
+}
+
+int main() {
+    test_echo(true);
+    test_echo(false);
+    return 0;
+}
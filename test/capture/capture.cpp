@@ -0,0 +1,214 @@
+#include <onyxudp/udpbase.h>
+#include <onyxudp/udpclient.h>
+#include <onyxudp/capture.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+
+struct server {
+    udp_params_t params;
+    udp_instance_t *instance;
+    udp_group_params_t gp;
+    udp_group_t *group;
+    int peers;
+    int messages;
+    int sum;
+    int errors;
+};
+
+server live;
+server replayed;
+
+struct client {
+    udp_client_params_t params;
+    udp_client_t *client;
+    int errors;
+};
+
+client cli;
+
+char const *capture_path = "obj/test_capture.cap";
+
+server *server_of(udp_params_t *params) {
+    return (server *)params;
+}
+
+void on_peer_message(udp_group_params_t *gpar, udp_peer_t *peer, udp_payload_t *payload) {
+    server *s = gpar == &live.gp ? &live : &replayed;
+    assert(payload->size == 5 && !memcmp(payload->data, "msg", 3));
+    s->messages++;
+    s->sum += ((unsigned char *)payload->data)[3];
+}
+
+void on_peer_removed(udp_group_params_t *gpar, udp_peer_t *peer, UDPPEER reason) {
+}
+
+void on_error(udp_params_t *params, UDPERR err, char const *text) {
+    fprintf(stderr, "SERVER ERROR: %d (%s)\n", err, text);
+    server_of(params)->errors++;
+}
+
+void on_idle(udp_params_t *params) {
+}
+
+void on_peer_new(udp_params_t *params, udp_peer_t *peer, udp_payload_t *payload) {
+    server *s = server_of(params);
+    if (!s->group) {
+        s->gp.on_peer_message = on_peer_message;
+        s->gp.on_peer_removed = on_peer_removed;
+        s->group = udp_group_create(s->instance, &s->gp);
+    }
+    assert(udp_group_peer_add(s->group, peer) == UDP_OK);
+    s->peers++;
+}
+
+void on_peer_expired(udp_params_t *params, udp_peer_t *peer, UDPPEER reason) {
+}
+
+void setup_server(server *s, uint16_t port, udp_impairment_t const *impairment) {
+    memset(s, 0, sizeof(*s));
+    s->params.port = port;
+    s->params.app_id = 37;
+    s->params.app_version = 1;
+    s->params.interface = "127.0.0.1";
+    s->params.on_error = on_error;
+    s->params.on_idle = on_idle;
+    s->params.on_peer_new = on_peer_new;
+    s->params.on_peer_expired = on_peer_expired;
+    s->params.impairment = impairment;
+    s->instance = udp_initialize(&s->params);
+    assert(s->instance != NULL);
+}
+
+void c_on_error(udp_client_params_t *cparm, UDPERR err, char const *text) {
+    fprintf(stderr, "CLIENT ERROR: %d (%s)\n", err, text);
+    cli.errors++;
+}
+
+void c_on_idle(udp_client_params_t *cparm) {
+}
+
+void c_on_payload(udp_client_params_t *cparm, udp_client_connection_t *conn, udp_payload_t *payload) {
+}
+
+void c_on_disconnect(udp_client_params_t *cparm, udp_client_connection_t *conn, UDPPEER reason) {
+}
+
+void c_on_snapshot(udp_client_params_t *cparm, udp_client_connection_t *conn, uint16_t stream, uint32_t sequence, void const *data, size_t size) {
+}
+
+void step() {
+    usleep(1000);
+    udp_poll(live.instance);
+    udp_client_poll(cli.client);
+}
+
+int count_records(char const *path, udp_conn_addr_t *o_from) {
+    udp_capture_t *cap = udp_capture_open(path);
+    assert(cap != NULL);
+    static unsigned char buf[65536];
+    udp_capture_record_t rec;
+    uint64_t last = 0;
+    int n = 0, r;
+    while ((r = udp_capture_read(cap, &rec, buf)) > 0) {
+        assert(rec.timestamp >= last);
+        last = rec.timestamp;
+        if (n == 0) {
+            *o_from = rec.from;
+        } else {
+            assert(!memcmp(&rec.from, o_from, sizeof(rec.from)));
+        }
+        ++n;
+    }
+    assert(r == 0);
+    udp_capture_close(cap);
+    return n;
+}
+
+int main() {
+    setup_server(&live, 12348, NULL);
+    assert(udp_capture_start(live.instance, capture_path) == UDP_OK);
+
+    memset(&cli, 0, sizeof(cli));
+    cli.params.app_id = 37;
+    cli.params.app_version = 1;
+    cli.params.on_error = c_on_error;
+    cli.params.on_idle = c_on_idle;
+    cli.params.on_payload = c_on_payload;
+    cli.params.on_disconnect = c_on_disconnect;
+    cli.params.on_snapshot = c_on_snapshot;
+    cli.client = udp_client_initialize(&cli.params);
+    assert(cli.client != NULL);
+    udp_addr_t afmt;
+    udp_conn_addr_t addr;
+    sprintf(afmt.addr, "127.0.0.1");
+    sprintf(afmt.port, "12348");
+    assert(udp_client_address_resolve(&afmt, &addr) == UDP_OK);
+    udp_client_connection_t *conn = udp_client_connect(cli.client, &addr, NULL);
+    assert(conn != NULL);
+    for (int i = 0; i != 5; ++i) {
+        step();
+    }
+    assert(live.peers == 1);
+    for (int i = 0; i != 20; ++i) {
+        udp_payload_t *pl = udp_client_payload_get(cli.client);
+        memcpy(pl->data, "msg", 3);
+        ((unsigned char *)pl->data)[3] = (unsigned char)i;
+        ((unsigned char *)pl->data)[4] = 0;
+        pl->size = 5;
+        assert(udp_client_payload_send(conn, pl) == UDP_OK);
+        step();
+        step();
+    }
+    assert(live.messages == 20);
+    udp_capture_stop(live.instance);
+    udp_stats_t stats;
+    udp_stats_get(live.instance, &stats);
+
+    //  everything that came in is in the file, from the client
+    udp_conn_addr_t from;
+    int n = count_records(capture_path, &from);
+    assert(n == (int)stats.packets_in);
+    assert(n >= 21);
+
+    //  a fresh instance, fed the capture, sees the same peer and messages, and sends
+    //  nothing anywhere
+    udp_impairment_t blackhole;
+    memset(&blackhole, 0, sizeof(blackhole));
+    blackhole.loss = 1.0f;
+    setup_server(&replayed, 12349, &blackhole);
+    udp_capture_t *cap = udp_capture_open(capture_path);
+    assert(cap != NULL);
+    static unsigned char buf[65536];
+    udp_capture_record_t rec;
+    while (udp_capture_read(cap, &rec, buf) > 0) {
+        assert(udp_receive_inject(replayed.instance, &rec.from, rec.ecn, rec.data, rec.size) == UDP_OK);
+        udp_poll(replayed.instance);
+    }
+    udp_capture_close(cap);
+    assert(replayed.peers == 1);
+    assert(replayed.messages == 20 && replayed.sum == live.sum);
+    assert(replayed.errors == 0 && live.errors == 0 && cli.errors == 0);
+
+    //  a capture cut short in the middle of the last record reads up to the record before
+    FILE *f = fopen(capture_path, "r+b");
+    assert(f != NULL);
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fclose(f);
+    assert(truncate(capture_path, size - 2) == 0);
+    assert(count_records(capture_path, &from) == n - 1);
+
+    assert(udp_capture_open("obj/no-such-capture") == NULL);
+    assert(udp_capture_start(live.instance, "obj/no-such-dir/x.cap") != UDP_OK);
+    assert(live.errors == 1);
+
+    unlink(capture_path);
+    udp_client_terminate(cli.client);
+    udp_terminate(live.instance);
+    udp_terminate(replayed.instance);
+    return 0;
+}
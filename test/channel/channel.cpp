@@ -0,0 +1,199 @@
+#include <onyxudp/udpbase.h>
+#include <onyxudp/protocol.h>
+#include <onyxudp/types.h>
+#include <onyxudp/channel.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+/* Two ends of a channel set, talking through a "wire" that can drop packets. */
+
+udp_params_t params;
+udp_channel_config_t config[UDP_MAX_CHANNELS];
+udp_channels_t sender;
+udp_channels_t receiver;
+udp_congestion_t cc;
+vector_t plain;
+
+//  packets on the wire
+struct packet {
+    udp_payload_t *payload;
+    channel_header hdr;
+    bool has_hdr;
+};
+packet wire[256];
+int nwire;
+int drop_every;
+int nsent;
+bool socket_full;
+
+//  what the receiving application got
+char delivered[256];
+int ndelivered;
+
+void on_error(udp_params_t *, UDPERR err, char const *text) {
+    fprintf(stderr, "ERROR: %d (%s)\n", err, text);
+    assert(!"unexpected error");
+}
+
+int wire_send(void *context, udp_payload_t *payload, channel_header const *hdr, uint64_t now) {
+    if (socket_full) {
+        return 0;
+    }
+    ++nsent;
+    if (drop_every && nsent % drop_every == 0) {
+        return 1;
+    }
+    assert(nwire < 256);
+    udp_payload_hold(payload);
+    wire[nwire].payload = payload;
+    wire[nwire].has_hdr = hdr != NULL;
+    if (hdr) {
+        wire[nwire].hdr = *hdr;
+    }
+    ++nwire;
+    return 1;
+}
+
+void wire_deliver() {
+    vector_t ready;
+    vector_init(&ready, sizeof(udp_payload_t *));
+    for (int i = 0; i != nwire; ++i) {
+        if (wire[i].has_hdr) {
+            udp_channels_receive(&receiver, &wire[i].hdr, wire[i].payload, &ready);
+        } else {
+            udp_payload_hold(wire[i].payload);
+            vector_item_append(&ready, &wire[i].payload);
+        }
+        udp_payload_release(wire[i].payload);
+    }
+    nwire = 0;
+    for (size_t i = 0; i != ready.item_count; ++i) {
+        udp_payload_t *pl = *(udp_payload_t **)vector_item_get(&ready, i);
+        delivered[ndelivered++] = ((char *)pl->data)[0];
+        udp_payload_release(pl);
+    }
+    vector_deinit(&ready);
+    //  and the acks back the other way
+    unsigned char acks[1200];
+    size_t n = udp_channels_ack_fill(&receiver, acks, sizeof(acks));
+    udp_channels_ack_receive(&sender, acks, n);
+}
+
+udp_payload_t *make(char c) {
+    udp_payload_t *pl = udp_payload_new(64, &params, NULL);
+    ((char *)pl->data)[0] = c;
+    pl->size = 1;
+    return pl;
+}
+
+void reset() {
+    udp_channels_deinit(&sender);
+    udp_channels_deinit(&receiver);
+    udp_channels_init(&sender);
+    udp_channels_init(&receiver);
+    ndelivered = 0;
+    nsent = 0;
+    drop_every = 0;
+    memset(delivered, 0, sizeof(delivered));
+}
+
+int main() {
+    params.on_error = on_error;
+    params.max_payload_size = 64;
+    udp_channel_config_init(config);
+    assert(udp_channel_config_set(config, 0, UDP_CHANNEL_RELIABLE_ORDERED, 0, 1) == UDPERR_INVALID_ARGUMENT);
+    assert(udp_channel_config_set(config, UDP_MAX_CHANNELS, UDP_CHANNEL_UNRELIABLE, 0, 1) == UDPERR_INVALID_ARGUMENT);
+    assert(udp_channel_config_set(config, 1, UDP_CHANNEL_LATEST_ONLY, 10, 1) == UDP_OK);
+    assert(udp_channel_config_set(config, 2, UDP_CHANNEL_RELIABLE_ORDERED, 1, 1) == UDP_OK);
+    assert(udp_channel_config_set(config, 3, UDP_CHANNEL_SEQUENCED, 1, 3) == UDP_OK);
+    udp_congestion_init(&cc, 0);
+    vector_init(&plain, sizeof(udp_payload_t *));
+    udp_channels_init(&sender);
+    udp_channels_init(&receiver);
+    uint64_t now = 1000;
+
+    /* unconfigured channels are refused */
+    assert(udp_channels_enqueue(&sender, config, 4, make('x')) == UDPERR_INVALID_ARGUMENT);
+
+    /* higher priority goes first; latest-only drops superseded payloads */
+    udp_payload_t *pl = make('p');
+    vector_item_append(&plain, &pl);
+    udp_channels_enqueue(&sender, config, 2, make('r'));
+    udp_channels_enqueue(&sender, config, 1, make('a'));
+    udp_channels_enqueue(&sender, config, 1, make('b'));
+    udp_channels_enqueue(&sender, config, 1, make('c'));
+    int n = udp_channels_flush(&sender, config, &plain, &cc, wire_send, NULL, now);
+    assert(n == 3);
+    wire_deliver();
+    assert(!strcmp(delivered, "crp"));
+    assert(plain.item_count == 0);
+
+    /* same priority shares by weight: channel 3 has three times the weight of 2 */
+    reset();
+    for (int i = 0; i != 16; ++i) {
+        pl = make('r');
+        pl->size = 64;
+        udp_channels_enqueue(&sender, config, 2, pl);
+        pl = make('s');
+        pl->size = 64;
+        udp_channels_enqueue(&sender, config, 3, pl);
+    }
+    n = udp_channels_flush(&sender, config, &plain, &cc, wire_send, NULL, now);
+    assert(n == 32);
+    wire_deliver();
+    //  a round is 256 bytes per unit of weight, so 4 of one and 12 of the other
+    assert(!strncmp(delivered, "rrrrssssssssssss", 16));
+
+    /* reliable payloads survive loss, and arrive in order */
+    reset();
+    drop_every = 3;
+    for (int i = 0; i != 20; ++i) {
+        udp_channels_enqueue(&sender, config, 2, make((char)('A' + i)));
+    }
+    for (int round = 0; round != 20 && ndelivered < 20; ++round) {
+        udp_channels_flush(&sender, config, &plain, &cc, wire_send, NULL, now);
+        wire_deliver();
+        now += 1000000;
+    }
+    assert(ndelivered == 20);
+    for (int i = 0; i != 20; ++i) {
+        assert(delivered[i] == 'A' + i);
+    }
+    assert(sender.send[2].unacked.item_count == 0);
+
+    /* nothing is lost when the socket is full */
+    reset();
+    socket_full = true;
+    udp_channels_enqueue(&sender, config, 2, make('x'));
+    udp_channels_enqueue(&sender, config, 3, make('y'));
+    n = udp_channels_flush(&sender, config, &plain, &cc, wire_send, NULL, now);
+    assert(n == 0);
+    socket_full = false;
+    n = udp_channels_flush(&sender, config, &plain, &cc, wire_send, NULL, now);
+    assert(n == 2);
+    wire_deliver();
+    assert(ndelivered == 2);
+
+    /* sequenced channels drop late payloads */
+    reset();
+    channel_header hdr = { 3, UDP_CHANNEL_SEQUENCED, 0, 5 };
+    vector_t ready;
+    vector_init(&ready, sizeof(udp_payload_t *));
+    pl = make('5');
+    udp_channels_receive(&receiver, &hdr, pl, &ready);
+    udp_payload_release(pl);
+    hdr.sequence = 4;
+    pl = make('4');
+    udp_channels_receive(&receiver, &hdr, pl, &ready);
+    udp_payload_release(pl);
+    assert(ready.item_count == 1);
+    udp_payload_release(*(udp_payload_t **)vector_item_get(&ready, 0));
+    vector_deinit(&ready);
+
+    udp_channels_deinit(&sender);
+    udp_channels_deinit(&receiver);
+    vector_deinit(&plain);
+    return 0;
+}
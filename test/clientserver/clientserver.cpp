@@ -5,6 +5,10 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 
 struct server {
@@ -15,6 +19,9 @@ struct server {
     int num_peers_expired;
     int num_peer_messages;
     int num_peers_removed;
+    int num_stamped_messages;
+    char last_message[1200];
+    size_t last_message_size;
     udp_instance_t *instance;
     udp_group_params_t gp1;
     server *self1;
@@ -33,12 +40,47 @@ struct client {
     int num_errors;
     int num_idles;
     int num_payloads;
+    char last_payload[1200];
+    size_t last_payload_size;
     int num_disconnects;
+    int num_snapshots;
+    unsigned char snapshot[4000];
+    size_t snapshot_size;
+    //  entity updates from the last replication payload
+    int num_updates;
+    udp_entity_update_t updates[8];
     int step;
     udp_client_t *client;
     vector_t packets;
 };
 
+struct entity {
+    int x;
+    int y;
+};
+
+enum {
+    FIELD_X = 1,
+    FIELD_Y = 2
+};
+
+size_t serialize_entity(udp_replication_params_t *params, uint32_t id, void *ent, uint32_t fields, void *out, size_t size) {
+    entity *e = (entity *)ent;
+    size_t n = 0;
+    if (size < sizeof(entity)) {
+        return 0;
+    }
+    if (fields & FIELD_X) {
+        memcpy((char *)out + n, &e->x, sizeof(int));
+        n += sizeof(int);
+    }
+    if (fields & FIELD_Y) {
+        memcpy((char *)out + n, &e->y, sizeof(int));
+        n += sizeof(int);
+    }
+    return n;
+}
+
 server server1;
 client client1;
 client client2;
@@ -46,6 +88,13 @@ client client2;
 void on_peer_message(udp_group_params_t *gpar, udp_peer_t *peer, udp_payload_t *payload) {
     server **spp = (server **)(gpar + 1);
     (*spp)->num_peer_messages++;
+    uint64_t received = udp_payload_received_at(payload);
+    if (received) {
+        assert(received <= udp_timestamp());
+        (*spp)->num_stamped_messages++;
+    }
+    memcpy((*spp)->last_message, payload->data, payload->size);
+    (*spp)->last_message_size = payload->size;
 }
 
 void on_peer_removed(udp_group_params_t *gpar, udp_peer_t *peer, UDPPEER reason) {
@@ -113,6 +162,7 @@ void setup_server(server *s) {
     s->params.on_idle = on_idle;
     s->params.on_peer_new = on_peer_new;
     s->params.on_peer_expired = on_peer_expired;
+    s->params.receive_timestamps = 1;
     int r = vector_init(&s->packets, sizeof(udp_payload_t *));
     assert(r == 0);
     s->instance = udp_initialize(&s->params);
@@ -143,6 +193,19 @@ void c_on_idle(udp_client_params_t *cparm) {
 void c_on_payload(udp_client_params_t *cparm, udp_client_connection_t *conn, udp_payload_t *payload) {
     client *c = (client *)cparm;
     c->num_payloads++;
+    memcpy(c->last_payload, payload->data, payload->size);
+    c->last_payload_size = payload->size;
+    if (udp_payload_channel(payload) == 3) {
+        c->num_updates = 0;
+        size_t offset = 0;
+        udp_entity_update_t u;
+        int r;
+        while ((r = udp_entity_update_next(c->last_payload, c->last_payload_size, &offset, &u)) > 0) {
+            assert(c->num_updates < 8);
+            c->updates[c->num_updates++] = u;
+        }
+        assert(r == 0);
+    }
 }
 
 void c_on_disconnect(udp_client_params_t *cparm, udp_client_connection_t *conn, UDPPEER reason) {
@@ -150,10 +213,23 @@ void c_on_disconnect(udp_client_params_t *cparm, udp_client_connection_t *conn,
     c->num_disconnects++;
 }
 
+void c_on_snapshot(udp_client_params_t *cparm, udp_client_connection_t *conn, uint16_t stream, uint32_t sequence, void const *data, size_t size) {
+    client *c = (client *)cparm;
+    c->num_snapshots++;
+    assert(size <= sizeof(c->snapshot));
+    memcpy(c->snapshot, data, size);
+    c->snapshot_size = size;
+}
+
 void setup_client(client *c) {
     memset(c, 0, sizeof(*c));
+    c->params.app_id = 34;
+    c->params.app_version = 3;
     c->params.on_error = c_on_error;
     c->params.on_idle = c_on_idle;
+    c->params.on_payload = c_on_payload;
+    c->params.on_disconnect = c_on_disconnect;
+    c->params.on_snapshot = c_on_snapshot;
     int r = vector_init(&c->packets, sizeof(udp_payload_t *));
     assert(r == 0);
     c->step = 0;
@@ -177,11 +253,27 @@ void step_server(server *s) {
 
 udp_addr_t afmt;
 udp_conn_addr_t addr;
+udp_client_connection_t *conn1;
 
 void step_client(client *c) {
     switch (c->step) {
-        case 0:
-            udp_client_connect(c->client, &addr, NULL);
+        case 0: {
+                udp_client_connection_t *conn = udp_client_connect(c->client, &addr, NULL);
+                assert(conn != NULL);
+                if (c == &client1) {
+                    conn1 = conn;
+                }
+            }
+            break;
+        case 2:
+            if (c == &client1) {
+                assert(udp_client_connection_send_budget(conn1) > 0);
+                udp_payload_t *pl = udp_client_payload_get(c->client);
+                memcpy(pl->data, "hello", 5);
+                pl->size = 5;
+                UDPERR err = udp_client_payload_send(conn1, pl);
+                assert(err == UDP_OK);
+            }
             break;
     }
     c->step++;
@@ -199,11 +291,268 @@ int main() {
 
     setup_client(&client1);
     step_client(&client1);
-    assert(server1.num_peers_new == 1);
+    //  the first connect is answered with a cookie, and nothing else
+    step_server(&server1);
+    assert(server1.num_peers_new == 0);
+    udp_client_poll(client1.client);
     step_server(&server1);
+    assert(server1.num_peers_new == 1);
     step_client(&client1);
     step_server(&server1);
     step_client(&client1);
+    step_server(&server1);
+    assert(server1.num_peer_messages == 2);
+    //  the kernel stamped them on the way in
+    assert(server1.num_stamped_messages == 2);
+
+    //  a snapshot that takes several packets, then a small change to it
+    unsigned char world[4000];
+    for (size_t i = 0; i != sizeof(world); ++i) {
+        world[i] = (unsigned char)(i * 7);
+    }
+    UDPERR err = udp_group_snapshot_send(server1.group2, world, sizeof(world));
+    assert(err == UDP_OK);
+    step_server(&server1);
+    udp_client_poll(client1.client);
+    assert(client1.num_snapshots == 1);
+    assert(client1.snapshot_size == sizeof(world));
+    assert(!memcmp(client1.snapshot, world, sizeof(world)));
+    //  the ack goes out on this poll
+    step_server(&server1);
+    world[100] = 1;
+    world[3000] = 2;
+    err = udp_group_snapshot_send(server1.group2, world, sizeof(world));
+    assert(err == UDP_OK);
+    step_server(&server1);
+    udp_client_poll(client1.client);
+    assert(client1.num_snapshots == 2);
+    assert(!memcmp(client1.snapshot, world, sizeof(world)));
+    assert(server1.num_peer_messages == 2);
+
+    //  compressed payloads both ways, with a dictionary
+    char const *dict = "\"entity\":\"position\":\"velocity\":";
+    err = udp_group_compression_set(server1.group2, 1, dict, strlen(dict));
+    assert(err == UDP_OK);
+    err = udp_client_connection_compression_set(conn1, 1, dict, strlen(dict));
+    assert(err == UDP_OK);
+    char msg[600];
+    size_t msize = 0;
+    for (int i = 0; i != 20; ++i) {
+        msize += sprintf(msg + msize, "{\"entity\":%d,\"position\":%d}", i, i * 3);
+    }
+    udp_payload_t *pl = udp_client_payload_get(client1.client);
+    memcpy(pl->data, msg, msize);
+    pl->size = (uint16_t)msize;
+    err = udp_client_payload_send(conn1, pl);
+    assert(err == UDP_OK);
+    udp_client_poll(client1.client);
+    step_server(&server1);
+    //  client 1 is in two groups
+    assert(server1.num_peer_messages == 4);
+    assert(server1.last_message_size == msize && !memcmp(server1.last_message, msg, msize));
+    pl = udp_payload_get(server1.instance);
+    memcpy(pl->data, msg, msize);
+    pl->size = (uint16_t)msize;
+    err = udp_group_payload_enqueue(server1.group2, pl);
+    assert(err == UDP_OK);
+    step_server(&server1);
+    udp_client_poll(client1.client);
+    assert(client1.last_payload_size == msize && !memcmp(client1.last_payload, msg, msize));
+    world[0] = 3;
+    err = udp_group_snapshot_send(server1.group2, world, sizeof(world));
+    assert(err == UDP_OK);
+    step_server(&server1);
+    udp_client_poll(client1.client);
+    assert(client1.num_snapshots == 3);
+    assert(!memcmp(client1.snapshot, world, sizeof(world)));
+
+    //  with some other dictionary, the packets say so, and are dropped rather than
+    //  turning into garbage
+    err = udp_client_connection_compression_set(conn1, 1, "\"entity\":", 9);
+    assert(err == UDP_OK);
+    pl = udp_client_payload_get(client1.client);
+    memcpy(pl->data, msg, msize);
+    pl->size = (uint16_t)msize;
+    err = udp_client_payload_send(conn1, pl);
+    assert(err == UDP_OK);
+    udp_client_poll(client1.client);
+    step_server(&server1);
+    assert(server1.num_peer_messages == 4);
+    udp_stats_t dstats;
+    udp_stats_get(server1.instance, &dstats);
+    assert(dstats.decompress_failures == 1);
+    err = udp_client_connection_compression_set(conn1, 1, dict, strlen(dict));
+    assert(err == UDP_OK);
+
+    //  channels: latest-only from the server drops the stale update, reliable from the client
+    err = udp_channel_configure(server1.instance, 1, UDP_CHANNEL_LATEST_ONLY, 10, 1);
+    assert(err == UDP_OK);
+    err = udp_client_channel_configure(client1.client, 2, UDP_CHANNEL_RELIABLE_ORDERED, 1, 1);
+    assert(err == UDP_OK);
+    int payloads = client1.num_payloads;
+    for (int i = 0; i != 2; ++i) {
+        pl = udp_payload_get(server1.instance);
+        sprintf((char *)pl->data, "move %d", i);
+        pl->size = 7;
+        err = udp_group_channel_enqueue(server1.group2, 1, pl);
+        assert(err == UDP_OK);
+    }
+    pl = udp_client_payload_get(client1.client);
+    memcpy(pl->data, "chat", 4);
+    pl->size = 4;
+    err = udp_client_channel_send(conn1, 2, pl);
+    assert(err == UDP_OK);
+    step_server(&server1);
+    udp_client_poll(client1.client);
+    assert(client1.num_payloads == payloads + 1);
+    assert(client1.last_payload_size == 7 && !memcmp(client1.last_payload, "move 1", 7));
+    step_server(&server1);
+    assert(server1.num_peer_messages == 6);
+    assert(server1.last_message_size == 4 && !memcmp(server1.last_message, "chat", 4));
+
+    //  spatial: only payloads within the peer's area of interest get there
+    udp_peer_t *peer1 = NULL;
+    assert(udp_group_peers_peek(server1.group2, &peer1, 1) == 1);
+    err = udp_group_spatial_init(server1.group2, 16.0f);
+    assert(err == UDP_OK);
+    err = udp_group_peer_position_set(server1.group2, peer1, 0, 0, 10);
+    assert(err == UDP_OK);
+    payloads = client1.num_payloads;
+    pl = udp_payload_get(server1.instance);
+    memcpy(pl->data, "far", 3);
+    pl->size = 3;
+    err = udp_group_payload_enqueue_at(server1.group2, 100, 100, pl);
+    assert(err == UDP_OK);
+    pl = udp_payload_get(server1.instance);
+    memcpy(pl->data, "near", 4);
+    pl->size = 4;
+    err = udp_group_payload_enqueue_at(server1.group2, 3, 4, pl);
+    assert(err == UDP_OK);
+    step_server(&server1);
+    udp_client_poll(client1.client);
+    assert(client1.num_payloads == payloads + 1);
+    assert(client1.last_payload_size == 4 && !memcmp(client1.last_payload, "near", 4));
+
+    //  replication: with room for one entity per tick, the most urgent goes first, 
+    //  and the others catch up as their priority accumulates
+    err = udp_channel_configure(server1.instance, 3, UDP_CHANNEL_RELIABLE_ORDERED, 5, 1);
+    assert(err == UDP_OK);
+    udp_replication_params_t rparams;
+    memset(&rparams, 0, sizeof(rparams));
+    rparams.serialize = serialize_entity;
+    rparams.channel = 4;
+    rparams.max_bytes_per_tick = 1;
+    //  not a channel that has been configured
+    assert(udp_group_replication_init(server1.group2, &rparams) == UDPERR_INVALID_ARGUMENT);
+    rparams.channel = 3;
+    err = udp_group_replication_init(server1.group2, &rparams);
+    assert(err == UDP_OK);
+    entity ents[3] = { { 1, 2 }, { 3, 4 }, { 5, 6 } };
+    float priorities[3] = { 1, 5, 2 };
+    for (int i = 0; i != 3; ++i) {
+        err = udp_group_entity_add(server1.group2, 100 + i, &ents[i], priorities[i]);
+        assert(err == UDP_OK);
+    }
+    assert(udp_group_entity_add(server1.group2, 100, &ents[0], 1) == UDPERR_INVALID_ARGUMENT);
+    uint32_t expected_order[3] = { 101, 102, 100 };
+    for (int i = 0; i != 3; ++i) {
+        //  the snapshots above may have used up the send budget for now
+        while (udp_peer_send_budget(peer1) < 100) {
+            usleep(1000);
+        }
+        assert(udp_group_replication_tick(server1.group2) == 1);
+        step_server(&server1);
+        udp_client_poll(client1.client);
+        assert(client1.num_updates == 1);
+        assert(client1.updates[0].id == expected_order[i]);
+        assert(client1.updates[0].fields == UDP_ENTITY_ALL_FIELDS && client1.updates[0].size == 8);
+    }
+    assert(udp_group_replication_tick(server1.group2) == 0);
+    //  only what changed is sent, and removals are sent
+    rparams.max_bytes_per_tick = 0;
+    ents[1].y = 40;
+    err = udp_group_entity_dirty(server1.group2, 101, FIELD_Y);
+    assert(err == UDP_OK);
+    err = udp_group_entity_remove(server1.group2, 100);
+    assert(err == UDP_OK);
+    while (udp_peer_send_budget(peer1) < 100) {
+        usleep(1000);
+    }
+    assert(udp_group_replication_tick(server1.group2) == 2);
+    step_server(&server1);
+    udp_client_poll(client1.client);
+    assert(client1.num_updates == 2);
+    assert(client1.updates[0].id == 100 && client1.updates[0].fields == 0);
+    assert(client1.updates[1].id == 101 && client1.updates[1].fields == FIELD_Y);
+    assert(client1.updates[1].size == sizeof(int) && !memcmp(client1.updates[1].data, &ents[1].y, sizeof(int)));
+
+    //  statistics
+    udp_stats_t sstats, cstats;
+    udp_stats_get(server1.instance, &sstats);
+    udp_client_stats_get(client1.client, &cstats);
+    assert(sstats.packets_in > 0 && sstats.bytes_in > sstats.packets_in);
+    assert(sstats.packets_out > 0 && sstats.bytes_out > sstats.packets_out);
+    assert(cstats.packets_in > 0 && cstats.packets_in <= sstats.packets_out);
+    assert(sstats.pool_misses > 0 && sstats.pool_hits > 0);
+    assert(cstats.pool_misses > 0);
+    assert(sstats.crc_failures == 0 && sstats.send_errors == 0);
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    assert(sock >= 0);
+    sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(12345);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    char garbage[40];
+    memset(garbage, 0x55, sizeof(garbage));
+    r = (int)sendto(sock, garbage, sizeof(garbage), 0, (sockaddr *)&sin, sizeof(sin));
+    assert(r == sizeof(garbage));
+    close(sock);
+    step_server(&server1);
+    udp_stats_get(server1.instance, &sstats);
+    assert(sstats.crc_failures == 1);
+
+    //  timing: off until asked for, then a histogram per part of the poll
+    histogram_t hist;
+    assert(udp_timing_get(server1.instance, UDP_TIMING_POLL, &hist, 0) != UDP_OK);
+    err = udp_timing_enable(server1.instance, 1);
+    assert(err == UDP_OK);
+    err = udp_client_timing_enable(client1.client, 1);
+    assert(err == UDP_OK);
+    while (udp_peer_send_budget(peer1) < 100 || udp_client_connection_send_budget(conn1) < 100) {
+        usleep(1000);
+    }
+    pl = udp_client_payload_get(client1.client);
+    memcpy(pl->data, "ping", 4);
+    pl->size = 4;
+    err = udp_client_payload_send(conn1, pl);
+    assert(err == UDP_OK);
+    pl = udp_payload_get(server1.instance);
+    memcpy(pl->data, "pong", 4);
+    pl->size = 4;
+    err = udp_group_payload_enqueue(server1.group2, pl);
+    assert(err == UDP_OK);
+    udp_client_poll(client1.client);
+    step_server(&server1);
+    udp_client_poll(client1.client);
+    UDPTIMING const server_timings[] = {
+        UDP_TIMING_POLL, UDP_TIMING_RECV, UDP_TIMING_SEND, UDP_TIMING_CRC, UDP_TIMING_ON_PEER_MESSAGE, UDP_TIMING_QUEUE
+    };
+    for (size_t i = 0; i != sizeof(server_timings) / sizeof(server_timings[0]); ++i) {
+        err = udp_timing_get(server1.instance, server_timings[i], &hist, 0);
+        assert(err == UDP_OK);
+        assert(hist.count > 0);
+        assert(histogram_percentile(&hist, 50) <= hist.max);
+    }
+    err = udp_client_timing_get(client1.client, UDP_TIMING_ON_PAYLOAD, &hist, 0);
+    assert(err == UDP_OK && hist.count > 0);
+    err = udp_client_timing_get(client1.client, UDP_TIMING_QUEUE, &hist, 1);
+    assert(err == UDP_OK && hist.count > 0);
+    err = udp_client_timing_get(client1.client, UDP_TIMING_QUEUE, &hist, 0);
+    assert(err == UDP_OK && hist.count == 0);
+    assert(udp_timing_get(server1.instance, UDP_TIMING_COUNT, &hist, 0) != UDP_OK);
+    err = udp_timing_enable(server1.instance, 0);
+    assert(err == UDP_OK);
 
     setup_client(&client2);
     step_client(&client1);
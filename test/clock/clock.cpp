@@ -0,0 +1,269 @@
+#include <onyxudp/udpbase.h>
+#include <onyxudp/udpclient.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+
+enum { CLIENTS = 32 };
+
+uint64_t virtual_now;
+
+uint64_t virtual_clock(void *context) {
+    assert(context == &virtual_now);
+    return virtual_now;
+}
+
+struct server {
+    udp_params_t params;
+    udp_instance_t *instance;
+    udp_group_params_t gp;
+    udp_group_t *group;
+    int peers;
+    int expired;
+    int timed_out;
+    int errors;
+};
+
+server srv;
+
+struct client {
+    udp_client_params_t params;
+    udp_client_t *client;
+    udp_client_connection_t *conn;
+    int disconnects;
+    int errors;
+};
+
+client clis[CLIENTS];
+
+void on_peer_message(udp_group_params_t *gpar, udp_peer_t *peer, udp_payload_t *payload) {
+}
+
+void on_peer_removed(udp_group_params_t *gpar, udp_peer_t *peer, UDPPEER reason) {
+}
+
+void on_error(udp_params_t *params, UDPERR err, char const *text) {
+    fprintf(stderr, "SERVER ERROR: %d (%s)\n", err, text);
+    srv.errors++;
+}
+
+void on_idle(udp_params_t *params) {
+}
+
+void on_peer_new(udp_params_t *params, udp_peer_t *peer, udp_payload_t *payload) {
+    assert(udp_group_peer_add(srv.group, peer) == UDP_OK);
+    srv.peers++;
+}
+
+void on_peer_expired(udp_params_t *params, udp_peer_t *peer, UDPPEER reason) {
+    srv.expired++;
+    if (reason == UDPPEER_TIMEDOUT) {
+        srv.timed_out++;
+    }
+}
+
+void c_on_error(udp_client_params_t *cparm, UDPERR err, char const *text) {
+    fprintf(stderr, "CLIENT ERROR: %d (%s)\n", err, text);
+    ((client *)cparm)->errors++;
+}
+
+void c_on_idle(udp_client_params_t *cparm) {
+}
+
+void c_on_payload(udp_client_params_t *cparm, udp_client_connection_t *conn, udp_payload_t *payload) {
+}
+
+void c_on_disconnect(udp_client_params_t *cparm, udp_client_connection_t *conn, UDPPEER reason) {
+    ((client *)cparm)->disconnects++;
+}
+
+void c_on_snapshot(udp_client_params_t *cparm, udp_client_connection_t *conn, uint16_t stream, uint32_t sequence, void const *data, size_t size) {
+}
+
+void step(uint64_t advance_us, bool clients) {
+    virtual_now += advance_us;
+    udp_poll(srv.instance);
+    if (clients) {
+        for (int i = 0; i != CLIENTS; ++i) {
+            udp_client_poll(clis[i].client);
+        }
+    }
+}
+
+/* With a virtual clock, ten minutes of keepalives go by without waiting for them,
+ * and then a timeout, all at once.
+ */
+void test_virtual_clock() {
+    virtual_now = 1000000;
+    udp_memnet_t *net = udp_memnet_create(1024, 1400);
+    assert(net != NULL);
+    memset(&srv, 0, sizeof(srv));
+    srv.params.app_id = 50;
+    srv.params.app_version = 1;
+    srv.params.on_error = on_error;
+    srv.params.on_idle = on_idle;
+    srv.params.on_peer_new = on_peer_new;
+    srv.params.on_peer_expired = on_peer_expired;
+    srv.params.transport = udp_memnet_endpoint(net, 4000);
+    srv.params.clock = virtual_clock;
+    srv.params.clock_context = &virtual_now;
+    srv.instance = udp_initialize(&srv.params);
+    assert(srv.instance != NULL);
+    srv.gp.on_peer_message = on_peer_message;
+    srv.gp.on_peer_removed = on_peer_removed;
+    srv.group = udp_group_create(srv.instance, &srv.gp);
+    assert(srv.group != NULL);
+
+    udp_addr_t afmt;
+    udp_conn_addr_t addr;
+    sprintf(afmt.addr, "127.0.0.1");
+    sprintf(afmt.port, "4000");
+    assert(udp_client_address_resolve(&afmt, &addr) == UDP_OK);
+    memset(clis, 0, sizeof(clis));
+    for (int i = 0; i != CLIENTS; ++i) {
+        client *c = &clis[i];
+        c->params.app_id = 50;
+        c->params.app_version = 1;
+        c->params.on_error = c_on_error;
+        c->params.on_idle = c_on_idle;
+        c->params.on_payload = c_on_payload;
+        c->params.on_disconnect = c_on_disconnect;
+        c->params.on_snapshot = c_on_snapshot;
+        c->params.transport = udp_memnet_endpoint(net, 0);
+        c->params.clock = virtual_clock;
+        c->params.clock_context = &virtual_now;
+        c->client = udp_client_initialize(&c->params);
+        assert(c->client != NULL);
+        c->conn = udp_client_connect(c->client, &addr, NULL);
+        assert(c->conn != NULL);
+    }
+    for (int i = 0; i != 5; ++i) {
+        step(1000, true);
+    }
+    assert(srv.peers == CLIENTS);
+
+    //  keepalives keep everybody connected, however long that is
+    timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i != 1200; ++i) {
+        step(500000, true);
+    }
+    assert(srv.expired == 0);
+    for (int i = 0; i != CLIENTS; ++i) {
+        assert(clis[i].disconnects == 0);
+    }
+    timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    //  ten minutes went by in much less
+    assert(end.tv_sec - start.tv_sec < 60);
+
+    //  the clients go quiet; what they last sent arrives, then they time out
+    step(0, false);
+    assert(srv.expired == 0);
+    step(6000000, false);
+    assert(srv.expired == CLIENTS && srv.timed_out == CLIENTS);
+    step(0, true);
+    for (int i = 0; i != CLIENTS; ++i) {
+        assert(clis[i].disconnects == 1);
+        assert(clis[i].errors == 0);
+        udp_client_terminate(clis[i].client);
+    }
+    assert(srv.errors == 0);
+    udp_group_destroy(srv.group);
+    udp_terminate(srv.instance);
+    udp_memnet_destroy(net);
+
+    //  the library's own clock isn't the virtual one, and hasn't been going for long
+    assert(udp_timestamp() < 60000000 && virtual_now > 600000000);
+}
+
+enum { ATTEMPTS = 8 };
+
+struct chain {
+    udp_client_params_t params;
+    udp_client_t *client;
+    udp_client_connection_t *conns[ATTEMPTS];
+    int timed_out;
+    int disconnected;
+    int errors;
+};
+
+chain chn;
+
+void chain_on_error(udp_client_params_t *cparm, UDPERR err, char const *text) {
+    fprintf(stderr, "CLIENT ERROR: %d (%s)\n", err, text);
+    chn.errors++;
+}
+
+void chain_on_disconnect(udp_client_params_t *cparm, udp_client_connection_t *conn, UDPPEER reason) {
+    for (int i = 0; i != ATTEMPTS; ++i) {
+        if (chn.conns[i] == conn) {
+            chn.conns[i] = NULL;
+        }
+    }
+    if (reason != UDPPEER_TIMEDOUT) {
+        //  one we disconnected, below
+        assert(reason == UDPPEER_CLIENT_DISCONNECTED);
+        chn.disconnected++;
+        return;
+    }
+    chn.timed_out++;
+    //  the next attempt that's still around is given up on as well
+    for (int i = 0; i != ATTEMPTS; ++i) {
+        if (chn.conns[i]) {
+            assert(udp_client_disconnect(chn.conns[i]) == UDP_OK);
+            break;
+        }
+    }
+}
+
+/* Connection attempts to nowhere all time out in the same poll, and each
+ * on_disconnect() disconnects another one of them, which the poll copes with.
+ */
+void test_disconnect_from_callback() {
+    virtual_now = 1000000;
+    udp_memnet_t *net = udp_memnet_create(1024, 1400);
+    assert(net != NULL);
+    memset(&chn, 0, sizeof(chn));
+    chn.params.app_id = 50;
+    chn.params.app_version = 1;
+    chn.params.on_error = chain_on_error;
+    chn.params.on_idle = c_on_idle;
+    chn.params.on_payload = c_on_payload;
+    chn.params.on_disconnect = chain_on_disconnect;
+    chn.params.on_snapshot = c_on_snapshot;
+    chn.params.transport = udp_memnet_endpoint(net, 0);
+    chn.params.clock = virtual_clock;
+    chn.params.clock_context = &virtual_now;
+    chn.client = udp_client_initialize(&chn.params);
+    assert(chn.client != NULL);
+    for (int i = 0; i != ATTEMPTS; ++i) {
+        udp_addr_t afmt;
+        udp_conn_addr_t addr;
+        sprintf(afmt.addr, "127.0.0.1");
+        sprintf(afmt.port, "%d", 5000 + i);
+        assert(udp_client_address_resolve(&afmt, &addr) == UDP_OK);
+        chn.conns[i] = udp_client_connect(chn.client, &addr, NULL);
+        assert(chn.conns[i] != NULL);
+    }
+    for (int i = 0; i != 60; ++i) {
+        virtual_now += 1000000;
+        udp_client_poll(chn.client);
+    }
+    assert(chn.timed_out == ATTEMPTS / 2 && chn.disconnected == ATTEMPTS / 2);
+    for (int i = 0; i != ATTEMPTS; ++i) {
+        assert(chn.conns[i] == NULL);
+    }
+    assert(chn.errors == 0);
+    udp_client_terminate(chn.client);
+    udp_memnet_destroy(net);
+}
+
+int main() {
+    test_virtual_clock();
+    test_disconnect_from_callback();
+    return 0;
+}
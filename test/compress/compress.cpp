@@ -0,0 +1,99 @@
+
+#include <onyxutil/compress.h>
+
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+
+size_t roundtrip(compress_dict_t const *dict, unsigned char const *data, size_t size) {
+    size_t bound = compress_bound(size);
+    unsigned char *enc = (unsigned char *)malloc(bound);
+    unsigned char *dec = (unsigned char *)malloc(size + 1);
+    size_t n = compress_block(dict, data, size, enc, bound);
+    assert(n > 0 && n <= bound);
+    int r = decompress_block(dict, enc, n, dec, size);
+    assert(r == (int)size);
+    assert(!memcmp(dec, data, size));
+    /* too small output fails cleanly */
+    if (size) {
+        assert(decompress_block(dict, enc, n, dec, size - 1) == -1);
+    }
+    free(enc);
+    free(dec);
+    return n;
+}
+
+/* something that looks like a game state update: mostly fixed field layout,
+ * a few varying values */
+size_t make_packet(unsigned char *buf, int seed) {
+    size_t n = 0;
+    for (int e = 0; e != 16; ++e) {
+        n += sprintf((char *)buf + n, "{\"entity\":%d,\"type\":\"player\",\"pos\":[%d,%d],\"hp\":100}", e + seed % 7, seed * 3 + e, seed ^ e);
+    }
+    return n;
+}
+
+int main() {
+    unsigned char a[4096];
+    for (size_t i = 0; i != sizeof(a); ++i) {
+        a[i] = (unsigned char)rand();
+    }
+    /* incompressible data stays within the bound; "only if smaller" fails */
+    roundtrip(NULL, a, sizeof(a));
+    unsigned char enc[8192];
+    assert(compress_block(NULL, a, sizeof(a), enc, sizeof(a) - 1) == 0);
+    roundtrip(NULL, a, 0);
+    roundtrip(NULL, a, 3);
+
+    /* repetitive data compresses well, including long, overlapping matches */
+    memset(a, 'x', sizeof(a));
+    assert(roundtrip(NULL, a, sizeof(a)) < 64);
+    for (size_t i = 0; i != sizeof(a); ++i) {
+        a[i] = (unsigned char)("abcdefg"[i % 7]);
+    }
+    assert(roundtrip(NULL, a, sizeof(a)) < 64);
+
+    /* a dictionary trained on similar packets makes small packets smaller */
+    unsigned char samples[64][1200];
+    void const *sp[64];
+    size_t ss[64];
+    for (int i = 0; i != 64; ++i) {
+        ss[i] = make_packet(samples[i], i);
+        sp[i] = samples[i];
+    }
+    unsigned char dbuf[4096];
+    size_t dsize = compress_dict_train(sp, ss, 64, dbuf, sizeof(dbuf));
+    assert(dsize > 0 && dsize <= sizeof(dbuf));
+    compress_dict_t dict;
+    int r = compress_dict_init(&dict, dbuf, dsize);
+    assert(r == 0);
+    unsigned char pkt[1200];
+    size_t psize = make_packet(pkt, 1000);
+    size_t plain = roundtrip(NULL, pkt, 200);
+    size_t primed = roundtrip(&dict, pkt, 200);
+    assert(primed < plain);
+    roundtrip(&dict, pkt, psize);
+    roundtrip(&dict, a, sizeof(a));
+
+    /* data compressed with a dictionary refers back into it */
+    size_t n = compress_block(&dict, pkt, 200, enc, sizeof(enc));
+    unsigned char out[1200];
+    assert(decompress_block(NULL, enc, n, out, sizeof(out)) == -1 || memcmp(out, pkt, 200));
+    compress_dict_deinit(&dict);
+
+    /* dictionaries that are too big are refused */
+    static unsigned char big[COMPRESS_MAX_DICT_SIZE + 1];
+    assert(compress_dict_init(&dict, big, sizeof(big)) == -1);
+
+    /* malformed input is rejected */
+    unsigned char badoffset[] = { 0x10, 'a', 0x05, 0x00 };
+    assert(decompress_block(NULL, badoffset, sizeof(badoffset), out, sizeof(out)) == -1);
+    unsigned char truncated[] = { 0xf0 };
+    assert(decompress_block(NULL, truncated, sizeof(truncated), out, sizeof(out)) == -1);
+    unsigned char shortlit[] = { 0x50, 'a', 'b' };
+    assert(decompress_block(NULL, shortlit, sizeof(shortlit), out, sizeof(out)) == -1);
+
+    return 0;
+}
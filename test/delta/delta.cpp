@@ -0,0 +1,74 @@
+
+#include <onyxutil/delta.h>
+
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+
+void roundtrip(unsigned char const *base, size_t base_size, unsigned char const *data, size_t size) {
+    size_t bound = delta_encode_bound(size);
+    unsigned char *enc = (unsigned char *)malloc(bound);
+    unsigned char *dec = (unsigned char *)malloc(size + 1);
+    size_t n = delta_encode(base, base_size, data, size, enc, bound);
+    assert(n <= bound);
+    assert(n > 0 || size == 0 || (base_size >= size && !memcmp(base, data, size)));
+    int r = delta_decode(base, base_size, enc, n, dec, size);
+    assert(r == 0);
+    assert(!memcmp(dec, data, size));
+    free(enc);
+    free(dec);
+}
+
+int main() {
+    unsigned char a[4096], b[4096];
+    for (size_t i = 0; i != sizeof(a); ++i) {
+        a[i] = (unsigned char)(i * 7 + (i >> 5));
+    }
+    memcpy(b, a, sizeof(b));
+
+    /* identical data encodes to nothing */
+    unsigned char enc[8192];
+    size_t n = delta_encode(a, sizeof(a), b, sizeof(b), enc, sizeof(enc));
+    assert(n == 0);
+    roundtrip(a, sizeof(a), b, sizeof(b));
+
+    /* a few changed bytes make a small delta */
+    b[10] ^= 1;
+    b[11] ^= 0x80;
+    b[2000] = 0;
+    b[4095] ^= 0x55;
+    n = delta_encode(a, sizeof(a), b, sizeof(b), enc, sizeof(enc));
+    assert(n > 0 && n < 32);
+    roundtrip(a, sizeof(a), b, sizeof(b));
+
+    /* no baseline, shorter baseline, longer baseline */
+    roundtrip(NULL, 0, b, sizeof(b));
+    roundtrip(a, 100, b, sizeof(b));
+    roundtrip(a, sizeof(a), b, 1000);
+    roundtrip(a, sizeof(a), b, 0);
+
+    /* worst case stays within the bound */
+    for (size_t i = 0; i != sizeof(b); ++i) {
+        b[i] = (i & 3) ? a[i] : (unsigned char)~a[i];
+    }
+    roundtrip(a, sizeof(a), b, sizeof(b));
+    for (size_t i = 0; i != sizeof(b); ++i) {
+        b[i] = (unsigned char)rand();
+    }
+    roundtrip(a, sizeof(a), b, sizeof(b));
+
+    /* too small output fails cleanly */
+    n = delta_encode(NULL, 0, b, sizeof(b), enc, 100);
+    assert(n == 0);
+
+    /* malformed input is rejected */
+    unsigned char bad[] = { 0x10, 0x80 };
+    unsigned char out[16];
+    assert(delta_decode(NULL, 0, bad, sizeof(bad), out, sizeof(out)) == -1);
+    unsigned char toolong[] = { 0x00, 0x20, 1, 2, 3 };
+    assert(delta_decode(NULL, 0, toolong, sizeof(toolong), out, sizeof(out)) == -1);
+
+    return 0;
+}
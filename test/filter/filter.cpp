@@ -0,0 +1,161 @@
+#include <onyxudp/udpbase.h>
+#include <onyxudp/udpclient.h>
+#include <onyxudp/protocol.h>
+#include <onyxudp/filter.h>
+#include <onyxutil/crc.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+
+unsigned char key[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+
+udp_conn_addr_t make_addr(char const *host, int port) {
+    udp_addr_t afmt;
+    udp_conn_addr_t addr;
+    snprintf(afmt.addr, sizeof(afmt.addr), "%s", host);
+    snprintf(afmt.port, sizeof(afmt.port), "%d", port);
+    assert(udp_client_address_resolve(&afmt, &addr) == UDP_OK);
+    return addr;
+}
+
+/* A burst, then the sustained rate; per host, not per port. */
+void test_rate() {
+    udp_rate_limit_t rate = { 1000, 10 };
+    udp_filter_t *f = udp_filter_create(&rate, key);
+    assert(f != NULL);
+    udp_conn_addr_t a1 = make_addr("10.0.0.1", 1000);
+    udp_conn_addr_t a2 = make_addr("10.0.0.1", 2000);
+    udp_conn_addr_t b = make_addr("10.0.0.2", 1000);
+    uint64_t now = 5000000;
+    for (int i = 0; i != 10; ++i) {
+        assert(udp_filter_check(f, i & 1 ? &a1 : &a2, now) == UDPFILTER_PASS);
+    }
+    assert(udp_filter_check(f, &a1, now) == UDPFILTER_RATE_LIMITED);
+    assert(udp_filter_check(f, &a2, now) == UDPFILTER_RATE_LIMITED);
+    //  someone else isn't held back
+    assert(udp_filter_check(f, &b, now) == UDPFILTER_PASS);
+    //  a token per millisecond
+    now += 1000;
+    assert(udp_filter_check(f, &a1, now) == UDPFILTER_PASS);
+    assert(udp_filter_check(f, &a1, now) == UDPFILTER_RATE_LIMITED);
+    //  being quiet for a long time is worth one burst, not more
+    now += 10000000;
+    int passed = 0;
+    for (int i = 0; i != 100; ++i) {
+        passed += udp_filter_check(f, &a1, now) == UDPFILTER_PASS;
+    }
+    assert(passed == 10);
+    udp_filter_destroy(f);
+}
+
+/* Blocked hosts are blocked on every port; others only rarely, by chance. */
+void test_blocklist() {
+    udp_filter_t *f = udp_filter_create(NULL, key);
+    udp_conn_addr_t a = make_addr("10.0.0.1", 1000);
+    udp_conn_addr_t b = make_addr("10.0.0.2", 1000);
+    assert(udp_filter_check(f, &a, 0) == UDPFILTER_PASS);
+    assert(udp_filter_block(f, &a) == 0);
+    assert(udp_filter_check(f, &a, 0) == UDPFILTER_BLOCKED);
+    udp_conn_addr_t a2 = make_addr("10.0.0.1", 3000);
+    assert(udp_filter_check(f, &a2, 0) == UDPFILTER_BLOCKED);
+    assert(udp_filter_check(f, &b, 0) == UDPFILTER_PASS);
+    udp_conn_addr_t v6 = make_addr("::1", 1000);
+    assert(udp_filter_check(f, &v6, 0) == UDPFILTER_PASS);
+    assert(udp_filter_block(f, &v6) == 0);
+    assert(udp_filter_check(f, &v6, 0) == UDPFILTER_BLOCKED);
+
+    char host[32];
+    for (int i = 0; i != 2000; ++i) {
+        snprintf(host, sizeof(host), "10.1.%d.%d", i >> 8, i & 255);
+        udp_conn_addr_t x = make_addr(host, 1);
+        assert(udp_filter_block(f, &x) == 0);
+    }
+    int false_positives = 0;
+    for (int i = 0; i != 10000; ++i) {
+        snprintf(host, sizeof(host), "10.2.%d.%d", i >> 8, i & 255);
+        udp_conn_addr_t x = make_addr(host, 1);
+        false_positives += udp_filter_check(f, &x, 0) == UDPFILTER_BLOCKED;
+    }
+    assert(false_positives < 100);
+    udp_filter_unblock_all(f);
+    assert(udp_filter_check(f, &a, 0) == UDPFILTER_PASS);
+    udp_filter_destroy(f);
+}
+
+int errors;
+
+void on_error(udp_params_t *params, UDPERR err, char const *text) {
+    fprintf(stderr, "SERVER ERROR: %d (%s)\n", err, text);
+    errors++;
+}
+
+void on_idle(udp_params_t *params) {
+}
+
+void on_peer_new(udp_params_t *params, udp_peer_t *peer, udp_payload_t *payload) {
+}
+
+void on_peer_expired(udp_params_t *params, udp_peer_t *peer, UDPPEER reason) {
+}
+
+void send_connects(udp_transport_t *ep, udp_conn_addr_t const *to, int n) {
+    for (int i = 0; i != n; ++i) {
+        command_header hdr = { 0, UDP_CMD_CONNECT, 42, 1, 0 };
+        hdr.crc16 = update_crc16(&hdr.command, 10, 0);
+        udp_datagram_t dg = { *to, &hdr, sizeof(hdr), 0 };
+        assert(ep->send_batch(ep, &dg, 1) == 1);
+    }
+}
+
+/* What the filter drops never gets as far as a challenge, and is counted. */
+void test_instance() {
+    udp_memnet_t *net = udp_memnet_create(256, 1400);
+    udp_transport_t *ep = udp_memnet_endpoint(net, 0);
+    udp_rate_limit_t rate = { 10, 5 };
+    udp_params_t params;
+    memset(&params, 0, sizeof(params));
+    params.app_id = 42;
+    params.app_version = 1;
+    params.on_error = on_error;
+    params.on_idle = on_idle;
+    params.on_peer_new = on_peer_new;
+    params.on_peer_expired = on_peer_expired;
+    params.transport = udp_memnet_endpoint(net, 4000);
+    params.rate_limit = &rate;
+    udp_instance_t *instance = udp_initialize(&params);
+    assert(instance != NULL);
+    udp_conn_addr_t to = make_addr("127.0.0.1", 4000);
+
+    send_connects(ep, &to, 20);
+    udp_poll(instance);
+    udp_stats_t stats;
+    udp_stats_get(instance, &stats);
+    assert(stats.packets_in == 20);
+    assert(stats.rate_limited_packets == 15 && stats.challenges_sent == 5);
+
+    //  the endpoint is 127.0.0.1 too, on another port; blocking it blocks us
+    udp_conn_addr_t self = make_addr("127.0.0.1", 1);
+    assert(udp_blocklist_add(instance, &self) == UDP_OK);
+    send_connects(ep, &to, 3);
+    udp_poll(instance);
+    udp_stats_get(instance, &stats);
+    assert(stats.blocked_packets == 3 && stats.challenges_sent == 5);
+    udp_blocklist_clear(instance);
+    send_connects(ep, &to, 1);
+    udp_poll(instance);
+    udp_stats_get(instance, &stats);
+    assert(stats.blocked_packets == 3 && stats.rate_limited_packets + stats.challenges_sent == 21);
+    assert(errors == 0);
+
+    udp_terminate(instance);
+    udp_memnet_destroy(net);
+}
+
+int main() {
+    test_rate();
+    test_blocklist();
+    test_instance();
+    return 0;
+}
@@ -77,11 +77,47 @@ void big_test() {
         n++;
     }
     assert(n == 999);
+    hash_table_deinit(&ht);
+}
+
+/* The table grows to keep chains short, and removing the current item while iterating 
+ * still works once it has.
+ */
+void grow_test() {
+    hash_table_t ht;
+    hash_table_init(&ht, sizeof(item), 0, hash_12, comp_12);
+    item itm;
+    for (int i = 0; i != 50000; ++i) {
+        memset(&itm, 0, sizeof(itm));
+        sprintf(itm.key, "key %d", i);
+        sprintf(itm.value, "value %d", i);
+        assert(hash_table_assign(&ht, &itm) != NULL);
+    }
+    assert(ht.item_count == 50000);
+    assert(ht.top_size >= ht.item_count && ht.top_size < 2 * ht.item_count);
+    for (int i = 0; i < 50000; i += 7) {
+        memset(&itm, 0, sizeof(itm));
+        sprintf(itm.key, "key %d", i);
+        item *p = (item *)hash_table_find(&ht, &itm);
+        assert(p != NULL && same_number(p));
+    }
+    size_t top_size = ht.top_size;
+    hash_iterator_t iter;
+    int n = 0;
+    for (void *p = hash_table_begin(&ht, &iter); p; p = hash_table_next(&iter)) {
+        assert(same_number((item *)p));
+        assert(hash_table_remove(&ht, p) == 1);
+        n++;
+    }
+    assert(n == 50000);
+    assert(ht.item_count == 0 && ht.top_size == top_size);
+    hash_table_deinit(&ht);
 }
 
 int main() {
     simple_test();
     big_test();
+    grow_test();
     return 0;
 }
 
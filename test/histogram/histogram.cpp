@@ -0,0 +1,65 @@
+#include <onyxutil/histogram.h>
+
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+
+/* within the 1/64 relative error of the buckets (plus one, for small values) */
+static bool close_to(uint64_t got, uint64_t want) {
+    uint64_t err = want / 64 + 1;
+    return got + err >= want && got <= want + err;
+}
+
+histogram_t hist;
+histogram_t other;
+
+int main() {
+    histogram_reset(&hist);
+    assert(histogram_percentile(&hist, 50) == 0);
+    assert(histogram_mean(&hist) == 0);
+
+    /* small values are exact */
+    for (uint64_t i = 1; i <= 100; ++i) {
+        histogram_record(&hist, i);
+    }
+    assert(hist.count == 100 && hist.min == 1 && hist.max == 100);
+    assert(histogram_percentile(&hist, 50) == 50);
+    assert(histogram_percentile(&hist, 99) == 99);
+    assert(histogram_percentile(&hist, 100) == 100);
+    assert(histogram_percentile(&hist, 0) == 1);
+    assert(histogram_mean(&hist) == 50.5);
+
+    /* big values are close, across many orders of magnitude */
+    histogram_reset(&hist);
+    for (uint64_t v = 1000; v < 100000000000ull; v *= 10) {
+        histogram_reset(&other);
+        for (int i = 0; i != 1000; ++i) {
+            histogram_record(&other, v + i * (v / 1000));
+        }
+        assert(close_to(histogram_percentile(&other, 50), v + 500 * (v / 1000)));
+        assert(close_to(histogram_percentile(&other, 99.9), v + 999 * (v / 1000)));
+        assert(histogram_percentile(&other, 100) == other.max);
+        histogram_merge(&hist, &other);
+    }
+    assert(hist.count == 8000);
+    assert(hist.min == 1000);
+    assert(close_to(histogram_percentile(&hist, 5), 1399));
+
+    /* out of range values end up at the top */
+    histogram_reset(&hist);
+    histogram_record(&hist, ~(uint64_t)0);
+    histogram_record(&hist, 1);
+    assert(hist.max == ~(uint64_t)0);
+    assert(histogram_percentile(&hist, 100) == ~(uint64_t)0);
+
+    /* a long tail shows up in the high percentiles only */
+    histogram_reset(&hist);
+    for (int i = 0; i != 10000; ++i) {
+        histogram_record(&hist, i < 9990 ? 2000 : 500000);
+    }
+    assert(close_to(histogram_percentile(&hist, 99), 2000));
+    assert(close_to(histogram_percentile(&hist, 99.95), 500000));
+    return 0;
+}
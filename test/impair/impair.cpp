@@ -0,0 +1,341 @@
+#include <onyxudp/udpbase.h>
+#include <onyxudp/udpclient.h>
+#include <onyxudp/impair.h>
+#include <onyxudp/socket.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+
+/* A pair of loopback sockets, so the simulated link has something to send to. */
+int tx;
+int rx;
+udp_conn_addr_t rx_addr;
+udp_socket_transport_t tx_transport;
+
+void open_sockets() {
+    tx = socket(AF_INET, SOCK_DGRAM, 0);
+    rx = socket(AF_INET, SOCK_DGRAM, 0);
+    assert(tx >= 0 && rx >= 0);
+    sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(bind(rx, (sockaddr *)&sin, sizeof(sin)) == 0);
+    socklen_t len = sizeof(sin);
+    assert(getsockname(rx, (sockaddr *)&sin, &len) == 0);
+    udp_conn_addr_set(&rx_addr, (sockaddr *)&sin, len);
+    fcntl(rx, F_SETFL, fcntl(rx, F_GETFL) | O_NONBLOCK);
+    udp_socket_transport_init(&tx_transport, tx, AF_INET, NULL, NULL);
+}
+
+/* Read what arrived, as the datagram numbers that were sent. */
+int receive(uint32_t *out, int max) {
+    int n = 0;
+    uint32_t seq;
+    while (n < max && recv(rx, &seq, sizeof(seq), 0) == sizeof(seq)) {
+        out[n++] = seq;
+    }
+    return n;
+}
+
+uint32_t seqs[4000];
+uint32_t seqs2[4000];
+
+void test_loss() {
+    udp_impairment_t params;
+    memset(&params, 0, sizeof(params));
+    params.seed = 42;
+    params.loss = 0.05f;
+    udp_impair_t *imp = udp_impair_create(&params);
+    int n = 0;
+    //  in batches, so the receive buffer doesn't overflow
+    for (int batch = 0; batch != 10; ++batch) {
+        for (int i = 0; i != 200; ++i) {
+            uint32_t seq = (uint32_t)(batch * 200 + i);
+            assert(udp_impair_send(imp, &seq, sizeof(seq), &rx_addr, 1000) == sizeof(seq));
+        }
+        udp_impair_flush(imp, &tx_transport.transport, 1000);
+        usleep(1000);
+        n += receive(seqs + n, 4000 - n);
+    }
+    assert(n > 1800 && n < 1960);
+    for (int i = 1; i != n; ++i) {
+        assert(seqs[i] > seqs[i - 1]);
+    }
+    udp_impair_destroy(imp);
+
+    //  the same seed loses the same datagrams
+    imp = udp_impair_create(&params);
+    int n2 = 0;
+    for (int batch = 0; batch != 10; ++batch) {
+        for (int i = 0; i != 200; ++i) {
+            uint32_t seq = (uint32_t)(batch * 200 + i);
+            udp_impair_send(imp, &seq, sizeof(seq), &rx_addr, 1000);
+        }
+        udp_impair_flush(imp, &tx_transport.transport, 1000);
+        usleep(1000);
+        n2 += receive(seqs2 + n2, 4000 - n2);
+    }
+    assert(n2 == n && !memcmp(seqs, seqs2, n * sizeof(uint32_t)));
+    udp_impair_destroy(imp);
+}
+
+void test_delay() {
+    udp_impairment_t params;
+    memset(&params, 0, sizeof(params));
+    params.seed = 7;
+    params.latency_us = 20000;
+    params.jitter_us = 80000;
+    udp_impair_t *imp = udp_impair_create(&params);
+    //  one every millisecond; nothing arrives early, and nothing is lost
+    int n = 0;
+    uint64_t now = 1000;
+    uint64_t sent[200];
+    int reordered = 0;
+    uint64_t min_delay = ~(uint64_t)0, max_delay = 0;
+    for (uint64_t end = now + 320000; now != end; now += 100) {
+        if (now % 1000 == 0 && now < 201000) {
+            uint32_t seq = (uint32_t)(now / 1000 - 1);
+            sent[seq] = now;
+            udp_impair_send(imp, &seq, sizeof(seq), &rx_addr, now);
+        }
+        if (udp_impair_flush(imp, &tx_transport.transport, now)) {
+            usleep(100);
+            int m = receive(seqs + n, 4000 - n);
+            for (int k = n; k != n + m; ++k) {
+                uint64_t d = now - sent[seqs[k]];
+                if (d < min_delay) min_delay = d;
+                if (d > max_delay) max_delay = d;
+                reordered += k && seqs[k] < seqs[k - 1];
+            }
+            n += m;
+        }
+    }
+    assert(n == 200);
+    assert(min_delay >= 20000 && min_delay < 25000);
+    assert(max_delay <= 100000 && max_delay > 90000);
+    assert(reordered > 20);
+    assert(!udp_impair_next(imp));
+    udp_impair_destroy(imp);
+}
+
+void test_bandwidth_duplicate_queue() {
+    udp_impairment_t params;
+    memset(&params, 0, sizeof(params));
+    params.bandwidth = 1000;
+    params.duplicate = 1.0f;
+    params.queue_bytes = 40;
+    udp_impair_t *imp = udp_impair_create(&params);
+    //  4 bytes at 1000 bytes per second is 4 ms on the link each
+    for (uint32_t i = 0; i != 5; ++i) {
+        assert(udp_impair_send(imp, &i, sizeof(i), &rx_addr, 1000) == sizeof(i));
+    }
+    //  10 datagrams of 4 bytes queued; the queue is full
+    uint32_t seq = 5;
+    errno = 0;
+    assert(udp_impair_send(imp, &seq, sizeof(seq), &rx_addr, 1000) == -1);
+    assert(errno == ENOBUFS);
+    assert(udp_impair_next(imp) == 5000);
+    assert(udp_impair_flush(imp, &tx_transport.transport, 8999) == 2);
+    assert(udp_impair_flush(imp, &tx_transport.transport, 21000) == 8);
+    usleep(1000);
+    int n = receive(seqs, 4000);
+    assert(n == 10);
+    for (int i = 0; i != 10; ++i) {
+        assert(seqs[i] == (uint32_t)(i / 2));
+    }
+    udp_impair_destroy(imp);
+}
+
+/* A whole client and server through a lossy, jittery network, both ways. */
+
+struct server {
+    udp_params_t params;
+    udp_instance_t *instance;
+    udp_group_params_t gp;
+    udp_group_t *group;
+    int plain;
+    int reliable;
+    uint32_t next_reliable;
+    uint64_t min_delay;
+    uint64_t max_delay;
+    int errors;
+};
+
+struct client {
+    udp_client_params_t params;
+    udp_client_t *client;
+    int errors;
+};
+
+server srv;
+client cli;
+
+struct message {
+    uint32_t seq;
+    uint64_t sent;
+};
+
+void on_peer_message(udp_group_params_t *gpar, udp_peer_t *peer, udp_payload_t *payload) {
+    message m;
+    assert(payload->size == sizeof(m));
+    memcpy(&m, payload->data, sizeof(m));
+    if (udp_payload_channel(payload) == 2) {
+        assert(m.seq == srv.next_reliable);
+        srv.next_reliable++;
+        srv.reliable++;
+        return;
+    }
+    uint64_t d = udp_timestamp() - m.sent;
+    if (d < srv.min_delay) srv.min_delay = d;
+    if (d > srv.max_delay) srv.max_delay = d;
+    srv.plain++;
+}
+
+void on_peer_removed(udp_group_params_t *gpar, udp_peer_t *peer, UDPPEER reason) {
+}
+
+void on_error(udp_params_t *params, UDPERR err, char const *text) {
+    fprintf(stderr, "SERVER ERROR: %d (%s)\n", err, text);
+    srv.errors++;
+}
+
+void on_idle(udp_params_t *params) {
+}
+
+void on_peer_new(udp_params_t *params, udp_peer_t *peer, udp_payload_t *payload) {
+    if (!srv.group) {
+        srv.gp.on_peer_message = on_peer_message;
+        srv.gp.on_peer_removed = on_peer_removed;
+        srv.group = udp_group_create(srv.instance, &srv.gp);
+    }
+    assert(udp_group_peer_add(srv.group, peer) == UDP_OK);
+}
+
+void on_peer_expired(udp_params_t *params, udp_peer_t *peer, UDPPEER reason) {
+}
+
+void c_on_error(udp_client_params_t *cparm, UDPERR err, char const *text) {
+    fprintf(stderr, "CLIENT ERROR: %d (%s)\n", err, text);
+    cli.errors++;
+}
+
+void c_on_idle(udp_client_params_t *cparm) {
+}
+
+void c_on_payload(udp_client_params_t *cparm, udp_client_connection_t *conn, udp_payload_t *payload) {
+}
+
+void c_on_disconnect(udp_client_params_t *cparm, udp_client_connection_t *conn, UDPPEER reason) {
+    cli.errors++;
+}
+
+void c_on_snapshot(udp_client_params_t *cparm, udp_client_connection_t *conn, uint16_t stream, uint32_t sequence, void const *data, size_t size) {
+}
+
+void send_message(udp_client_connection_t *conn, uint8_t channel, uint32_t seq) {
+    message m = { seq, udp_timestamp() };
+    udp_payload_t *pl = udp_client_payload_get(cli.client);
+    memcpy(pl->data, &m, sizeof(m));
+    pl->size = sizeof(m);
+    assert(udp_client_channel_send(conn, channel, pl) == UDP_OK);
+}
+
+void poll_for(uint64_t us) {
+    uint64_t end = udp_timestamp() + us;
+    while (udp_timestamp() < end) {
+        udp_poll(srv.instance);
+        udp_client_poll(cli.client);
+        usleep(200);
+    }
+}
+
+void test_clientserver() {
+    udp_impairment_t impairment;
+    memset(&impairment, 0, sizeof(impairment));
+    impairment.seed = 1234;
+    impairment.loss = 0.05f;
+    impairment.latency_us = 10000;
+    impairment.jitter_us = 80000;
+
+    memset(&srv, 0, sizeof(srv));
+    srv.min_delay = ~(uint64_t)0;
+    srv.params.port = 12347;
+    srv.params.app_id = 36;
+    srv.params.app_version = 1;
+    srv.params.interface = "127.0.0.1";
+    srv.params.on_error = on_error;
+    srv.params.on_idle = on_idle;
+    srv.params.on_peer_new = on_peer_new;
+    srv.params.on_peer_expired = on_peer_expired;
+    srv.params.impairment = &impairment;
+    srv.instance = udp_initialize(&srv.params);
+    assert(srv.instance != NULL);
+
+    memset(&cli, 0, sizeof(cli));
+    cli.params.app_id = 36;
+    cli.params.app_version = 1;
+    cli.params.on_error = c_on_error;
+    cli.params.on_idle = c_on_idle;
+    cli.params.on_payload = c_on_payload;
+    cli.params.on_disconnect = c_on_disconnect;
+    cli.params.on_snapshot = c_on_snapshot;
+    impairment.seed = 5678;
+    cli.params.impairment = &impairment;
+    cli.client = udp_client_initialize(&cli.params);
+    assert(cli.client != NULL);
+    assert(udp_client_channel_configure(cli.client, 2, UDP_CHANNEL_RELIABLE_ORDERED, 1, 1) == UDP_OK);
+
+    udp_addr_t afmt;
+    udp_conn_addr_t addr;
+    sprintf(afmt.addr, "127.0.0.1");
+    sprintf(afmt.port, "12347");
+    assert(udp_client_address_resolve(&afmt, &addr) == UDP_OK);
+    udp_client_connection_t *conn = udp_client_connect(cli.client, &addr, NULL);
+    assert(conn != NULL);
+    //  the connect handshake can be lost, too; it's retried
+    for (int i = 0; i != 50 && !srv.group; ++i) {
+        poll_for(20000);
+    }
+    assert(srv.group != NULL);
+    poll_for(200000);
+
+    //  a payload of each kind every 2 ms for 400 ms
+    for (uint32_t i = 0; i != 200; ++i) {
+        send_message(conn, 0, i);
+        send_message(conn, 2, i);
+        poll_for(2000);
+    }
+    for (int i = 0; i != 100 && srv.reliable != 200; ++i) {
+        poll_for(20000);
+    }
+    //  about 5% of the plain payloads are lost; none of the reliable ones are, and
+    //  they come out in order in spite of the jitter
+    assert(srv.plain >= 170 && srv.plain < 200);
+    assert(srv.reliable == 200);
+    //  one-way delay is the latency plus up to the jitter, plus a poll or two
+    assert(srv.min_delay >= 10000);
+    assert(srv.max_delay > 60000 && srv.max_delay < 150000);
+    assert(srv.errors == 0 && cli.errors == 0);
+
+    udp_client_terminate(cli.client);
+    udp_terminate(srv.instance);
+}
+
+int main() {
+    open_sockets();
+    test_loss();
+    test_delay();
+    test_bandwidth_duplicate_queue();
+    test_clientserver();
+    close(tx);
+    close(rx);
+    return 0;
+}
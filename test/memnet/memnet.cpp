@@ -0,0 +1,1112 @@
+#include <onyxudp/udpbase.h>
+#include <onyxudp/udpclient.h>
+#include <onyxudp/protocol.h>
+#include <onyxutil/crc.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+
+struct server {
+    udp_params_t params;
+    udp_instance_t *instance;
+    udp_group_params_t gp;
+    udp_group_t *group;
+    int peers;
+    int messages;
+    int removed;
+    int errors;
+};
+
+server srv;
+
+struct client {
+    udp_client_params_t params;
+    udp_client_t *client;
+    int payloads;
+    int sum;
+    int disconnects;
+    int errors;
+};
+
+client cli;
+
+void on_peer_message(udp_group_params_t *gpar, udp_peer_t *peer, udp_payload_t *payload) {
+    srv.messages++;
+    udp_payload_t *pl = udp_payload_get(srv.instance);
+    memcpy(pl->data, payload->data, payload->size);
+    pl->size = payload->size;
+    assert(udp_peer_payload_enqueue(peer, pl) == UDP_OK);
+}
+
+void on_peer_removed(udp_group_params_t *gpar, udp_peer_t *peer, UDPPEER reason) {
+    srv.removed++;
+}
+
+void on_error(udp_params_t *params, UDPERR err, char const *text) {
+    fprintf(stderr, "SERVER ERROR: %d (%s)\n", err, text);
+    srv.errors++;
+}
+
+void on_idle(udp_params_t *params) {
+}
+
+void on_peer_new(udp_params_t *params, udp_peer_t *peer, udp_payload_t *payload) {
+    if (!srv.group) {
+        srv.gp.on_peer_message = on_peer_message;
+        srv.gp.on_peer_removed = on_peer_removed;
+        srv.group = udp_group_create(srv.instance, &srv.gp);
+    }
+    assert(udp_group_peer_add(srv.group, peer) == UDP_OK);
+    srv.peers++;
+}
+
+void on_peer_expired(udp_params_t *params, udp_peer_t *peer, UDPPEER reason) {
+}
+
+void c_on_error(udp_client_params_t *cparm, UDPERR err, char const *text) {
+    fprintf(stderr, "CLIENT ERROR: %d (%s)\n", err, text);
+    cli.errors++;
+}
+
+void c_on_idle(udp_client_params_t *cparm) {
+}
+
+void c_on_payload(udp_client_params_t *cparm, udp_client_connection_t *conn, udp_payload_t *payload) {
+    assert(payload->size == 40);
+    cli.payloads++;
+    cli.sum += ((unsigned char *)payload->data)[0];
+}
+
+void c_on_disconnect(udp_client_params_t *cparm, udp_client_connection_t *conn, UDPPEER reason) {
+    cli.disconnects++;
+}
+
+void c_on_snapshot(udp_client_params_t *cparm, udp_client_connection_t *conn, uint16_t stream, uint32_t sequence, void const *data, size_t size) {
+}
+
+void step() {
+    udp_poll(srv.instance);
+    udp_client_poll(cli.client);
+}
+
+/* A client and a server, talking through memory only. */
+void test_client_server() {
+    udp_memnet_t *net = udp_memnet_create(256, 1400);
+    assert(net != NULL);
+    udp_transport_t *server_ep = udp_memnet_endpoint(net, 4000);
+    udp_transport_t *client_ep = udp_memnet_endpoint(net, 0);
+    assert(server_ep != NULL && client_ep != NULL);
+    assert(udp_memnet_endpoint(net, 4000) == NULL);
+
+    memset(&srv, 0, sizeof(srv));
+    srv.params.app_id = 39;
+    srv.params.app_version = 1;
+    srv.params.on_error = on_error;
+    srv.params.on_idle = on_idle;
+    srv.params.on_peer_new = on_peer_new;
+    srv.params.on_peer_expired = on_peer_expired;
+    srv.params.transport = server_ep;
+    srv.instance = udp_initialize(&srv.params);
+    assert(srv.instance != NULL);
+
+    memset(&cli, 0, sizeof(cli));
+    cli.params.app_id = 39;
+    cli.params.app_version = 1;
+    cli.params.on_error = c_on_error;
+    cli.params.on_idle = c_on_idle;
+    cli.params.on_payload = c_on_payload;
+    cli.params.on_disconnect = c_on_disconnect;
+    cli.params.on_snapshot = c_on_snapshot;
+    cli.params.transport = client_ep;
+    cli.client = udp_client_initialize(&cli.params);
+    assert(cli.client != NULL);
+
+    udp_addr_t afmt;
+    udp_conn_addr_t addr;
+    sprintf(afmt.addr, "127.0.0.1");
+    sprintf(afmt.port, "4000");
+    assert(udp_client_address_resolve(&afmt, &addr) == UDP_OK);
+    udp_client_connection_t *conn = udp_client_connect(cli.client, &addr, NULL);
+    assert(conn != NULL);
+    for (int i = 0; i != 3; ++i) {
+        step();
+    }
+    assert(srv.peers == 1);
+    int sum = 0;
+    for (int i = 0; i != 50; ++i) {
+        udp_payload_t *pl = udp_client_payload_get(cli.client);
+        memset(pl->data, i, 40);
+        pl->size = 40;
+        sum += i;
+        assert(udp_client_payload_send(conn, pl) == UDP_OK);
+        step();
+        step();
+    }
+    assert(srv.messages == 50);
+    assert(cli.payloads == 50 && cli.sum == sum);
+
+    //  nothing was lost, and nothing went through the kernel
+    udp_stats_t stats;
+    udp_stats_get(srv.instance, &stats);
+    assert(stats.packets_in > 50 && stats.send_errors == 0);
+    assert(udp_memnet_dropped(net) == 0);
+    assert(srv.errors == 0 && cli.errors == 0);
+
+    udp_client_terminate(cli.client);
+    udp_terminate(srv.instance);
+    udp_memnet_destroy(net);
+}
+
+/* A client transport that can be told to send from a different address, like a
+ * client behind a NAT that has forgotten its mapping.
+ */
+struct rebinding_transport {
+    udp_transport_t transport;
+    udp_transport_t *ep[2];
+    int current;
+};
+
+int rebinding_send_batch(udp_transport_t *t, udp_datagram_t const *datagrams, int count) {
+    rebinding_transport *rt = (rebinding_transport *)t;
+    return rt->ep[rt->current]->send_batch(rt->ep[rt->current], datagrams, count);
+}
+
+int rebinding_recv_batch(udp_transport_t *t, udp_datagram_t *datagrams, int count) {
+    rebinding_transport *rt = (rebinding_transport *)t;
+    int n = rt->ep[0]->recv_batch(rt->ep[0], datagrams, count);
+    return n + rt->ep[1]->recv_batch(rt->ep[1], datagrams + n, count - n);
+}
+
+int rebinding_wait(udp_transport_t *t, uint32_t timeout_us) {
+    rebinding_transport *rt = (rebinding_transport *)t;
+    return rt->ep[rt->current]->wait(rt->ep[rt->current], timeout_us);
+}
+
+/* The client's address changes mid-connection; the server follows it by connection id,
+ * once the client has answered a challenge at the new address, and the same peer keeps
+ * getting the messages, and answering them there. The message that showed the server
+ * the new address is dropped.
+ */
+void test_migration() {
+    udp_memnet_t *net = udp_memnet_create(256, 1400);
+    rebinding_transport rt;
+    rt.transport.send_batch = rebinding_send_batch;
+    rt.transport.recv_batch = rebinding_recv_batch;
+    rt.transport.wait = rebinding_wait;
+    rt.ep[0] = udp_memnet_endpoint(net, 0);
+    rt.ep[1] = udp_memnet_endpoint(net, 0);
+    rt.current = 0;
+
+    memset(&srv, 0, sizeof(srv));
+    srv.params.app_id = 40;
+    srv.params.app_version = 1;
+    srv.params.on_error = on_error;
+    srv.params.on_idle = on_idle;
+    srv.params.on_peer_new = on_peer_new;
+    srv.params.on_peer_expired = on_peer_expired;
+    srv.params.transport = udp_memnet_endpoint(net, 4000);
+    srv.instance = udp_initialize(&srv.params);
+    assert(srv.instance != NULL);
+
+    memset(&cli, 0, sizeof(cli));
+    cli.params.app_id = 40;
+    cli.params.app_version = 1;
+    cli.params.on_error = c_on_error;
+    cli.params.on_idle = c_on_idle;
+    cli.params.on_payload = c_on_payload;
+    cli.params.on_disconnect = c_on_disconnect;
+    cli.params.on_snapshot = c_on_snapshot;
+    cli.params.transport = &rt.transport;
+    cli.client = udp_client_initialize(&cli.params);
+    assert(cli.client != NULL);
+
+    udp_addr_t afmt;
+    udp_conn_addr_t addr;
+    sprintf(afmt.addr, "127.0.0.1");
+    sprintf(afmt.port, "4000");
+    assert(udp_client_address_resolve(&afmt, &addr) == UDP_OK);
+    udp_client_connection_t *conn = udp_client_connect(cli.client, &addr, NULL);
+    assert(conn != NULL);
+    for (int i = 0; i != 3; ++i) {
+        step();
+    }
+    assert(srv.peers == 1);
+    for (int i = 0; i != 20; ++i) {
+        if (i == 10) {
+            rt.current = 1;
+        }
+        udp_payload_t *pl = udp_client_payload_get(cli.client);
+        memset(pl->data, i, 40);
+        pl->size = 40;
+        assert(udp_client_payload_send(conn, pl) == UDP_OK);
+        step();
+        step();
+    }
+    assert(srv.peers == 1);
+    assert(srv.messages == 19 && cli.payloads == 19);
+    assert(cli.sum == 190 - 10);
+    udp_stats_t stats;
+    udp_stats_get(srv.instance, &stats);
+    assert(stats.peer_migrations == 1 && stats.unknown_peer_packets == 0);
+    assert(stats.challenges_sent == 2);
+    assert(srv.errors == 0 && cli.errors == 0);
+
+    udp_client_terminate(cli.client);
+    udp_terminate(srv.instance);
+    udp_memnet_destroy(net);
+}
+
+void raw_command(udp_transport_t *ep, udp_conn_addr_t const *to, uint16_t command, uint32_t connection_id) {
+    command_header hdr = { 0, command, 41, 1, connection_id };
+    hdr.crc16 = update_crc16(&hdr.command, 10, 0);
+    udp_datagram_t dg = { *to, &hdr, sizeof(hdr), 0 };
+    assert(ep->send_batch(ep, &dg, 1) == 1);
+}
+
+void raw_data(udp_transport_t *ep, udp_conn_addr_t const *to, uint16_t flags, uint32_t connection_id) {
+    unsigned char buf[sizeof(data_header) + 40];
+    data_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.app_id = 41;
+    hdr.app_version = 1;
+    hdr.flags = flags;
+    hdr.connection_id = connection_id;
+    memcpy(buf, &hdr, sizeof(hdr));
+    memset(buf + sizeof(hdr), 7, 40);
+    uint32_t crc = update_crc32(buf + 4, sizeof(buf) - 4, 0);
+    memcpy(buf, &crc, 4);
+    udp_datagram_t dg = { *to, buf, sizeof(buf), 0 };
+    assert(ep->send_batch(ep, &dg, 1) == 1);
+}
+
+/* @return the connection_id of the command waiting at ep, which must be command */
+uint32_t raw_receive(udp_transport_t *ep, uint16_t command) {
+    command_header hdr;
+    udp_datagram_t dg;
+    dg.data = &hdr;
+    dg.size = sizeof(hdr);
+    assert(ep->recv_batch(ep, &dg, 1) == 1);
+    assert(dg.size == sizeof(hdr) && hdr.command == command);
+    assert(hdr.crc16 == update_crc16(&hdr.command, 10, 0));
+    return hdr.connection_id;
+}
+
+/* Nothing is allocated for an address until it echoes a cookie sent to it. */
+void test_cookies() {
+    udp_memnet_t *net = udp_memnet_create(256, 1400);
+    udp_transport_t *a = udp_memnet_endpoint(net, 0);
+    udp_transport_t *b = udp_memnet_endpoint(net, 0);
+    memset(&srv, 0, sizeof(srv));
+    srv.params.app_id = 41;
+    srv.params.app_version = 1;
+    srv.params.on_error = on_error;
+    srv.params.on_idle = on_idle;
+    srv.params.on_peer_new = on_peer_new;
+    srv.params.on_peer_expired = on_peer_expired;
+    srv.params.transport = udp_memnet_endpoint(net, 4000);
+    srv.instance = udp_initialize(&srv.params);
+    assert(srv.instance != NULL);
+    udp_addr_t afmt;
+    udp_conn_addr_t to;
+    sprintf(afmt.addr, "127.0.0.1");
+    sprintf(afmt.port, "4000");
+    assert(udp_client_address_resolve(&afmt, &to) == UDP_OK);
+
+    //  no cookie, or a made-up one: challenged, and forgotten
+    raw_command(a, &to, UDP_CMD_CONNECT, 0);
+    raw_data(b, &to, 0, 0);
+    udp_poll(srv.instance);
+    uint32_t cookie_a = raw_receive(a, UDP_CMD_CHALLENGE);
+    uint32_t cookie_b = raw_receive(b, UDP_CMD_CHALLENGE);
+    assert(cookie_a != 0 && cookie_b != 0 && cookie_a != cookie_b);
+    raw_command(a, &to, UDP_CMD_CONNECT, cookie_a + 1);
+    raw_data(b, &to, UDP_DATA_FLAG_COOKIE, cookie_a);
+    udp_poll(srv.instance);
+    assert(raw_receive(a, UDP_CMD_CHALLENGE) == cookie_a && raw_receive(b, UDP_CMD_CHALLENGE) == cookie_b);
+    assert(srv.peers == 0 && srv.messages == 0);
+    udp_stats_t stats;
+    udp_stats_get(srv.instance, &stats);
+    assert(stats.challenges_sent == 4);
+
+    //  the right cookie gets a peer, whether it comes with a connect or with data
+    raw_command(a, &to, UDP_CMD_CONNECT, cookie_a);
+    raw_data(b, &to, UDP_DATA_FLAG_COOKIE, cookie_b);
+    udp_poll(srv.instance);
+    assert(srv.peers == 2);
+    assert(raw_receive(a, UDP_CMD_CONNECT) != 0 && raw_receive(b, UDP_CMD_CONNECT) != 0);
+    udp_stats_get(srv.instance, &stats);
+    assert(stats.challenges_sent == 4);
+    assert(srv.errors == 0);
+
+    udp_terminate(srv.instance);
+    udp_memnet_destroy(net);
+}
+
+void raw_migrate(udp_transport_t *ep, udp_conn_addr_t const *to, uint32_t connection_id, uint32_t cookie) {
+    unsigned char buf[sizeof(data_header) + sizeof(cookie)];
+    data_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.app_id = 41;
+    hdr.app_version = 1;
+    hdr.flags = UDP_DATA_FLAG_MIGRATE;
+    hdr.connection_id = connection_id;
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), &cookie, sizeof(cookie));
+    uint32_t crc = update_crc32(buf + 4, sizeof(buf) - 4, 0);
+    memcpy(buf, &crc, 4);
+    udp_datagram_t dg = { *to, buf, sizeof(buf), 0 };
+    assert(ep->send_batch(ep, &dg, 1) == 1);
+}
+
+/* Somebody else sends with a live connection id, from their own address. Whatever
+ * they send, the peer stays where it is, until a cookie comes back from the new address.
+ */
+void test_spoofed_id() {
+    udp_memnet_t *net = udp_memnet_create(256, 1400);
+    udp_transport_t *a = udp_memnet_endpoint(net, 0);
+    udp_transport_t *b = udp_memnet_endpoint(net, 0);
+    memset(&srv, 0, sizeof(srv));
+    srv.params.app_id = 41;
+    srv.params.app_version = 1;
+    srv.params.on_error = on_error;
+    srv.params.on_idle = on_idle;
+    srv.params.on_peer_new = on_peer_new;
+    srv.params.on_peer_expired = on_peer_expired;
+    srv.params.transport = udp_memnet_endpoint(net, 4000);
+    srv.instance = udp_initialize(&srv.params);
+    assert(srv.instance != NULL);
+    udp_addr_t afmt;
+    udp_conn_addr_t to;
+    sprintf(afmt.addr, "127.0.0.1");
+    sprintf(afmt.port, "4000");
+    assert(udp_client_address_resolve(&afmt, &to) == UDP_OK);
+
+    raw_command(a, &to, UDP_CMD_CONNECT, 0);
+    udp_poll(srv.instance);
+    raw_command(a, &to, UDP_CMD_CONNECT, raw_receive(a, UDP_CMD_CHALLENGE));
+    udp_poll(srv.instance);
+    uint32_t id = raw_receive(a, UDP_CMD_CONNECT);
+    assert(srv.peers == 1 && id != 0);
+
+    //  data, keep-alives, disconnects, and made-up cookies from b: all challenged or dropped
+    raw_data(b, &to, 0, id);
+    raw_command(b, &to, UDP_CMD_IDLE, id);
+    raw_command(b, &to, UDP_CMD_DISCONNECT, id);
+    udp_poll(srv.instance);
+    uint32_t cookie = raw_receive(b, UDP_CMD_CHALLENGE);
+    assert(raw_receive(b, UDP_CMD_CHALLENGE) == cookie && raw_receive(b, UDP_CMD_CHALLENGE) == cookie);
+    raw_migrate(b, &to, id, cookie + 1);
+    raw_migrate(b, &to, id, 0);
+    udp_poll(srv.instance);
+    assert(srv.messages == 0);
+    udp_stats_t stats;
+    udp_stats_get(srv.instance, &stats);
+    assert(stats.peer_migrations == 0);
+
+    //  still a's: its data gets through, and answered there
+    raw_data(a, &to, 0, id);
+    udp_poll(srv.instance);
+    assert(srv.messages == 1);
+    unsigned char buf[1400];
+    udp_datagram_t dg = { to, buf, sizeof(buf), 0 };
+    assert(a->recv_batch(a, &dg, 1) == 1 && dg.size == sizeof(data_header) + 40);
+    dg.size = sizeof(buf);
+    assert(b->recv_batch(b, &dg, 1) == 0);
+
+    //  had b really been a, moved, the cookie would have moved the peer
+    raw_migrate(b, &to, id, cookie);
+    udp_poll(srv.instance);
+    udp_stats_get(srv.instance, &stats);
+    assert(stats.peer_migrations == 1);
+    assert(srv.peers == 1 && srv.errors == 0);
+
+    udp_terminate(srv.instance);
+    udp_memnet_destroy(net);
+}
+
+/* A client transport that keeps a copy of the last datagram it sent, and can make
+ * one up that seems to come from where that went.
+ */
+struct recording_transport {
+    udp_transport_t transport;
+    udp_transport_t *ep;
+    udp_conn_addr_t to;
+    unsigned char last[1400];
+    size_t size;
+    unsigned char forged[1400];
+    size_t forged_size;
+};
+
+int recording_send_batch(udp_transport_t *t, udp_datagram_t const *datagrams, int count) {
+    recording_transport *rt = (recording_transport *)t;
+    if (count) {
+        rt->to = datagrams[count - 1].addr;
+        rt->size = datagrams[count - 1].size;
+        memcpy(rt->last, datagrams[count - 1].data, rt->size);
+    }
+    return rt->ep->send_batch(rt->ep, datagrams, count);
+}
+
+int recording_recv_batch(udp_transport_t *t, udp_datagram_t *datagrams, int count) {
+    recording_transport *rt = (recording_transport *)t;
+    if (rt->forged_size && count) {
+        datagrams[0].addr = rt->to;
+        memcpy(datagrams[0].data, rt->forged, rt->forged_size);
+        datagrams[0].size = rt->forged_size;
+        rt->forged_size = 0;
+        return 1;
+    }
+    return rt->ep->recv_batch(rt->ep, datagrams, count);
+}
+
+int recording_wait(udp_transport_t *t, uint32_t timeout_us) {
+    recording_transport *rt = (recording_transport *)t;
+    return rt->ep->wait(rt->ep, timeout_us);
+}
+
+/* With a key pair, the payloads go sealed, and forged, replayed, and keyless traffic
+ * is dropped.
+ */
+void test_encryption() {
+    udp_memnet_t *net = udp_memnet_create(256, 1400);
+    recording_transport rt;
+    memset(&rt, 0, sizeof(rt));
+    rt.transport.send_batch = recording_send_batch;
+    rt.transport.recv_batch = recording_recv_batch;
+    rt.transport.wait = recording_wait;
+    rt.ep = udp_memnet_endpoint(net, 0);
+    unsigned char pub[UDP_KEY_SIZE], priv[UDP_KEY_SIZE];
+    assert(udp_keypair_generate(pub, priv) == UDP_OK);
+
+    memset(&srv, 0, sizeof(srv));
+    srv.params.app_id = 43;
+    srv.params.app_version = 1;
+    srv.params.on_error = on_error;
+    srv.params.on_idle = on_idle;
+    srv.params.on_peer_new = on_peer_new;
+    srv.params.on_peer_expired = on_peer_expired;
+    srv.params.transport = udp_memnet_endpoint(net, 4000);
+    srv.params.private_key = priv;
+    srv.instance = udp_initialize(&srv.params);
+    assert(srv.instance != NULL);
+
+    memset(&cli, 0, sizeof(cli));
+    cli.params.app_id = 43;
+    cli.params.app_version = 1;
+    cli.params.on_error = c_on_error;
+    cli.params.on_idle = c_on_idle;
+    cli.params.on_payload = c_on_payload;
+    cli.params.on_disconnect = c_on_disconnect;
+    cli.params.on_snapshot = c_on_snapshot;
+    cli.params.transport = &rt.transport;
+    cli.params.server_public_key = pub;
+    cli.client = udp_client_initialize(&cli.params);
+    assert(cli.client != NULL);
+
+    udp_addr_t afmt;
+    udp_conn_addr_t addr;
+    sprintf(afmt.addr, "127.0.0.1");
+    sprintf(afmt.port, "4000");
+    assert(udp_client_address_resolve(&afmt, &addr) == UDP_OK);
+    udp_client_connection_t *conn = udp_client_connect(cli.client, &addr, NULL);
+    assert(conn != NULL);
+    //  sent before there are keys; it waits for them
+    udp_payload_t *pl = udp_client_payload_get(cli.client);
+    memset(pl->data, 100, 40);
+    pl->size = 40;
+    assert(udp_client_payload_send(conn, pl) == UDP_OK);
+    for (int i = 0; i != 4; ++i) {
+        step();
+    }
+    assert(srv.peers == 1 && srv.messages == 1 && cli.payloads == 1);
+    for (int i = 0; i != 20; ++i) {
+        pl = udp_client_payload_get(cli.client);
+        memset(pl->data, i, 40);
+        pl->size = 40;
+        assert(udp_client_payload_send(conn, pl) == UDP_OK);
+        step();
+        step();
+    }
+    assert(srv.messages == 21 && cli.payloads == 21);
+
+    //  what went over the wire was sealed, and isn't the payload
+    data_header hdr;
+    memcpy(&hdr, rt.last, sizeof(hdr));
+    assert(hdr.flags & UDP_DATA_FLAG_ENCRYPTED);
+    assert(rt.size == sizeof(hdr) + 40 + 16);
+    unsigned char plain[40];
+    memset(plain, 19, sizeof(plain));
+    assert(memcmp(rt.last + sizeof(hdr), plain, sizeof(plain)) != 0);
+
+    //  sent again, or changed, it's dropped
+    udp_datagram_t dg = { rt.to, rt.last, rt.size, 0 };
+    assert(rt.ep->send_batch(rt.ep, &dg, 1) == 1);
+    rt.last[sizeof(hdr) + 3] ^= 1;
+    assert(rt.ep->send_batch(rt.ep, &dg, 1) == 1);
+    udp_poll(srv.instance);
+    udp_stats_t stats;
+    udp_stats_get(srv.instance, &stats);
+    assert(stats.auth_failures == 2 && srv.messages == 21);
+
+    //  Commands with the right id, from the right address, but not sealed, end nothing:
+    //  not the peer, and not the connection. They don't keep anything up, either.
+    command_header cmd = { 0, UDP_CMD_DISCONNECT, 43, 1, hdr.connection_id };
+    cmd.crc16 = update_crc16(&cmd.command, 10, 0);
+    udp_datagram_t cdg = { rt.to, &cmd, sizeof(cmd), 0 };
+    assert(rt.ep->send_batch(rt.ep, &cdg, 1) == 1);
+    memcpy(rt.forged, &cmd, sizeof(cmd));
+    rt.forged_size = sizeof(cmd);
+    step();
+    assert(srv.removed == 0 && cli.disconnects == 0);
+    udp_stats_get(srv.instance, &stats);
+    assert(stats.auth_failures == 3);
+    udp_client_stats_get(cli.client, &stats);
+    assert(stats.auth_failures == 1);
+    pl = udp_client_payload_get(cli.client);
+    memset(pl->data, 21, 40);
+    pl->size = 40;
+    assert(udp_client_payload_send(conn, pl) == UDP_OK);
+    step();
+    step();
+    assert(srv.messages == 22 && cli.payloads == 22);
+
+    //  neither a client with some other key, nor one without a key, gets in
+    unsigned char other_pub[UDP_KEY_SIZE], other_priv[UDP_KEY_SIZE];
+    assert(udp_keypair_generate(other_pub, other_priv) == UDP_OK);
+    udp_client_params_t wrong = cli.params;
+    wrong.server_public_key = other_pub;
+    wrong.transport = udp_memnet_endpoint(net, 0);
+    udp_client_params_t plaintext = cli.params;
+    plaintext.server_public_key = NULL;
+    plaintext.transport = udp_memnet_endpoint(net, 0);
+    udp_client_t *wrong_client = udp_client_initialize(&wrong);
+    udp_client_t *plain_client = udp_client_initialize(&plaintext);
+    assert(udp_client_connect(wrong_client, &addr, NULL) != NULL);
+    assert(udp_client_connect(plain_client, &addr, NULL) != NULL);
+    for (int i = 0; i != 10; ++i) {
+        udp_client_poll(wrong_client);
+        udp_client_poll(plain_client);
+        udp_poll(srv.instance);
+    }
+    assert(srv.peers == 1);
+    udp_stats_get(srv.instance, &stats);
+    assert(stats.auth_failures >= 5 && stats.crc_failures == 0);
+    assert(srv.errors == 0 && cli.errors == 0);
+
+    //  the real disconnect is sealed, and does end the peer
+    assert(udp_client_disconnect(conn) == UDP_OK);
+    udp_poll(srv.instance);
+    assert(srv.removed == 1);
+
+    udp_client_terminate(wrong_client);
+    udp_client_terminate(plain_client);
+    udp_client_terminate(cli.client);
+    udp_terminate(srv.instance);
+    udp_memnet_destroy(net);
+}
+
+struct batches {
+    udp_group_params_t gp;
+    udp_group_t *group;
+    int calls;
+    int messages;
+    size_t largest;
+    int next;
+    //  remove the peer of the next message
+    bool leave;
+    int removed;
+    int expired;
+    int c_calls;
+    int c_payloads;
+    size_t c_largest;
+    int c_next;
+};
+
+batches bat;
+
+void b_on_peer_messages(udp_group_params_t *gpar, udp_peer_message_t const *messages, size_t count) {
+    assert(count > 0);
+    bat.calls++;
+    if (count > bat.largest) {
+        bat.largest = count;
+    }
+    for (size_t i = 0; i != count; ++i) {
+        assert(messages[i].payload->size == 40);
+        assert(((unsigned char *)messages[i].payload->data)[0] == bat.next);
+        bat.next++;
+        bat.messages++;
+        if (bat.leave) {
+            //  the peer stays valid for the rest of the batch
+            assert(udp_group_peer_remove(bat.group, messages[i].peer) == UDP_OK);
+            bat.leave = false;
+        }
+        if (bat.removed) {
+            continue;
+        }
+        udp_payload_t *pl = udp_payload_get(srv.instance);
+        memcpy(pl->data, messages[i].payload->data, messages[i].payload->size);
+        pl->size = messages[i].payload->size;
+        assert(udp_peer_payload_enqueue(messages[i].peer, pl) == UDP_OK);
+    }
+}
+
+void b_on_peer_removed(udp_group_params_t *gpar, udp_peer_t *peer, UDPPEER reason) {
+    bat.removed++;
+}
+
+void b_on_peer_new(udp_params_t *params, udp_peer_t *peer, udp_payload_t *payload) {
+    assert(udp_group_peer_add(bat.group, peer) == UDP_OK);
+    srv.peers++;
+}
+
+void b_on_peer_expired(udp_params_t *params, udp_peer_t *peer, UDPPEER reason) {
+    bat.expired++;
+}
+
+void c_on_payloads(udp_client_params_t *cparm, udp_client_connection_t *conn, udp_payload_t * const *payloads, size_t count) {
+    assert(count > 0);
+    bat.c_calls++;
+    if (count > bat.c_largest) {
+        bat.c_largest = count;
+    }
+    for (size_t i = 0; i != count; ++i) {
+        assert(payloads[i]->size == 40);
+        assert(((unsigned char *)payloads[i]->data)[0] == bat.c_next);
+        bat.c_next++;
+        bat.c_payloads++;
+    }
+}
+
+/* With on_peer_messages() and on_payloads(), what arrives in one poll comes in one call,
+ * in order; on_peer_message() and on_payload() aren't called.
+ */
+void test_batches() {
+    udp_memnet_t *net = udp_memnet_create(256, 1400);
+    memset(&srv, 0, sizeof(srv));
+    memset(&bat, 0, sizeof(bat));
+    srv.params.app_id = 39;
+    srv.params.app_version = 1;
+    srv.params.on_error = on_error;
+    srv.params.on_idle = on_idle;
+    srv.params.on_peer_new = b_on_peer_new;
+    srv.params.on_peer_expired = b_on_peer_expired;
+    srv.params.transport = udp_memnet_endpoint(net, 4000);
+    srv.instance = udp_initialize(&srv.params);
+    assert(srv.instance != NULL);
+    bat.gp.on_peer_message = on_peer_message;
+    bat.gp.on_peer_messages = b_on_peer_messages;
+    bat.gp.on_peer_removed = b_on_peer_removed;
+    bat.group = udp_group_create(srv.instance, &bat.gp);
+    assert(bat.group != NULL);
+
+    memset(&cli, 0, sizeof(cli));
+    cli.params.app_id = 39;
+    cli.params.app_version = 1;
+    cli.params.on_error = c_on_error;
+    cli.params.on_idle = c_on_idle;
+    cli.params.on_payload = c_on_payload;
+    cli.params.on_payloads = c_on_payloads;
+    cli.params.on_disconnect = c_on_disconnect;
+    cli.params.on_snapshot = c_on_snapshot;
+    cli.params.transport = udp_memnet_endpoint(net, 0);
+    cli.client = udp_client_initialize(&cli.params);
+    assert(cli.client != NULL);
+
+    udp_addr_t afmt;
+    udp_conn_addr_t addr;
+    sprintf(afmt.addr, "127.0.0.1");
+    sprintf(afmt.port, "4000");
+    assert(udp_client_address_resolve(&afmt, &addr) == UDP_OK);
+    udp_client_connection_t *conn = udp_client_connect(cli.client, &addr, NULL);
+    for (int i = 0; i != 3; ++i) {
+        step();
+    }
+    assert(srv.peers == 1);
+
+    for (int i = 0; i != 10; ++i) {
+        udp_payload_t *pl = udp_client_payload_get(cli.client);
+        memset(pl->data, i, 40);
+        pl->size = 40;
+        assert(udp_client_payload_send(conn, pl) == UDP_OK);
+    }
+    for (int i = 0; i != 4; ++i) {
+        step();
+    }
+    assert(bat.messages == 10 && bat.largest > 1 && bat.calls < 10);
+    assert(bat.c_payloads == 10 && bat.c_largest > 1 && bat.c_calls < 10);
+    //  the single message callbacks weren't used
+    assert(srv.messages == 0 && cli.payloads == 0);
+
+    //  removing a peer in the middle of a batch
+    bat.leave = true;
+    for (int i = 10; i != 13; ++i) {
+        udp_payload_t *pl = udp_client_payload_get(cli.client);
+        memset(pl->data, i, 40);
+        pl->size = 40;
+        assert(udp_client_payload_send(conn, pl) == UDP_OK);
+    }
+    for (int i = 0; i != 4; ++i) {
+        step();
+    }
+    assert(bat.messages == 13 && bat.removed == 1 && bat.expired == 1);
+    assert(srv.errors == 0 && cli.errors == 0);
+
+    udp_client_terminate(cli.client);
+    udp_group_destroy(bat.group);
+    udp_terminate(srv.instance);
+    udp_memnet_destroy(net);
+}
+
+enum { ARENA_SLOTS = 8 };
+
+udp_payload_t *held[64];
+int nheld;
+
+void a_on_peer_message(udp_group_params_t *gpar, udp_peer_t *peer, udp_payload_t *payload) {
+    srv.messages++;
+    udp_payload_hold(payload);
+    held[nheld++] = payload;
+}
+
+/* With a receive arena, payloads are the slots they were received into, until the
+ * application holds them all; then they're copied as before.
+ */
+void test_arena() {
+    udp_memnet_t *net = udp_memnet_create(256, 1400);
+    memset(&srv, 0, sizeof(srv));
+    nheld = 0;
+    srv.params.app_id = 39;
+    srv.params.app_version = 1;
+    srv.params.on_error = on_error;
+    srv.params.on_idle = on_idle;
+    srv.params.on_peer_new = on_peer_new;
+    srv.params.on_peer_expired = on_peer_expired;
+    srv.params.transport = udp_memnet_endpoint(net, 4000);
+    srv.params.receive_arena = ARENA_SLOTS;
+    //  there usually aren't any reserved, which is fine too
+    srv.params.receive_arena_huge_pages = 1;
+    srv.instance = udp_initialize(&srv.params);
+    assert(srv.instance != NULL);
+
+    memset(&cli, 0, sizeof(cli));
+    cli.params.app_id = 39;
+    cli.params.app_version = 1;
+    cli.params.on_error = c_on_error;
+    cli.params.on_idle = c_on_idle;
+    cli.params.on_payload = c_on_payload;
+    cli.params.on_disconnect = c_on_disconnect;
+    cli.params.on_snapshot = c_on_snapshot;
+    cli.params.transport = udp_memnet_endpoint(net, 0);
+    cli.client = udp_client_initialize(&cli.params);
+    assert(cli.client != NULL);
+
+    udp_addr_t afmt;
+    udp_conn_addr_t addr;
+    sprintf(afmt.addr, "127.0.0.1");
+    sprintf(afmt.port, "4000");
+    assert(udp_client_address_resolve(&afmt, &addr) == UDP_OK);
+    udp_client_connection_t *conn = udp_client_connect(cli.client, &addr, NULL);
+    for (int i = 0; i != 3; ++i) {
+        step();
+    }
+    assert(srv.peers == 1);
+    srv.gp.on_peer_message = a_on_peer_message;
+
+    for (int i = 0; i != 20; ++i) {
+        udp_payload_t *pl = udp_client_payload_get(cli.client);
+        memset(pl->data, i, 40);
+        pl->size = 40;
+        assert(udp_client_payload_send(conn, pl) == UDP_OK);
+        step();
+        step();
+    }
+    assert(srv.messages == 20 && nheld == 20);
+    udp_stats_t stats;
+    udp_stats_get(srv.instance, &stats);
+    //  only so many can be held in the arena
+    assert(stats.arena_exhausted >= 20 - ARENA_SLOTS && stats.arena_exhausted < 20);
+    unsigned char *lo = (unsigned char *)held[0]->data;
+    unsigned char *hi = lo;
+    for (int i = 0; i != nheld; ++i) {
+        unsigned char *d = (unsigned char *)held[i]->data;
+        assert(held[i]->size == 40 && d[0] == i && d[39] == i);
+        if (i < 20 - (int)stats.arena_exhausted) {
+            lo = d < lo ? d : lo;
+            hi = d > hi ? d : hi;
+        }
+    }
+    //  the ones in the arena are close together
+    assert((size_t)(hi - lo) < ARENA_SLOTS * 2048);
+    for (int i = 0; i != nheld; ++i) {
+        udp_payload_release(held[i]);
+    }
+    nheld = 0;
+
+    //  released slots are used again
+    uint64_t exhausted = stats.arena_exhausted;
+    for (int i = 0; i != 20; ++i) {
+        udp_payload_t *pl = udp_client_payload_get(cli.client);
+        memset(pl->data, i, 40);
+        pl->size = 40;
+        assert(udp_client_payload_send(conn, pl) == UDP_OK);
+        step();
+        step();
+        assert(nheld == 1);
+        udp_payload_release(held[--nheld]);
+    }
+    udp_stats_get(srv.instance, &stats);
+    assert(srv.messages == 40 && stats.arena_exhausted == exhausted);
+
+    //  a payload held past udp_terminate() keeps its slot
+    udp_payload_t *pl = udp_client_payload_get(cli.client);
+    memset(pl->data, 99, 40);
+    pl->size = 40;
+    assert(udp_client_payload_send(conn, pl) == UDP_OK);
+    step();
+    step();
+    assert(nheld == 1);
+    assert(srv.errors == 0 && cli.errors == 0);
+    udp_client_terminate(cli.client);
+    udp_group_destroy(srv.group);
+    udp_terminate(srv.instance);
+    assert(((unsigned char *)held[0]->data)[0] == 99);
+    udp_payload_release(held[0]);
+    udp_memnet_destroy(net);
+}
+
+uint64_t stamp_received;
+uint64_t stamp_delivered;
+
+void t_on_peer_message(udp_group_params_t *gpar, udp_peer_t *peer, udp_payload_t *payload) {
+    srv.messages++;
+    stamp_received = udp_payload_received_at(payload);
+    stamp_delivered = udp_timestamp();
+}
+
+/* The memory network stamps datagrams as they're sent, so the time they sat in the
+ * queue shows as the difference from udp_timestamp() when they're delivered.
+ */
+void test_timestamps() {
+    udp_memnet_t *net = udp_memnet_create(256, 1400);
+    memset(&srv, 0, sizeof(srv));
+    srv.params.app_id = 39;
+    srv.params.app_version = 1;
+    srv.params.on_error = on_error;
+    srv.params.on_idle = on_idle;
+    srv.params.on_peer_new = on_peer_new;
+    srv.params.on_peer_expired = on_peer_expired;
+    srv.params.transport = udp_memnet_endpoint(net, 4000);
+    srv.instance = udp_initialize(&srv.params);
+    assert(srv.instance != NULL);
+
+    memset(&cli, 0, sizeof(cli));
+    cli.params.app_id = 39;
+    cli.params.app_version = 1;
+    cli.params.on_error = c_on_error;
+    cli.params.on_idle = c_on_idle;
+    cli.params.on_payload = c_on_payload;
+    cli.params.on_disconnect = c_on_disconnect;
+    cli.params.on_snapshot = c_on_snapshot;
+    cli.params.transport = udp_memnet_endpoint(net, 0);
+    cli.client = udp_client_initialize(&cli.params);
+    assert(cli.client != NULL);
+
+    udp_addr_t afmt;
+    udp_conn_addr_t addr;
+    sprintf(afmt.addr, "127.0.0.1");
+    sprintf(afmt.port, "4000");
+    assert(udp_client_address_resolve(&afmt, &addr) == UDP_OK);
+    udp_client_connection_t *conn = udp_client_connect(cli.client, &addr, NULL);
+    for (int i = 0; i != 3; ++i) {
+        step();
+    }
+    assert(srv.peers == 1);
+    srv.gp.on_peer_message = t_on_peer_message;
+
+    udp_payload_t *pl = udp_client_payload_get(cli.client);
+    assert(udp_payload_received_at(pl) == 0);
+    memset(pl->data, 1, 40);
+    pl->size = 40;
+    uint64_t sent = udp_timestamp();
+    assert(udp_client_payload_send(conn, pl) == UDP_OK);
+    udp_client_poll(cli.client);
+    usleep(5000);
+    udp_poll(srv.instance);
+    assert(srv.messages == 1);
+    assert(stamp_received >= sent && stamp_received <= stamp_delivered);
+    assert(stamp_delivered - stamp_received >= 5000);
+    assert(srv.errors == 0 && cli.errors == 0);
+    udp_client_terminate(cli.client);
+    udp_group_destroy(srv.group);
+    udp_terminate(srv.instance);
+    udp_memnet_destroy(net);
+}
+
+/* Full queues and unknown ports drop; too big is cut short and says so. */
+void test_drops() {
+    udp_memnet_t *net = udp_memnet_create(5, 64);
+    udp_transport_t *a = udp_memnet_endpoint(net, 1);
+    udp_transport_t *b = udp_memnet_endpoint(net, 2);
+    udp_addr_t afmt;
+    udp_conn_addr_t to_b, nowhere;
+    sprintf(afmt.addr, "127.0.0.1");
+    sprintf(afmt.port, "2");
+    assert(udp_client_address_resolve(&afmt, &to_b) == UDP_OK);
+    sprintf(afmt.port, "3");
+    assert(udp_client_address_resolve(&afmt, &nowhere) == UDP_OK);
+
+    unsigned char data[100];
+    for (int i = 0; i != 100; ++i) {
+        data[i] = (unsigned char)i;
+    }
+    udp_datagram_t out[10];
+    for (int i = 0; i != 10; ++i) {
+        out[i].addr = to_b;
+        out[i].data = data;
+        out[i].size = 10 + i;
+        out[i].ecn = 0;
+    }
+    out[1].size = 100;
+    out[2].addr = nowhere;
+    assert(a->send_batch(a, out, 10) == 10);
+    //  8 slots; one went nowhere, so one didn't fit
+    assert(udp_memnet_dropped(net) == 2);
+    assert(b->wait(b, 0) == 1);
+
+    unsigned char buf[4][128];
+    udp_datagram_t in[4];
+    int got = 0;
+    for (;;) {
+        for (int i = 0; i != 4; ++i) {
+            in[i].data = buf[i];
+            in[i].size = sizeof(buf[i]);
+        }
+        int n = b->recv_batch(b, in, 4);
+        assert(n >= 0 && n <= 4);
+        if (!n) {
+            break;
+        }
+        for (int i = 0; i != n; ++i, ++got) {
+            int sent = got < 2 ? got : got + 1;
+            assert(in[i].size == out[sent].size);
+            assert(!memcmp(in[i].data, data, in[i].size > 64 ? 64 : in[i].size));
+            udp_conn_addr_t from;
+            sprintf(afmt.port, "1");
+            udp_client_address_resolve(&afmt, &from);
+            assert(!memcmp(&in[i].addr, &from, sizeof(from)));
+        }
+    }
+    assert(got == 8);
+    assert(b->wait(b, 100) == 0);
+
+    //  an endpoint with a longer queue of its own takes all ten
+    udp_transport_t *c = udp_memnet_endpoint_queue(net, 4, 10);
+    assert(c != NULL);
+    udp_conn_addr_t to_c;
+    sprintf(afmt.port, "4");
+    assert(udp_client_address_resolve(&afmt, &to_c) == UDP_OK);
+    for (int i = 0; i != 10; ++i) {
+        out[i].addr = to_c;
+    }
+    assert(a->send_batch(a, out, 10) == 10);
+    assert(udp_memnet_dropped(net) == 2);
+    got = 0;
+    for (int n; (n = c->recv_batch(c, in, 4)) > 0; got += n) {
+        for (int i = 0; i != n; ++i) {
+            assert(in[i].size == out[got + i].size);
+            in[i].data = buf[i];
+            in[i].size = sizeof(buf[i]);
+        }
+    }
+    assert(got == 10);
+    udp_memnet_destroy(net);
+}
+
+struct sender {
+    pthread_t thread;
+    udp_transport_t *ep;
+    udp_conn_addr_t to;
+    int index;
+};
+
+enum { SENDERS = 4, PER_SENDER = 20000 };
+
+void *send_thread(void *arg) {
+    sender *s = (sender *)arg;
+    for (int i = 0; i != PER_SENDER; ++i) {
+        int msg[2] = { s->index, i };
+        udp_datagram_t dg;
+        dg.addr = s->to;
+        dg.data = msg;
+        dg.size = sizeof(msg);
+        dg.ecn = 0;
+        s->ep->send_batch(s->ep, &dg, 1);
+    }
+    return NULL;
+}
+
+/* Many senders, one receiver: everything either arrives, in order per sender, or is
+ * counted as dropped. */
+void test_threads() {
+    udp_memnet_t *net = udp_memnet_create(1024, 32);
+    udp_transport_t *rx = udp_memnet_endpoint(net, 7);
+    sender senders[SENDERS];
+    udp_addr_t afmt;
+    sprintf(afmt.addr, "127.0.0.1");
+    sprintf(afmt.port, "7");
+    for (int i = 0; i != SENDERS; ++i) {
+        senders[i].ep = udp_memnet_endpoint(net, 0);
+        senders[i].index = i;
+        assert(udp_client_address_resolve(&afmt, &senders[i].to) == UDP_OK);
+    }
+    for (int i = 0; i != SENDERS; ++i) {
+        assert(pthread_create(&senders[i].thread, NULL, send_thread, &senders[i]) == 0);
+    }
+    int next[SENDERS] = { 0 };
+    uint64_t received = 0;
+    int bufs[16][2];
+    udp_datagram_t in[16];
+    for (;;) {
+        for (int i = 0; i != 16; ++i) {
+            in[i].data = bufs[i];
+            in[i].size = sizeof(bufs[i]);
+        }
+        int n = rx->recv_batch(rx, in, 16);
+        for (int i = 0; i != n; ++i) {
+            int who = bufs[i][0];
+            assert(in[i].size == sizeof(bufs[i]) && who >= 0 && who < SENDERS);
+            assert(bufs[i][1] >= next[who]);
+            next[who] = bufs[i][1] + 1;
+            received++;
+        }
+        if (!n && received + udp_memnet_dropped(net) == SENDERS * PER_SENDER) {
+            break;
+        }
+        if (!n) {
+            rx->wait(rx, 1000);
+        }
+    }
+    for (int i = 0; i != SENDERS; ++i) {
+        pthread_join(senders[i].thread, NULL);
+    }
+    assert(received > 0);
+    udp_memnet_destroy(net);
+}
+
+int main() {
+    test_client_server();
+    test_migration();
+    test_cookies();
+    test_spoofed_id();
+    test_encryption();
+    test_batches();
+    test_arena();
+    test_timestamps();
+    test_drops();
+    test_threads();
+    return 0;
+}
@@ -0,0 +1,221 @@
+#include <onyxudp/udpbase.h>
+#include <onyxudp/udpclient.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+
+/* Where a thread was found to run, and what memory it prefers. */
+struct placement {
+    bool seen;
+    bool on_cpu0;
+    int mode;
+    unsigned long nodes;
+};
+
+void placement_get(placement *p) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    assert(pthread_getaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0);
+    p->on_cpu0 = CPU_COUNT(&cpus) == 1 && CPU_ISSET(0, &cpus);
+    p->mode = -1;
+    p->nodes = 0;
+    assert(syscall(SYS_get_mempolicy, &p->mode, &p->nodes, 8 * sizeof(unsigned long) + 1, NULL, 0) == 0);
+    __atomic_store_n(&p->seen, true, __ATOMIC_SEQ_CST);
+}
+
+bool placed(placement *p) {
+    return p->on_cpu0 && p->mode == MPOL_PREFERRED && p->nodes == 1;
+}
+
+int const cpus[] = { 0 };
+
+struct server {
+    udp_params_t params;
+    udp_thread_params_t thread;
+    udp_group_params_t gp;
+    udp_instance_t *instance;
+    udp_group_t *group;
+    placement run;
+    placement worker;
+    int errors;
+};
+
+server srv;
+
+struct client {
+    udp_client_params_t params;
+    udp_thread_params_t thread;
+    udp_client_t *client;
+    udp_client_connection_t *conn;
+    placement run;
+    int errors;
+};
+
+client cli;
+
+void on_error(udp_params_t *params, UDPERR err, char const *text) {
+    fprintf(stderr, "SERVER ERROR: %d (%s)\n", err, text);
+    srv.errors++;
+}
+
+void on_idle(udp_params_t *params) {
+}
+
+void on_peer_new(udp_params_t *params, udp_peer_t *peer, udp_payload_t *payload) {
+    placement_get(&srv.run);
+    assert(udp_group_peer_add(srv.group, peer) == UDP_OK);
+    udp_payload_t *pl = udp_payload_get(srv.instance);
+    memset(pl->data, 1, 16);
+    pl->size = 16;
+    assert(udp_peer_payload_enqueue(peer, pl) == UDP_OK);
+}
+
+void on_peer_expired(udp_params_t *params, udp_peer_t *peer, UDPPEER reason) {
+}
+
+void on_peer_message(udp_group_params_t *gpar, udp_peer_t *peer, udp_payload_t *payload) {
+    placement_get(&srv.worker);
+}
+
+void on_peer_removed(udp_group_params_t *gpar, udp_peer_t *peer, UDPPEER reason) {
+}
+
+void c_on_error(udp_client_params_t *cparm, UDPERR err, char const *text) {
+    fprintf(stderr, "CLIENT ERROR: %d (%s)\n", err, text);
+    cli.errors++;
+}
+
+void c_on_idle(udp_client_params_t *cparm) {
+}
+
+void c_on_payload(udp_client_params_t *cparm, udp_client_connection_t *conn, udp_payload_t *payload) {
+    placement_get(&cli.run);
+    udp_payload_t *pl = udp_client_payload_get(cli.client);
+    memset(pl->data, 2, 16);
+    pl->size = 16;
+    assert(udp_client_payload_send(conn, pl) == UDP_OK);
+}
+
+void c_on_disconnect(udp_client_params_t *cparm, udp_client_connection_t *conn, UDPPEER reason) {
+}
+
+void c_on_snapshot(udp_client_params_t *cparm, udp_client_connection_t *conn, uint16_t stream, uint32_t sequence, void const *data, size_t size) {
+}
+
+void mempolicy_get(int *o_mode, unsigned long *o_nodes) {
+    *o_mode = -1;
+    *o_nodes = 0;
+    assert(syscall(SYS_get_mempolicy, o_mode, o_nodes, 8 * sizeof(unsigned long) + 1, NULL, 0) == 0);
+}
+
+/* The polling thread, the workers and the client thread all run where they're told,
+ * and prefer the node they're told; the caller's own policy is left as it was.
+ */
+void test_placement() {
+    memset(&srv, 0, sizeof(srv));
+    srv.params.port = 12346;
+    srv.params.app_id = 47;
+    srv.params.app_version = 1;
+    srv.params.interface = "127.0.0.1";
+    srv.params.on_error = on_error;
+    srv.params.on_idle = on_idle;
+    srv.params.on_peer_new = on_peer_new;
+    srv.params.on_peer_expired = on_peer_expired;
+    srv.params.worker_threads = 2;
+    srv.params.receive_arena = 16;
+    srv.thread.cpus = cpus;
+    srv.thread.cpu_count = 1;
+    srv.params.run_thread = &srv.thread;
+    srv.params.worker_thread = &srv.thread;
+    srv.params.numa_nodes = 1;
+
+    int mode_before, mode_after;
+    unsigned long nodes_before, nodes_after;
+    mempolicy_get(&mode_before, &nodes_before);
+    srv.instance = udp_initialize(&srv.params);
+    assert(srv.instance != NULL);
+    mempolicy_get(&mode_after, &nodes_after);
+    assert(mode_before == mode_after && nodes_before == nodes_after);
+
+    srv.gp.on_peer_message = on_peer_message;
+    srv.gp.on_peer_removed = on_peer_removed;
+    srv.group = udp_group_create(srv.instance, &srv.gp);
+    assert(srv.group != NULL);
+    assert(udp_run(srv.instance) == UDP_OK);
+
+    memset(&cli, 0, sizeof(cli));
+    cli.params.app_id = 47;
+    cli.params.app_version = 1;
+    cli.params.on_error = c_on_error;
+    cli.params.on_idle = c_on_idle;
+    cli.params.on_payload = c_on_payload;
+    cli.params.on_disconnect = c_on_disconnect;
+    cli.params.on_snapshot = c_on_snapshot;
+    cli.thread.cpus = cpus;
+    cli.thread.cpu_count = 1;
+    cli.params.run_thread = &cli.thread;
+    cli.params.numa_nodes = 1;
+    cli.client = udp_client_initialize(&cli.params);
+    assert(cli.client != NULL);
+    udp_addr_t afmt;
+    udp_conn_addr_t addr;
+    sprintf(afmt.addr, "127.0.0.1");
+    sprintf(afmt.port, "12346");
+    assert(udp_client_address_resolve(&afmt, &addr) == UDP_OK);
+    cli.conn = udp_client_connect(cli.client, &addr, NULL);
+    assert(cli.conn != NULL);
+    assert(udp_client_run(cli.client) == UDP_OK);
+
+    for (int i = 0; i != 5000 && !__atomic_load_n(&srv.worker.seen, __ATOMIC_SEQ_CST); ++i) {
+        usleep(1000);
+    }
+    udp_client_terminate(cli.client);
+    udp_terminate(srv.instance);
+    assert(srv.run.seen && srv.worker.seen && cli.run.seen);
+    assert(placed(&srv.run));
+    assert(placed(&srv.worker));
+    assert(placed(&cli.run));
+    assert(srv.errors == 0 && cli.errors == 0);
+}
+
+/* A CPU that can't be is refused; FIFO works, or is refused for lack of permission. */
+void test_refused() {
+    udp_memnet_t *net = udp_memnet_create(16, 1400);
+    assert(net != NULL);
+    memset(&srv, 0, sizeof(srv));
+    srv.params.app_id = 47;
+    srv.params.app_version = 1;
+    srv.params.on_error = on_error;
+    srv.params.on_idle = on_idle;
+    srv.params.on_peer_new = on_peer_new;
+    srv.params.on_peer_expired = on_peer_expired;
+    srv.params.transport = udp_memnet_endpoint(net, 4000);
+    int const bad[] = { -1 };
+    srv.thread.cpus = bad;
+    srv.thread.cpu_count = 1;
+    srv.params.run_thread = &srv.thread;
+    srv.instance = udp_initialize(&srv.params);
+    assert(srv.instance != NULL);
+    assert(udp_run(srv.instance) == UDPERR_INVALID_ARGUMENT);
+
+    srv.thread.cpus = cpus;
+    srv.thread.fifo_priority = 1;
+    UDPERR err = udp_run(srv.instance);
+    assert(err == UDP_OK || err == UDPERR_INVALID_ARGUMENT);
+    udp_terminate(srv.instance);
+    assert(srv.errors == 0);
+    udp_memnet_destroy(net);
+}
+
+int main() {
+    test_placement();
+    test_refused();
+    return 0;
+}
@@ -0,0 +1,49 @@
+
+#include <onyxutil/pool.h>
+
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+
+
+int main() {
+    pool_t pool;
+    int r = pool_init(&pool, 0, 0);
+    assert(r == -1);
+    r = pool_init(&pool, 13, 4);
+    assert(r == 0);
+    assert(pool.block_size >= 13);
+    assert(pool.block_size % sizeof(void *) == 0);
+
+    void *blocks[10];
+    for (int i = 0; i != 10; ++i) {
+        blocks[i] = pool_alloc(&pool);
+        assert(blocks[i] != NULL);
+        memset(blocks[i], i, 13);
+    }
+    assert(pool.item_count == 10);
+    /* 10 blocks at 4 per chunk takes 3 chunks */
+    assert(pool.misses == 3);
+    assert(pool.hits == 7);
+    for (int i = 0; i != 10; ++i) {
+        for (int j = 0; j != 10; ++j) {
+            if (i != j) {
+                assert(blocks[i] != blocks[j]);
+            }
+        }
+        assert(((unsigned char *)blocks[i])[12] == i);
+    }
+
+    pool_free(&pool, blocks[3]);
+    pool_free(&pool, blocks[7]);
+    pool_free(&pool, NULL);
+    assert(pool.item_count == 8);
+    void *a = pool_alloc(&pool);
+    void *b = pool_alloc(&pool);
+    assert((a == blocks[3] && b == blocks[7]) || (a == blocks[7] && b == blocks[3]));
+    assert(pool.misses == 3);
+
+    pool_deinit(&pool);
+    assert(pool.item_count == 0);
+    return 0;
+}
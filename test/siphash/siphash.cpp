@@ -0,0 +1,44 @@
+#include <onyxutil/siphash.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+//  From the reference implementation: key is 00 01 ... 0f, and the message of
+//  length N is 00 01 ... N-1.
+struct test {
+    size_t size;
+    uint64_t hash;
+};
+
+test tests[] = {
+    { 0, 0x726fdb47dd0e0e31ULL },
+    { 1, 0x74f839c593dc67fdULL },
+    { 8, 0x93f5f5799a932462ULL },
+    { 15, 0xa129ca6149be45e5ULL },
+    { (size_t)-1 }
+};
+
+int main() {
+    unsigned char key[16];
+    unsigned char msg[64];
+    for (int i = 0; i != 16; ++i) {
+        key[i] = (unsigned char)i;
+    }
+    for (int i = 0; i != 64; ++i) {
+        msg[i] = (unsigned char)i;
+    }
+    for (int i = 0; tests[i].size != (size_t)-1; ++i) {
+        assert(siphash24(key, msg, tests[i].size) == tests[i].hash);
+    }
+    //  any change to key or message changes the hash
+    uint64_t h = siphash24(key, msg, 40);
+    key[15] ^= 1;
+    assert(siphash24(key, msg, 40) != h);
+    key[15] ^= 1;
+    msg[39] ^= 0x80;
+    assert(siphash24(key, msg, 40) != h);
+    msg[39] ^= 0x80;
+    assert(siphash24(key, msg, 40) == h);
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include <onyxudp/udpbase.h>
+#include <onyxudp/spatial.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The spatial index never looks inside the peers, so these stand in for them. */
+
+#define NPEERS 200
+
+char peers[NPEERS];
+float px[NPEERS], py[NPEERS], pr[NPEERS];
+bool placed[NPEERS];
+int hits[NPEERS];
+
+udp_peer_t *peer(int i) {
+    return (udp_peer_t *)&peers[i];
+}
+
+void visit(void *context, udp_peer_t *p) {
+    int i = (int)((char *)p - peers);
+    assert(i >= 0 && i < NPEERS);
+    ++hits[i];
+}
+
+size_t query(udp_spatial_t *sp, float x, float y) {
+    memset(hits, 0, sizeof(hits));
+    return udp_spatial_query(sp, x, y, visit, NULL);
+}
+
+float rnd(float lo, float hi) {
+    return lo + (hi - lo) * (rand() / (float)RAND_MAX);
+}
+
+/* Every query should find exactly the peers a brute force search finds. */
+void check(udp_spatial_t *sp, float x, float y) {
+    size_t n = query(sp, x, y);
+    size_t expected = 0;
+    for (int i = 0; i != NPEERS; ++i) {
+        float dx = x - px[i], dy = y - py[i];
+        int want = placed[i] && dx * dx + dy * dy <= pr[i] * pr[i];
+        assert(hits[i] == want);
+        expected += want;
+    }
+    assert(n == expected);
+}
+
+int main() {
+    udp_spatial_t *sp = udp_spatial_create(10.0f);
+    assert(sp != NULL);
+
+    /* the basics */
+    assert(udp_spatial_set(sp, peer(0), 0, 0, 5) == UDP_OK);
+    assert(udp_spatial_set(sp, peer(1), 100, 100, 5) == UDP_OK);
+    assert(query(sp, 1, 1) == 1 && hits[0] == 1);
+    assert(query(sp, 99, 103) == 1 && hits[1] == 1);
+    assert(query(sp, 50, 50) == 0);
+    assert(query(sp, -4, 0) == 1 && hits[0] == 1);
+    assert(query(sp, -6, 0) == 0);
+
+    /* moving */
+    assert(udp_spatial_set(sp, peer(0), 1, 1, 5) == UDP_OK);
+    assert(query(sp, 5, 1) == 1);
+    assert(udp_spatial_set(sp, peer(0), 50, 50, 5) == UDP_OK);
+    assert(query(sp, 1, 1) == 0);
+    assert(query(sp, 52, 48) == 1 && hits[0] == 1);
+
+    /* a radius covering cells that share a bucket is still visited only once */
+    assert(udp_spatial_set(sp, peer(2), 0, 0, 500) == UDP_OK);
+    assert(query(sp, 50, 50) == 2 && hits[0] == 1 && hits[2] == 1);
+    assert(query(sp, -300, 300) == 1 && hits[2] == 1);
+    assert(query(sp, 400, 400) == 0);
+
+    /* bad positions */
+    assert(udp_spatial_set(sp, peer(3), 0, 0, -1) == UDPERR_INVALID_ARGUMENT);
+    assert(query(sp, 0, 0) == 1);
+
+    /* removing */
+    udp_spatial_remove(sp, peer(2));
+    udp_spatial_remove(sp, peer(2));
+    assert(query(sp, -300, 300) == 0);
+    udp_spatial_remove(sp, peer(0));
+    udp_spatial_remove(sp, peer(1));
+    udp_spatial_destroy(sp);
+
+    /* lots of peers, moving around, against brute force */
+    sp = udp_spatial_create(16.0f);
+    srand(1);
+    for (int round = 0; round != 50; ++round) {
+        for (int i = 0; i != NPEERS; ++i) {
+            if (rand() % 10 == 0) {
+                udp_spatial_remove(sp, peer(i));
+                placed[i] = false;
+                continue;
+            }
+            if (!placed[i] || rand() % 4 == 0) {
+                //  mostly small moves, sometimes jumps
+                px[i] = placed[i] && rand() % 8 ? px[i] + rnd(-4, 4) : rnd(-500, 500);
+                py[i] = placed[i] && rand() % 8 ? py[i] + rnd(-4, 4) : rnd(-500, 500);
+                pr[i] = rand() % 50 ? rnd(0, 40) : rnd(200, 1000);
+                assert(udp_spatial_set(sp, peer(i), px[i], py[i], pr[i]) == UDP_OK);
+                placed[i] = true;
+            }
+        }
+        for (int q = 0; q != 200; ++q) {
+            check(sp, rnd(-600, 600), rnd(-600, 600));
+        }
+        for (int i = 0; i != NPEERS; ++i) {
+            if (placed[i]) {
+                check(sp, px[i], py[i]);
+            }
+        }
+    }
+    udp_spatial_destroy(sp);
+    return 0;
+}
@@ -0,0 +1,285 @@
+#include <onyxudp/udpbase.h>
+#include <onyxudp/udpclient.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+
+enum { GROUPS = 4, WORKERS = 4, CLIENTS = 8, MESSAGES = 20, LEAVE = 0xee };
+
+struct group {
+    //  must be first, the callbacks get a pointer to it
+    udp_group_params_t gp;
+    udp_group_t *group;
+    pthread_t thread;
+    bool thread_set;
+    int inside;
+    bool overlapped;
+    bool wrong_thread;
+    int messages;
+    int batches;
+    int removed;
+};
+
+struct server {
+    udp_params_t params;
+    udp_instance_t *instance;
+    group groups[GROUPS];
+    pthread_t thread;
+    int peers;
+    int expired;
+    int errors;
+};
+
+server srv;
+
+struct client {
+    udp_client_params_t params;
+    udp_client_t *client;
+    udp_client_connection_t *conn;
+    int payloads;
+    int errors;
+};
+
+client clis[CLIENTS];
+
+/* Called on a worker: always the same one for a group, never the polling thread. */
+void group_enter(group *g) {
+    if (__atomic_add_fetch(&g->inside, 1, __ATOMIC_SEQ_CST) != 1) {
+        g->overlapped = true;
+    }
+    if (!g->thread_set) {
+        g->thread = pthread_self();
+        g->thread_set = true;
+    } else if (!pthread_equal(g->thread, pthread_self())) {
+        g->wrong_thread = true;
+    }
+    if (pthread_equal(srv.thread, pthread_self())) {
+        g->wrong_thread = true;
+    }
+}
+
+void group_leave(group *g) {
+    __atomic_sub_fetch(&g->inside, 1, __ATOMIC_SEQ_CST);
+}
+
+void handle_message(group *g, udp_peer_t *peer, udp_payload_t *payload) {
+    g->messages++;
+    if (((unsigned char *)payload->data)[0] == LEAVE) {
+        assert(udp_group_peer_remove(g->group, peer) == UDP_OK);
+    } else {
+        //  take some time, so the other groups' callbacks overlap with this one
+        usleep(200);
+        udp_payload_t *pl = udp_payload_get(srv.instance);
+        memcpy(pl->data, payload->data, payload->size);
+        pl->size = payload->size;
+        assert(udp_peer_payload_enqueue(peer, pl) == UDP_OK);
+    }
+}
+
+void on_peer_message(udp_group_params_t *gpar, udp_peer_t *peer, udp_payload_t *payload) {
+    group *g = (group *)gpar;
+    group_enter(g);
+    handle_message(g, peer, payload);
+    group_leave(g);
+}
+
+void on_peer_messages(udp_group_params_t *gpar, udp_peer_message_t const *messages, size_t count) {
+    group *g = (group *)gpar;
+    group_enter(g);
+    g->batches++;
+    for (size_t i = 0; i != count; ++i) {
+        handle_message(g, messages[i].peer, messages[i].payload);
+    }
+    group_leave(g);
+}
+
+void on_peer_removed(udp_group_params_t *gpar, udp_peer_t *peer, UDPPEER reason) {
+    group *g = (group *)gpar;
+    group_enter(g);
+    __atomic_add_fetch(&g->removed, 1, __ATOMIC_SEQ_CST);
+    group_leave(g);
+}
+
+void on_error(udp_params_t *params, UDPERR err, char const *text) {
+    fprintf(stderr, "SERVER ERROR: %d (%s)\n", err, text);
+    srv.errors++;
+}
+
+void on_idle(udp_params_t *params) {
+}
+
+void on_peer_new(udp_params_t *params, udp_peer_t *peer, udp_payload_t *payload) {
+    assert(pthread_equal(srv.thread, pthread_self()));
+    assert(udp_group_peer_add(srv.groups[srv.peers % GROUPS].group, peer) == UDP_OK);
+    srv.peers++;
+}
+
+void on_peer_expired(udp_params_t *params, udp_peer_t *peer, UDPPEER reason) {
+    assert(pthread_equal(srv.thread, pthread_self()));
+    srv.expired++;
+}
+
+void c_on_error(udp_client_params_t *cparm, UDPERR err, char const *text) {
+    fprintf(stderr, "CLIENT ERROR: %d (%s)\n", err, text);
+    ((client *)cparm)->errors++;
+}
+
+void c_on_idle(udp_client_params_t *cparm) {
+}
+
+void c_on_payload(udp_client_params_t *cparm, udp_client_connection_t *conn, udp_payload_t *payload) {
+    assert(payload->size == 40);
+    ((client *)cparm)->payloads++;
+}
+
+void c_on_disconnect(udp_client_params_t *cparm, udp_client_connection_t *conn, UDPPEER reason) {
+}
+
+void c_on_snapshot(udp_client_params_t *cparm, udp_client_connection_t *conn, uint16_t stream, uint32_t sequence, void const *data, size_t size) {
+}
+
+void step() {
+    udp_poll(srv.instance);
+    for (int i = 0; i != CLIENTS; ++i) {
+        udp_client_poll(clis[i].client);
+    }
+}
+
+int echoes() {
+    int n = 0;
+    for (int i = 0; i != CLIENTS; ++i) {
+        n += clis[i].payloads;
+    }
+    return n;
+}
+
+int removed() {
+    int n = 0;
+    for (int i = 0; i != GROUPS; ++i) {
+        n += __atomic_load_n(&srv.groups[i].removed, __ATOMIC_SEQ_CST);
+    }
+    return n;
+}
+
+void send(client *c, unsigned char value) {
+    udp_payload_t *pl = udp_client_payload_get(c->client);
+    memset(pl->data, value, 40);
+    pl->size = 40;
+    assert(udp_client_payload_send(c->conn, pl) == UDP_OK);
+}
+
+/* Several groups on several workers: each group's callbacks stay on one worker, one at
+ * a time, while different groups run at once; what they send gets sent.
+ */
+void test_workers() {
+    udp_memnet_t *net = udp_memnet_create(1024, 1400);
+    assert(net != NULL);
+
+    memset(&srv, 0, sizeof(srv));
+    srv.thread = pthread_self();
+    srv.params.app_id = 44;
+    srv.params.app_version = 1;
+    srv.params.on_error = on_error;
+    srv.params.on_idle = on_idle;
+    srv.params.on_peer_new = on_peer_new;
+    srv.params.on_peer_expired = on_peer_expired;
+    srv.params.transport = udp_memnet_endpoint(net, 4000);
+    srv.params.worker_threads = WORKERS;
+    //  the workers let go of payloads in the arena from their own threads
+    srv.params.receive_arena = 64;
+    srv.instance = udp_initialize(&srv.params);
+    assert(srv.instance != NULL);
+    for (int i = 0; i != GROUPS; ++i) {
+        srv.groups[i].gp.on_peer_message = on_peer_message;
+        if (i & 1) {
+            //  half the groups take their messages in batches
+            srv.groups[i].gp.on_peer_messages = on_peer_messages;
+        }
+        srv.groups[i].gp.on_peer_removed = on_peer_removed;
+        srv.groups[i].group = udp_group_create(srv.instance, &srv.groups[i].gp);
+        assert(srv.groups[i].group != NULL);
+    }
+
+    udp_addr_t afmt;
+    udp_conn_addr_t addr;
+    sprintf(afmt.addr, "127.0.0.1");
+    sprintf(afmt.port, "4000");
+    assert(udp_client_address_resolve(&afmt, &addr) == UDP_OK);
+    memset(clis, 0, sizeof(clis));
+    for (int i = 0; i != CLIENTS; ++i) {
+        client *c = &clis[i];
+        c->params.app_id = 44;
+        c->params.app_version = 1;
+        c->params.on_error = c_on_error;
+        c->params.on_idle = c_on_idle;
+        c->params.on_payload = c_on_payload;
+        c->params.on_disconnect = c_on_disconnect;
+        c->params.on_snapshot = c_on_snapshot;
+        c->params.transport = udp_memnet_endpoint(net, 0);
+        c->client = udp_client_initialize(&c->params);
+        assert(c->client != NULL);
+        c->conn = udp_client_connect(c->client, &addr, NULL);
+        assert(c->conn != NULL);
+    }
+    for (int i = 0; i != 3; ++i) {
+        step();
+    }
+    assert(srv.peers == CLIENTS);
+
+    for (int m = 0; m != MESSAGES; ++m) {
+        for (int i = 0; i != CLIENTS; ++i) {
+            send(&clis[i], (unsigned char)m);
+        }
+        step();
+    }
+    for (int i = 0; i != 5000 && echoes() != CLIENTS * MESSAGES; ++i) {
+        step();
+        usleep(100);
+    }
+    assert(echoes() == CLIENTS * MESSAGES);
+
+    for (int i = 0; i != GROUPS; ++i) {
+        group *g = &srv.groups[i];
+        assert(g->messages == CLIENTS / GROUPS * MESSAGES);
+        assert(g->thread_set && !g->wrong_thread && !g->overlapped);
+        assert((g->batches > 0) == (i & 1));
+        for (int j = 0; j != i; ++j) {
+            //  round robin: each group has a worker of its own
+            assert(!pthread_equal(g->thread, srv.groups[j].thread));
+        }
+    }
+
+    //  removing itself from a worker: the peer is removed on the polling thread, which
+    //  tells the group's worker, then lets the peer go
+    send(&clis[0], LEAVE);
+    for (int i = 0; i != 5000 && (removed() != 1 || srv.expired != 1); ++i) {
+        step();
+        usleep(100);
+    }
+    assert(removed() == 1 && srv.expired == 1);
+    assert(srv.groups[0].removed == 1);
+    assert(!srv.groups[0].wrong_thread && !srv.groups[0].overlapped);
+
+    //  the rest go with their groups, which wait for the workers
+    for (int i = 0; i != GROUPS; ++i) {
+        udp_group_destroy(srv.groups[i].group);
+        assert(!srv.groups[i].wrong_thread);
+    }
+    assert(removed() == CLIENTS && srv.expired == CLIENTS);
+    assert(srv.errors == 0);
+    for (int i = 0; i != CLIENTS; ++i) {
+        assert(clis[i].errors == 0);
+        udp_client_terminate(clis[i].client);
+    }
+    udp_terminate(srv.instance);
+    udp_memnet_destroy(net);
+}
+
+int main() {
+    test_workers();
+    return 0;
+}
@@ -0,0 +1,58 @@
+#include <onyxutil/x25519.h>
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+//  Test vectors from RFC 7748.
+
+void unhex(unsigned char *out, char const *s) {
+    for (size_t i = 0; s[2 * i]; ++i) {
+        unsigned v;
+        sscanf(s + 2 * i, "%2x", &v);
+        out[i] = (unsigned char)v;
+    }
+}
+
+/* 5.2 */
+void test_scalarmult() {
+    unsigned char scalar[32], point[32], out[32], expected[32];
+    unhex(scalar, "a546e36bf0527c9d3b16154b82465edd62144c0ac1fc5a18506a2244ba449ac4");
+    unhex(point, "e6db6867583030db3594c1a424b15f7c726624ec26b3353b10a903a6d0ab1c4c");
+    unhex(expected, "c3da55379de9c6908e94ea4df28d084f32eccf03491c71f754b4075577a28552");
+    assert(x25519(out, scalar, point) == 0);
+    assert(!memcmp(out, expected, 32));
+}
+
+/* 6.1 */
+void test_diffie_hellman() {
+    unsigned char alice[32], bob[32], alice_pub[32], bob_pub[32], expected[32];
+    unsigned char shared1[32], shared2[32];
+    unhex(alice, "77076d0a7318a57d3c16c17251b26645df4c2f87ebc0992ab177fba51db92c2a");
+    unhex(bob, "5dab087e624a8a4b79e17f8b83800ee66f3bb1292618b6fd1c2f8b27ff88e0eb");
+    x25519_public_key(alice_pub, alice);
+    x25519_public_key(bob_pub, bob);
+    unhex(expected, "8520f0098930a754748b7ddcb43ef75a0dbf3a0d26381af4eba4a98eaa9b4e6a");
+    assert(!memcmp(alice_pub, expected, 32));
+    unhex(expected, "de9edb7d7b7dc1b4d35b61c2ece435373f8343c85b78674dadfc7e146f882b4f");
+    assert(!memcmp(bob_pub, expected, 32));
+    assert(x25519(shared1, alice, bob_pub) == 0);
+    assert(x25519(shared2, bob, alice_pub) == 0);
+    unhex(expected, "4a5d9d5ba4ce2de1728e3bf480350f25e07e21c947d19e3376f09b3c1e161742");
+    assert(!memcmp(shared1, expected, 32) && !memcmp(shared2, expected, 32));
+}
+
+/* A low-order point forces the secret to zero, and is refused. */
+void test_low_order() {
+    unsigned char scalar[32], zero[32], out[32];
+    memset(scalar, 0x55, sizeof(scalar));
+    memset(zero, 0, sizeof(zero));
+    assert(x25519(out, scalar, zero) == -1);
+}
+
+int main() {
+    test_scalarmult();
+    test_diffie_hellman();
+    test_low_order();
+    return 0;
+}